@@ -0,0 +1,385 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+
+// 生成代码时给每个函数编号：同一个函数对象只会出现在一个外层函数的常量表里
+typedef struct
+{
+  ObjFunction **functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+static int addFunction(FunctionList *list, ObjFunction *function)
+{
+  if (list->capacity < list->count + 1)
+  {
+    list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+    list->functions = (ObjFunction **)realloc(list->functions, sizeof(ObjFunction *) * list->capacity);
+    if (list->functions == NULL)
+      exit(1);
+  }
+  list->functions[list->count] = function;
+  return list->count++;
+}
+
+// 先序遍历函数树，编号就是它在列表里的下标，0 号是顶层脚本
+static void collectFunctions(FunctionList *list, ObjFunction *function)
+{
+  addFunction(list, function);
+  ValueArray *constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++)
+  {
+    if (IS_FUNCTION(constants->values[i]))
+      collectFunctions(list, AS_FUNCTION(constants->values[i]));
+  }
+}
+
+static int functionId(FunctionList *list, ObjFunction *function)
+{
+  for (int i = 0; i < list->count; i++)
+  {
+    if (list->functions[i] == function)
+      return i;
+  }
+  return -1;
+}
+
+// 用八进制转义输出任意字节，避免十六进制转义吞掉后面的数字字符
+static void emitCString(FILE *out, const char *chars, int length)
+{
+  fputc('"', out);
+  for (int i = 0; i < length; i++)
+  {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c >= 0x20 && c < 0x7f && c != '?')
+      fputc(c, out);
+    else
+      fprintf(out, "\\%03o", c);
+  }
+  fputc('"', out);
+}
+
+static int jumpTarget(Chunk *chunk, int offset, int sign)
+{
+  uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+  return offset + 3 + sign * jump;
+}
+
+static void emitInstruction(FILE *out, Chunk *chunk, int offset)
+{
+  uint8_t *ip = chunk->code + offset;
+  int next = offset + instructionLength(chunk, offset);
+  switch (*ip)
+  {
+  case OP_CONSTANT:
+    fprintf(out, "  AOT_PUSH(k[%d]);\n", ip[1]);
+    break;
+  case OP_NIL:
+    fprintf(out, "  AOT_PUSH(NIL_VAL);\n");
+    break;
+  case OP_TRUE:
+    fprintf(out, "  AOT_PUSH(BOOL_VAL(true));\n");
+    break;
+  case OP_FALSE:
+    fprintf(out, "  AOT_PUSH(BOOL_VAL(false));\n");
+    break;
+  case OP_POP:
+    fprintf(out, "  vm->stackTop--;\n");
+    break;
+  case OP_GET_LOCAL:
+    fprintf(out, "  AOT_PUSH(slots[%d]);\n", ip[1]);
+    break;
+  case OP_SET_LOCAL:
+    fprintf(out, "  slots[%d] = AOT_PEEK(0);\n", ip[1]);
+    break;
+  case OP_GET_GLOBAL:
+    fprintf(out, "  AOT_HELPER(%d, jitGetGlobal(vm, AS_STRING(k[%d])));\n", next, ip[1]);
+    break;
+  case OP_DEFINE_GLOBAL:
+    fprintf(out, "  AOT_HELPER(%d, jitDefineGlobal(vm, AS_STRING(k[%d])));\n", next, ip[1]);
+    break;
+  case OP_SET_GLOBAL:
+    fprintf(out, "  AOT_HELPER(%d, jitSetGlobal(vm, AS_STRING(k[%d])));\n", next, ip[1]);
+    break;
+  case OP_GET_UPVALUE:
+    fprintf(out, "  AOT_PUSH(*AS_UPVALUE(frame->closure->upvalues[%d])->location);\n", ip[1]);
+    break;
+  case OP_GET_CAPTURED:
+    fprintf(out, "  AOT_PUSH(frame->closure->upvalues[%d]);\n", ip[1]);
+    break;
+  case OP_SET_UPVALUE:
+    fprintf(out, "  *AS_UPVALUE(frame->closure->upvalues[%d])->location = AOT_PEEK(0);\n", ip[1]);
+    break;
+  case OP_GET_PROPERTY:
+    fprintf(out, "  AOT_HELPER(%d, jitGetProperty(vm, AS_STRING(k[%d])));\n", next, ip[1]);
+    break;
+  case OP_SET_PROPERTY:
+    fprintf(out, "  AOT_HELPER(%d, jitSetProperty(vm, AS_STRING(k[%d])));\n", next, ip[1]);
+    break;
+  case OP_GET_SUPER:
+    fprintf(out, "  AOT_HELPER(%d, jitGetSuper(vm, AS_STRING(k[%d])));\n", next, ip[1]);
+    break;
+  case OP_EQUAL:
+    fprintf(out, "  vm->stackTop[-2] = BOOL_VAL(valuesEqual(vm, vm->stackTop[-2], vm->stackTop[-1]));\n");
+    fprintf(out, "  vm->stackTop--;\n");
+    break;
+  case OP_GREATER:
+    fprintf(out, "  AOT_INT_BINARY(BOOL_VAL, BOOL_VAL, >, OP_GREATER, %d);\n", next);
+    break;
+  case OP_LESS:
+    fprintf(out, "  AOT_INT_BINARY(BOOL_VAL, BOOL_VAL, <, OP_LESS, %d);\n", next);
+    break;
+  case OP_ADD:
+    fprintf(out, "  AOT_INT_BINARY(int64ToValue, NUMBER_VAL, +, OP_ADD, %d);\n", next);
+    break;
+  case OP_SUBTRACT:
+    fprintf(out, "  AOT_INT_BINARY(int64ToValue, NUMBER_VAL, -, OP_SUBTRACT, %d);\n", next);
+    break;
+  case OP_MULTIPLY:
+    fprintf(out, "  AOT_BINARY(NUMBER_VAL, *, OP_MULTIPLY, %d);\n", next);
+    break;
+  case OP_DIVIDE:
+    fprintf(out, "  AOT_BINARY(NUMBER_VAL, /, OP_DIVIDE, %d);\n", next);
+    break;
+  case OP_NOT:
+    fprintf(out, "  vm->stackTop[-1] = BOOL_VAL(AOT_FALSEY(vm->stackTop[-1]));\n");
+    break;
+  case OP_NEGATE:
+    fprintf(out, "  if (IS_NUMBER(AOT_PEEK(0)))\n");
+    fprintf(out, "    vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm->stackTop[-1]));\n");
+    fprintf(out, "  else\n");
+    fprintf(out, "    AOT_HELPER(%d, jitNegate(vm));\n", next);
+    break;
+  case OP_PRINT:
+    fprintf(out, "  jitPrint(vm);\n");
+    break;
+  case OP_JUMP:
+    fprintf(out, "  goto L%d;\n", jumpTarget(chunk, offset, 1));
+    break;
+  case OP_JUMP_IF_FALSE:
+    fprintf(out, "  if (AOT_FALSEY(AOT_PEEK(0)))\n");
+    fprintf(out, "    goto L%d;\n", jumpTarget(chunk, offset, 1));
+    break;
+  case OP_LOOP:
+    fprintf(out, "  goto L%d;\n", jumpTarget(chunk, offset, -1));
+    break;
+  case OP_CALL:
+    fprintf(out, "  AOT_HELPER(%d, jitCall(vm, %d));\n", next, ip[1]);
+    break;
+  case OP_SQRT:
+  case OP_FLOOR:
+  case OP_ABS:
+  case OP_MIN:
+  case OP_MAX:
+  case OP_LEN:
+  case OP_CLOCK:
+    fprintf(out, "  AOT_HELPER(%d, jitIntrinsic(vm, %d, %d));\n", next, ip[0] - OP_SQRT, ip[1]);
+    break;
+  case OP_INVOKE:
+    fprintf(out, "  AOT_HELPER(%d, jitInvoke(vm, AS_STRING(k[%d]), %d));\n", next, ip[1], ip[2]);
+    break;
+  case OP_SUPER_INVOKE:
+    fprintf(out, "  AOT_HELPER(%d, jitSuperInvoke(vm, AS_STRING(k[%d]), %d));\n", next, ip[1], ip[2]);
+    break;
+  case OP_CLOSURE:
+    fprintf(out, "  AOT_HELPER(%d, jitClosure(vm, code + %d));\n", next, offset + 1);
+    break;
+  case OP_CLOSE_UPVALUE:
+    fprintf(out, "  AOT_HELPER(%d, jitCloseUpvalue(vm));\n", next);
+    break;
+  case OP_RETURN:
+    fprintf(out, "  AOT_HELPER(%d, jitReturn(vm));\n", next);
+    break;
+  case OP_CLASS:
+    fprintf(out, "  AOT_HELPER(%d, jitClass(vm, AS_STRING(k[%d])));\n", next, ip[1]);
+    break;
+  case OP_INHERIT:
+    fprintf(out, "  AOT_HELPER(%d, jitInherit(vm));\n", next);
+    break;
+  case OP_METHOD:
+    fprintf(out, "  AOT_HELPER(%d, jitMethod(vm, AS_STRING(k[%d])));\n", next, ip[1]);
+    break;
+  default:
+    // 没有翻译的指令（寄存器变体）回到解释器执行
+    fprintf(out, "  frame->ip = code + %d;\n  return JIT_EXIT;\n", offset);
+    break;
+  }
+}
+
+// 每条指令起始处都有一个标签：跳转用它，调用返回后从 frame->ip 恢复执行也用它
+static void emitBody(FILE *out, ObjFunction *function, int id)
+{
+  Chunk *chunk = &function->chunk;
+  fprintf(out, "static JitStatus fn_%d(VM *vm, void *entry)\n{\n", id);
+  fprintf(out, "  CallFrame *frame = (CallFrame *)entry;\n");
+  fprintf(out, "  Value *slots = frame->slots;\n");
+  fprintf(out, "  Value *k = FROM_REF(ObjFunction, frame->closure->function)->chunk.constants.values;\n");
+  fprintf(out, "  uint8_t *code = FROM_REF(ObjFunction, frame->closure->function)->chunk.code;\n");
+  fprintf(out, "  JitStatus status;\n");
+  fprintf(out, "  (void)slots;\n  (void)k;\n  (void)status;\n");
+  fprintf(out, "  switch ((int)(frame->ip - code))\n  {\n");
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+  {
+    fprintf(out, "  case %d:\n    goto L%d;\n", offset, offset);
+  }
+  fprintf(out, "  default:\n    return JIT_EXIT;\n  }\n");
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+  {
+    fprintf(out, "L%d:\n", offset);
+    emitInstruction(out, chunk, offset);
+  }
+  // 字节码总以 OP_RETURN 结尾，走不到这里
+  fprintf(out, "  return JIT_EXIT;\n}\n\n");
+}
+
+static void emitLoader(FILE *out, FunctionList *list, ObjFunction *function, int id)
+{
+  Chunk *chunk = &function->chunk;
+  fprintf(out, "static const uint8_t code_%d[] = {", id);
+  for (int i = 0; i < chunk->count; i++)
+    fprintf(out, "%s%d", i == 0 ? "\n  " : i % 16 == 0 ? ",\n  " : ", ", chunk->code[i]);
+  fprintf(out, "};\n");
+  fprintf(out, "static const int lines_%d[] = {", id);
+  for (int i = 0; i < chunk->count; i++)
+    fprintf(out, "%s%d", i == 0 ? "\n  " : i % 16 == 0 ? ",\n  " : ", ", chunk->lines[i]);
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "static ObjFunction *load_%d(VM *vm)\n{\n", id);
+  fprintf(out, "  ObjFunction *function = aotBeginFunction(vm, %d, %d, ", function->arity, function->upvalueCount);
+  ObjString *name = FROM_REF(ObjString, function->name);
+  if (name == NULL)
+    fprintf(out, "NULL");
+  else
+    emitCString(out, name->chars, name->length);
+  fprintf(out, ", code_%d, lines_%d, %d, fn_%d);\n", id, id, chunk->count, id);
+
+  ValueArray *constants = &chunk->constants;
+  for (int i = 0; i < constants->count; i++)
+  {
+    Value value = constants->values[i];
+    if (IS_INT(value))
+    {
+      fprintf(out, "  aotInt(vm, function, %d);\n", AS_INT(value));
+    }
+    else if (IS_NUMBER(value))
+    {
+      // 按位保存双精度数，保证和源码编译出来的常量完全一致
+      double number = AS_NUMBER(value);
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      fprintf(out, "  aotNumber(vm, function, 0x%016llxull);\n", (unsigned long long)bits);
+    }
+    else if (IS_STRING(value))
+    {
+      fprintf(out, "  aotString(vm, function, ");
+      emitCString(out, AS_STRING(value)->chars, AS_STRING(value)->length);
+      fprintf(out, ", %d, %s);\n", AS_STRING(value)->length,
+              AS_STRING(value)->interned ? "true" : "false");
+    }
+    else if (IS_FUNCTION(value))
+    {
+      fprintf(out, "  aotFunction(vm, function, load_%d(vm));\n", functionId(list, AS_FUNCTION(value)));
+    }
+  }
+  fprintf(out, "  aotEndFunction(vm);\n  return function;\n}\n\n");
+}
+
+void emitC(ObjFunction *script, FILE *out)
+{
+  FunctionList list = {0};
+  collectFunctions(&list, script);
+
+  fprintf(out, "// Generated by clox --emit-c. Link with every clox object file except main.o.\n");
+  fprintf(out, "#include \"aot.h\"\n\n");
+  for (int i = 0; i < list.count; i++)
+    fprintf(out, "static ObjFunction *load_%d(VM *vm);\n", i);
+  fprintf(out, "\n");
+  for (int i = 0; i < list.count; i++)
+  {
+    emitBody(out, list.functions[i], i);
+    emitLoader(out, &list, list.functions[i], i);
+  }
+  fprintf(out, "int main()\n{\n  return aotMain(load_0);\n}\n");
+  free(list.functions);
+}
+
+// 重建函数对象期间它一直压在栈上，和编译器通过 markCompilerRoots 保护函数对象是同一个道理
+ObjFunction *aotBeginFunction(VM *vm, int arity, int upvalueCount, const char *name,
+                              const uint8_t *code, const int *lines, int count,
+                              AotEntry compiled)
+{
+  ObjFunction *function = newFunction(vm);
+  push(vm, OBJ_VAL(function));
+  function->arity = arity;
+  function->upvalueCount = upvalueCount;
+  if (name != NULL)
+    function->name = TO_REF(copyString(vm, name, (int)strlen(name)));
+  for (int i = 0; i < count; i++)
+    writeChunk(vm, &function->chunk, code[i], lines[i]);
+
+  JitCode *jitCode = (JitCode *)malloc(sizeof(JitCode));
+  if (jitCode == NULL)
+    exit(1);
+  jitCode->compiled = compiled;
+  jitCode->code = NULL;
+  jitCode->size = 0;
+  jitCode->offsets = NULL;
+  jitCode->offsetCount = 0;
+  function->jitCode = jitCode;
+  return function;
+}
+
+void aotNumber(VM *vm, ObjFunction *function, uint64_t bits)
+{
+  double number;
+  memcpy(&number, &bits, sizeof(number));
+  addConstant(vm, &function->chunk, NUMBER_VAL(number));
+}
+
+void aotInt(VM *vm, ObjFunction *function, int32_t number)
+{
+  addConstant(vm, &function->chunk, INT_VAL(number));
+}
+
+void aotString(VM *vm, ObjFunction *function, const char *chars, int length, bool interned)
+{
+  // 标识符常量要当表的键，编译时驻留过的这里也驻留
+  ObjString *string = interned ? internString(vm, chars, length) : copyString(vm, chars, length);
+  addConstant(vm, &function->chunk, OBJ_VAL(string));
+}
+
+void aotFunction(VM *vm, ObjFunction *function, ObjFunction *child)
+{
+  addConstant(vm, &function->chunk, OBJ_VAL(child));
+}
+
+void aotEndFunction(VM *vm)
+{
+  // 重建的函数对象没有经过 endCompiler，在这里识别 getter/setter
+  tagAccessor(AS_FUNCTION(pop(vm)));
+}
+
+// 和 main.c 的 runFile 使用同样的退出码
+int aotMain(AotLoader loader)
+{
+  VM *vm = (VM *)malloc(sizeof(VM));
+  if (vm == NULL)
+    exit(1);
+  initVM(vm);
+  ObjFunction *script = loader(vm);
+  InterpretResult result = interpretFunction(vm, script);
+  freeVM(vm);
+  free(vm);
+  if (result == INTERPRET_COMPILE_ERROR)
+    return 65;
+  if (result == INTERPRET_RUNTIME_ERROR)
+    return 70;
+  return 0;
+}
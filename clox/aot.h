@@ -0,0 +1,78 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include "common.h"
+#include "jit.h"
+#include "object.h"
+#include "vm.h"
+
+// 提前编译：clox --emit-c out.c script.lox 把编译好的函数树翻译成一个C文件，
+// 和运行时（除 main.c 外的所有 .c）链接后得到一个独立的可执行程序。
+// 每个Lox函数变成一个C函数，值仍然放在 vm.stack 里，GC根和解释器完全一样。
+
+void emitC(ObjFunction *script, FILE *out);
+
+// 下面是生成的C代码使用的运行时接口
+
+typedef ObjFunction *(*AotLoader)(VM *vm);
+// 启动时重建函数对象：字节码和行号表保留下来，用于报错和回退到解释器
+ObjFunction *aotBeginFunction(VM *vm, int arity, int upvalueCount, const char *name,
+                              const uint8_t *code, const int *lines, int count,
+                              AotEntry compiled);
+void aotNumber(VM *vm, ObjFunction *function, uint64_t bits);
+void aotInt(VM *vm, ObjFunction *function, int32_t number);
+void aotString(VM *vm, ObjFunction *function, const char *chars, int length, bool interned);
+void aotFunction(VM *vm, ObjFunction *function, ObjFunction *child);
+void aotEndFunction(VM *vm);
+int aotMain(AotLoader loader);
+
+// 生成的函数体直接操作 vm.stackTop，省掉 push()/pop() 的跨文件调用
+#define AOT_PUSH(value) (*vm->stackTop++ = (value))
+#define AOT_POP() (*--vm->stackTop)
+#define AOT_PEEK(distance) (vm->stackTop[-1 - (distance)])
+#define AOT_FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+// 调用 vm.c 的慢路径之前把 ip 指向下一条指令，报错时的行号才和解释器一致
+#define AOT_HELPER(next, call)      \
+  do                                \
+  {                                 \
+    frame->ip = code + (next);      \
+    status = (call);                \
+    if (status != JIT_CONTINUE)     \
+      return status;                \
+  } while (false)
+
+// 两个操作数都是数字时直接计算，其他情况（字符串拼接、类型错误）交给 jitBinary
+#define AOT_BINARY(valueType, op, opcode, next)                      \
+  do                                                                 \
+  {                                                                  \
+    if (IS_NUMBER(AOT_PEEK(0)) && IS_NUMBER(AOT_PEEK(1)))            \
+    {                                                                \
+      double b = AS_NUMBER(AOT_POP());                               \
+      double a = AS_NUMBER(AOT_POP());                               \
+      AOT_PUSH(valueType(a op b));                                   \
+    }                                                                \
+    else                                                             \
+    {                                                                \
+      AOT_HELPER(next, jitBinary(vm, opcode));                           \
+    }                                                                \
+  } while (false)
+
+
+// 加减和比较先试32位整数快路径，语义和解释器的 INT_BINARY_OP 一致
+#define AOT_INT_BINARY(intType, valueType, op, opcode, next)         \
+  do                                                                 \
+  {                                                                  \
+    if (IS_INT(AOT_PEEK(0)) && IS_INT(AOT_PEEK(1)))                  \
+    {                                                                \
+      int64_t b = AS_INT(AOT_POP());                                 \
+      int64_t a = AS_INT(AOT_POP());                                 \
+      AOT_PUSH(intType(a op b));                                     \
+    }                                                                \
+    else                                                             \
+    {                                                                \
+      AOT_BINARY(valueType, op, opcode, next);                       \
+    }                                                                \
+  } while (false)
+
+#endif
@@ -0,0 +1,133 @@
+// make intern-bench：并发驻留表的多线程压力测试，也是基准。
+// 每个线程一个VM，都从同一份共享代码创建，反复编译运行从一个公共名字池里随机取名的脚本：
+// 全局变量名、类名、方法名和字符串字面量同时在几个线程里插入、查找共享表；
+// 每个脚本都检查运行时拼出来的字符串和编译出来的常量相等（驻留的不变量），
+// 隔一段时间 lox_reset 一次，让弱引用清理有东西可收。
+// 同样的工作再用各自独立的VM（lox_new）跑一遍作对照，两者的差就是共享表的开销。
+// 用法：intern_bench [线程数 [轮数 [名字池大小]]]，不给线程数时依次跑 1、2、4、8 个线程
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lox.h"
+
+#define MAX_THREADS 64
+// 每个脚本里的声明数：每条声明要用掉十几个常量，一个块最多256个
+#define DECLARATIONS 12
+#define RESET_EVERY 50
+
+static LoxProgram *program;
+static bool shared;
+static int rounds = 300;
+static int pool = 2000;
+static atomic_long failures;
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// 脚本只在检查失败时才 print
+static void countFailure(LoxVM *vm, void *userData, const char *text, size_t length)
+{
+    atomic_fetch_add(&failures, 1);
+}
+
+static void *worker(void *arg)
+{
+    unsigned seed = (unsigned)(long)arg * 7919u + 1;
+    LoxVM *vm = shared ? lox_new_shared(program) : lox_new();
+    lox_set_print(vm, countFailure, NULL);
+    char *source = malloc(DECLARATIONS * 256);
+    if (source == NULL)
+        exit(1);
+    for (int round = 0; round < rounds; round++)
+    {
+        int length = 0;
+        for (int i = 0; i < DECLARATIONS; i++)
+        {
+            int k = rand_r(&seed) % pool;
+            // 全局变量 idK 的值是字面量 "idK"，和运行时拼出来的 "id" + "K" 比较；类 CK 有方法 mK
+            length += sprintf(source + length,
+                              "var id%d = \"id%d\"; if (id%d != \"id\" + \"%d\") print \"BAD\";"
+                              " class C%d { m%d() { return %d; } } if (C%d().m%d() != %d) print \"BAD\";\n",
+                              k, k, k, k, k, k, k, k, k, k);
+        }
+        LoxScript *script = lox_compile(vm, source);
+        if (script == NULL || lox_run(vm, script) != LOX_OK)
+            atomic_fetch_add(&failures, 1);
+        if (script != NULL)
+            lox_release(vm, script);
+        if (round % RESET_EVERY == RESET_EVERY - 1)
+            lox_reset(vm);
+    }
+    free(source);
+    lox_free(vm);
+    return NULL;
+}
+
+static double run(int threads)
+{
+    pthread_t workers[MAX_THREADS];
+    double start = now();
+    for (long i = 0; i < threads; i++)
+    {
+        if (pthread_create(&workers[i], NULL, worker, (void *)i) != 0)
+            exit(1);
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    return now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    int counts[] = {1, 2, 4, 8};
+    int countCount = 4;
+    if (argc > 1)
+    {
+        counts[0] = atoi(argv[1]);
+        countCount = 1;
+        if (counts[0] < 1 || counts[0] > MAX_THREADS)
+        {
+            fprintf(stderr, "Thread count must be 1-%d.\n", MAX_THREADS);
+            return 64;
+        }
+    }
+    if (argc > 2)
+        rounds = atoi(argv[2]);
+    if (argc > 3)
+        pool = atoi(argv[3]);
+    if (rounds < 1 || pool < 1)
+    {
+        fprintf(stderr, "Usage: intern_bench [threads [rounds [pool]]]\n");
+        return 64;
+    }
+
+    program = lox_program_new("fun helper(x) { return x; }");
+    printf("%d rounds x %d declarations per thread, %d names\n", rounds, DECLARATIONS, pool);
+    for (int i = 0; i < countCount; i++)
+    {
+        shared = true;
+        double sharedTime = run(counts[i]);
+        shared = false;
+        double privateTime = run(counts[i]);
+        printf("  threads %2d  shared program %7.3f s  separate VMs %7.3f s\n", counts[i],
+               sharedTime, privateTime);
+    }
+    lox_program_free(program);
+
+    long failed = atomic_load(&failures);
+    if (failed != 0)
+    {
+        printf("%ld checks failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,399 @@
+// make table-bench：哈希表的微基准，只链接 table.c。
+// 同一组键、同一串操作分别跑在现在的表（控制字节 + 16槽一组探测）和原来的布局（条目数组线性探测，
+// 墓碑是值为 true 的空键条目，负载到 0.75 就扩容）上，按不同负载因子比较命中、未命中、
+// 删除后再插入的耗时，以及实例字段那样的小表。原来的布局照搬在这个文件里，只改了名字
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+
+// table.c 只用到这几个函数，这里给最简单的实现：不计数、不回收
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize)
+{
+    if (newSize == 0)
+    {
+        free(pointer);
+        return NULL;
+    }
+    void *result = realloc(pointer, newSize);
+    if (result == NULL)
+        exit(1);
+    return result;
+}
+
+void markObject(VM *vm, Obj *object) {}
+void markValue(VM *vm, Value value) {}
+
+// ---- 原来的布局 ----
+#define LINEAR_MAX_LOAD 0.75
+
+typedef struct
+{
+    int count;
+    int capacity;
+    Entry *entries;
+} LinearTable;
+
+static void initLinear(LinearTable *table)
+{
+    table->count = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+}
+
+static void freeLinear(LinearTable *table)
+{
+    free(table->entries);
+    initLinear(table);
+}
+
+static Entry *linearFindEntry(Entry *entries, int capacity, ObjString *key)
+{
+    uint32_t index = key->hash & (capacity - 1);
+    Entry *tombstone = NULL;
+    for (;;)
+    {
+        Entry *entry = &entries[index];
+        if (entry->key == NULL)
+        {
+            if (IS_NIL(entry->value))
+                return tombstone != NULL ? tombstone : entry;
+            if (tombstone == NULL)
+                tombstone = entry;
+        }
+        else if (entry->key == key)
+        {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static bool linearGet(LinearTable *table, ObjString *key, Value *value)
+{
+    if (table->count == 0)
+        return false;
+    Entry *entry = linearFindEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL)
+        return false;
+    *value = entry->value;
+    return true;
+}
+
+static void linearAdjustCapacity(LinearTable *table, int capacity)
+{
+    Entry *entries = malloc(sizeof(Entry) * capacity);
+    if (entries == NULL)
+        exit(1);
+    for (int i = 0; i < capacity; i++)
+    {
+        entries[i].key = NULL;
+        entries[i].value = NIL_VAL;
+    }
+    table->count = 0;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry *entry = &table->entries[i];
+        if (entry->key == NULL)
+            continue;
+        Entry *dest = linearFindEntry(entries, capacity, entry->key);
+        dest->key = entry->key;
+        dest->value = entry->value;
+        table->count++;
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+static bool linearSet(LinearTable *table, ObjString *key, Value value)
+{
+    if (table->count + 1 > table->capacity * LINEAR_MAX_LOAD)
+        linearAdjustCapacity(table, GROW_CAPACITY(table->capacity));
+    Entry *entry = linearFindEntry(table->entries, table->capacity, key);
+    bool isNewKey = entry->key == NULL;
+    if (isNewKey && IS_NIL(entry->value))
+        table->count++;
+    entry->key = key;
+    entry->value = value;
+    return isNewKey;
+}
+
+static bool linearDelete(LinearTable *table, ObjString *key)
+{
+    if (table->count == 0)
+        return false;
+    Entry *entry = linearFindEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL)
+        return false;
+    entry->key = NULL;
+    entry->value = BOOL_VAL(true);
+    return true;
+}
+
+static ObjString *linearFindString(LinearTable *table, const char *chars, int length, uint32_t hash)
+{
+    if (table->count == 0)
+        return NULL;
+    uint32_t index = hash & (table->capacity - 1);
+    for (;;)
+    {
+        Entry *entry = &table->entries[index];
+        if (entry->key == NULL)
+        {
+            if (IS_NIL(entry->value))
+                return NULL;
+        }
+        else if (entry->key->length == length && entry->key->hash == hash &&
+                 memcmp(entry->key->chars, chars, length) == 0)
+        {
+            return entry->key;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    }
+}
+
+// ---- 两种布局的统一入口 ----
+// 基准代码只写一遍，按 linear 选布局
+typedef struct
+{
+    bool linear;
+    Table swiss;
+    LinearTable old;
+} BenchTable;
+
+static void benchInit(BenchTable *table, bool linear)
+{
+    table->linear = linear;
+    initTable(&table->swiss);
+    initLinear(&table->old);
+}
+
+static void benchFree(BenchTable *table)
+{
+    freeTable(NULL, &table->swiss);
+    freeLinear(&table->old);
+}
+
+static int benchCapacity(BenchTable *table)
+{
+    return table->linear ? table->old.capacity : table->swiss.capacity;
+}
+
+static inline bool benchGet(BenchTable *table, ObjString *key, Value *value)
+{
+    return table->linear ? linearGet(&table->old, key, value) : tableGet(&table->swiss, key, value);
+}
+
+static inline void benchSet(BenchTable *table, ObjString *key, Value value)
+{
+    if (table->linear)
+        linearSet(&table->old, key, value);
+    else
+        tableSet(NULL, &table->swiss, key, value);
+}
+
+static inline void benchDelete(BenchTable *table, ObjString *key)
+{
+    if (table->linear)
+        linearDelete(&table->old, key);
+    else
+        tableDelete(&table->swiss, key);
+}
+
+static inline ObjString *benchFindString(BenchTable *table, ObjString *probe)
+{
+    return table->linear ? linearFindString(&table->old, probe->chars, probe->length, probe->hash)
+                         : tableFindString(&table->swiss, probe->chars, probe->length, probe->hash);
+}
+
+// ---- 键和计时 ----
+static uint64_t seed;
+
+// splitmix64：两种布局用同一个种子，拿到的键和操作顺序完全一样
+static uint64_t randomNext(void)
+{
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// 随机的8个字母和随机哈希，已标记、已驻留，和VM里的键一样可以按指针比较
+static ObjString *newKey(void)
+{
+    ObjString *string = calloc(1, sizeof(ObjString) + 9);
+    if (string == NULL)
+        exit(1);
+    string->obj.isMarked = true;
+    string->length = 8;
+    for (int i = 0; i < 8; i++)
+        string->chars[i] = 'a' + randomNext() % 26;
+    string->hash = (uint32_t)randomNext();
+    string->hashed = true;
+    string->interned = true;
+    string->selector = -1;
+    return string;
+}
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+#define LOOKUPS 4000000
+#define MISSES 4096
+
+// 大表：装 count 个键，随机命中、不在表里的字符串查找（驻留表的用法）、
+// 删一个插一个新的反复做 LOOKUPS/4 次，再测一遍命中
+static void benchLarge(int count, bool linear)
+{
+    seed = 12345;
+    ObjString **keys = malloc(sizeof(ObjString *) * count);
+    ObjString **misses = malloc(sizeof(ObjString *) * MISSES);
+    int *order = malloc(sizeof(int) * LOOKUPS);
+    if (keys == NULL || misses == NULL || order == NULL)
+        exit(1);
+    for (int i = 0; i < count; i++)
+        keys[i] = newKey();
+    for (int i = 0; i < MISSES; i++)
+        misses[i] = newKey();
+    for (int i = 0; i < LOOKUPS; i++)
+        order[i] = randomNext() % count;
+
+    BenchTable table;
+    benchInit(&table, linear);
+    for (int i = 0; i < count; i++)
+        benchSet(&table, keys[i], NUMBER_VAL(i));
+    int capacity = benchCapacity(&table);
+
+    // found 只是为了不让编译器把查找整个删掉
+    long found = 0;
+    Value value;
+    double start = now();
+    for (int i = 0; i < LOOKUPS; i++)
+        found += benchGet(&table, keys[order[i]], &value);
+    double hit = (now() - start) / LOOKUPS;
+
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++)
+        found += benchFindString(&table, misses[i & (MISSES - 1)]) != NULL;
+    double miss = (now() - start) / LOOKUPS;
+
+    start = now();
+    for (int i = 0; i < LOOKUPS / 4; i++)
+    {
+        int k = order[i];
+        benchDelete(&table, keys[k]);
+        free(keys[k]);
+        keys[k] = newKey();
+        benchSet(&table, keys[k], NIL_VAL);
+    }
+    double churn = (now() - start) / (LOOKUPS / 4);
+
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++)
+        found += benchGet(&table, keys[order[i]], &value);
+    double after = (now() - start) / LOOKUPS;
+
+    printf("  %-6s keys %6d  cap %6d  load %.2f  hit %5.1f  miss %5.1f  delete+insert %6.1f  "
+           "hit after %5.1f  (cap after %7d)%s\n",
+           linear ? "linear" : "swiss", count, capacity, (double)count / capacity, hit, miss, churn,
+           after, benchCapacity(&table), found < 0 ? "!" : "");
+
+    benchFree(&table);
+    for (int i = 0; i < count; i++)
+        free(keys[i]);
+    for (int i = 0; i < MISSES; i++)
+        free(misses[i]);
+    free(keys);
+    free(misses);
+    free(order);
+}
+
+#define SMALL_TABLES 1000
+#define SMALL_ROUNDS 20000
+
+// 小表：SMALL_TABLES 张各装 count 个键（像实例字段），测建表、命中和不在表里的键
+static void benchSmall(int count, bool linear)
+{
+    seed = 54321;
+    ObjString *keys[64];
+    for (int i = 0; i < 64; i++)
+        keys[i] = newKey();
+    BenchTable *tables = malloc(sizeof(BenchTable) * SMALL_TABLES);
+    if (tables == NULL)
+        exit(1);
+
+    double start = now();
+    for (int round = 0; round < 20; round++)
+    {
+        for (int t = 0; t < SMALL_TABLES; t++)
+        {
+            benchInit(&tables[t], linear);
+            for (int i = 0; i < count; i++)
+                benchSet(&tables[t], keys[(i + t) & 63], NUMBER_VAL(i));
+            if (round < 19)
+                benchFree(&tables[t]);
+        }
+    }
+    double build = (now() - start) / (20.0 * SMALL_TABLES * count);
+
+    long found = 0;
+    Value value;
+    start = now();
+    for (int round = 0; round < SMALL_ROUNDS; round++)
+    {
+        int t = round % SMALL_TABLES;
+        for (int i = 0; i < count; i++)
+            found += benchGet(&tables[t], keys[(i + t) & 63], &value);
+    }
+    double hit = (now() - start) / ((double)SMALL_ROUNDS * count);
+
+    start = now();
+    for (int round = 0; round < SMALL_ROUNDS; round++)
+    {
+        int t = round % SMALL_TABLES;
+        for (int i = 0; i < 8; i++)
+            found += benchGet(&tables[t], keys[(i + count + t) & 63], &value);
+    }
+    double miss = (now() - start) / (SMALL_ROUNDS * 8.0);
+
+    printf("  %-6s keys %6d  cap %6d  build %5.1f/key  hit %5.2f  miss %5.2f%s\n",
+           linear ? "linear" : "swiss", count, benchCapacity(&tables[0]), build, hit, miss,
+           found < 0 ? "!" : "");
+
+    for (int t = 0; t < SMALL_TABLES; t++)
+        benchFree(&tables[t]);
+    free(tables);
+    for (int i = 0; i < 64; i++)
+        free(keys[i]);
+}
+
+int main(int argc, char *argv[])
+{
+    // 键数选在两种布局各自扩容的边上：0.68、0.73 两边都有；49000 个键时原来的布局在 0.75 的上限，
+    // 57000 个键时新表在 0.87，原来的布局已经翻倍到 0.43
+    static const int large[] = {700, 12000, 24000, 49000, 57000};
+    static const int small[] = {3, 8, 24};
+
+    printf("ns per operation\n");
+    for (size_t i = 0; i < sizeof(large) / sizeof(large[0]); i++)
+    {
+        benchLarge(large[i], true);
+        benchLarge(large[i], false);
+    }
+    for (size_t i = 0; i < sizeof(small) / sizeof(small[0]); i++)
+    {
+        benchSmall(small[i], true);
+        benchSmall(small[i], false);
+    }
+    return 0;
+}
@@ -0,0 +1,612 @@
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "channel.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// 一个序列化后的值：发送方 malloc，接收方重建之后释放
+typedef struct
+{
+    size_t length;
+    uint8_t bytes[];
+} Message;
+
+// 队列的一个槽。sequence 等于某个入队位置时这个槽可写，等于该位置+1时可读（Vyukov 有界 MPMC 队列）
+typedef struct
+{
+    atomic_size_t sequence;
+    Message *message;
+} Slot;
+
+struct Channel
+{
+    // 生产者和消费者争用的两个位置各占一个缓存行
+    _Alignas(64) atomic_size_t enqueuePos;
+    _Alignas(64) atomic_size_t dequeuePos;
+    _Alignas(64) atomic_bool closed;
+    // 最多同时排着这么多个值；槽数取了不小于它的2的幂，多出来的槽不用
+    size_t capacity;
+    size_t mask;
+    Slot *slots;
+    char *name;
+    // 登记表里的下一个通道
+    Channel *next;
+};
+
+// 登记表只在按名字打开通道时加锁，收发都不碰它
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static Channel *channels = NULL;
+
+static Channel *openChannel(const char *name, int length, int capacity)
+{
+    pthread_mutex_lock(&registryLock);
+    for (Channel *channel = channels; channel != NULL; channel = channel->next)
+    {
+        if ((int)strlen(channel->name) == length && memcmp(channel->name, name, length) == 0)
+        {
+            pthread_mutex_unlock(&registryLock);
+            return channel;
+        }
+    }
+
+    // 序号的算法要求至少两个槽
+    size_t size = 2;
+    while (size < (size_t)capacity)
+        size <<= 1;
+    Channel *channel = (Channel *)aligned_alloc(64, sizeof(Channel));
+    Slot *slots = (Slot *)malloc(sizeof(Slot) * size);
+    char *copy = (char *)malloc(length + 1);
+    if (channel == NULL || slots == NULL || copy == NULL)
+        exit(1);
+    for (size_t i = 0; i < size; i++)
+    {
+        atomic_init(&slots[i].sequence, i);
+        slots[i].message = NULL;
+    }
+    atomic_init(&channel->enqueuePos, 0);
+    atomic_init(&channel->dequeuePos, 0);
+    atomic_init(&channel->closed, false);
+    channel->capacity = (size_t)capacity;
+    channel->mask = size - 1;
+    channel->slots = slots;
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    channel->name = copy;
+    channel->next = channels;
+    channels = channel;
+    pthread_mutex_unlock(&registryLock);
+    return channel;
+}
+
+const char *channelName(Channel *channel)
+{
+    return channel->name;
+}
+
+// 满了返回 false
+static bool enqueue(Channel *channel, Message *message)
+{
+    size_t position = atomic_load_explicit(&channel->enqueuePos, memory_order_relaxed);
+    Slot *slot;
+    for (;;)
+    {
+        slot = &channel->slots[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0)
+        {
+            // 槽空着也可能已经排满了容量。dequeuePos 比 position 还大说明 position 过时了，下面的 CAS 会失败重来
+            size_t dequeued = atomic_load_explicit(&channel->dequeuePos, memory_order_relaxed);
+            if ((intptr_t)(position - dequeued) >= (intptr_t)channel->capacity)
+                return false;
+            if (atomic_compare_exchange_weak_explicit(&channel->enqueuePos, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+        {
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&channel->enqueuePos, memory_order_relaxed);
+        }
+    }
+    slot->message = message;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+    return true;
+}
+
+// 空的时候返回NULL
+static Message *dequeue(Channel *channel)
+{
+    size_t position = atomic_load_explicit(&channel->dequeuePos, memory_order_relaxed);
+    Slot *slot;
+    for (;;)
+    {
+        slot = &channel->slots[position & channel->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&channel->dequeuePos, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            position = atomic_load_explicit(&channel->dequeuePos, memory_order_relaxed);
+        }
+    }
+    Message *message = slot->message;
+    // 槽留给绕一圈之后的那次入队
+    atomic_store_explicit(&slot->sequence, position + channel->mask + 1, memory_order_release);
+    return message;
+}
+
+// 阻塞收发时的等待：先让出CPU，等得久了再睡一小会儿
+static void backoff(int *spins)
+{
+    if (++*spins < 64)
+    {
+        sched_yield();
+        return;
+    }
+    struct timespec pause = {0, 50000};
+    nanosleep(&pause, NULL);
+}
+
+// 序列化格式：一个标签字节，后面跟着这种值的内容
+typedef enum
+{
+    MESSAGE_NIL,
+    MESSAGE_FALSE,
+    MESSAGE_TRUE,
+    MESSAGE_INT,
+    MESSAGE_NUMBER,
+    // uint32 长度 + 字符
+    MESSAGE_STRING,
+    // 类名字符串 + uint32 字段数 + 每个字段的名字字符串和值
+    MESSAGE_INSTANCE,
+    // uint32 序号：同一条消息里第几个写出的实例。共享的子对象只写一次，后面都指回它
+    MESSAGE_REFERENCE
+} MessageTag;
+
+// 实例里嵌套实例最多这么多层
+#define MAX_DEPTH 64
+
+// 消息先在这里拼好，开头留出 Message 头，最后整块交给队列
+typedef struct
+{
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static void writeBytes(Buffer *buffer, const void *bytes, size_t length)
+{
+    if (buffer->length + length > buffer->capacity)
+    {
+        buffer->capacity = (buffer->length + length) * 2;
+        buffer->bytes = (uint8_t *)realloc(buffer->bytes, buffer->capacity);
+        if (buffer->bytes == NULL)
+            exit(1);
+    }
+    memcpy(buffer->bytes + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+// 已经写出的实例，按地址开放寻址。onPath 表示还在写它的字段：这时又遇到它就是环
+typedef struct
+{
+    ObjInstance *instance;
+    uint32_t index;
+    bool onPath;
+} Seen;
+
+typedef struct
+{
+    Seen *entries;
+    uint32_t count;
+    uint32_t capacity;
+} SeenSet;
+
+// 返回 instance 所在的槽，没有时返回它该放的空槽
+static Seen *findSeen(SeenSet *set, ObjInstance *instance)
+{
+    uint32_t mask = set->capacity - 1;
+    uint32_t index = ((uint32_t)((uintptr_t)instance >> 4) * 0x9e3779b1u >> 16) & mask;
+    for (;;)
+    {
+        Seen *seen = &set->entries[index];
+        if (seen->instance == instance || seen->instance == NULL)
+            return seen;
+        index = (index + 1) & mask;
+    }
+}
+
+// 负载不超过 3/4
+static void addSeen(SeenSet *set, ObjInstance *instance)
+{
+    if ((set->count + 1) * 4 > set->capacity * 3)
+    {
+        SeenSet grown = {NULL, set->count, set->capacity < 8 ? 8 : set->capacity * 2};
+        grown.entries = (Seen *)calloc(grown.capacity, sizeof(Seen));
+        if (grown.entries == NULL)
+            exit(1);
+        for (uint32_t i = 0; i < set->capacity; i++)
+        {
+            if (set->entries[i].instance != NULL)
+                *findSeen(&grown, set->entries[i].instance) = set->entries[i];
+        }
+        free(set->entries);
+        *set = grown;
+    }
+    Seen *seen = findSeen(set, instance);
+    seen->instance = instance;
+    seen->index = set->count++;
+    seen->onPath = true;
+}
+
+static void writeTag(Buffer *buffer, MessageTag tag)
+{
+    uint8_t byte = (uint8_t)tag;
+    writeBytes(buffer, &byte, 1);
+}
+
+static void writeString(Buffer *buffer, ObjString *string)
+{
+    uint32_t length = (uint32_t)string->length;
+    writeBytes(buffer, &length, sizeof(length));
+    writeBytes(buffer, string->chars, string->length);
+}
+
+// 出错时返回报错信息
+static const char *writeValue(VM *vm, Buffer *buffer, SeenSet *seen, Value value, int depth)
+{
+    if (IS_NIL(value))
+    {
+        writeTag(buffer, MESSAGE_NIL);
+    }
+    else if (IS_BOOL(value))
+    {
+        writeTag(buffer, AS_BOOL(value) ? MESSAGE_TRUE : MESSAGE_FALSE);
+    }
+    else if (IS_INT(value))
+    {
+        int32_t number = AS_INT(value);
+        writeTag(buffer, MESSAGE_INT);
+        writeBytes(buffer, &number, sizeof(number));
+    }
+    else if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        writeTag(buffer, MESSAGE_NUMBER);
+        writeBytes(buffer, &number, sizeof(number));
+    }
+    else if (IS_TEXT(value))
+    {
+        // 值还在发送方的栈上，展平出来的字符串挂在 rope 上不会被回收
+        writeTag(buffer, MESSAGE_STRING);
+        writeString(buffer, IS_STRING(value) ? AS_STRING(value) : flattenRope(vm, AS_ROPE(value)));
+    }
+    else if (IS_INSTANCE(value))
+    {
+        ObjInstance *instance = AS_INSTANCE(value);
+        Seen *previous = seen->capacity != 0 ? findSeen(seen, instance) : NULL;
+        if (previous != NULL && previous->instance != NULL)
+        {
+            if (previous->onPath)
+                return "Cannot send a value that contains a cycle.";
+            writeTag(buffer, MESSAGE_REFERENCE);
+            writeBytes(buffer, &previous->index, sizeof(previous->index));
+            return NULL;
+        }
+        if (depth >= MAX_DEPTH)
+            return "Value is too deeply nested to send.";
+        addSeen(seen, instance);
+        writeTag(buffer, MESSAGE_INSTANCE);
+        writeString(buffer, FROM_REF(ObjString, FROM_REF(ObjClass, instance->klass)->name));
+        // 字段表里有墓碑，字段数最后再回填
+        size_t countAt = buffer->length;
+        uint32_t count = 0;
+        writeBytes(buffer, &count, sizeof(count));
+        for (int i = 0; i < instance->fields.capacity; i++)
+        {
+            Entry *entry = &instance->fields.entries[i];
+            if (entry->key == NULL)
+                continue;
+            writeString(buffer, entry->key);
+            const char *error = writeValue(vm, buffer, seen, entry->value, depth + 1);
+            if (error != NULL)
+                return error;
+            count++;
+        }
+        memcpy(buffer->bytes + countAt, &count, sizeof(count));
+        // 写字段时表可能扩容过，要重新找
+        findSeen(seen, instance)->onPath = false;
+    }
+    else
+    {
+        return "Can only send nil, booleans, numbers, strings and instances.";
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    const uint8_t *bytes;
+    // 按出现次序记下重建出来的实例，给后面的 MESSAGE_REFERENCE 用。
+    // 它们都挂在栈上的根值下面，不会被回收
+    ObjInstance **instances;
+    uint32_t count;
+    uint32_t capacity;
+    char error[128];
+} Reader;
+
+static ObjString *readString(VM *vm, Reader *reader, bool intern)
+{
+    uint32_t length;
+    memcpy(&length, reader->bytes, sizeof(length));
+    const char *chars = (const char *)reader->bytes + sizeof(length);
+    reader->bytes += sizeof(length) + length;
+    return intern ? internString(vm, chars, (int)length) : copyString(vm, chars, (int)length);
+}
+
+// 成功时把重建的值压在栈上；发送方已经检查过嵌套深度
+static bool readValue(VM *vm, Reader *reader)
+{
+    MessageTag tag = (MessageTag)*reader->bytes++;
+    switch (tag)
+    {
+    case MESSAGE_NIL:
+        push(vm, NIL_VAL);
+        return true;
+    case MESSAGE_FALSE:
+    case MESSAGE_TRUE:
+        push(vm, BOOL_VAL(tag == MESSAGE_TRUE));
+        return true;
+    case MESSAGE_INT:
+    {
+        int32_t number;
+        memcpy(&number, reader->bytes, sizeof(number));
+        reader->bytes += sizeof(number);
+        push(vm, INT_VAL(number));
+        return true;
+    }
+    case MESSAGE_NUMBER:
+    {
+        double number;
+        memcpy(&number, reader->bytes, sizeof(number));
+        reader->bytes += sizeof(number);
+        push(vm, NUMBER_VAL(number));
+        return true;
+    }
+    case MESSAGE_STRING:
+        push(vm, OBJ_VAL(readString(vm, reader, false)));
+        return true;
+    case MESSAGE_INSTANCE:
+    {
+        // 实例按类名在接收方的全局变量里找类，两边通常运行的是同一个脚本
+        ObjString *name = readString(vm, reader, true);
+        Value klass;
+        if (!tableGet(&vm->globals, name, &klass) || !IS_CLASS(klass))
+        {
+            snprintf(reader->error, sizeof(reader->error), "Undefined class '%s'.", name->chars);
+            return false;
+        }
+        ObjInstance *instance = newInstance(vm, AS_CLASS(klass));
+        push(vm, OBJ_VAL(instance));
+        if (reader->count == reader->capacity)
+        {
+            reader->capacity = reader->capacity < 8 ? 8 : reader->capacity * 2;
+            reader->instances = (ObjInstance **)realloc(reader->instances, sizeof(ObjInstance *) * reader->capacity);
+            if (reader->instances == NULL)
+                exit(1);
+        }
+        reader->instances[reader->count++] = instance;
+        uint32_t count;
+        memcpy(&count, reader->bytes, sizeof(count));
+        reader->bytes += sizeof(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            push(vm, OBJ_VAL(readString(vm, reader, true)));
+            if (!readValue(vm, reader))
+                return false;
+            tableSet(vm, &AS_INSTANCE(vm->stackTop[-3])->fields, AS_STRING(vm->stackTop[-2]), vm->stackTop[-1]);
+            pop(vm);
+            pop(vm);
+        }
+        return true;
+    }
+    case MESSAGE_REFERENCE:
+    {
+        uint32_t index;
+        memcpy(&index, reader->bytes, sizeof(index));
+        reader->bytes += sizeof(index);
+        if (index >= reader->count)
+            return false;
+        push(vm, OBJ_VAL(reader->instances[index]));
+        return true;
+    }
+    }
+    return false;
+}
+
+static Value receiveMessage(VM *vm, Message *message)
+{
+    Reader reader;
+    reader.bytes = message->bytes;
+    reader.instances = NULL;
+    reader.count = 0;
+    reader.capacity = 0;
+    snprintf(reader.error, sizeof(reader.error), "Malformed message.");
+    Value *stackTop = vm->stackTop;
+    bool ok = readValue(vm, &reader);
+    free(reader.instances);
+    free(message);
+    if (!ok)
+    {
+        vm->stackTop = stackTop;
+        return nativeError(vm, reader.error);
+    }
+    return pop(vm);
+}
+
+static bool checkChannel(VM *vm, Value value, Channel **channel)
+{
+    if (!IS_CHANNEL(value))
+    {
+        nativeError(vm, "Expected a channel.");
+        return false;
+    }
+    *channel = AS_CHANNEL(value)->channel;
+    return true;
+}
+
+// 序列化失败时已经报过错了，返回NULL
+static Message *packMessage(VM *vm, Value value)
+{
+    Buffer buffer = {NULL, 0, 0};
+    Message header = {0};
+    writeBytes(&buffer, &header, sizeof(header));
+    SeenSet seen = {NULL, 0, 0};
+    const char *error = writeValue(vm, &buffer, &seen, value, 0);
+    free(seen.entries);
+    if (error != NULL)
+    {
+        free(buffer.bytes);
+        nativeError(vm, error);
+        return NULL;
+    }
+    Message *message = (Message *)buffer.bytes;
+    message->length = buffer.length - sizeof(Message);
+    return message;
+}
+
+// Channel(name, capacity)：打开名为 name 的通道，不存在时按 capacity 创建；已经存在的通道容量必须一样
+static Value channelNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_TEXT(args[0]) || !IS_NUMBER(args[1]))
+        return nativeError(vm, "Expected a channel name and a capacity.");
+    double capacity = AS_NUMBER(args[1]);
+    if (!(capacity >= 1 && capacity <= CHANNEL_MAX_CAPACITY))
+        return nativeError(vm, "Channel capacity must be between 1 and 1048576.");
+    ObjString *name = IS_STRING(args[0]) ? AS_STRING(args[0]) : flattenRope(vm, AS_ROPE(args[0]));
+    Channel *channel = openChannel(name->chars, name->length, (int)capacity);
+    if (channel->capacity != (size_t)(int)capacity)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Channel '%.64s' already exists with capacity %zu.", channel->name,
+                 channel->capacity);
+        return nativeError(vm, message);
+    }
+    return OBJ_VAL(newChannel(vm, channel));
+}
+
+// send(channel, value)：满了就等
+static Value sendNative(VM *vm, int argCount, Value *args)
+{
+    Channel *channel;
+    if (!checkChannel(vm, args[0], &channel))
+        return NIL_VAL;
+    if (atomic_load(&channel->closed))
+        return nativeError(vm, "Send on a closed channel.");
+    Message *message = packMessage(vm, args[1]);
+    if (message == NULL)
+        return NIL_VAL;
+    int spins = 0;
+    while (!enqueue(channel, message))
+    {
+        if (atomic_load(&channel->closed))
+        {
+            free(message);
+            return nativeError(vm, "Send on a closed channel.");
+        }
+        backoff(&spins);
+    }
+    return NIL_VAL;
+}
+
+// trySend(channel, value)：满了返回 false
+static Value trySendNative(VM *vm, int argCount, Value *args)
+{
+    Channel *channel;
+    if (!checkChannel(vm, args[0], &channel))
+        return NIL_VAL;
+    if (atomic_load(&channel->closed))
+        return nativeError(vm, "Send on a closed channel.");
+    Message *message = packMessage(vm, args[1]);
+    if (message == NULL)
+        return NIL_VAL;
+    if (!enqueue(channel, message))
+    {
+        free(message);
+        return BOOL_VAL(false);
+    }
+    return BOOL_VAL(true);
+}
+
+// receive(channel)：空了就等；通道关闭并且取空之后返回 nil
+static Value receiveNative(VM *vm, int argCount, Value *args)
+{
+    Channel *channel;
+    if (!checkChannel(vm, args[0], &channel))
+        return NIL_VAL;
+    int spins = 0;
+    for (;;)
+    {
+        Message *message = dequeue(channel);
+        if (message != NULL)
+            return receiveMessage(vm, message);
+        if (atomic_load(&channel->closed))
+        {
+            // 关闭之前发出的值还要收完
+            message = dequeue(channel);
+            return message != NULL ? receiveMessage(vm, message) : NIL_VAL;
+        }
+        backoff(&spins);
+    }
+}
+
+// tryReceive(channel)：空了返回 nil
+static Value tryReceiveNative(VM *vm, int argCount, Value *args)
+{
+    Channel *channel;
+    if (!checkChannel(vm, args[0], &channel))
+        return NIL_VAL;
+    Message *message = dequeue(channel);
+    return message != NULL ? receiveMessage(vm, message) : NIL_VAL;
+}
+
+// close(channel)：之后不能再发送，等着接收的一方取完剩下的值后收到 nil
+static Value closeNative(VM *vm, int argCount, Value *args)
+{
+    Channel *channel;
+    if (!checkChannel(vm, args[0], &channel))
+        return NIL_VAL;
+    atomic_store(&channel->closed, true);
+    return NIL_VAL;
+}
+
+void defineChannelNatives(VM *vm)
+{
+    defineGlobal(vm, "Channel", OBJ_VAL(newNative(vm, channelNative, 2)));
+    defineGlobal(vm, "send", OBJ_VAL(newNative(vm, sendNative, 2)));
+    defineGlobal(vm, "trySend", OBJ_VAL(newNative(vm, trySendNative, 2)));
+    defineGlobal(vm, "receive", OBJ_VAL(newNative(vm, receiveNative, 1)));
+    defineGlobal(vm, "tryReceive", OBJ_VAL(newNative(vm, tryReceiveNative, 1)));
+    defineGlobal(vm, "close", OBJ_VAL(newNative(vm, closeNative, 1)));
+}
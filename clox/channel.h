@@ -0,0 +1,20 @@
+#ifndef clox_channel_h
+#define clox_channel_h
+
+#include "common.h"
+#include "value.h"
+
+// 通道：不同VM（通常在不同线程里）之间传递值的有界多生产者多消费者队列。
+// 通道不属于任何VM的堆，按名字登记在进程范围的表里：任何VM里 Channel("jobs", n) 拿到的都是同一个通道，
+// 一直存在到进程结束。值在发送时序列化，接收时在接收方的堆里重建，两个VM之间不共享任何对象
+
+// 通道容量的上限
+#define CHANNEL_MAX_CAPACITY (1 << 20)
+
+typedef struct Channel Channel;
+
+const char *channelName(Channel *channel);
+// 定义 Channel/send/trySend/receive/tryReceive/close 这几个本地函数
+void defineChannelNatives(VM *vm);
+
+#endif
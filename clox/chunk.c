@@ -2,7 +2,19 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
+
+const Intrinsic intrinsics[INTRINSIC_COUNT] = {
+    {"sqrt", 1},
+    {"floor", 1},
+    {"abs", 1},
+    {"min", 2},
+    {"max", 2},
+    {"len", 1},
+    {"clock", 0},
+};
+
 void initChunk(Chunk *chunk)
 {
     chunk->count = 0;
@@ -11,32 +23,104 @@ void initChunk(Chunk *chunk)
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
 }
-void freeChunk(Chunk *chunk)
+void freeChunk(VM *vm, Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+    freeValueArray(vm, &chunk->constants);
     initChunk(chunk);
 }
-void writeChunk(Chunk *chunk, uint8_t byte, int line)
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1)
     {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY(vm, int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
     chunk->lines[chunk->count] = line;
     chunk->count++;
 }
-int addConstant(Chunk *chunk, Value value)
+int addConstant(VM *vm, Chunk *chunk, Value value)
 {
     // 将常量临时推入栈中
-    push(value);
-    writeValueArray(&chunk->constants, value);
-    pop();
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+int instructionLength(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_SQRT:
+    case OP_FLOOR:
+    case OP_ABS:
+    case OP_MIN:
+    case OP_MAX:
+    case OP_LEN:
+    case OP_CLOCK:
+        return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return 3;
+#ifdef REGISTER_VM
+    case OP_STORE:
+        return 2;
+    case OP_MOVE:
+    case OP_LOADK:
+        return 3;
+    case OP_ADD_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RR:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RR:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RR:
+    case OP_DIVIDE_RK:
+    case OP_LESS_RR:
+    case OP_LESS_RK:
+    case OP_GREATER_RR:
+    case OP_GREATER_RK:
+    case OP_EQUAL_RR:
+    case OP_EQUAL_RK:
+        return 4;
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_RK:
+    case OP_JUMP_IF_NOT_GREATER_RR:
+    case OP_JUMP_IF_NOT_GREATER_RK:
+    case OP_JUMP_IF_NOT_EQUAL_RR:
+    case OP_JUMP_IF_NOT_EQUAL_RK:
+        return 5;
+#endif
+    case OP_CLOSURE:
+    {
+        // OP_CLOSURE 后面跟着常量索引，以及每个上值的 (isLocal, index) 两个字节
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + function->upvalueCount * 2;
+    }
+    default:
+        return 1;
+    }
+}
@@ -18,6 +18,8 @@ typedef enum
     OP_SET_GLOBAL,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    // 读取按值捕获的上值：值直接存在闭包里，没有 ObjUpvalue
+    OP_GET_CAPTURED,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
@@ -42,9 +44,63 @@ typedef enum
     OP_RETURN,
     OP_CLASS,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    // 内置函数直接编译成的指令，操作数是参数个数，参数就在栈顶。
+    // 顺序和 intrinsics 表一致；对应的全局变量被重新绑定过时退回普通调用
+    OP_SQRT,
+    OP_FLOOR,
+    OP_ABS,
+    OP_MIN,
+    OP_MAX,
+    OP_LEN,
+    OP_CLOCK,
+#ifdef REGISTER_VM
+    // 三地址寄存器指令，由 regcode.c 从栈式字节码改写而来。
+    // 寄存器就是帧里的栈槽：R 操作数是槽号，K 操作数是常量下标。
+    // 每个运算都有 RR/RK 两种形式，并且按这个顺序相邻排列
+    OP_ADD_RR,      // dst a b
+    OP_ADD_RK,      // dst a k
+    OP_SUBTRACT_RR,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RR,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RR,
+    OP_DIVIDE_RK,
+    OP_LESS_RR,
+    OP_LESS_RK,
+    OP_GREATER_RR,
+    OP_GREATER_RK,
+    OP_EQUAL_RR,
+    OP_EQUAL_RK,
+    // 比较结果为假时跳转：a b offset(2字节)，不经过操作数栈
+    OP_JUMP_IF_NOT_LESS_RR,
+    OP_JUMP_IF_NOT_LESS_RK,
+    OP_JUMP_IF_NOT_GREATER_RR,
+    OP_JUMP_IF_NOT_GREATER_RK,
+    OP_JUMP_IF_NOT_EQUAL_RR,
+    OP_JUMP_IF_NOT_EQUAL_RK,
+    OP_MOVE,  // dst src
+    OP_LOADK, // dst k
+    OP_STORE, // dst：弹出栈顶写进 dst
+#endif
 } OpCode;
 
+// OP_CLOSURE 里每个上值的第一个操作数字节
+// 捕获的是外层函数的局部变量；没有这一位时捕获的是外层函数的上值
+#define UPVALUE_LOCAL 1
+// 局部变量捕获后不会再被赋值，闭包直接保存它的值
+#define UPVALUE_BY_VALUE 2
+
+// 可以编译成指令的内置函数：全局变量名和参数个数
+typedef struct
+{
+    const char *name;
+    int arity;
+} Intrinsic;
+
+#define INTRINSIC_COUNT (OP_CLOCK - OP_SQRT + 1)
+extern const Intrinsic intrinsics[INTRINSIC_COUNT];
+
 typedef struct
 {
     // 实际使用的已分配元数数量（计数，count）
@@ -60,7 +116,9 @@ typedef struct
 } Chunk;
 
 void initChunk(Chunk *chunk);
-void freeChunk(Chunk *chunk);
-void writeChunk(Chunk *chunk, uint8_t byte, int line);
-int addConstant(Chunk *chunk, Value value);
+void freeChunk(VM *vm, Chunk *chunk);
+void writeChunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
+int addConstant(VM *vm, Chunk *chunk, Value value);
+// 返回 offset 处指令连同操作数一共占多少字节
+int instructionLength(Chunk *chunk, int offset);
 #endif
\ No newline at end of file
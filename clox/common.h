@@ -13,5 +13,13 @@
 #define DEBUG_STRESS_GC
 // 启用这个功能后，当clox使用动态内存执行某些操作时，会将信息打印到控制台
 // #define DEBUG_LOG_GC
+// 启用后，每次JIT编译一个函数都会打印字节码和本地代码的大小
+// #define DEBUG_LOG_JIT
+// 启用后统计解释器分派的指令条数，每次运行结束时打印到 stderr
+// #define DEBUG_COUNT_INSTRUCTIONS
+// 启用后编译器把常见的栈式指令序列改写成三地址寄存器指令（见 regcode.h）
+// #define REGISTER_VM
+// 启用后对象都分配在一块预留的连续地址空间里，对象之间的引用压缩成32位偏移（见 object.h）
+// #define COMPRESSED_REFS
 #define UINT8_COUNT (UINT8_MAX + 1)
 #endif
\ No newline at end of file
@@ -4,17 +4,13 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "regcode.h"
 #include "scanner.h"
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
-typedef struct
-{
-    Token current;
-    Token previous;
-    bool hadError;
-    bool panicMode;
-} Parser;
+// 编译一份源码需要的全部状态，所有编译函数都通过它访问，不同的VM可以同时编译
+typedef struct Parser Parser;
 
 // 这些是Lox中的所有优先级，按照从低到高的顺序排列
 typedef enum
@@ -31,7 +27,7 @@ typedef enum
     PREC_CALL,       // . ()
     PREC_PRIMARY
 } Precedence;
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
 typedef struct
 {
     ParseFn prefix;
@@ -46,12 +42,17 @@ typedef struct
     int depth;
     // 局部变量被后面嵌套的任何函数声明捕获，字段则为true
     bool isCaptured;
+    // 第一次被捕获时确定：声明之后再也没有赋值的变量按值捕获，闭包里直接存它的值
+    bool byValue;
+    // 正在编译以它命名的函数体：闭包创建时这个槽还没有值，只能按引用捕获
+    bool initializing;
 } Local;
 
 typedef struct
 {
     uint8_t index;
     bool isLocal;
+    bool byValue;
 } Upvalue;
 
 typedef enum
@@ -80,6 +81,8 @@ typedef struct Compiler
     Upvalue upvalues[UINT8_COUNT];
     // scopeDepth记录当前编译的代码块的作用域深度
     int scopeDepth;
+    // 正在编译延迟函数体时指向它的存根，最外层的上值按名字从这里解析
+    LazyFunction *lazy;
 } Compiler;
 
 typedef struct ClassCompiler
@@ -89,21 +92,32 @@ typedef struct ClassCompiler
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-// current ： 当前正在编译的函数对应的 Compiler 结构体
-Compiler *current = NULL;
-// currentClass 指向一个表示当前正在编译的最内部类的结构体
-ClassCompiler *currentClass = NULL;
+struct Parser
+{
+    // 常量、函数对象都分配在这个VM里
+    VM *vm;
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool hadError;
+    bool panicMode;
+    // compiler ： 当前正在编译的函数对应的 Compiler 结构体
+    Compiler *compiler;
+    // currentClass 指向一个表示当前正在编译的最内部类的结构体
+    ClassCompiler *currentClass;
+    // 延迟编译模式下当前脚本的源码，编译期间作为GC根
+    ObjString *lazySource;
+};
 // Chunk *compilingChunk;
-static Chunk *currentChunk()
+static Chunk *currentChunk(Parser *parser)
 {
-    return &current->function->chunk;
+    return &parser->compiler->function->chunk;
 }
-static void errorAt(Token *token, const char *message)
+static void errorAt(Parser *parser, Token *token, const char *message)
 {
-    if (parser.panicMode)
+    if (parser->panicMode)
         return;
-    parser.panicMode = true;
+    parser->panicMode = true;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
@@ -120,155 +134,159 @@ static void errorAt(Token *token, const char *message)
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    parser->hadError = true;
 }
-static void error(const char *message)
+static void error(Parser *parser, const char *message)
 {
-    errorAt(&parser.previous, message);
+    errorAt(parser, &parser->previous, message);
 }
-static void errorAtCurrent(const char *message)
+static void errorAtCurrent(Parser *parser, const char *message)
 {
-    errorAt(&parser.current, message);
+    errorAt(parser, &parser->current, message);
 }
-static void advance()
+static void advance(Parser *parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
 
     // for(;;) 不是为了“正常消耗token”，而是为了错误恢复：
     // 跳过所有非法token，直到拿到第一个能用的token为止。
     for (;;)
     {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR)
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR)
         {
             // printf("%.*s\n", parser.current.length, parser.current.start);
             break;
         }
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
-static void consume(TokenType type, const char *message)
+static void consume(Parser *parser, TokenType type, const char *message)
 {
-    if (parser.current.type == type)
+    if (parser->current.type == type)
     {
-        advance();
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type)
+static bool check(Parser *parser, TokenType type)
 {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
-static bool match(TokenType type)
+static bool match(Parser *parser, TokenType type)
 {
-    if (!check(type))
+    if (!check(parser, type))
         return false;
-    advance();
+    advance(parser);
     return true;
 }
 
-static void emitByte(uint8_t byte)
+static void emitByte(Parser *parser, uint8_t byte)
 {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
-static void emitBytes(uint8_t byte1, uint8_t byte2)
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2)
 {
-    emitByte(byte1);
-    emitByte(byte2);
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static void emitLoop(int loopStart)
+static void emitLoop(Parser *parser, int loopStart)
 {
-    emitByte(OP_LOOP);
+    emitByte(parser, OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
+    int offset = currentChunk(parser)->count - loopStart + 2;
     if (offset > UINT16_MAX)
-        error("Loop body too large.");
+        error(parser, "Loop body too large.");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
-static int emitJump(uint8_t instruction)
+static int emitJump(Parser *parser, uint8_t instruction)
 {
-    emitByte(instruction);
+    emitByte(parser, instruction);
     // 因为保存字节码的数组是 uint8_t *code;类型,无法一次存储两个字节的跳转偏移量,用2条字节码存储offset位置
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
-static void emitReturn()
+static void emitReturn(Parser *parser)
 {
-    if (current->type == TYPE_INITIALIZER)
+    if (parser->compiler->type == TYPE_INITIALIZER)
     {
-        emitBytes(OP_GET_LOCAL, 0);
+        emitBytes(parser, OP_GET_LOCAL, 0);
     }
     else
     {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    emitByte(OP_RETURN);
+    emitByte(parser, OP_RETURN);
 }
-static uint8_t makeConstant(Value value)
+static uint8_t makeConstant(Parser *parser, Value value)
 {
-    int constant = addConstant(currentChunk(), value);
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
     if (constant > UINT8_MAX)
     {
         // 一个块中最多只能存储和加载256个常量，stack overflow
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
     return (uint8_t)constant;
 }
-static void emitConstant(Value value)
+static void emitConstant(Parser *parser, Value value)
 {
     // makeConstant 把 value 存入 Chunk的 constants 返回存放 位置 index
     // 把OP_CONSTANT，index位置 都压入Chunk中了
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
 }
 
-static void patchJump(int offset)
+static void patchJump(Parser *parser, int offset)
 {
     // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX)
     {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
     //  利用位运算把 jump 拆成两个字节，存回之前留空的位置
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type)
+// function 为NULL时新建函数对象；编译延迟的函数体时传入已有的存根
+static void initCompiler(Parser *parser, Compiler *compiler, FunctionType type, ObjFunction *function)
 {
-    compiler->enclosing = current;
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
-    current = compiler;
-    if (type != TYPE_SCRIPT)
+    compiler->lazy = NULL;
+    compiler->function = function != NULL ? function : newFunction(parser->vm);
+    parser->compiler = compiler;
+    if (type != TYPE_SCRIPT && function == NULL)
     {
         // 设置函数名称
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+        parser->compiler->function->name = TO_REF(copyString(parser->vm, parser->previous.start, parser->previous.length));
     }
     // 编译器的locals数组记录了哪些栈槽与哪些局部变量或临时变量相关联。
     // 从现在开始，编译器隐式地要求栈槽0供虚拟机自己内部使用。
     // 我们给它一个空的名称，这样用户就不能向一个指向它的标识符写值
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->byValue = false;
+    local->initializing = false;
     // initCompiler对于TYPE_METHOD 方法来说，local存储的局部变量中index = 0保留给了this关键字
     // this_ 中进行 variable 的 resolveLocal 解析到这个局部变量 index = 0
     // 运行时先通过OBJ_BOUND_METHOD插入 vm.stackTop[-argCount - 1] = bound->receiver; this实例到栈顶index=0的位置
@@ -285,35 +303,81 @@ static void initCompiler(Compiler *compiler, FunctionType type)
     }
 }
 
-static ObjFunction *endCompiler()
+// 识别取值、赋值和返回常量的方法体。取值和返回常量只看开头，return 之后的字节码不会执行；
+// 赋值的方法体后面必须紧跟 emitReturn 补上的 nil 返回
+void tagAccessor(ObjFunction *function)
+{
+    uint8_t *code = function->chunk.code;
+    int count = function->chunk.count;
+    Value *constants = function->chunk.constants.values;
+    if (function->upvalueCount != 0)
+        return;
+    if (function->arity == 0 && count >= 5 && code[0] == OP_GET_LOCAL && code[1] == 0 &&
+        code[2] == OP_GET_PROPERTY && code[4] == OP_RETURN)
+    {
+        function->accessor = ACCESSOR_GETTER;
+        function->accessorValue = constants[code[3]];
+    }
+    else if (function->arity == 1 && count >= 9 && code[0] == OP_GET_LOCAL && code[1] == 0 &&
+             code[2] == OP_GET_LOCAL && code[3] == 1 && code[4] == OP_SET_PROPERTY &&
+             code[6] == OP_POP && code[7] == OP_NIL && code[8] == OP_RETURN)
+    {
+        function->accessor = ACCESSOR_SETTER;
+        function->accessorValue = constants[code[5]];
+    }
+    else if (count >= 3 && code[0] == OP_CONSTANT && code[2] == OP_RETURN)
+    {
+        function->accessor = ACCESSOR_CONSTANT;
+        function->accessorValue = constants[code[1]];
+    }
+    else if (count >= 2 && code[1] == OP_RETURN &&
+             (code[0] == OP_NIL || code[0] == OP_TRUE || code[0] == OP_FALSE))
+    {
+        function->accessor = ACCESSOR_CONSTANT;
+        function->accessorValue = code[0] == OP_NIL ? NIL_VAL : BOOL_VAL(code[0] == OP_TRUE);
+    }
+}
+
+static ObjFunction *endCompiler(Parser *parser)
 {
-    emitReturn();
-    ObjFunction *function = current->function;
+    emitReturn(parser);
+    ObjFunction *function = parser->compiler->function;
+    if (!parser->hadError && parser->compiler->type == TYPE_METHOD)
+    {
+        tagAccessor(function);
+    }
+#ifdef REGISTER_VM
+    if (!parser->hadError)
+    {
+        registerizeFunction(parser->vm, function);
+    }
+#endif
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
+    if (!parser->hadError)
     {
-        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+        disassembleChunk(parser->vm, currentChunk(parser), function->name != TO_REF(NULL) ? FROM_REF(ObjString, function->name)->chars : "<script>");
     }
 #endif
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
-static void beginScope()
+static void beginScope(Parser *parser)
 {
-    current->scopeDepth++;
+    parser->compiler->scopeDepth++;
 }
 
-static void endScope()
+static void endScope(Parser *parser)
 {
-    current->scopeDepth--;
+    parser->compiler->scopeDepth--;
     // 在离开某个作用域时，把该作用域内新添加的局部变量全部弹出栈。
-    while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth)
+    while (parser->compiler->localCount > 0 && parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth)
     {
         // 在块作用域的末尾，当编译器生成字节码来释放局部变量的栈槽时，我们可以判断哪些数据需要被提取到堆中
-        if (current->locals[current->localCount - 1].isCaptured)
+        Local *local = &parser->compiler->locals[parser->compiler->localCount - 1];
+        if (local->isCaptured && !local->byValue)
         {
-            emitByte(OP_CLOSE_UPVALUE);
+            emitByte(parser, OP_CLOSE_UPVALUE);
             // 现在，生成的字节码准确地告诉运行时，每个被捕获的局部变量必须移动到堆中的确切时间。
             // 更好的是，它只对被闭包使用并需要这种特殊处理的局部变量才会这样做。
             // 这与我们的总体性能目标是一致的，即我们希望用户只为他们使用的功能付费。
@@ -321,22 +385,22 @@ static void endScope()
         }
         else
         {
-            emitByte(OP_POP);
+            emitByte(parser, OP_POP);
         }
-        current->localCount--;
+        parser->compiler->localCount--;
     }
 }
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void declaration(Parser *parser);
 
 static ParseRule *getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser *parser, Precedence precedence);
 
-static uint8_t identifierConstant(Token *name)
+static uint8_t identifierConstant(Parser *parser, Token *name)
 {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    return makeConstant(parser, OBJ_VAL(internString(parser->vm, name->start, name->length)));
 }
 
 static bool identifiersEqual(Token *a, Token *b)
@@ -346,7 +410,7 @@ static bool identifiersEqual(Token *a, Token *b)
     return memcmp(a->start, b->start, a->length) == 0;
 }
 // 查找本地变量
-static int resolveLocal(Compiler *compiler, Token *name)
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name)
 {
     for (int i = compiler->localCount - 1; i >= 0; i--)
     {
@@ -355,7 +419,7 @@ static int resolveLocal(Compiler *compiler, Token *name)
         {
             if (local->depth == -1)
             {
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -364,7 +428,7 @@ static int resolveLocal(Compiler *compiler, Token *name)
     return -1;
 }
 // 添加上值变量
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal)
+static int addUpvalue(Parser *parser, Compiler *compiler, uint8_t index, bool isLocal, bool byValue)
 {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -382,34 +446,96 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal)
     // 限制上值数组容量
     if (upvalueCount == UINT8_COUNT)
     {
-        error("Too many closure variables in function.");
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
+    compiler->upvalues[upvalueCount].byValue = byValue;
     return compiler->function->upvalueCount++;
 }
+// 从局部变量的声明处向后扫描它的作用域，看有没有 "name =" 形式的赋值。
+// 被内层同名变量遮蔽的赋值也算进去，只是少一次按值捕获，不影响语义
+static bool isReassigned(Local *local)
+{
+    // this 和 super 不能被赋值，名字也不在源码里
+    Token *name = &local->name;
+    if (name->length == 0 || (name->length == 4 && memcmp(name->start, "this", 4) == 0) ||
+        (name->length == 5 && memcmp(name->start, "super", 5) == 0))
+        return false;
+
+    // 用一个独立的扫描器向前看，不影响正在编译的位置
+    Scanner scanner;
+    initScannerAt(&scanner, local->name.start, local->name.line);
+    Token previous = scanToken(&scanner);
+    // 声明里的 "var x =" 是初始化，不是赋值
+    TokenType beforePrevious = TOKEN_VAR;
+    Token token = scanToken(&scanner);
+    // 形参的作用域到函数体结束为止，其余的局部变量到所在代码块结束为止
+    bool parameter = token.type == TOKEN_COMMA || token.type == TOKEN_RIGHT_PAREN;
+    bool assigned = false;
+    int depth = 0;
+    while (token.type != TOKEN_EOF)
+    {
+        if (token.type == TOKEN_LEFT_BRACE)
+        {
+            depth++;
+        }
+        else if (token.type == TOKEN_RIGHT_BRACE)
+        {
+            if (--depth < 0 || (parameter && depth == 0))
+                break;
+        }
+        else if (token.type == TOKEN_EQUAL && previous.type == TOKEN_IDENTIFIER &&
+                 beforePrevious != TOKEN_DOT && beforePrevious != TOKEN_VAR &&
+                 identifiersEqual(&previous, &local->name))
+        {
+            assigned = true;
+            break;
+        }
+        beforePrevious = previous.type;
+        previous = token;
+        token = scanToken(&scanner);
+    }
+    return assigned;
+}
+
 // 查找上值变量
 // resolveUpvalue 返回的“索引”是“上一帧里那个局部变量在它自己CallFrame中的 slot 编号
-static int resolveUpvalue(Compiler *compiler, Token *name)
+static int resolveUpvalue(Parser *parser, Compiler *compiler, Token *name)
 {
     if (compiler->enclosing == NULL)
+    {
+        if (compiler->lazy == NULL)
+            return -1;
+        // 延迟编译的函数体：上值在声明时已经确定，按名字找回下标
+        for (int i = 0; i < compiler->function->upvalueCount; i++)
+        {
+            if (identifiersEqual(name, &compiler->lazy->upvalueNames[i]))
+                return i;
+        }
         return -1;
+    }
 
     // Compiler中存储了一个指向外层函数Compiler的指针，这些指针形成了一个链，一直到顶层代码的根Compiler
     // 如果在局部变量中查找到name，就把它添加为上值变量，并返回上值索引，且设置isLocal为true
-    int local = resolveLocal(compiler->enclosing, name);
+    int local = resolveLocal(parser, compiler->enclosing, name);
     if (local != -1)
     {
         // 解析标识符时，如果我们最终为某个局部变量创建了一个上值，我们将其标记为已捕获
-        compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        Local *captured = &compiler->enclosing->locals[local];
+        if (!captured->isCaptured)
+        {
+            captured->isCaptured = true;
+            captured->byValue = !captured->initializing && !isReassigned(captured);
+        }
+        return addUpvalue(parser, compiler, (uint8_t)local, true, captured->byValue);
     }
     // 查找enclosing上的上值变量，且设置isLocal为false
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1)
     {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(parser, compiler, (uint8_t)upvalue, false, compiler->enclosing->upvalues[upvalue].byValue);
     }
     // addUpvalue这个函数其实会在每一个Compiler都记录对应的上值索引，是一层一层传递的
     // 每个 Compiler 实例都有自己的 upvalues[] 小数组
@@ -418,31 +544,33 @@ static int resolveUpvalue(Compiler *compiler, Token *name)
     return -1;
 }
 
-static void addLocal(Token name)
+static void addLocal(Parser *parser, Token name)
 {
-    if (current->localCount == UINT8_COUNT)
+    if (parser->compiler->localCount == UINT8_COUNT)
     {
-        error("Too many local variables in function.");
+        error(parser, "Too many local variables in function.");
         return;
     }
     // localCount++ 就是当前变量在vm's stack存储index
-    Local *local = &current->locals[current->localCount++];
+    Local *local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->byValue = false;
+    local->initializing = false;
 }
 
-static void declareVariable()
+static void declareVariable(Parser *parser)
 {
-    if (current->scopeDepth == 0)
+    if (parser->compiler->scopeDepth == 0)
         return;
 
-    Token *name = &parser.previous;
+    Token *name = &parser->previous;
     // 局部变量的名称根本不重要，只需要防止重复就行了，不想全局变量需要拿name计算hash存储
-    for (int i = current->localCount - 1; i >= 0; i--)
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--)
     {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth)
+        Local *local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth)
         {
             break;
         }
@@ -450,230 +578,260 @@ static void declareVariable()
         // 反向查找具有相同名称的已有变量。如果是当前作用域中找到，我们就报告错误
         if (identifiersEqual(name, &local->name))
         {
-            error("Already a variable with this name in this scope.");
+            error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char *errorMessage)
+static uint8_t parseVariable(Parser *parser, const char *errorMessage)
 {
-    consume(TOKEN_IDENTIFIER, errorMessage);
-    declareVariable();
-    if (current->scopeDepth > 0)
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
+    declareVariable(parser);
+    if (parser->compiler->scopeDepth > 0)
     {
         // 局部变量不需要返回常量索引，返回一个假的表索引
         return 0;
     }
-    return identifierConstant(&parser.previous);
+    return identifierConstant(parser, &parser->previous);
 }
 
-static void markInitialized()
+static void markInitialized(Parser *parser)
 {
-    if (current->scopeDepth == 0)
+    if (parser->compiler->scopeDepth == 0)
         return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(Parser *parser, uint8_t global)
 {
-    if (current->scopeDepth > 0)
+    if (parser->compiler->scopeDepth > 0)
     {
-        markInitialized();
+        markInitialized(parser);
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitBytes(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argumentList()
+static uint8_t argumentList(Parser *parser)
 {
     uint8_t argCount = 0;
-    if (!check(TOKEN_RIGHT_PAREN))
+    if (!check(parser, TOKEN_RIGHT_PAREN))
     {
         do
         {
-            expression();
+            expression(parser);
             if (argCount == 255)
             {
-                error("Can't have more than 255 arguments.");
+                error(parser, "Can't have more than 255 arguments.");
             }
             argCount++;
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return argCount;
 }
 
-static void and_(bool canAssign)
+static void and_(Parser *parser, bool canAssign)
 {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
-    patchJump(endJump);
+    patchJump(parser, endJump);
 }
 
-static void binary(bool canAssign)
+static void binary(Parser *parser, bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
     ParseRule *rule = getRule(operatorType);
     // 数值 +1 的唯一目的就是让“同优先级”在下一层循环里不再满足 <= 条件，从而：
     // 把同级的运算符挡在递归外面, 先做完左边，再回来合并——天生左结合
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
     switch (operatorType)
     {
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        emitBytes(parser, OP_EQUAL, OP_NOT);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emitByte(OP_EQUAL);
+        emitByte(parser, OP_EQUAL);
         break;
     case TOKEN_GREATER:
-        emitByte(OP_GREATER);
+        emitByte(parser, OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        emitBytes(parser, OP_LESS, OP_NOT);
         break;
     case TOKEN_LESS:
-        emitByte(OP_LESS);
+        emitByte(parser, OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_GREATER, OP_NOT);
+        emitBytes(parser, OP_GREATER, OP_NOT);
         break;
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+        emitByte(parser, OP_ADD);
         break;
     case TOKEN_MINUS:
-        emitByte(OP_SUBTRACT);
+        emitByte(parser, OP_SUBTRACT);
         break;
     case TOKEN_STAR:
-        emitByte(OP_MULTIPLY);
+        emitByte(parser, OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+        emitByte(parser, OP_DIVIDE);
         break;
     default:
         return; // Unreachable.
     }
 }
 
-static void call(bool canAssign)
+static void call(Parser *parser, bool canAssign)
 {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
 }
 
-static void dot(bool canAssign)
+static void dot(Parser *parser, bool canAssign)
 {
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
 
-    if (canAssign && match(TOKEN_EQUAL))
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        expression(parser);
+        emitBytes(parser, OP_SET_PROPERTY, name);
     }
-    else if (match(TOKEN_LEFT_PAREN))
+    else if (match(parser, TOKEN_LEFT_PAREN))
     {
         // 一个带点的属性访问后面跟着一个左括号，很可能是一个方法调用
         // 我们寻找一个左括号。如果匹配到了，则切换到一个新的代码路径
         // 跳过创建ObjBoundMethod的流程直接调用
-        uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+        uint8_t argCount = argumentList(parser);
+        emitBytes(parser, OP_INVOKE, name);
+        emitByte(parser, argCount);
     }
     else
     {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitBytes(parser, OP_GET_PROPERTY, name);
     }
 }
 
-static void literal(bool canAssign)
+static void literal(Parser *parser, bool canAssign)
 {
-    switch (parser.previous.type)
+    switch (parser->previous.type)
     {
     case TOKEN_FALSE:
-        emitByte(OP_FALSE);
+        emitByte(parser, OP_FALSE);
         break;
     case TOKEN_NIL:
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
         break;
     case TOKEN_TRUE:
-        emitByte(OP_TRUE);
+        emitByte(parser, OP_TRUE);
         break;
     default:
         return; // Unreachable.
     }
 }
-static void grouping(bool canAssign)
+static void grouping(Parser *parser, bool canAssign)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
-static void number(bool canAssign)
+static void number(Parser *parser, bool canAssign)
 {
     // strtod 是标准库“字符串 → double”的解析器；
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    double value = strtod(parser->previous.start, NULL);
+    // 能精确放进32位整数的字面量编成整数常量，运行时的整数快路径才有机会生效
+    if (value >= INT32_MIN && value <= INT32_MAX && value == (int32_t)value)
+    {
+        emitConstant(parser, INT_VAL((int32_t)value));
+    }
+    else
+    {
+        emitConstant(parser, NUMBER_VAL(value));
+    }
 }
-static void or_(bool canAssign)
+static void or_(Parser *parser, bool canAssign)
 {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
-static void string(bool canAssign)
+static void string(Parser *parser, bool canAssign)
 {
     // “把源码里的字符串字面量复制到堆，做成 ObjString，再当成常量塞进字节码。”
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(parser, OBJ_VAL(copyString(parser->vm, parser->previous.start + 1, parser->previous.length - 2)));
+}
+
+// 名字是 intrinsics 表里的内置函数时返回下标，否则返回-1
+static int intrinsicIndex(Token *name)
+{
+    for (int i = 0; i < INTRINSIC_COUNT; i++)
+    {
+        const char *chars = intrinsics[i].name;
+        if ((int)strlen(chars) == name->length && memcmp(chars, name->start, name->length) == 0)
+            return i;
+    }
+    return -1;
 }
 
-static void namedVariable(Token name, bool canAssign)
+static void namedVariable(Parser *parser, Token name, bool canAssign)
 {
     uint8_t getOp, setOp;
     // resolveLocal 返回值可以直接当 OP_GET_LOCAL 的操作数
     // 返回-1，表示没有找到，应该假定它是一个全局变量
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if (arg != -1)
     {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
     }
     // 这个新的resolveUpvalue()函数会查找在任何外围函数中声明的局部变量。如果找到了，就会返回该变量的“上值索引”。
-    else if ((arg = resolveUpvalue(current, &name)) != -1)
+    else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1)
     {
-        getOp = OP_GET_UPVALUE;
+        getOp = parser->compiler->upvalues[arg].byValue ? OP_GET_CAPTURED : OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     }
     else
     {
-        arg = identifierConstant(&name);
+        // 没有被局部变量遮蔽的内置函数调用直接编译成专用指令，
+        // 运行时如果全局变量被重新赋值过，指令自己会退回普通调用
+        int intrinsic = intrinsicIndex(&name);
+        if (intrinsic != -1 && check(parser, TOKEN_LEFT_PAREN))
+        {
+            advance(parser);
+            uint8_t argCount = argumentList(parser);
+            emitBytes(parser, (uint8_t)(OP_SQRT + intrinsic), argCount);
+            return;
+        }
+        arg = identifierConstant(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     // 当编译器到达函数声明的结尾时，每个变量的引用都已经被解析为局部变量、上值或全局变量。
-    if (canAssign && match(TOKEN_EQUAL))
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
+        expression(parser);
+        emitBytes(parser, setOp, (uint8_t)arg);
     }
     else
     {
-        emitBytes(getOp, (uint8_t)arg);
+        emitBytes(parser, getOp, (uint8_t)arg);
     }
 }
 
-static void variable(bool canAssign)
+static void variable(Parser *parser, bool canAssign)
 {
-    namedVariable(parser.previous, canAssign);
+    namedVariable(parser, parser->previous, canAssign);
 }
 
 static Token syntheticToken(const char *text)
@@ -684,69 +842,69 @@ static Token syntheticToken(const char *text)
     return token;
 }
 
-static void super_(bool canAssign)
+static void super_(Parser *parser, bool canAssign)
 {
     // 超类调用只有在方法主体（或方法中嵌套的函数）中才有意义
-    if (currentClass == NULL)
+    if (parser->currentClass == NULL)
     {
-        error("Can't use 'super' outside of a class.");
+        error(parser, "Can't use 'super' outside of a class.");
     }
-    else if (!currentClass->hasSuperclass)
+    else if (!parser->currentClass->hasSuperclass)
     {
-        error("Can't use 'super' in a class with no superclass.");
+        error(parser, "Can't use 'super' in a class with no superclass.");
     }
 
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
     // 这就是 Robert Nystrom 的“栈即作用域”式小巧思：
     // OP_INHERIT 的时候 父类对象一旦压栈就故意不弹；
     // 再把 super 硬绑到槽 0；
     // super 不是指针，也不是魔法，就是栈里那个没被人 pop 的父类本体。
     // 第一条指令将实例加载到栈中。
-    namedVariable(syntheticToken("this"), false);
-    if (match(TOKEN_LEFT_PAREN))
+    namedVariable(parser, syntheticToken("this"), false);
+    if (match(parser, TOKEN_LEFT_PAREN))
     {
-        uint8_t argCount = argumentList();
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
-        emitByte(argCount);
+        uint8_t argCount = argumentList(parser);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_SUPER_INVOKE, name);
+        emitByte(parser, argCount);
     }
     else
     {
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_GET_SUPER, name);
     }
 }
 
-static void this_(bool canAssign)
+static void this_(Parser *parser, bool canAssign)
 {
     // 每进入一个类体，classDeclaration() 就把一个 ClassCompiler 压入 currentClass 链表；
     // currentClass == null 表示 类之外，此时 的this就被正确地禁止了。
-    if (currentClass == NULL)
+    if (parser->currentClass == NULL)
     {
-        error("Can't use 'this' outside of a class.");
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
     // 用于判断编译器是否应该查找后续的=运算符并解析setter。你不能给this赋值，所以我们传入false来禁止它。
-    variable(false);
+    variable(parser, false);
 }
 
-static void unary(bool canAssign)
+static void unary(Parser *parser, bool canAssign)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
 
     // Compile the operand.
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     // Emit the operator instruction.
     switch (operatorType)
     {
     case TOKEN_BANG:
-        emitByte(OP_NOT);
+        emitByte(parser, OP_NOT);
         break;
     case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
+        emitByte(parser, OP_NEGATE);
         break;
     default:
         return; // Unreachable.
@@ -798,317 +956,416 @@ ParseRule rules[] = {
     [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
     [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
 };
-static void parsePrecedence(Precedence precedence)
+static void parsePrecedence(Parser *parser, Precedence precedence)
 {
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL)
     {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
-    while (precedence <= getRule(parser.current.type)->precedence)
+    prefixRule(parser, canAssign);
+    while (precedence <= getRule(parser->current.type)->precedence)
     {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
-    if (canAssign && match(TOKEN_EQUAL))
+    if (canAssign && match(parser, TOKEN_EQUAL))
     {
-        error("Invalid assignment target.");
+        error(parser, "Invalid assignment target.");
     }
 }
 static ParseRule *getRule(TokenType type)
 {
     return &rules[type];
 }
-static void expression()
+static void expression(Parser *parser)
 {
-    parsePrecedence(PREC_ASSIGNMENT);
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block()
+static void block(Parser *parser)
 {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
     {
-        declaration();
+        declaration(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type)
+// 按编译函数体时的规则解析一个名字：不是形参就尝试作为上值捕获，并记下新上值的名字
+static void captureName(Parser *parser, Compiler *compiler, Token name, Token *upvalueNames)
+{
+    if (resolveLocal(parser, compiler, &name) != -1)
+        return;
+    int count = compiler->function->upvalueCount;
+    int upvalue = resolveUpvalue(parser, compiler, &name);
+    if (upvalue != -1 && compiler->function->upvalueCount > count)
+        upvalueNames[upvalue] = name;
+}
+
+// 延迟编译时跳过函数体：只匹配大括号，并把函数体（含嵌套函数）里出现的每个名字
+// 都解析一遍，确定上值列表以及外层哪些局部变量会被捕获。
+// 被函数体内部局部变量遮蔽的名字也会被捕获，这只是多一个上值，不影响语义
+static void skipFunctionBody(Parser *parser, Compiler *compiler, Token *upvalueNames)
+{
+    int depth = 1;
+    for (;;)
+    {
+        TokenType previous = parser->previous.type;
+        advance(parser);
+        switch (parser->previous.type)
+        {
+        case TOKEN_LEFT_BRACE:
+            depth++;
+            break;
+        case TOKEN_RIGHT_BRACE:
+            if (--depth == 0)
+                return;
+            break;
+        case TOKEN_EOF:
+            error(parser, "Expect '}' after block.");
+            return;
+        case TOKEN_SUPER:
+            // super 会同时读取 super 和 this 两个变量；类外面的 this/super 留给编译函数体时报错
+            if (parser->currentClass != NULL)
+            {
+                captureName(parser, compiler, syntheticToken("super"), upvalueNames);
+                captureName(parser, compiler, syntheticToken("this"), upvalueNames);
+            }
+            break;
+        case TOKEN_THIS:
+            if (parser->currentClass != NULL)
+                captureName(parser, compiler, syntheticToken("this"), upvalueNames);
+            break;
+        case TOKEN_IDENTIFIER:
+            // 点号后面的是属性名，不是变量
+            if (previous != TOKEN_DOT)
+                captureName(parser, compiler, parser->previous, upvalueNames);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void function(Parser *parser, FunctionType type)
 {
     Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+    initCompiler(parser, &compiler, type, NULL);
+    beginScope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!check(TOKEN_RIGHT_PAREN))
+    Token paren = parser->current;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN))
     {
         do
         {
             // 形参就是在函数体最外层的词法作用域中声明的一个局部变量
-            current->function->arity++;
-            if (current->function->arity > 255)
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255)
             {
-                errorAtCurrent("Can't have more than 255 parameters.");
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
-            defineVariable(constant);
-        } while (match(TOKEN_COMMA));
+            uint8_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
 
-    ObjFunction *function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    ObjFunction *function;
+    if (parser->lazySource != NULL)
+    {
+        Token upvalueNames[UINT8_COUNT];
+        skipFunctionBody(parser, &compiler, upvalueNames);
+        function = compiler.function;
+        LazyFunction *lazy = ALLOCATE(parser->vm, LazyFunction, 1);
+        lazy->source = parser->lazySource;
+        lazy->start = paren.start;
+        lazy->line = paren.line;
+        lazy->type = type;
+        lazy->inClass = parser->currentClass != NULL;
+        lazy->hasSuperclass = parser->currentClass != NULL && parser->currentClass->hasSuperclass;
+        lazy->upvalueCount = function->upvalueCount;
+        lazy->upvalueNames = NULL;
+        lazy->upvalueByValue = NULL;
+        // 没有上值时 ALLOCATE 返回 NULL，不能交给 memcpy
+        if (function->upvalueCount > 0)
+        {
+            lazy->upvalueNames = ALLOCATE(parser->vm, Token, function->upvalueCount);
+            memcpy(lazy->upvalueNames, upvalueNames, sizeof(Token) * function->upvalueCount);
+            lazy->upvalueByValue = ALLOCATE(parser->vm, bool, function->upvalueCount);
+            for (int i = 0; i < function->upvalueCount; i++)
+                lazy->upvalueByValue[i] = compiler.upvalues[i].byValue;
+        }
+        function->lazy = lazy;
+        parser->compiler = parser->compiler->enclosing;
+    }
+    else
+    {
+        block(parser);
+        function = endCompiler(parser);
+    }
+    emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++)
     {
-        // 如果第一个字节是1，它捕获的就是外层函数中的一个局部变量。
-        // 如果是0，它捕获的是函数的一个上值。
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+        // 第一个字节带 UPVALUE_LOCAL 时，它捕获的就是外层函数中的一个局部变量，否则捕获的是函数的一个上值。
+        // 局部变量捕获后不再赋值时再带上 UPVALUE_BY_VALUE，闭包直接复制它的值
+        uint8_t flags = 0;
+        if (compiler.upvalues[i].isLocal)
+            flags = UPVALUE_LOCAL | (compiler.upvalues[i].byValue ? UPVALUE_BY_VALUE : 0);
+        emitByte(parser, flags);
         // 下一个字节是要捕获局部变量插槽或上值索引。
-        emitByte(compiler.upvalues[i].index);
+        emitByte(parser, compiler.upvalues[i].index);
     }
 }
 
-static void method()
+static void method(Parser *parser)
 {
-    consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+    uint8_t constant = identifierConstant(parser, &parser->previous);
+    // 编译类体时就给方法名编号，同一个类的方法编号相邻，运行时的方法数组更紧凑
+    methodSelector(parser->vm, AS_STRING(currentChunk(parser)->constants.values[constant]));
     FunctionType type = TYPE_METHOD;
 
-    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0)
+    if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0)
     {
         type = TYPE_INITIALIZER;
     }
-    function(type);
-    emitBytes(OP_METHOD, constant);
+    function(parser, type);
+    emitBytes(parser, OP_METHOD, constant);
 }
 
-static void classDeclaration()
+static void classDeclaration(Parser *parser)
 {
-    consume(TOKEN_IDENTIFIER, "Expect class name.");
-    Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
-    declareVariable();
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser->previous;
+    uint8_t nameConstant = identifierConstant(parser, &parser->previous);
+    declareVariable(parser);
     // 先压入class
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitBytes(parser, OP_CLASS, nameConstant);
+    defineVariable(parser, nameConstant);
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
-    classCompiler.enclosing = currentClass;
-    currentClass = &classCompiler;
+    classCompiler.enclosing = parser->currentClass;
+    parser->currentClass = &classCompiler;
     // 开始编译新语法
     // class A < B 继承
-    if (match(TOKEN_LESS))
+    if (match(parser, TOKEN_LESS))
     {
-        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+        consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
         // 解析父类class变量压入stack
-        variable(false);
+        variable(parser, false);
 
-        if (identifiersEqual(&className, &parser.previous))
+        if (identifiersEqual(&className, &parser->previous))
         {
-            error("A class can't inherit from itself.");
+            error(parser, "A class can't inherit from itself.");
         }
         // 创建一个新的词法作用域可以确保 super 在一个定义域内不冲突
-        beginScope();
+        beginScope(parser);
 
         // 只在编译器侧的 compiler.locals[] 数组里追加一条记录，
         // “以后只要见到标识符 super，就给我发 OP_GET_LOCAL 0 / OP_SET_LOCAL 0
-        addLocal(syntheticToken("super"));
-        defineVariable(0);
+        addLocal(parser, syntheticToken("super"));
+        defineVariable(parser, 0);
 
-        namedVariable(className, false);
-        emitByte(OP_INHERIT);
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
         classCompiler.hasSuperclass = true;
     }
-    namedVariable(className, false);
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    namedVariable(parser, className, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
 
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
     {
         // 再压入每一个method
-        method();
+        method(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
     // 弹出class
-    emitByte(OP_POP);
+    emitByte(parser, OP_POP);
     if (classCompiler.hasSuperclass)
     {
-        endScope();
+        endScope(parser);
     }
-    currentClass = currentClass->enclosing;
+    parser->currentClass = parser->currentClass->enclosing;
 }
-static void funDeclaration()
+static void funDeclaration(Parser *parser)
 {
-    uint8_t global = parseVariable("Expect function name.");
-    markInitialized();
-    function(TYPE_FUNCTION);
-    defineVariable(global);
+    uint8_t global = parseVariable(parser, "Expect function name.");
+    markInitialized(parser);
+    // 局部函数在自己的函数体里引用自己时要按引用捕获：创建闭包时它的栈槽里还没有值
+    Local *local = parser->compiler->scopeDepth > 0 ? &parser->compiler->locals[parser->compiler->localCount - 1] : NULL;
+    if (local != NULL)
+        local->initializing = true;
+    function(parser, TYPE_FUNCTION);
+    if (local != NULL)
+        local->initializing = false;
+    defineVariable(parser, global);
 }
 
-static void varDeclaration()
+static void varDeclaration(Parser *parser)
 {
-    uint8_t global = parseVariable("Expect variable name.");
+    uint8_t global = parseVariable(parser, "Expect variable name.");
 
-    if (match(TOKEN_EQUAL))
+    if (match(parser, TOKEN_EQUAL))
     {
-        expression();
+        expression(parser);
     }
     else
     {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-    defineVariable(global);
+    defineVariable(parser, global);
 }
 
-static void expressionStatement()
+static void expressionStatement(Parser *parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
 }
-static void forStatement()
+static void forStatement(Parser *parser)
 {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
     // 处理for循环的初始化部分
-    if (match(TOKEN_SEMICOLON))
+    if (match(parser, TOKEN_SEMICOLON))
     {
         // No initializer.
     }
-    else if (match(TOKEN_VAR))
+    else if (match(parser, TOKEN_VAR))
     {
-        varDeclaration();
+        varDeclaration(parser);
     }
     else
     {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     // 处理for循环的条件部分
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON))
+    if (!match(parser, TOKEN_SEMICOLON))
     {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Condition.
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP); // Condition.
     }
     // 处理for循环的增量部分
-    if (!match(TOKEN_RIGHT_PAREN))
+    if (!match(parser, TOKEN_RIGHT_PAREN))
     {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
     if (exitJump != -1)
     {
-        patchJump(exitJump);
-        emitByte(OP_POP); // Condition.
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP); // Condition.
     }
-    endScope();
+    endScope(parser);
 }
 
-static void ifStatement()
+static void ifStatement(Parser *parser)
 {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
     // 通过语法分析，拿到ifelse对应字节码地址，在运行时做跳转
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    int elseJump = emitJump(OP_JUMP);
-    patchJump(thenJump);
-    emitByte(OP_POP);
-    if (match(TOKEN_ELSE))
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    int elseJump = emitJump(parser, OP_JUMP);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
+    if (match(parser, TOKEN_ELSE))
     {
-        statement();
+        statement(parser);
     }
-    patchJump(elseJump);
+    patchJump(parser, elseJump);
 }
 
-static void printStatement()
+static void printStatement(Parser *parser)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement()
+static void returnStatement(Parser *parser)
 {
     // 我们已经规定，在任何函数之外有return语句都是编译错误
-    if (current->type == TYPE_SCRIPT)
+    if (parser->compiler->type == TYPE_SCRIPT)
     {
-        error("Can't return from top-level code.");
+        error(parser, "Can't return from top-level code.");
     }
-    if (match(TOKEN_SEMICOLON))
+    if (match(parser, TOKEN_SEMICOLON))
     {
         // 如果没有返回值，语句会隐式地返回nil
-        emitReturn();
+        emitReturn(parser);
     }
     else
     {
         // 从class init中返回任何其它值的行为成为错误
-        if (current->type == TYPE_INITIALIZER)
+        if (parser->compiler->type == TYPE_INITIALIZER)
         {
-            error("Can't return a value from an initializer.");
+            error(parser, "Can't return a value from an initializer.");
         }
         // 否则，我们编译返回值表达式，并用OP_RETURN指令将其返回。
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emitByte(OP_RETURN);
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        emitByte(parser, OP_RETURN);
     }
 }
 
-static void whileStatement()
+static void whileStatement(Parser *parser)
 {
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
 }
 
-static void synchronize()
+static void synchronize(Parser *parser)
 {
-    parser.panicMode = false;
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF)
+    while (parser->current.type != TOKEN_EOF)
     {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+        if (parser->previous.type == TOKEN_SEMICOLON)
             return;
-        switch (parser.current.type)
+        switch (parser->current.type)
         {
         case TOKEN_CLASS:
         case TOKEN_FUN:
@@ -1123,88 +1380,160 @@ static void synchronize()
         default:; // Do nothing.
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-static void declaration()
+static void declaration(Parser *parser)
 {
-    if (match(TOKEN_CLASS))
+    if (match(parser, TOKEN_CLASS))
     {
-        classDeclaration();
+        classDeclaration(parser);
     }
-    else if (match(TOKEN_FUN))
+    else if (match(parser, TOKEN_FUN))
     {
-        funDeclaration();
+        funDeclaration(parser);
     }
-    else if (match(TOKEN_VAR))
+    else if (match(parser, TOKEN_VAR))
     {
-        varDeclaration();
+        varDeclaration(parser);
     }
     else
     {
-        statement();
+        statement(parser);
     }
-    if (parser.panicMode)
+    if (parser->panicMode)
     {
-        synchronize();
+        synchronize(parser);
     }
 }
-static void statement()
+static void statement(Parser *parser)
 {
-    if (match(TOKEN_PRINT))
+    if (match(parser, TOKEN_PRINT))
     {
-        printStatement();
+        printStatement(parser);
     }
-    else if (match(TOKEN_FOR))
+    else if (match(parser, TOKEN_FOR))
     {
-        forStatement();
+        forStatement(parser);
     }
-    else if (match(TOKEN_IF))
+    else if (match(parser, TOKEN_IF))
     {
-        ifStatement();
+        ifStatement(parser);
     }
-    else if (match(TOKEN_RETURN))
+    else if (match(parser, TOKEN_RETURN))
     {
-        returnStatement();
+        returnStatement(parser);
     }
-    else if (match(TOKEN_WHILE))
+    else if (match(parser, TOKEN_WHILE))
     {
-        whileStatement();
+        whileStatement(parser);
     }
-    else if (match(TOKEN_LEFT_BRACE))
+    else if (match(parser, TOKEN_LEFT_BRACE))
     {
-        beginScope();
-        block();
-        endScope();
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     }
     else
     {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
-ObjFunction *compile(const char *source)
+// 编译期间 vm->parser 指向这次编译的状态，GC 从它找到还没编译完的函数
+static void initParser(Parser *parser, VM *vm)
+{
+    parser->vm = vm;
+    parser->hadError = false;
+    parser->panicMode = false;
+    parser->compiler = NULL;
+    parser->currentClass = NULL;
+    parser->lazySource = NULL;
+    vm->parser = parser;
+}
+
+ObjFunction *compile(VM *vm, const char *source)
 {
-    initScanner(source);
+    Parser state;
+    Parser *parser = &state;
+    initParser(parser, vm);
+    // 延迟编译要在运行时回头读函数体的源码，所以先把源码复制成一个由GC管理的字符串
+    if (vm->lazyCompile)
+        parser->lazySource = copyString(vm, source, (int)strlen(source));
+    initScanner(&parser->scanner, parser->lazySource != NULL ? parser->lazySource->chars : source);
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
-    // compilingChunk = chunk;
-    parser.hadError = false;
-    parser.panicMode = false;
-    advance();
-    while (!match(TOKEN_EOF))
+    initCompiler(parser, &compiler, TYPE_SCRIPT, NULL);
+    advance(parser);
+    while (!match(parser, TOKEN_EOF))
     {
-        declaration();
+        declaration(parser);
     }
-    ObjFunction *function = endCompiler();
-    return parser.hadError ? NULL : function;
+    ObjFunction *function = endCompiler(parser);
+    vm->parser = NULL;
+    return parser->hadError ? NULL : function;
 }
-void markCompilerRoots()
+
+bool compileLazy(VM *vm, ObjFunction *function)
 {
-    Compiler *compiler = current;
+    Parser state;
+    Parser *parser = &state;
+    initParser(parser, vm);
+    LazyFunction *lazy = function->lazy;
+    // 函数体里的嵌套函数同样延迟编译
+    parser->lazySource = lazy->source;
+    initScannerAt(&parser->scanner, lazy->start, lazy->line);
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = NULL;
+    classCompiler.hasSuperclass = lazy->hasSuperclass;
+    parser->currentClass = lazy->inClass ? &classCompiler : NULL;
+
+    Compiler compiler;
+    initCompiler(parser, &compiler, (FunctionType)lazy->type, function);
+    compiler.lazy = lazy;
+    // 函数体读上值时要知道它是不是按值捕获的
+    for (int i = 0; i < lazy->upvalueCount; i++)
+        compiler.upvalues[i].byValue = lazy->upvalueByValue[i];
+    advance(parser);
+    beginScope(parser);
+    // 形参在声明时已经检查过，这里重新声明为局部变量；arity 保持不变
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            uint8_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
+    endCompiler(parser);
+
+    vm->parser = NULL;
+    function->lazy = NULL;
+    freeLazyFunction(vm, lazy);
+    return !parser->hadError;
+}
+
+void freeLazyFunction(VM *vm, LazyFunction *lazy)
+{
+    if (lazy == NULL)
+        return;
+    FREE_ARRAY(vm, Token, lazy->upvalueNames, lazy->upvalueCount);
+    FREE_ARRAY(vm, bool, lazy->upvalueByValue, lazy->upvalueCount);
+    FREE(vm, LazyFunction, lazy);
+}
+void markCompilerRoots(VM *vm)
+{
+    Parser *parser = vm->parser;
+    if (parser == NULL)
+        return;
+    Compiler *compiler = parser->compiler;
     while (compiler != NULL)
     {
-        markObject((Obj *)compiler->function);
+        markObject(vm, (Obj *)compiler->function);
         compiler = compiler->enclosing;
     }
+    markObject(vm, (Obj *)parser->lazySource);
 }
\ No newline at end of file
@@ -1,7 +1,34 @@
 #ifndef clox_compiler_h
 #define clox_compiler_h
 #include "object.h"
+#include "scanner.h"
 #include "vm.h"
-ObjFunction* compile(const char* source);
-void markCompilerRoots();
+
+// 延迟编译模式下函数体的编译存根：只记录源码位置和上值，第一次调用时才生成字节码
+struct LazyFunction
+{
+  // 整个脚本的源码，保证函数体的文本在编译之前一直有效
+  ObjString *source;
+  // 形参列表的 '(' 在源码中的位置和行号
+  const char *start;
+  int line;
+  // FunctionType
+  int type;
+  // 声明所在的类上下文，决定 this/super 是否合法
+  bool inClass;
+  bool hasSuperclass;
+  // 第i个上值对应的变量名；函数体编译时外层作用域已经不在了，只能按名字找回上值下标
+  Token *upvalueNames;
+  // 第i个上值是不是按值捕获的，函数体里读它时用不同的指令
+  bool *upvalueByValue;
+  int upvalueCount;
+};
+
+ObjFunction* compile(VM *vm, const char* source);
+// 编译延迟的函数体，字节码直接写进存根函数；有编译错误时返回false
+bool compileLazy(VM *vm, ObjFunction *function);
+void freeLazyFunction(VM *vm, LazyFunction *lazy);
+// 在编译好的字节码里识别 getter/setter/常量方法，给 OP_INVOKE 的快路径用
+void tagAccessor(ObjFunction *function);
+void markCompilerRoots(VM *vm);
 #endif
\ No newline at end of file
@@ -4,30 +4,30 @@
 #include "object.h"
 #include "value.h"
 
-void disassembleChunk(Chunk *chunk, const char *name)
+void disassembleChunk(VM *vm, Chunk *chunk, const char *name)
 {
     printf("== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;)
     {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
 }
-static int constantInstruction(const char *name, Chunk *chunk, int offset)
+static int constantInstruction(VM *vm, const char *name, Chunk *chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
+    printValue(vm, chunk->constants.values[constant]);
     printf("'\n");
     return offset + 2;
 }
 
-static int invokeInstruction(const char *name, Chunk *chunk, int offset)
+static int invokeInstruction(VM *vm, const char *name, Chunk *chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
-    printValue(chunk->constants.values[constant]);
+    printValue(vm, chunk->constants.values[constant]);
     printf("'\n");
     return offset + 3;
 }
@@ -53,7 +53,46 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
-int disassembleInstruction(Chunk *chunk, int offset)
+#ifdef REGISTER_VM
+// 寄存器操作数打印成 r<n>，常量操作数打印成 k<n> 并附上常量的值
+static void printOperand(VM *vm, Chunk *chunk, uint8_t operand, bool isConstant)
+{
+    if (isConstant)
+    {
+        printf(" k%d '", operand);
+        printValue(vm, chunk->constants.values[operand]);
+        printf("'");
+    }
+    else
+    {
+        printf(" r%d", operand);
+    }
+}
+
+// 依次打印 operands 个操作数；lastIsConstant 表示最后一个操作数是常量下标
+static int registerInstruction(VM *vm, const char *name, Chunk *chunk, int offset, int operands, bool lastIsConstant)
+{
+    printf("%-16s", name);
+    for (int i = 1; i <= operands; i++)
+    {
+        printOperand(vm, chunk, chunk->code[offset + i], lastIsConstant && i == operands);
+    }
+    printf("\n");
+    return offset + 1 + operands;
+}
+
+static int branchInstruction(VM *vm, const char *name, Chunk *chunk, int offset, bool isConstant)
+{
+    uint16_t jump = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s", name);
+    printOperand(vm, chunk, chunk->code[offset + 1], false);
+    printOperand(vm, chunk, chunk->code[offset + 2], isConstant);
+    printf(" -> %d\n", offset + 5 + jump);
+    return offset + 5;
+}
+#endif
+
+int disassembleInstruction(VM *vm, Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
@@ -68,7 +107,7 @@ int disassembleInstruction(Chunk *chunk, int offset)
     switch (instruction)
     {
     case OP_CONSTANT:
-        return constantInstruction("OP_CONSTANT", chunk, offset);
+        return constantInstruction(vm, "OP_CONSTANT", chunk, offset);
     case OP_NIL:
         return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
@@ -82,21 +121,23 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_SET_LOCAL:
         return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return constantInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return constantInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return constantInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:
         return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
         return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_GET_CAPTURED:
+        return byteInstruction("OP_GET_CAPTURED", chunk, offset);
     case OP_GET_PROPERTY:
-        return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+        return constantInstruction(vm, "OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-        return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+        return constantInstruction(vm, "OP_SET_PROPERTY", chunk, offset);
     case OP_GET_SUPER:
-        return constantInstruction("OP_GET_SUPER", chunk, offset);
+        return constantInstruction(vm, "OP_GET_SUPER", chunk, offset);
     case OP_EQUAL:
         return simpleInstruction("OP_EQUAL", offset);
     case OP_GREATER:
@@ -126,23 +167,25 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
     case OP_INVOKE:
-        return invokeInstruction("OP_INVOKE", chunk, offset);
+        return invokeInstruction(vm, "OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
-        return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        return invokeInstruction(vm, "OP_SUPER_INVOKE", chunk, offset);
     case OP_CLOSURE:
     {
         offset++;
         uint8_t constant = chunk->code[offset++];
         printf("%-16s %4d ", "OP_CLOSURE", constant);
-        printValue(chunk->constants.values[constant]);
+        printValue(vm, chunk->constants.values[constant]);
         printf("\n");
 
         ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
         for (int j = 0; j < function->upvalueCount; j++)
         {
-            int isLocal = chunk->code[offset++];
+            int flags = chunk->code[offset++];
             int index = chunk->code[offset++];
-            printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+            const char *kind = !(flags & UPVALUE_LOCAL) ? "upvalue"
+                               : (flags & UPVALUE_BY_VALUE) ? "value" : "local";
+            printf("%04d      |                     %s %d\n", offset - 2, kind, index);
         }
         return offset;
     }
@@ -151,11 +194,73 @@ int disassembleInstruction(Chunk *chunk, int offset)
     case OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
     case OP_CLASS:
-        return constantInstruction("OP_CLASS", chunk, offset);
+        return constantInstruction(vm, "OP_CLASS", chunk, offset);
     case OP_INHERIT:
         return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:
-        return constantInstruction("OP_METHOD", chunk, offset);
+        return constantInstruction(vm, "OP_METHOD", chunk, offset);
+    case OP_SQRT:
+        return byteInstruction("OP_SQRT", chunk, offset);
+    case OP_FLOOR:
+        return byteInstruction("OP_FLOOR", chunk, offset);
+    case OP_ABS:
+        return byteInstruction("OP_ABS", chunk, offset);
+    case OP_MIN:
+        return byteInstruction("OP_MIN", chunk, offset);
+    case OP_MAX:
+        return byteInstruction("OP_MAX", chunk, offset);
+    case OP_LEN:
+        return byteInstruction("OP_LEN", chunk, offset);
+    case OP_CLOCK:
+        return byteInstruction("OP_CLOCK", chunk, offset);
+#ifdef REGISTER_VM
+    case OP_ADD_RR:
+        return registerInstruction(vm, "OP_ADD_RR", chunk, offset, 3, false);
+    case OP_ADD_RK:
+        return registerInstruction(vm, "OP_ADD_RK", chunk, offset, 3, true);
+    case OP_SUBTRACT_RR:
+        return registerInstruction(vm, "OP_SUBTRACT_RR", chunk, offset, 3, false);
+    case OP_SUBTRACT_RK:
+        return registerInstruction(vm, "OP_SUBTRACT_RK", chunk, offset, 3, true);
+    case OP_MULTIPLY_RR:
+        return registerInstruction(vm, "OP_MULTIPLY_RR", chunk, offset, 3, false);
+    case OP_MULTIPLY_RK:
+        return registerInstruction(vm, "OP_MULTIPLY_RK", chunk, offset, 3, true);
+    case OP_DIVIDE_RR:
+        return registerInstruction(vm, "OP_DIVIDE_RR", chunk, offset, 3, false);
+    case OP_DIVIDE_RK:
+        return registerInstruction(vm, "OP_DIVIDE_RK", chunk, offset, 3, true);
+    case OP_LESS_RR:
+        return registerInstruction(vm, "OP_LESS_RR", chunk, offset, 3, false);
+    case OP_LESS_RK:
+        return registerInstruction(vm, "OP_LESS_RK", chunk, offset, 3, true);
+    case OP_GREATER_RR:
+        return registerInstruction(vm, "OP_GREATER_RR", chunk, offset, 3, false);
+    case OP_GREATER_RK:
+        return registerInstruction(vm, "OP_GREATER_RK", chunk, offset, 3, true);
+    case OP_EQUAL_RR:
+        return registerInstruction(vm, "OP_EQUAL_RR", chunk, offset, 3, false);
+    case OP_EQUAL_RK:
+        return registerInstruction(vm, "OP_EQUAL_RK", chunk, offset, 3, true);
+    case OP_JUMP_IF_NOT_LESS_RR:
+        return branchInstruction(vm, "OP_JUMP_IF_NOT_LESS_RR", chunk, offset, false);
+    case OP_JUMP_IF_NOT_LESS_RK:
+        return branchInstruction(vm, "OP_JUMP_IF_NOT_LESS_RK", chunk, offset, true);
+    case OP_JUMP_IF_NOT_GREATER_RR:
+        return branchInstruction(vm, "OP_JUMP_IF_NOT_GREATER_RR", chunk, offset, false);
+    case OP_JUMP_IF_NOT_GREATER_RK:
+        return branchInstruction(vm, "OP_JUMP_IF_NOT_GREATER_RK", chunk, offset, true);
+    case OP_JUMP_IF_NOT_EQUAL_RR:
+        return branchInstruction(vm, "OP_JUMP_IF_NOT_EQUAL_RR", chunk, offset, false);
+    case OP_JUMP_IF_NOT_EQUAL_RK:
+        return branchInstruction(vm, "OP_JUMP_IF_NOT_EQUAL_RK", chunk, offset, true);
+    case OP_MOVE:
+        return registerInstruction(vm, "OP_MOVE", chunk, offset, 2, false);
+    case OP_LOADK:
+        return registerInstruction(vm, "OP_LOADK", chunk, offset, 2, true);
+    case OP_STORE:
+        return registerInstruction(vm, "OP_STORE", chunk, offset, 1, false);
+#endif
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
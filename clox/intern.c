@@ -0,0 +1,416 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// 键哈希的最高几位选分片，低位在分片里线性探测
+#define SHARD_BITS 6
+#define SHARD_COUNT (1 << SHARD_BITS)
+#define SHARD_MIN_CAPACITY 16
+
+// 摘掉的字符串留下的墓碑，探测时跳过它继续往后找
+static char tombstoneMark;
+#define TOMBSTONE ((ObjString *)&tombstoneMark)
+
+// 每个共享字符串前面的头：最近一次有VM用到它的轮次
+typedef struct
+{
+    _Atomic uint64_t seen;
+} StringHeader;
+
+typedef struct
+{
+    int capacity;
+    _Atomic(ObjString *) entries[];
+} Slots;
+
+// 摘下来的字符串和换下来的槽数组：查找不加锁，别的VM可能还在读，
+// 要等所有成员都再回收一次（那时它们早就查完了）才能释放
+typedef struct Retired
+{
+    struct Retired *next;
+    uint64_t epoch;
+    // 字符串的头或者槽数组
+    void *pointer;
+    // 字符串连同头的大小，槽数组为0
+    size_t size;
+} Retired;
+
+typedef struct
+{
+    _Alignas(64) pthread_mutex_t lock;
+    _Atomic(Slots *) slots;
+    // 用过的槽（包括墓碑）和活着的字符串，只在持锁时读写
+    int used;
+    int live;
+    Retired *retired;
+} Shard;
+
+struct InternMember
+{
+    // 最近一次完成的回收开始时的轮次，它拿着的共享字符串都至少记上了这一轮
+    _Atomic uint64_t epoch;
+    // 正在进行的回收开始时的轮次，只有这个VM自己读写
+    uint64_t collecting;
+    InternMember *next;
+};
+
+struct InternTable
+{
+    Shard shards[SHARD_COUNT];
+    // 当前轮次，从1开始；所有成员都回收过一次之后清理并加一
+    _Alignas(64) _Atomic uint64_t epoch;
+    atomic_int nextSelector;
+    pthread_mutex_t membersLock;
+    InternMember *members;
+    // 同一时间只有一个VM做清理
+    pthread_mutex_t sweepLock;
+};
+
+static StringHeader *headerOf(ObjString *string)
+{
+    return (StringHeader *)((char *)string - sizeof(StringHeader));
+}
+
+static size_t sharedStringSize(int length)
+{
+    return sizeof(StringHeader) + sizeof(ObjString) + length + 1;
+}
+
+static Shard *shardFor(InternTable *table, uint32_t hash)
+{
+    return &table->shards[hash >> (32 - SHARD_BITS)];
+}
+
+// 只往大里记：别的VM可能同时记上更早的轮次
+static void touch(StringHeader *header, uint64_t epoch)
+{
+    uint64_t seen = atomic_load_explicit(&header->seen, memory_order_relaxed);
+    while (seen < epoch && !atomic_compare_exchange_weak(&header->seen, &seen, epoch))
+        ;
+}
+
+static Slots *newSlots(int capacity)
+{
+    Slots *slots = (Slots *)malloc(sizeof(Slots) + sizeof(_Atomic(ObjString *)) * capacity);
+    if (slots == NULL)
+        exit(1);
+    slots->capacity = capacity;
+    for (int i = 0; i < capacity; i++)
+        atomic_init(&slots->entries[i], NULL);
+    return slots;
+}
+
+// 返回槽的下标，没有时返回 -1。墓碑保证了探测链不断，空槽一定存在（负载不超过3/4）
+static int probe(Slots *slots, const char *chars, int length, uint32_t hash, ObjString **found)
+{
+    int mask = slots->capacity - 1;
+    for (int index = hash & mask;; index = (index + 1) & mask)
+    {
+        ObjString *string = atomic_load_explicit(&slots->entries[index], memory_order_acquire);
+        if (string == NULL)
+            return -1;
+        if (string != TOMBSTONE && string->hash == hash && string->length == length &&
+            memcmp(string->chars, chars, length) == 0)
+        {
+            *found = string;
+            return index;
+        }
+    }
+}
+
+static void retire(Shard *shard, void *pointer, size_t size, uint64_t epoch)
+{
+    Retired *retired = (Retired *)malloc(sizeof(Retired));
+    if (retired == NULL)
+        exit(1);
+    retired->pointer = pointer;
+    retired->size = size;
+    retired->epoch = epoch;
+    retired->next = shard->retired;
+    shard->retired = retired;
+}
+
+static void release(Retired *retired)
+{
+    if (retired->size == 0)
+        free(retired->pointer);
+    else
+        freeUnowned(retired->pointer, retired->size);
+    free(retired);
+}
+
+InternTable *newInternTable(int selector)
+{
+    InternTable *table = (InternTable *)aligned_alloc(64, sizeof(InternTable));
+    if (table == NULL)
+        exit(1);
+    for (int i = 0; i < SHARD_COUNT; i++)
+    {
+        Shard *shard = &table->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        atomic_init(&shard->slots, newSlots(SHARD_MIN_CAPACITY));
+        shard->used = 0;
+        shard->live = 0;
+        shard->retired = NULL;
+    }
+    atomic_init(&table->epoch, 1);
+    atomic_init(&table->nextSelector, selector);
+    pthread_mutex_init(&table->membersLock, NULL);
+    table->members = NULL;
+    pthread_mutex_init(&table->sweepLock, NULL);
+    return table;
+}
+
+void freeInternTable(InternTable *table)
+{
+    for (int i = 0; i < SHARD_COUNT; i++)
+    {
+        Shard *shard = &table->shards[i];
+        Slots *slots = atomic_load(&shard->slots);
+        for (int j = 0; j < slots->capacity; j++)
+        {
+            ObjString *string = atomic_load_explicit(&slots->entries[j], memory_order_relaxed);
+            if (string != NULL && string != TOMBSTONE)
+                freeUnowned(headerOf(string), sharedStringSize(string->length));
+        }
+        free(slots);
+        while (shard->retired != NULL)
+        {
+            Retired *next = shard->retired->next;
+            release(shard->retired);
+            shard->retired = next;
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+    pthread_mutex_destroy(&table->membersLock);
+    pthread_mutex_destroy(&table->sweepLock);
+    free(table);
+}
+
+InternMember *joinInternTable(InternTable *table)
+{
+    InternMember *member = (InternMember *)malloc(sizeof(InternMember));
+    if (member == NULL)
+        exit(1);
+    // 新成员还没拿着任何共享字符串，以后查到的都会记上不早于现在的轮次
+    uint64_t epoch = atomic_load(&table->epoch);
+    atomic_init(&member->epoch, epoch);
+    member->collecting = epoch;
+    pthread_mutex_lock(&table->membersLock);
+    member->next = table->members;
+    table->members = member;
+    pthread_mutex_unlock(&table->membersLock);
+    return member;
+}
+
+void leaveInternTable(InternTable *table, InternMember *member)
+{
+    pthread_mutex_lock(&table->membersLock);
+    InternMember **link = &table->members;
+    while (*link != member)
+        link = &(*link)->next;
+    *link = member->next;
+    pthread_mutex_unlock(&table->membersLock);
+    free(member);
+}
+
+ObjString *findSharedString(InternTable *table, const char *chars, int length, uint32_t hash)
+{
+    Shard *shard = shardFor(table, hash);
+    for (;;)
+    {
+        Slots *slots = atomic_load_explicit(&shard->slots, memory_order_acquire);
+        ObjString *string;
+        int index = probe(slots, chars, length, hash, &string);
+        if (index < 0)
+            return NULL;
+        touch(headerOf(string), atomic_load(&table->epoch));
+        // 清理是先摘掉再看轮次，这里是先记轮次再看它还在不在：两边至少有一边看得见另一边，
+        // 不会出现清理摘掉了它、这里却把它交给了VM。槽数组换过了就重新查
+        if (atomic_load(&shard->slots) == slots && atomic_load(&slots->entries[index]) == string)
+            return string;
+    }
+}
+
+// 分片负载太高时换一个槽数组：活着的字符串至多占一半，墓碑都丢掉
+static Slots *resizeShard(InternTable *table, Shard *shard)
+{
+    Slots *old = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+    int capacity = SHARD_MIN_CAPACITY;
+    while (capacity < (shard->live + 1) * 2)
+        capacity *= 2;
+    Slots *slots = newSlots(capacity);
+    for (int i = 0; i < old->capacity; i++)
+    {
+        ObjString *string = atomic_load_explicit(&old->entries[i], memory_order_relaxed);
+        if (string == NULL || string == TOMBSTONE)
+            continue;
+        int index = string->hash & (capacity - 1);
+        while (atomic_load_explicit(&slots->entries[index], memory_order_relaxed) != NULL)
+            index = (index + 1) & (capacity - 1);
+        atomic_store_explicit(&slots->entries[index], string, memory_order_relaxed);
+    }
+    atomic_store_explicit(&shard->slots, slots, memory_order_release);
+    shard->used = shard->live;
+    retire(shard, old, 0, atomic_load(&table->epoch));
+    return slots;
+}
+
+static ObjString *newSharedString(InternTable *table, const char *chars, int length, uint32_t hash)
+{
+    StringHeader *header = (StringHeader *)allocateUnowned(sharedStringSize(length));
+    atomic_init(&header->seen, atomic_load(&table->epoch));
+    ObjString *string = (ObjString *)(header + 1);
+    // 不在任何VM的对象链表上，永远是已标记的：markObject 碰到它只记轮次
+    string->obj.type = OBJ_STRING;
+    string->obj.isMarked = true;
+    string->obj.next = TO_REF(NULL);
+    string->length = length;
+    string->hash = hash;
+    string->hashed = true;
+    string->interned = true;
+    string->shared = true;
+    string->intrinsic = 0;
+    // 和共享代码里的名字一样预先编号，发布之后就没有VM再写它
+    string->selector = nextSharedSelector(table);
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    return string;
+}
+
+ObjString *addSharedString(InternTable *table, const char *chars, int length, uint32_t hash)
+{
+    ObjString *string = findSharedString(table, chars, length, hash);
+    if (string != NULL)
+        return string;
+
+    Shard *shard = shardFor(table, hash);
+    pthread_mutex_lock(&shard->lock);
+    Slots *slots = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+    // 没拿到锁之前别的VM可能刚插入了同样的内容；清理也要持锁，这里不用再确认
+    if (probe(slots, chars, length, hash, &string) >= 0)
+    {
+        touch(headerOf(string), atomic_load(&table->epoch));
+        pthread_mutex_unlock(&shard->lock);
+        return string;
+    }
+    if ((shard->used + 1) * 4 > slots->capacity * 3)
+        slots = resizeShard(table, shard);
+    string = newSharedString(table, chars, length, hash);
+    int mask = slots->capacity - 1;
+    int index = hash & mask;
+    for (;;)
+    {
+        ObjString *entry = atomic_load_explicit(&slots->entries[index], memory_order_relaxed);
+        if (entry == NULL || entry == TOMBSTONE)
+        {
+            if (entry == NULL)
+                shard->used++;
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+    shard->live++;
+    atomic_store_explicit(&slots->entries[index], string, memory_order_release);
+    pthread_mutex_unlock(&shard->lock);
+    return string;
+}
+
+int nextSharedSelector(InternTable *table)
+{
+    return atomic_fetch_add_explicit(&table->nextSelector, 1, memory_order_relaxed);
+}
+
+void beginInternCollection(VM *vm)
+{
+    if (vm->internMember != NULL)
+        vm->internMember->collecting = atomic_load(&vm->shared->strings->epoch);
+}
+
+void touchSharedString(VM *vm, ObjString *string)
+{
+    if (vm->internMember != NULL)
+        touch(headerOf(string), vm->internMember->collecting);
+}
+
+// 最落后的成员完成的轮次
+static uint64_t oldestMember(InternTable *table)
+{
+    uint64_t oldest = UINT64_MAX;
+    pthread_mutex_lock(&table->membersLock);
+    for (InternMember *member = table->members; member != NULL; member = member->next)
+    {
+        uint64_t epoch = atomic_load_explicit(&member->epoch, memory_order_acquire);
+        if (epoch < oldest)
+            oldest = epoch;
+    }
+    pthread_mutex_unlock(&table->membersLock);
+    return oldest;
+}
+
+// 所有成员都完成了 epoch 这一轮的回收：它们拿着的共享字符串都记上了 epoch，更早的谁都没拿着
+static void sweepShard(Shard *shard, uint64_t epoch)
+{
+    pthread_mutex_lock(&shard->lock);
+    Retired **link = &shard->retired;
+    while (*link != NULL)
+    {
+        Retired *retired = *link;
+        if (retired->epoch < epoch)
+        {
+            *link = retired->next;
+            release(retired);
+        }
+        else
+        {
+            link = &retired->next;
+        }
+    }
+
+    Slots *slots = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+    for (int i = 0; i < slots->capacity; i++)
+    {
+        ObjString *string = atomic_load_explicit(&slots->entries[i], memory_order_relaxed);
+        if (string == NULL || string == TOMBSTONE)
+            continue;
+        StringHeader *header = headerOf(string);
+        if (atomic_load_explicit(&header->seen, memory_order_relaxed) >= epoch)
+            continue;
+        atomic_store(&slots->entries[i], TOMBSTONE);
+        if (atomic_load(&header->seen) >= epoch)
+        {
+            // 有VM在摘掉之前刚查到它，放回去；插入要持锁，这段时间里没人能占这个槽
+            atomic_store(&slots->entries[i], string);
+            continue;
+        }
+        shard->live--;
+        retire(shard, header, sharedStringSize(string->length), epoch);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void endInternCollection(VM *vm)
+{
+    InternMember *member = vm->internMember;
+    if (member == NULL)
+        return;
+    atomic_store_explicit(&member->epoch, member->collecting, memory_order_release);
+    InternTable *table = vm->shared->strings;
+    // 别的VM正在清理时不用等它
+    if (pthread_mutex_trylock(&table->sweepLock) != 0)
+        return;
+    uint64_t epoch = atomic_load(&table->epoch);
+    if (oldestMember(table) == epoch)
+    {
+        for (int i = 0; i < SHARD_COUNT; i++)
+            sweepShard(&table->shards[i], epoch);
+        atomic_store(&table->epoch, epoch + 1);
+    }
+    pthread_mutex_unlock(&table->sweepLock);
+}
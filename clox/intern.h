@@ -0,0 +1,36 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "object.h"
+
+// 并发驻留表：同一份共享代码的所有VM（通常在不同线程里）共用，编译时遇到的名字和字符串字面量驻留在这里，
+// 各个VM编译出的常量因此是同一批对象。查找不加锁；插入、扩容和清理只锁住键所在的分片。
+// 表里的字符串不属于任何VM的堆，永远是已标记的。它们是弱引用的：每个VM回收时给够得着的字符串记上当前轮次，
+// 所有成员都回收过一次之后，最后回收的那个VM顺便摘掉这一轮谁都没碰过的字符串，再等一轮才真正释放
+
+typedef struct InternTable InternTable;
+typedef struct InternMember InternMember;
+
+// selector 是第一个可以分配的方法选择子编号
+InternTable *newInternTable(int selector);
+// 所有成员都离开之后才能调用
+void freeInternTable(InternTable *table);
+InternMember *joinInternTable(InternTable *table);
+void leaveInternTable(InternTable *table, InternMember *member);
+
+// 不加锁的查找，没有时返回 NULL
+ObjString *findSharedString(InternTable *table, const char *chars, int length, uint32_t hash);
+// 查找，没有时在锁住的分片里创建一个
+ObjString *addSharedString(InternTable *table, const char *chars, int length, uint32_t hash);
+// 共用这张表的VM的方法选择子都从这里编号，共享字符串的编号才不会和某个VM自己的冲突
+int nextSharedSelector(InternTable *table);
+
+// 回收开始时调用，记下这一次回收属于哪一轮
+void beginInternCollection(VM *vm);
+// markObject 碰到共享字符串时调用
+void touchSharedString(VM *vm, ObjString *string);
+// tableRemoveWhite 之后调用：这个VM这一轮回收完了，轮次凑齐时清理共享表
+void endInternCollection(VM *vm);
+
+#endif
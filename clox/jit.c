@@ -0,0 +1,839 @@
+// -std=c11 下 mmap 的 MAP_ANONYMOUS 属于扩展，需要显式打开
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "vm.h"
+
+#ifdef JIT_SUPPORTED
+#include <stddef.h>
+#include <sys/mman.h>
+#endif
+
+// 基线JIT：逐条把字节码翻译成固定的机器码模板，不做寄存器分配。
+// 操作数栈仍然是 vm.stack，Value 仍然是 NaN 装箱的64位整数，
+// 所以本地代码在任何一条指令的边界上都能和解释器互相切换：
+// 1. 字节码偏移 -> 本地代码地址的映射表让解释器可以从循环头或调用返回点跳进来；
+// 2. 本地代码把 frame->ip 写回之后返回，解释器就从那条指令接着执行。
+//
+// 本地代码运行期间固定使用这几个callee-saved寄存器：
+//   rbx = 当前 CallFrame*
+//   r12 = frame->slots
+//   r13 = 缓存的 vm->stackTop，调用慢路径之前写回，之后重新读取
+//   r15 = 正在运行的 VM*，作为第一个参数传给慢路径辅助函数
+
+#ifdef JIT_SUPPORTED
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R9 9
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+#define XMM0 0
+#define XMM1 1
+
+#define CC_O 0x0
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+#define CC_NP 0xb
+#define CC_L 0xc
+#define CC_G 0xf
+
+// 跳转目标在整个函数翻译完成后才知道，先记下要回填的位置
+typedef struct
+{
+  // rel32 字段在机器码中的位置
+  int at;
+  // 目标字节码偏移；-1 表示跳到函数出口
+  int target;
+} JitPatch;
+
+typedef struct
+{
+  uint8_t *code;
+  int count;
+  int capacity;
+  JitPatch *patches;
+  int patchCount;
+  int patchCapacity;
+} Assembler;
+
+static void emit8(Assembler *as, uint8_t byte)
+{
+  if (as->capacity < as->count + 1)
+  {
+    as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+    as->code = (uint8_t *)realloc(as->code, as->capacity);
+    if (as->code == NULL)
+      exit(1);
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    emit8(as, (uint8_t)(value >> (i * 8)));
+}
+
+static void emit64(Assembler *as, uint64_t value)
+{
+  for (int i = 0; i < 8; i++)
+    emit8(as, (uint8_t)(value >> (i * 8)));
+}
+
+static void addPatch(Assembler *as, int target)
+{
+  if (as->patchCapacity < as->patchCount + 1)
+  {
+    as->patchCapacity = as->patchCapacity < 16 ? 16 : as->patchCapacity * 2;
+    as->patches = (JitPatch *)realloc(as->patches, sizeof(JitPatch) * as->patchCapacity);
+    if (as->patches == NULL)
+      exit(1);
+  }
+  as->patches[as->patchCount].at = as->count;
+  as->patches[as->patchCount].target = target;
+  as->patchCount++;
+  emit32(as, 0);
+}
+
+// REX.W 前缀：reg 写在 ModRM.reg，rm 写在 ModRM.rm
+static void rexW(Assembler *as, int reg, int rm)
+{
+  emit8(as, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// [base + disp32] 形式的内存操作数；rsp/r12 做基址时必须带 SIB 字节
+static void memOperand(Assembler *as, int reg, int base, int32_t disp)
+{
+  emit8(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP)
+    emit8(as, 0x24);
+  emit32(as, (uint32_t)disp);
+}
+
+// mov reg, imm64
+static void movImm(Assembler *as, int reg, uint64_t value)
+{
+  emit8(as, 0x48 | (reg >> 3));
+  emit8(as, 0xb8 | (reg & 7));
+  emit64(as, value);
+}
+
+// mov reg, [base + disp]
+static void load(Assembler *as, int reg, int base, int32_t disp)
+{
+  rexW(as, reg, base);
+  emit8(as, 0x8b);
+  memOperand(as, reg, base, disp);
+}
+
+// mov [base + disp], reg
+static void store(Assembler *as, int base, int32_t disp, int reg)
+{
+  rexW(as, reg, base);
+  emit8(as, 0x89);
+  memOperand(as, reg, base, disp);
+}
+
+// 两个64位寄存器之间的 ALU 运算：opcode 是 "op r/m64, r64" 形式
+static void aluRR(Assembler *as, uint8_t opcode, int dst, int src)
+{
+  rexW(as, src, dst);
+  emit8(as, opcode);
+  emit8(as, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+#define MOV_RR(as, dst, src) aluRR(as, 0x89, dst, src)
+#define AND_RR(as, dst, src) aluRR(as, 0x21, dst, src)
+#define OR_RR(as, dst, src) aluRR(as, 0x09, dst, src)
+#define XOR_RR(as, dst, src) aluRR(as, 0x31, dst, src)
+#define CMP_RR(as, dst, src) aluRR(as, 0x39, dst, src)
+
+// add/sub reg, imm32
+static void addImm(Assembler *as, int reg, int32_t value)
+{
+  rexW(as, 0, reg);
+  emit8(as, 0x81);
+  emit8(as, 0xc0 | (reg & 7));
+  emit32(as, (uint32_t)value);
+}
+
+static void subImm(Assembler *as, int reg, int32_t value)
+{
+  rexW(as, 0, reg);
+  emit8(as, 0x81);
+  emit8(as, 0xe8 | (reg & 7));
+  emit32(as, (uint32_t)value);
+}
+
+// movq xmm, reg
+static void movqToXmm(Assembler *as, int xmm, int reg)
+{
+  emit8(as, 0x66);
+  rexW(as, xmm, reg);
+  emit8(as, 0x0f);
+  emit8(as, 0x6e);
+  emit8(as, 0xc0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+// movq reg, xmm
+static void movqFromXmm(Assembler *as, int reg, int xmm)
+{
+  emit8(as, 0x66);
+  rexW(as, xmm, reg);
+  emit8(as, 0x0f);
+  emit8(as, 0x7e);
+  emit8(as, 0xc0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+// 标量双精度运算：addsd(0x58) subsd(0x5c) mulsd(0x59) divsd(0x5e)
+static void sseOp(Assembler *as, uint8_t opcode, int dst, int src)
+{
+  emit8(as, 0xf2);
+  emit8(as, 0x0f);
+  emit8(as, opcode);
+  emit8(as, 0xc0 | (dst << 3) | src);
+}
+
+static void ucomisd(Assembler *as, int a, int b)
+{
+  emit8(as, 0x66);
+  emit8(as, 0x0f);
+  emit8(as, 0x2e);
+  emit8(as, 0xc0 | (a << 3) | b);
+}
+
+// setcc 低8位寄存器（只用 al/cl）
+static void setcc(Assembler *as, uint8_t cc, int reg)
+{
+  emit8(as, 0x0f);
+  emit8(as, 0x90 | cc);
+  emit8(as, 0xc0 | reg);
+}
+
+// jcc rel32 / jmp rel32 到某个字节码偏移
+static void jccTo(Assembler *as, uint8_t cc, int target)
+{
+  emit8(as, 0x0f);
+  emit8(as, 0x80 | cc);
+  addPatch(as, target);
+}
+
+static void jmpTo(Assembler *as, int target)
+{
+  emit8(as, 0xe9);
+  addPatch(as, target);
+}
+
+// 函数内部的短距离前向跳转，返回 rel8 的位置等待回填
+static int jccShort(Assembler *as, uint8_t cc)
+{
+  emit8(as, 0x70 | cc);
+  emit8(as, 0);
+  return as->count - 1;
+}
+
+static int jmpShort(Assembler *as)
+{
+  emit8(as, 0xeb);
+  emit8(as, 0);
+  return as->count - 1;
+}
+
+static void patchShort(Assembler *as, int at)
+{
+  as->code[at] = (uint8_t)(as->count - at - 1);
+}
+
+// 同一条指令内部、距离可能超过 rel8 的前向跳转，返回 rel32 的位置等待回填
+static int jccNear(Assembler *as, uint8_t cc)
+{
+  emit8(as, 0x0f);
+  emit8(as, 0x80 | cc);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static int jmpNear(Assembler *as)
+{
+  emit8(as, 0xe9);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static void patchNear(Assembler *as, int at)
+{
+  uint32_t rel = (uint32_t)(as->count - at - 4);
+  memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+// 把 rax 压入 Lox 操作数栈
+static void pushRax(Assembler *as)
+{
+  store(as, R13, 0, RAX);
+  addImm(as, R13, sizeof(Value));
+}
+
+// 如果 reg 不是一个双精度数就跳转到 rel8 位置（返回需要回填的位置）
+// 判断方式和 IS_NUMBER 一样：(value & QNAN) != QNAN，rdx 中需要预先放好 QNAN
+static int jumpIfNotDouble(Assembler *as, int reg)
+{
+  MOV_RR(as, RSI, reg);
+  AND_RR(as, RSI, RDX);
+  CMP_RR(as, RSI, RDX);
+  return jccShort(as, CC_E);
+}
+
+// al 中是 0/1，转换成 FALSE_VAL / TRUE_VAL（两者只差最低位）
+static void boolFromAl(Assembler *as)
+{
+  emit8(as, 0x0f); // movzx eax, al
+  emit8(as, 0xb6);
+  emit8(as, 0xc0);
+  movImm(as, RDX, FALSE_VAL);
+  OR_RR(as, RAX, RDX);
+}
+
+// 调用 vm.c 里的慢路径辅助函数：先把 ip 和 stackTop 同步给解释器，
+// 返回后重新读取 stackTop，非 JIT_CONTINUE 的状态直接从本地代码返回
+static void callHelper(Assembler *as, void *helper, uint8_t *nextIp, int argCount, uint64_t arg0, uint64_t arg1)
+{
+  movImm(as, RAX, (uint64_t)(uintptr_t)nextIp);
+  store(as, RBX, offsetof(CallFrame, ip), RAX);
+  store(as, R15, offsetof(VM, stackTop), R13);
+  MOV_RR(as, RDI, R15);
+  if (argCount > 0)
+    movImm(as, RSI, arg0);
+  if (argCount > 1)
+    movImm(as, RDX, arg1);
+  movImm(as, RAX, (uint64_t)(uintptr_t)helper);
+  emit8(as, 0xff); // call rax
+  emit8(as, 0xd0);
+  load(as, R13, R15, offsetof(VM, stackTop));
+  emit8(as, 0x85); // test eax, eax
+  emit8(as, 0xc0);
+  jccTo(as, CC_NE, -1);
+}
+
+// 把 ip 写回当前指令并返回 JIT_EXIT，让解释器执行这条指令
+static void exitToInterpreter(Assembler *as, uint8_t *ip)
+{
+  movImm(as, RAX, (uint64_t)(uintptr_t)ip);
+  store(as, RBX, offsetof(CallFrame, ip), RAX);
+  emit8(as, 0xb8); // mov eax, imm32
+  emit32(as, JIT_EXIT);
+  jmpTo(as, -1);
+}
+
+// 如果 reg 不是32位整数就跳转（返回 rel32 的位置），r8/r9 中需要预先放好 INT_MASK/INT_TAG
+static int jumpIfNotInt(Assembler *as, int reg)
+{
+  MOV_RR(as, RSI, reg);
+  AND_RR(as, RSI, R8);
+  CMP_RR(as, RSI, R9);
+  return jccNear(as, CC_NE);
+}
+
+// 把一个数字（双精度或32位整数）放进 xmm，不是数字时跳转（返回 rel32 的位置）
+// rdx/r8/r9 中需要预先放好 QNAN/INT_MASK/INT_TAG
+static int numberToXmm(Assembler *as, int xmm, int reg)
+{
+  int notDouble = jumpIfNotDouble(as, reg);
+  movqToXmm(as, xmm, reg);
+  int done = jmpShort(as);
+  patchShort(as, notDouble);
+  int notNumber = jumpIfNotInt(as, reg);
+  emit8(as, 0xf2); // cvtsi2sd xmm, reg32
+  emit8(as, 0x0f);
+  emit8(as, 0x2a);
+  emit8(as, 0xc0 | (xmm << 3) | reg);
+  patchShort(as, done);
+  return notNumber;
+}
+
+static void loadNumberTags(Assembler *as)
+{
+  movImm(as, RDX, QNAN);
+  movImm(as, R8, INT_MASK);
+  movImm(as, R9, INT_TAG);
+}
+
+// 加减和比较先试整数快路径：结果溢出时不写回，转去双精度路径重新计算；
+// 乘除以及整数和双精度混合的情况把操作数转换成双精度再算
+static void binaryNumber(Assembler *as, OpCode op, uint8_t *nextIp)
+{
+  load(as, RAX, R13, -16);
+  load(as, RCX, R13, -8);
+  loadNumberTags(as);
+  int notIntA = -1, notIntB = -1, overflow = -1, intDone = -1;
+  if (op != OP_MULTIPLY && op != OP_DIVIDE)
+  {
+    notIntA = jumpIfNotInt(as, RAX);
+    notIntB = jumpIfNotInt(as, RCX);
+    if (op == OP_ADD || op == OP_SUBTRACT)
+    {
+      emit8(as, 0x89); // mov esi, eax
+      emit8(as, 0xc6);
+      emit8(as, op == OP_ADD ? 0x01 : 0x29); // add/sub esi, ecx
+      emit8(as, 0xce);
+      overflow = jccNear(as, CC_O);
+      // 32位运算会清零高32位，补上整数标记即可
+      OR_RR(as, RSI, R9);
+      store(as, R13, -16, RSI);
+    }
+    else
+    {
+      emit8(as, 0x39); // cmp eax, ecx
+      emit8(as, 0xc8);
+      setcc(as, op == OP_LESS ? CC_L : CC_G, RAX);
+      boolFromAl(as);
+      store(as, R13, -16, RAX);
+    }
+    subImm(as, R13, sizeof(Value));
+    intDone = jmpNear(as);
+    patchNear(as, notIntA);
+    patchNear(as, notIntB);
+    if (overflow != -1)
+      patchNear(as, overflow);
+    // boolFromAl 会改写 rdx
+    movImm(as, RDX, QNAN);
+  }
+  int slowA = numberToXmm(as, XMM0, RAX);
+  int slowB = numberToXmm(as, XMM1, RCX);
+  switch (op)
+  {
+  case OP_ADD:
+    sseOp(as, 0x58, XMM0, XMM1);
+    movqFromXmm(as, RAX, XMM0);
+    break;
+  case OP_SUBTRACT:
+    sseOp(as, 0x5c, XMM0, XMM1);
+    movqFromXmm(as, RAX, XMM0);
+    break;
+  case OP_MULTIPLY:
+    sseOp(as, 0x59, XMM0, XMM1);
+    movqFromXmm(as, RAX, XMM0);
+    break;
+  case OP_DIVIDE:
+    sseOp(as, 0x5e, XMM0, XMM1);
+    movqFromXmm(as, RAX, XMM0);
+    break;
+  case OP_LESS:
+    // a < b 等价于 b > a；无序比较（NaN）时 seta 得到 0
+    XOR_RR(as, RAX, RAX);
+    ucomisd(as, XMM1, XMM0);
+    setcc(as, CC_A, RAX);
+    boolFromAl(as);
+    break;
+  case OP_GREATER:
+    XOR_RR(as, RAX, RAX);
+    ucomisd(as, XMM0, XMM1);
+    setcc(as, CC_A, RAX);
+    boolFromAl(as);
+    break;
+  default:
+    break;
+  }
+  store(as, R13, -16, RAX);
+  subImm(as, R13, sizeof(Value));
+  int done = jmpNear(as);
+  patchNear(as, slowA);
+  patchNear(as, slowB);
+  callHelper(as, (void *)jitBinary, nextIp, 1, op, 0);
+  patchNear(as, done);
+  if (intDone != -1)
+    patchNear(as, intDone);
+}
+
+// 按照 valuesEqual 的语义：两个都是数字（整数或双精度）时按数值比较，否则按位比较；
+// 位模式不同的两个对象交给 jitEqual，它们可能是内容相同的长字符串或 rope
+static void equal(Assembler *as, uint8_t *nextIp)
+{
+  load(as, RAX, R13, -16);
+  load(as, RCX, R13, -8);
+  loadNumberTags(as);
+  int bitsA = numberToXmm(as, XMM0, RAX);
+  int bitsB = numberToXmm(as, XMM1, RCX);
+  ucomisd(as, XMM0, XMM1);
+  setcc(as, CC_E, RAX);
+  setcc(as, CC_NP, RCX);
+  emit8(as, 0x20); // and al, cl
+  emit8(as, 0xc8);
+  int done = jmpShort(as);
+  patchNear(as, bitsA);
+  patchNear(as, bitsB);
+  CMP_RR(as, RAX, RCX);
+  int same = jccShort(as, CC_E);
+  MOV_RR(as, RSI, RAX);
+  AND_RR(as, RSI, RCX);
+  movImm(as, RDX, SIGN_BIT | QNAN);
+  AND_RR(as, RSI, RDX);
+  CMP_RR(as, RSI, RDX);
+  int notObjects = jccShort(as, CC_NE);
+  callHelper(as, (void *)jitEqual, nextIp, 0, 0, 0);
+  int helperDone = jmpNear(as);
+  patchShort(as, same);
+  patchShort(as, notObjects);
+  CMP_RR(as, RAX, RCX);
+  setcc(as, CC_E, RAX);
+  patchShort(as, done);
+  boolFromAl(as);
+  store(as, R13, -16, RAX);
+  subImm(as, R13, sizeof(Value));
+  patchNear(as, helperDone);
+}
+
+// 把栈顶是否为假（nil 或 false）放进 al
+static void falseyToAl(Assembler *as)
+{
+  load(as, RAX, R13, -8);
+  movImm(as, RDX, NIL_VAL);
+  CMP_RR(as, RAX, RDX);
+  setcc(as, CC_E, RCX);
+  movImm(as, RDX, FALSE_VAL);
+  CMP_RR(as, RAX, RDX);
+  setcc(as, CC_E, RAX);
+  emit8(as, 0x08); // or al, cl
+  emit8(as, 0xc8);
+}
+
+// 翻译一条指令；不支持的指令翻译成“退回解释器”
+static void translate(Assembler *as, Chunk *chunk, int offset)
+{
+  uint8_t *ip = chunk->code + offset;
+  uint8_t *next = ip + instructionLength(chunk, offset);
+  switch (*ip)
+  {
+  case OP_CONSTANT:
+    // 常量在编译完成后不会再变，直接作为立即数嵌进机器码
+    movImm(as, RAX, chunk->constants.values[ip[1]]);
+    pushRax(as);
+    break;
+  case OP_NIL:
+    movImm(as, RAX, NIL_VAL);
+    pushRax(as);
+    break;
+  case OP_TRUE:
+    movImm(as, RAX, TRUE_VAL);
+    pushRax(as);
+    break;
+  case OP_FALSE:
+    movImm(as, RAX, FALSE_VAL);
+    pushRax(as);
+    break;
+  case OP_POP:
+    subImm(as, R13, sizeof(Value));
+    break;
+  case OP_GET_LOCAL:
+    load(as, RAX, R12, ip[1] * sizeof(Value));
+    pushRax(as);
+    break;
+  case OP_SET_LOCAL:
+    load(as, RAX, R13, -8);
+    store(as, R12, ip[1] * sizeof(Value), RAX);
+    break;
+  case OP_GET_GLOBAL:
+    callHelper(as, (void *)jitGetGlobal, next, 1, (uintptr_t)AS_OBJ(chunk->constants.values[ip[1]]), 0);
+    break;
+  case OP_DEFINE_GLOBAL:
+    callHelper(as, (void *)jitDefineGlobal, next, 1, (uintptr_t)AS_OBJ(chunk->constants.values[ip[1]]), 0);
+    break;
+  case OP_SET_GLOBAL:
+    callHelper(as, (void *)jitSetGlobal, next, 1, (uintptr_t)AS_OBJ(chunk->constants.values[ip[1]]), 0);
+    break;
+  case OP_GET_UPVALUE:
+    // *AS_UPVALUE(frame->closure->upvalues[slot])->location，上值数组就在闭包对象里
+    load(as, RAX, RBX, offsetof(CallFrame, closure));
+    load(as, RAX, RAX, offsetof(ObjClosure, upvalues) + ip[1] * sizeof(Value));
+    movImm(as, RDX, ~(SIGN_BIT | QNAN));
+    AND_RR(as, RAX, RDX);
+    load(as, RAX, RAX, offsetof(ObjUpvalue, location));
+    load(as, RAX, RAX, 0);
+    pushRax(as);
+    break;
+  case OP_SET_UPVALUE:
+    load(as, RAX, RBX, offsetof(CallFrame, closure));
+    load(as, RAX, RAX, offsetof(ObjClosure, upvalues) + ip[1] * sizeof(Value));
+    movImm(as, RDX, ~(SIGN_BIT | QNAN));
+    AND_RR(as, RAX, RDX);
+    load(as, RAX, RAX, offsetof(ObjUpvalue, location));
+    load(as, RCX, R13, -8);
+    store(as, RAX, 0, RCX);
+    break;
+  case OP_GET_CAPTURED:
+    // 按值捕获的上值就存在闭包里，一次加载
+    load(as, RAX, RBX, offsetof(CallFrame, closure));
+    load(as, RAX, RAX, offsetof(ObjClosure, upvalues) + ip[1] * sizeof(Value));
+    pushRax(as);
+    break;
+  case OP_GET_PROPERTY:
+    callHelper(as, (void *)jitGetProperty, next, 1, (uintptr_t)AS_OBJ(chunk->constants.values[ip[1]]), 0);
+    break;
+  case OP_SET_PROPERTY:
+    callHelper(as, (void *)jitSetProperty, next, 1, (uintptr_t)AS_OBJ(chunk->constants.values[ip[1]]), 0);
+    break;
+  case OP_GET_SUPER:
+    callHelper(as, (void *)jitGetSuper, next, 1, (uintptr_t)AS_OBJ(chunk->constants.values[ip[1]]), 0);
+    break;
+  case OP_EQUAL:
+    equal(as, next);
+    break;
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+    binaryNumber(as, (OpCode)*ip, next);
+    break;
+  case OP_NOT:
+    falseyToAl(as);
+    boolFromAl(as);
+    store(as, R13, -8, RAX);
+    break;
+  case OP_NEGATE:
+  {
+    load(as, RAX, R13, -8);
+    movImm(as, RDX, QNAN);
+    int slow = jumpIfNotDouble(as, RAX);
+    movImm(as, RDX, SIGN_BIT);
+    XOR_RR(as, RAX, RDX);
+    store(as, R13, -8, RAX);
+    int done = jmpShort(as);
+    patchShort(as, slow);
+    callHelper(as, (void *)jitNegate, next, 0, 0, 0);
+    patchShort(as, done);
+    break;
+  }
+  case OP_PRINT:
+    callHelper(as, (void *)jitPrint, next, 0, 0, 0);
+    break;
+  case OP_JUMP:
+    jmpTo(as, (int)(next - chunk->code) + (uint16_t)((ip[1] << 8) | ip[2]));
+    break;
+  case OP_JUMP_IF_FALSE:
+  {
+    int target = (int)(next - chunk->code) + (uint16_t)((ip[1] << 8) | ip[2]);
+    load(as, RAX, R13, -8);
+    movImm(as, RDX, NIL_VAL);
+    CMP_RR(as, RAX, RDX);
+    jccTo(as, CC_E, target);
+    movImm(as, RDX, FALSE_VAL);
+    CMP_RR(as, RAX, RDX);
+    jccTo(as, CC_E, target);
+    break;
+  }
+  case OP_LOOP:
+    jmpTo(as, (int)(next - chunk->code) - (uint16_t)((ip[1] << 8) | ip[2]));
+    break;
+  case OP_CALL:
+    callHelper(as, (void *)jitCall, next, 1, ip[1], 0);
+    break;
+  case OP_SQRT:
+  case OP_FLOOR:
+  case OP_ABS:
+  case OP_MIN:
+  case OP_MAX:
+  case OP_LEN:
+  case OP_CLOCK:
+    callHelper(as, (void *)jitIntrinsic, next, 2, ip[0] - OP_SQRT, ip[1]);
+    break;
+  case OP_INVOKE:
+    callHelper(as, (void *)jitInvoke, next, 2, (uintptr_t)AS_OBJ(chunk->constants.values[ip[1]]), ip[2]);
+    break;
+  case OP_SUPER_INVOKE:
+    callHelper(as, (void *)jitSuperInvoke, next, 2, (uintptr_t)AS_OBJ(chunk->constants.values[ip[1]]), ip[2]);
+    break;
+  case OP_CLOSURE:
+    callHelper(as, (void *)jitClosure, next, 1, (uintptr_t)(ip + 1), 0);
+    break;
+  case OP_CLOSE_UPVALUE:
+    callHelper(as, (void *)jitCloseUpvalue, next, 0, 0, 0);
+    break;
+  case OP_RETURN:
+    callHelper(as, (void *)jitReturn, next, 0, 0, 0);
+    break;
+  default:
+    // 类定义这类只执行一次的指令没必要翻译，退回解释器
+    exitToInterpreter(as, ip);
+    break;
+  }
+}
+
+void jitCompile(ObjFunction *function)
+{
+  Chunk *chunk = &function->chunk;
+  Assembler as = {0};
+  uint32_t *offsets = (uint32_t *)malloc(sizeof(uint32_t) * (chunk->count + 1));
+  if (offsets == NULL)
+    exit(1);
+
+  // 入口：JitStatus entry(VM *vm, CallFrame *frame, void *target)
+  emit8(&as, 0x53); // push rbx
+  emit8(&as, 0x41); // push r12
+  emit8(&as, 0x54);
+  emit8(&as, 0x41); // push r13
+  emit8(&as, 0x55);
+  emit8(&as, 0x41); // push r14（只为了让 rsp 保持16字节对齐）
+  emit8(&as, 0x56);
+  emit8(&as, 0x41); // push r15
+  emit8(&as, 0x57);
+  MOV_RR(&as, R15, RDI);
+  MOV_RR(&as, RBX, RSI);
+  load(&as, R12, RBX, offsetof(CallFrame, slots));
+  load(&as, R13, R15, offsetof(VM, stackTop));
+  emit8(&as, 0xff); // jmp rdx
+  emit8(&as, 0xe2);
+
+  for (int offset = 0; offset < chunk->count; offset++)
+    offsets[offset] = UINT32_MAX;
+  for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+  {
+    offsets[offset] = (uint32_t)as.count;
+    translate(&as, chunk, offset);
+  }
+  // 字节码最后总是 OP_RETURN，走不到这里；保险起见退回解释器
+  offsets[chunk->count] = (uint32_t)as.count;
+  exitToInterpreter(&as, chunk->code + chunk->count);
+
+  // 出口：eax 中已经是 JitStatus，把缓存的栈顶写回
+  int epilogue = as.count;
+  store(&as, R15, offsetof(VM, stackTop), R13);
+  emit8(&as, 0x41); // pop r15
+  emit8(&as, 0x5f);
+  emit8(&as, 0x41); // pop r14
+  emit8(&as, 0x5e);
+  emit8(&as, 0x41); // pop r13
+  emit8(&as, 0x5d);
+  emit8(&as, 0x41); // pop r12
+  emit8(&as, 0x5c);
+  emit8(&as, 0x5b); // pop rbx
+  emit8(&as, 0xc3); // ret
+
+  for (int i = 0; i < as.patchCount; i++)
+  {
+    JitPatch *patch = &as.patches[i];
+    int target = patch->target == -1 ? epilogue : (int)offsets[patch->target];
+    int32_t rel = target - (patch->at + 4);
+    memcpy(as.code + patch->at, &rel, sizeof(rel));
+  }
+
+  // 先以可写方式映射，拷贝完成后改成只读可执行
+  uint8_t *code = (uint8_t *)mmap(NULL, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+  {
+    free(as.code);
+    free(as.patches);
+    free(offsets);
+    function->hotness = INT32_MIN;
+    return;
+  }
+  memcpy(code, as.code, as.count);
+  mprotect(code, as.count, PROT_READ | PROT_EXEC);
+
+  JitCode *jitCode = (JitCode *)malloc(sizeof(JitCode));
+  if (jitCode == NULL)
+    exit(1);
+  jitCode->compiled = NULL;
+  jitCode->code = code;
+  jitCode->size = as.count;
+  jitCode->offsets = offsets;
+  jitCode->offsetCount = chunk->count + 1;
+  function->jitCode = jitCode;
+#ifdef DEBUG_LOG_JIT
+  printf("-- jit %s: %d bytes of bytecode -> %d bytes of x86-64\n",
+         function->name != NULL ? function->name->chars : "<script>", chunk->count, as.count);
+#endif
+  free(as.code);
+  free(as.patches);
+}
+
+void jitFree(JitCode *code)
+{
+  if (code == NULL)
+    return;
+  if (code->code != NULL)
+    munmap(code->code, code->size);
+  free(code->offsets);
+  free(code);
+}
+
+JitStatus jitRun(VM *vm)
+{
+  for (;;)
+  {
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    JitCode *jitCode = FROM_REF(ObjFunction, frame->closure->function)->jitCode;
+    if (jitCode == NULL)
+      return JIT_EXIT;
+
+    JitStatus status;
+    if (jitCode->compiled != NULL)
+    {
+      // AOT生成的C函数自己根据 frame->ip 找到继续执行的位置
+      status = jitCode->compiled(vm, frame);
+      if (status != JIT_FRAME)
+        return status;
+      continue;
+    }
+    if (!vm->jitEnabled)
+      return JIT_EXIT;
+
+    int offset = (int)(frame->ip - FROM_REF(ObjFunction, frame->closure->function)->chunk.code);
+    uint32_t target = jitCode->offsets[offset];
+    if (target == UINT32_MAX)
+      return JIT_EXIT;
+
+    JitEntry entry = (JitEntry)(void *)jitCode->code;
+    status = entry(vm, frame, jitCode->code + target);
+    // 调用或返回之后栈顶帧变了，新的栈顶帧也可能已经编译过
+    if (status != JIT_FRAME)
+      return status;
+  }
+}
+
+#else
+
+// 不支持的平台上JIT是空操作，所有函数都留在解释器里
+void jitCompile(ObjFunction *function)
+{
+  function->hotness = INT32_MIN;
+}
+
+void jitFree(JitCode *code)
+{
+  if (code == NULL)
+    return;
+  free(code->offsets);
+  free(code);
+}
+
+JitStatus jitRun(VM *vm)
+{
+  // AOT生成的C函数不依赖平台，照常执行
+  for (;;)
+  {
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    JitCode *jitCode = FROM_REF(ObjFunction, frame->closure->function)->jitCode;
+    if (jitCode == NULL || jitCode->compiled == NULL)
+      return JIT_EXIT;
+    JitStatus status = jitCode->compiled(vm, frame);
+    if (status != JIT_FRAME)
+      return status;
+  }
+}
+
+#endif
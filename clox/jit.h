@@ -0,0 +1,55 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+
+// 基线JIT只针对 x86-64 + NaN装箱：一个Value正好是一个64位寄存器，模板代码可以直接搬运
+// 压缩引用模式下对象字段是32位偏移，模板代码按指针读取它们，所以不启用JIT
+#if defined(__x86_64__) && defined(NAN_BOXING) && !defined(COMPRESSED_REFS) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_SUPPORTED
+#endif
+
+// 函数的热度（调用次数 + 循环回边次数）超过这个阈值，就把它的字节码翻译成本地代码
+#ifndef JIT_HOT_THRESHOLD
+#define JIT_HOT_THRESHOLD 64
+#endif
+
+// 本地代码返回给解释器的状态
+typedef enum
+{
+  // 继续执行下一条指令（只在本地代码和慢路径辅助函数之间使用）
+  JIT_CONTINUE,
+  // 遇到不支持的指令，回到解释器从 frame->ip 继续执行
+  JIT_EXIT,
+  // 调用或返回改变了栈顶的CallFrame，需要重新决定由谁执行
+  JIT_FRAME,
+  // 顶层代码执行完毕
+  JIT_HALT,
+  // 运行时错误已经报告
+  JIT_ERROR
+} JitStatus;
+
+// 本地代码入口：frame是要执行的帧，target是字节码偏移对应的本地代码地址
+typedef JitStatus (*JitEntry)(VM *vm, void *frame, void *target);
+// 提前编译（clox --emit-c）生成的C函数入口，从 frame->ip 处继续执行
+typedef JitStatus (*AotEntry)(VM *vm, void *frame);
+
+struct JitCode
+{
+  // 非NULL表示这是AOT生成的C函数，此时下面的机器码字段都为空
+  AotEntry compiled;
+  // mmap出来的可执行内存
+  uint8_t *code;
+  size_t size;
+  // 字节码偏移 -> 本地代码偏移，只有指令起始位置有效
+  uint32_t *offsets;
+  int offsetCount;
+};
+
+// 尝试把函数翻译成本地代码；失败（比如平台不支持）时函数继续由解释器执行
+void jitCompile(ObjFunction *function);
+void jitFree(JitCode *code);
+// 只要栈顶帧的函数已经编译过，就在本地代码里执行它，直到需要解释器接手
+JitStatus jitRun(VM *vm);
+#endif
@@ -0,0 +1,795 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "loop.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// epoll_wait 一次最多取这么多事件
+#define MAX_EVENTS 64
+// sleep 最长这么多秒，再长换算成纳秒会溢出
+#define MAX_SLEEP_SECONDS 1e9
+
+// 就绪队列的一项：要恢复的纤程和交给它的值
+typedef struct
+{
+    ObjFiber *fiber;
+    Value value;
+} Wakeup;
+
+// sleep 中的纤程，按到期时间排成最小堆，到期时间相同的按先后顺序恢复
+typedef struct
+{
+    uint64_t deadline;
+    uint64_t sequence;
+    ObjFiber *fiber;
+} Timer;
+
+// 一个 fd 上等着的纤程，按 fd 编号索引
+typedef struct
+{
+    ObjFiber *reader;
+    ObjFiber *writer;
+    // writer 要写的字符串和已经写出去的字节数
+    ObjString *output;
+    int written;
+    // 加进过 epoll。EPOLLONESHOT 报告一次之后登记还在，只是关掉了，再等时用 MOD 打开
+    bool registered;
+    // 查过 O_NONBLOCK：非阻塞的 fd 先直接读写，阻塞的要等 epoll 报告就绪之后才读写
+    bool known;
+    bool nonblocking;
+    // 普通文件 epoll 不收，它总是就绪的，直接（阻塞地）读写
+    bool unpollable;
+} Watch;
+
+typedef enum
+{
+    IO_DONE,
+    IO_BLOCKED,
+    IO_FAILED
+} IoStatus;
+
+struct EventLoop
+{
+    int epollFd;
+    // 最早到期的定时器到期时可读，所有 sleep 共用这一个
+    int timerFd;
+    // 环形的就绪队列
+    Wakeup *ready;
+    int readyHead;
+    int readyCount;
+    int readyCapacity;
+    Watch *watches;
+    int watchCapacity;
+    // 等在 fd 上的纤程数
+    int watching;
+    Timer *timers;
+    int timerCount;
+    int timerCapacity;
+    uint64_t timerSequence;
+    // timerfd 当前设定的到期时间，0 表示没设定
+    uint64_t armedDeadline;
+    // 调用 wait() 的纤程：别的纤程都结束了（或者也在 wait()）时一起恢复
+    ObjFiber **waiters;
+    int waiterCount;
+    int waiterCapacity;
+    // pipe() 和 socketPair() 结果的类
+    ObjClass *pipeClass;
+    ObjClass *socketPairClass;
+    char buffer[LOOP_READ_CHUNK];
+};
+
+// 循环自己的数组不归GC管，和灰色栈一样直接 realloc
+static void *growArray(void *array, int *capacity, size_t size)
+{
+    *capacity = GROW_CAPACITY(*capacity);
+    array = realloc(array, size * *capacity);
+    if (array == NULL)
+        exit(1);
+    return array;
+}
+
+static uint64_t monotonicNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static Value ioError(VM *vm, const char *operation)
+{
+    char message[128];
+    snprintf(message, sizeof(message), "Could not %s: %s.", operation, strerror(errno));
+    return nativeError(vm, message);
+}
+
+static EventLoop *getLoop(VM *vm)
+{
+    if (vm->loop != NULL)
+        return vm->loop;
+    EventLoop *loop = (EventLoop *)malloc(sizeof(EventLoop));
+    if (loop == NULL)
+        exit(1);
+    loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = loop->timerFd;
+    if (loop->epollFd < 0 || loop->timerFd < 0 || epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->timerFd, &event) < 0)
+    {
+        int error = errno;
+        if (loop->epollFd >= 0)
+            close(loop->epollFd);
+        if (loop->timerFd >= 0)
+            close(loop->timerFd);
+        free(loop);
+        errno = error;
+        ioError(vm, "create the event loop");
+        return NULL;
+    }
+    loop->ready = NULL;
+    loop->readyHead = 0;
+    loop->readyCount = 0;
+    loop->readyCapacity = 0;
+    loop->watches = NULL;
+    loop->watchCapacity = 0;
+    loop->watching = 0;
+    loop->timers = NULL;
+    loop->timerCount = 0;
+    loop->timerCapacity = 0;
+    loop->timerSequence = 0;
+    loop->armedDeadline = 0;
+    loop->waiters = NULL;
+    loop->waiterCount = 0;
+    loop->waiterCapacity = 0;
+    loop->pipeClass = NULL;
+    loop->socketPairClass = NULL;
+    // 往读端已经关闭的管道里写时要拿到 EPIPE，而不是被 SIGPIPE 杀掉。宿主自己处理这个信号时不动它
+    struct sigaction action;
+    if (sigaction(SIGPIPE, NULL, &action) == 0 && action.sa_handler == SIG_DFL)
+        signal(SIGPIPE, SIG_IGN);
+    vm->loop = loop;
+    return loop;
+}
+
+static void pushReady(EventLoop *loop, ObjFiber *fiber, Value value)
+{
+    if (loop->readyCount == loop->readyCapacity)
+    {
+        // 环形队列扩容时顺便把队头挪到0
+        int capacity = GROW_CAPACITY(loop->readyCapacity);
+        Wakeup *ready = (Wakeup *)malloc(sizeof(Wakeup) * capacity);
+        if (ready == NULL)
+            exit(1);
+        for (int i = 0; i < loop->readyCount; i++)
+            ready[i] = loop->ready[(loop->readyHead + i) % loop->readyCapacity];
+        free(loop->ready);
+        loop->ready = ready;
+        loop->readyHead = 0;
+        loop->readyCapacity = capacity;
+    }
+    Wakeup *wakeup = &loop->ready[(loop->readyHead + loop->readyCount) % loop->readyCapacity];
+    wakeup->fiber = fiber;
+    wakeup->value = value;
+    loop->readyCount++;
+}
+
+static bool timerBefore(Timer *a, Timer *b)
+{
+    if (a->deadline != b->deadline)
+        return a->deadline < b->deadline;
+    return a->sequence < b->sequence;
+}
+
+static void pushTimer(EventLoop *loop, uint64_t deadline, ObjFiber *fiber)
+{
+    if (loop->timerCount == loop->timerCapacity)
+        loop->timers = (Timer *)growArray(loop->timers, &loop->timerCapacity, sizeof(Timer));
+    Timer timer = {deadline, loop->timerSequence++, fiber};
+    int i = loop->timerCount++;
+    while (i > 0 && timerBefore(&timer, &loop->timers[(i - 1) / 2]))
+    {
+        loop->timers[i] = loop->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    loop->timers[i] = timer;
+}
+
+static ObjFiber *popTimer(EventLoop *loop)
+{
+    ObjFiber *fiber = loop->timers[0].fiber;
+    Timer last = loop->timers[--loop->timerCount];
+    int i = 0;
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= loop->timerCount)
+            break;
+        if (child + 1 < loop->timerCount && timerBefore(&loop->timers[child + 1], &loop->timers[child]))
+            child++;
+        if (!timerBefore(&loop->timers[child], &last))
+            break;
+        loop->timers[i] = loop->timers[child];
+        i = child;
+    }
+    loop->timers[i] = last;
+    return fiber;
+}
+
+// 让 timerfd 在最早的定时器到期时可读
+static void armTimer(EventLoop *loop)
+{
+    if (loop->timerCount == 0 || loop->timers[0].deadline == loop->armedDeadline)
+        return;
+    uint64_t deadline = loop->timers[0].deadline;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t)(deadline / 1000000000);
+    spec.it_value.tv_nsec = (long)(deadline % 1000000000);
+    timerfd_settime(loop->timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+    loop->armedDeadline = deadline;
+}
+
+static void fireTimers(EventLoop *loop)
+{
+    // 读掉到期次数，timerfd 才会变回不可读
+    uint64_t expirations;
+    ssize_t count = read(loop->timerFd, &expirations, sizeof(expirations));
+    (void)count;
+    loop->armedDeadline = 0;
+    uint64_t now = monotonicNow();
+    while (loop->timerCount > 0 && loop->timers[0].deadline <= now)
+        pushReady(loop, popTimer(loop), NIL_VAL);
+    armTimer(loop);
+}
+
+// fd 对应的表项，表不够长时加长。fd 无效时返回NULL
+static Watch *getWatch(EventLoop *loop, int fd)
+{
+    if (fd >= loop->watchCapacity)
+    {
+        // 先确认 fd 有效，随便一个大数字不能把表撑大
+        if (fcntl(fd, F_GETFD) < 0)
+            return NULL;
+        int capacity = loop->watchCapacity;
+        while (capacity <= fd)
+            capacity = GROW_CAPACITY(capacity);
+        loop->watches = (Watch *)realloc(loop->watches, sizeof(Watch) * capacity);
+        if (loop->watches == NULL)
+            exit(1);
+        memset(loop->watches + loop->watchCapacity, 0, sizeof(Watch) * (capacity - loop->watchCapacity));
+        loop->watchCapacity = capacity;
+    }
+    Watch *watch = &loop->watches[fd];
+    if (!watch->known)
+    {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0)
+            return NULL;
+        watch->known = true;
+        watch->nonblocking = (flags & O_NONBLOCK) != 0;
+    }
+    return watch;
+}
+
+// 循环自己创建的 fd：都是非阻塞的。编号可能是刚关掉的 fd 重用的，旧的表项作废
+static void adoptFds(EventLoop *loop, int fds[2])
+{
+    for (int i = 0; i < 2; i++)
+    {
+        getWatch(loop, fds[i]);
+        Watch *watch = &loop->watches[fds[i]];
+        memset(watch, 0, sizeof(Watch));
+        watch->known = true;
+        watch->nonblocking = true;
+    }
+}
+
+// 按等着的纤程重新登记 fd 关心的事件。失败时 errno 是 epoll_ctl 的，普通文件是 EPERM
+static bool armWatch(EventLoop *loop, int fd)
+{
+    Watch *watch = &loop->watches[fd];
+    struct epoll_event event;
+    event.events = EPOLLONESHOT;
+    if (watch->reader != NULL)
+        event.events |= EPOLLIN | EPOLLRDHUP;
+    if (watch->writer != NULL)
+        event.events |= EPOLLOUT;
+    event.data.fd = fd;
+    int op = watch->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(loop->epollFd, op, fd, &event) < 0)
+    {
+        // 登记和实际对不上：fd 在循环之外被关掉，编号又被重用了
+        if (errno != ENOENT && errno != EEXIST)
+            return false;
+        op = op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (epoll_ctl(loop->epollFd, op, fd, &event) < 0)
+            return false;
+    }
+    watch->registered = true;
+    return true;
+}
+
+// 读一次，有多少读多少：读到的字符串，文件尾是 nil。失败时 errno 说明原因
+static IoStatus readSome(VM *vm, EventLoop *loop, int fd, Value *result)
+{
+    ssize_t count;
+    do
+        count = read(fd, loop->buffer, LOOP_READ_CHUNK);
+    while (count < 0 && errno == EINTR);
+    if (count < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? IO_BLOCKED : IO_FAILED;
+    *result = count > 0 ? OBJ_VAL(copyString(vm, loop->buffer, (int)count)) : NIL_VAL;
+    return IO_DONE;
+}
+
+// 从 *written 处接着写，直到写完、缓冲区满或者出错
+static IoStatus writeOut(int fd, ObjString *text, int *written)
+{
+    while (*written < text->length)
+    {
+        ssize_t count = write(fd, text->chars + *written, text->length - *written);
+        if (count >= 0)
+            *written += (int)count;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return IO_BLOCKED;
+        else if (errno != EINTR)
+            return IO_FAILED;
+    }
+    return IO_DONE;
+}
+
+// fd 可读了，替等着的纤程读。出错当作读到了文件尾，纤程拿到 nil
+static void completeRead(VM *vm, EventLoop *loop, int fd)
+{
+    Value value = NIL_VAL;
+    if (readSome(vm, loop, fd, &value) == IO_BLOCKED)
+        return;
+    // 分配字符串可能触发GC，纤程一直留在表项里，排进就绪队列之后才拿掉
+    Watch *watch = &loop->watches[fd];
+    pushReady(loop, watch->reader, value);
+    watch->reader = NULL;
+    loop->watching--;
+}
+
+// fd 可写了，替等着的纤程接着写。写完或者出错时纤程拿到写出去的字节数
+static void completeWrite(EventLoop *loop, int fd)
+{
+    Watch *watch = &loop->watches[fd];
+    if (writeOut(fd, watch->output, &watch->written) == IO_BLOCKED)
+        return;
+    pushReady(loop, watch->writer, INT_VAL(watch->written));
+    watch->writer = NULL;
+    watch->output = NULL;
+    loop->watching--;
+}
+
+// 阻塞到有 fd 就绪或者定时器到期，替等着的纤程做完操作，排进就绪队列
+static void pollEvents(VM *vm, EventLoop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(loop->epollFd, events, MAX_EVENTS, -1);
+    for (int i = 0; i < count; i++)
+    {
+        int fd = events[i].data.fd;
+        if (fd == loop->timerFd)
+        {
+            fireTimers(loop);
+            continue;
+        }
+        Watch *watch = &loop->watches[fd];
+        uint32_t happened = events[i].events;
+        if (watch->reader != NULL && (happened & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            completeRead(vm, loop, fd);
+        if (watch->writer != NULL && (happened & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+            completeWrite(loop, fd);
+        // 登记报告一次就关了，还有纤程在等就再打开
+        if (watch->reader != NULL || watch->writer != NULL)
+            armWatch(loop, fd);
+    }
+}
+
+bool nextReadyFiber(VM *vm, ObjFiber **fiber, Value *value)
+{
+    EventLoop *loop = vm->loop;
+    if (loop == NULL)
+        return false;
+    while (loop->readyCount == 0)
+    {
+        if (loop->watching == 0 && loop->timerCount == 0)
+        {
+            // 别的纤程都结束了或者也在 wait()，一起恢复
+            if (loop->waiterCount == 0)
+                return false;
+            for (int i = 0; i < loop->waiterCount; i++)
+                pushReady(loop, loop->waiters[i], NIL_VAL);
+            loop->waiterCount = 0;
+            continue;
+        }
+        pollEvents(vm, loop);
+    }
+    Wakeup *wakeup = &loop->ready[loop->readyHead];
+    *fiber = wakeup->fiber;
+    *value = wakeup->value;
+    loop->readyHead = (loop->readyHead + 1) % loop->readyCapacity;
+    loop->readyCount--;
+    return true;
+}
+
+// 宿主直接调用的，或者宿主嵌套调用的 run() 还在 C 栈上：离开这个纤程就回不来了
+static bool canSuspend(VM *vm)
+{
+    if (vm->entryFrame != 0 || vm->frameCount == 0)
+    {
+        nativeError(vm, "Cannot wait for events across a native call.");
+        return false;
+    }
+    return true;
+}
+
+// 当前纤程已经登记在循环里，换下一个能运行的纤程。下一个就是它自己时不用切换，交给它的值直接作为本地函数的结果
+static Value suspendCurrent(VM *vm, Value *args)
+{
+    ObjFiber *current = vm->fiber;
+    current->state = FIBER_WAITING;
+    ObjFiber *fiber;
+    Value value;
+    if (!nextReadyFiber(vm, &fiber, &value))
+        return nativeError(vm, "Deadlock: every fiber is waiting.");
+    if (fiber == current)
+    {
+        current->state = FIBER_RUNNING;
+        return value;
+    }
+    // 弹出被调用者和参数，循环恢复它时结果压在这里
+    vm->stackTop = args - 1;
+    if (!enterFiber(vm, fiber, value))
+        vm->nativeFailed = true;
+    return NIL_VAL;
+}
+
+Value yieldToLoop(VM *vm, Value *args)
+{
+    pushReady(getLoop(vm), vm->fiber, NIL_VAL);
+    return suspendCurrent(vm, args);
+}
+
+static bool checkFd(VM *vm, Value value, int *fd)
+{
+    if (!IS_NUMBER(value) || AS_NUMBER(value) < 0 || AS_NUMBER(value) != (int)AS_NUMBER(value))
+    {
+        nativeError(vm, "Expected a file descriptor.");
+        return false;
+    }
+    *fd = (int)AS_NUMBER(value);
+    return true;
+}
+
+static bool checkWatch(VM *vm, Value value, EventLoop **loop, int *fd, Watch **watch)
+{
+    if (!checkFd(vm, value, fd) || (*loop = getLoop(vm)) == NULL)
+        return false;
+    *watch = getWatch(*loop, *fd);
+    if (*watch == NULL)
+    {
+        ioError(vm, "use the descriptor");
+        return false;
+    }
+    return true;
+}
+
+// spawn(fn)：新建一个纤程交给事件循环，当前纤程挂起或者 wait() 时它才开始运行。它没有恢复者，返回值丢掉
+static Value spawnNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_CLOSURE(args[0]) || FROM_REF(ObjFunction, AS_CLOSURE(args[0])->function)->arity != 0)
+        return nativeError(vm, "Expected a function that takes no arguments.");
+    EventLoop *loop = getLoop(vm);
+    if (loop == NULL)
+        return NIL_VAL;
+    ObjFiber *fiber = newFiber(vm, AS_CLOSURE(args[0]));
+    fiber->state = FIBER_WAITING;
+    pushReady(loop, fiber, NIL_VAL);
+    return OBJ_VAL(fiber);
+}
+
+// wait()：挂起到别的纤程都结束为止
+static Value waitNative(VM *vm, int argCount, Value *args)
+{
+    EventLoop *loop = vm->loop;
+    if (loop == NULL || (loop->readyCount == 0 && loop->watching == 0 && loop->timerCount == 0 && loop->waiterCount == 0))
+        return NIL_VAL;
+    if (!canSuspend(vm))
+        return NIL_VAL;
+    if (loop->waiterCount == loop->waiterCapacity)
+        loop->waiters = (ObjFiber **)growArray(loop->waiters, &loop->waiterCapacity, sizeof(ObjFiber *));
+    loop->waiters[loop->waiterCount++] = vm->fiber;
+    return suspendCurrent(vm, args);
+}
+
+// sleep(seconds)：挂起 seconds 秒。sleep(0) 只是让已经就绪的纤程先运行
+static Value sleepNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]) || !(AS_NUMBER(args[0]) >= 0))
+        return nativeError(vm, "Expected a non-negative number of seconds.");
+    EventLoop *loop = getLoop(vm);
+    if (loop == NULL || !canSuspend(vm))
+        return NIL_VAL;
+    double seconds = AS_NUMBER(args[0]);
+    if (seconds > MAX_SLEEP_SECONDS)
+        seconds = MAX_SLEEP_SECONDS;
+    if (seconds == 0)
+    {
+        pushReady(loop, vm->fiber, NIL_VAL);
+    }
+    else
+    {
+        pushTimer(loop, monotonicNow() + (uint64_t)(seconds * 1e9), vm->fiber);
+        armTimer(loop);
+    }
+    return suspendCurrent(vm, args);
+}
+
+static ObjClass *pairClass(VM *vm, ObjClass **klass, const char *name)
+{
+    if (*klass == NULL)
+    {
+        push(vm, OBJ_VAL(internString(vm, name, (int)strlen(name))));
+        *klass = newClass(vm, AS_STRING(vm->stackTop[-1]));
+        pop(vm);
+    }
+    return *klass;
+}
+
+// 一个实例，两个字段各是一个 fd
+static Value newPair(VM *vm, ObjClass *klass, const char *first, const char *second, int fds[2])
+{
+    push(vm, OBJ_VAL(newInstance(vm, klass)));
+    const char *names[2] = {first, second};
+    for (int i = 0; i < 2; i++)
+    {
+        push(vm, OBJ_VAL(internString(vm, names[i], (int)strlen(names[i]))));
+        tableSet(vm, &AS_INSTANCE(vm->stackTop[-2])->fields, AS_STRING(vm->stackTop[-1]), INT_VAL(fds[i]));
+        pop(vm);
+    }
+    return pop(vm);
+}
+
+// pipe()：新建一个非阻塞的管道。结果的 reader 字段是读端，writer 字段是写端
+static Value pipeNative(VM *vm, int argCount, Value *args)
+{
+    EventLoop *loop = getLoop(vm);
+    if (loop == NULL)
+        return NIL_VAL;
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+        return ioError(vm, "create a pipe");
+    adoptFds(loop, fds);
+    return newPair(vm, pairClass(vm, &loop->pipeClass, "Pipe"), "reader", "writer", fds);
+}
+
+// socketPair()：新建一对互相连着的非阻塞 Unix 流套接字。结果的 left 和 right 字段各是一端，两端都能读写
+static Value socketPairNative(VM *vm, int argCount, Value *args)
+{
+    EventLoop *loop = getLoop(vm);
+    if (loop == NULL)
+        return NIL_VAL;
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+        return ioError(vm, "create a socket pair");
+    adoptFds(loop, fds);
+    return newPair(vm, pairClass(vm, &loop->socketPairClass, "SocketPair"), "left", "right", fds);
+}
+
+// read(fd)：读到的字符串，有多少读多少（最多 LOOP_READ_CHUNK 字节）；读到文件尾时是 nil。
+// 没有数据时挂起到 fd 可读。挂起之后出的错当作文件尾
+static Value readNative(VM *vm, int argCount, Value *args)
+{
+    EventLoop *loop;
+    int fd;
+    Watch *watch;
+    if (!checkWatch(vm, args[0], &loop, &fd, &watch))
+        return NIL_VAL;
+    if (watch->reader != NULL)
+        return nativeError(vm, "Another fiber is already reading this descriptor.");
+    Value result = NIL_VAL;
+    if (watch->nonblocking || watch->unpollable)
+    {
+        IoStatus status = readSome(vm, loop, fd, &result);
+        if (status == IO_DONE)
+            return result;
+        if (status == IO_FAILED)
+            return ioError(vm, "read");
+    }
+    if (!canSuspend(vm))
+        return NIL_VAL;
+    watch->reader = vm->fiber;
+    if (!armWatch(loop, fd))
+    {
+        watch->reader = NULL;
+        if (errno != EPERM)
+            return ioError(vm, "read");
+        watch->unpollable = true;
+        if (readSome(vm, loop, fd, &result) != IO_DONE)
+            return ioError(vm, "read");
+        return result;
+    }
+    loop->watching++;
+    return suspendCurrent(vm, args);
+}
+
+// write(fd, text)：把 text 全部写出去，结果是写出的字节数。缓冲区满时挂起到 fd 可写，
+// 挂起之后对端关闭或者出错时，结果比 text 的长度小
+static Value writeNative(VM *vm, int argCount, Value *args)
+{
+    EventLoop *loop;
+    int fd;
+    Watch *watch;
+    if (!checkWatch(vm, args[0], &loop, &fd, &watch))
+        return NIL_VAL;
+    if (!IS_TEXT(args[1]))
+        return nativeError(vm, "Expected a string.");
+    if (watch->writer != NULL)
+        return nativeError(vm, "Another fiber is already writing this descriptor.");
+    ObjString *text = IS_ROPE(args[1]) ? flattenRope(vm, AS_ROPE(args[1])) : AS_STRING(args[1]);
+    int written = 0;
+    if (watch->nonblocking || watch->unpollable)
+    {
+        IoStatus status = writeOut(fd, text, &written);
+        if (status == IO_DONE)
+            return INT_VAL(written);
+        if (status == IO_FAILED)
+            return ioError(vm, "write");
+    }
+    if (!canSuspend(vm))
+        return NIL_VAL;
+    watch->writer = vm->fiber;
+    watch->output = text;
+    watch->written = written;
+    if (!armWatch(loop, fd))
+    {
+        watch->writer = NULL;
+        watch->output = NULL;
+        if (errno != EPERM)
+            return ioError(vm, "write");
+        watch->unpollable = true;
+        if (writeOut(fd, text, &written) != IO_DONE)
+            return ioError(vm, "write");
+        return INT_VAL(written);
+    }
+    loop->watching++;
+    return suspendCurrent(vm, args);
+}
+
+// closeFd(fd)：关闭 fd。还有纤程等在它上面时报错
+static Value closeFdNative(VM *vm, int argCount, Value *args)
+{
+    int fd;
+    if (!checkFd(vm, args[0], &fd))
+        return NIL_VAL;
+    EventLoop *loop = vm->loop;
+    if (loop != NULL)
+    {
+        if (fd == loop->epollFd || fd == loop->timerFd)
+            return nativeError(vm, "Cannot close a descriptor of the event loop.");
+        if (fd < loop->watchCapacity)
+        {
+            Watch *watch = &loop->watches[fd];
+            if (watch->reader != NULL || watch->writer != NULL)
+                return nativeError(vm, "Cannot close a descriptor another fiber is waiting on.");
+            // 同一个文件还有别的 fd 开着时，关闭不会把它从 epoll 里删掉
+            if (watch->registered)
+                epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+            memset(watch, 0, sizeof(Watch));
+        }
+    }
+    if (close(fd) < 0)
+        return ioError(vm, "close");
+    return NIL_VAL;
+}
+
+void defineLoopNatives(VM *vm)
+{
+    defineGlobal(vm, "spawn", OBJ_VAL(newNative(vm, spawnNative, 1)));
+    defineGlobal(vm, "wait", OBJ_VAL(newNative(vm, waitNative, 0)));
+    defineGlobal(vm, "sleep", OBJ_VAL(newNative(vm, sleepNative, 1)));
+    defineGlobal(vm, "pipe", OBJ_VAL(newNative(vm, pipeNative, 0)));
+    defineGlobal(vm, "socketPair", OBJ_VAL(newNative(vm, socketPairNative, 0)));
+    defineGlobal(vm, "read", OBJ_VAL(newNative(vm, readNative, 1)));
+    defineGlobal(vm, "write", OBJ_VAL(newNative(vm, writeNative, 2)));
+    defineGlobal(vm, "closeFd", OBJ_VAL(newNative(vm, closeFdNative, 1)));
+}
+
+void markLoop(VM *vm)
+{
+    EventLoop *loop = vm->loop;
+    if (loop == NULL)
+        return;
+    for (int i = 0; i < loop->readyCount; i++)
+    {
+        Wakeup *wakeup = &loop->ready[(loop->readyHead + i) % loop->readyCapacity];
+        markObject(vm, (Obj *)wakeup->fiber);
+        markValue(vm, wakeup->value);
+    }
+    for (int fd = 0; fd < loop->watchCapacity; fd++)
+    {
+        markObject(vm, (Obj *)loop->watches[fd].reader);
+        markObject(vm, (Obj *)loop->watches[fd].writer);
+        markObject(vm, (Obj *)loop->watches[fd].output);
+    }
+    for (int i = 0; i < loop->timerCount; i++)
+        markObject(vm, (Obj *)loop->timers[i].fiber);
+    for (int i = 0; i < loop->waiterCount; i++)
+        markObject(vm, (Obj *)loop->waiters[i]);
+    markObject(vm, (Obj *)loop->pipeClass);
+    markObject(vm, (Obj *)loop->socketPairClass);
+}
+
+// 挂起的纤程连同等着它的纤程一起停下来。主纤程留给 resetStack
+static void abandonFiber(VM *vm, ObjFiber *fiber)
+{
+    while (fiber != NULL && fiber != &vm->mainFiber)
+    {
+        ObjFiber *caller = fiber->caller;
+        fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        fiber->frameCount = 0;
+        fiber->stackTop = fiber->stack;
+        fiber->openUpvaluesTop = fiber->stack;
+        fiber = caller;
+    }
+}
+
+void resetLoop(VM *vm)
+{
+    EventLoop *loop = vm->loop;
+    if (loop == NULL)
+        return;
+    for (int i = 0; i < loop->readyCount; i++)
+        abandonFiber(vm, loop->ready[(loop->readyHead + i) % loop->readyCapacity].fiber);
+    for (int fd = 0; fd < loop->watchCapacity; fd++)
+    {
+        Watch *watch = &loop->watches[fd];
+        abandonFiber(vm, watch->reader);
+        abandonFiber(vm, watch->writer);
+        // epoll 里的登记留着，之后报告的事件没有纤程在等，直接忽略
+        watch->reader = NULL;
+        watch->writer = NULL;
+        watch->output = NULL;
+    }
+    for (int i = 0; i < loop->timerCount; i++)
+        abandonFiber(vm, loop->timers[i].fiber);
+    for (int i = 0; i < loop->waiterCount; i++)
+        abandonFiber(vm, loop->waiters[i]);
+    loop->readyHead = 0;
+    loop->readyCount = 0;
+    loop->watching = 0;
+    loop->timerCount = 0;
+    loop->waiterCount = 0;
+}
+
+void freeLoop(VM *vm)
+{
+    EventLoop *loop = vm->loop;
+    if (loop == NULL)
+        return;
+    close(loop->epollFd);
+    close(loop->timerFd);
+    free(loop->ready);
+    free(loop->watches);
+    free(loop->timers);
+    free(loop->waiters);
+    free(loop);
+    vm->loop = NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef clox_loop_h
+#define clox_loop_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// 事件循环：基于 epoll 和 timerfd，每个VM一个，第一次用到时创建。
+// read/write/sleep 这些本地函数不能马上完成时，调用它的纤程挂起，VM 接着运行别的纤程；
+// fd 就绪或者定时器到期后循环替它做完操作，再把结果交给它恢复运行。所有纤程都在等时才阻塞在 epoll_wait 上。
+// spawn 出来的纤程没有恢复者，结束或者 yield 时由循环决定下一个运行谁
+
+// 一次 read 最多读这么多字节
+#define LOOP_READ_CHUNK 65536
+
+typedef struct EventLoop EventLoop;
+
+// 定义 spawn/wait/sleep/pipe/socketPair/read/write/closeFd 这几个本地函数
+void defineLoopNatives(VM *vm);
+// 取出下一个能运行的纤程和交给它的值，没有时阻塞在 epoll_wait 上等。谁都不会再就绪（死锁）时返回 false
+bool nextReadyFiber(VM *vm, ObjFiber **fiber, Value *value);
+// 没有恢复者的纤程 yield：排到就绪队列末尾，先让别的纤程运行
+Value yieldToLoop(VM *vm, Value *args);
+void markLoop(VM *vm);
+// 运行时错误之后，等在循环里的纤程都不会再恢复了
+void resetLoop(VM *vm);
+void freeLoop(VM *vm);
+
+#endif
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "lox.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// 嵌入接口：在 LoxValue 和 VM 内部的 Value 之间转换，其余工作都交给 vm.c
+
+// 宿主传进来的字符串会分配内存，调用方要保证之前转换好的值已经在栈上
+static Value toValue(VM *vm, LoxValue value)
+{
+    switch (value.type)
+    {
+    case LOX_BOOL:
+        return BOOL_VAL(value.as.boolean);
+    case LOX_NUMBER:
+        return NUMBER_VAL(value.as.number);
+    case LOX_STRING:
+        return OBJ_VAL(copyString(vm, value.as.string.chars, value.as.string.length));
+    case LOX_OBJECT:
+        return OBJ_VAL((Obj *)value.as.object);
+    default:
+        return NIL_VAL;
+    }
+}
+
+// rope 在这里拼接，拼好的字符串挂在 rope 上，所以 value 还在栈上时转换出的字符指针就是安全的
+static LoxValue fromValue(VM *vm, Value value)
+{
+    LoxValue result = lox_nil();
+    if (IS_BOOL(value))
+    {
+        result = lox_bool(AS_BOOL(value));
+    }
+    else if (IS_NUMBER(value))
+    {
+        result = lox_number(AS_NUMBER(value));
+    }
+    else if (IS_TEXT(value))
+    {
+        ObjString *string = IS_STRING(value) ? AS_STRING(value) : flattenRope(vm, AS_ROPE(value));
+        result = lox_string(string->chars, string->length);
+    }
+    else if (IS_OBJ(value))
+    {
+        result.type = LOX_OBJECT;
+        result.as.object = AS_OBJ(value);
+    }
+    return result;
+}
+
+// 宿主注册的本地函数共用这个入口。callValue 调用本地函数时被调用者就在参数下面，
+// 从那里取回宿主函数和它的私有数据
+static Value hostNative(VM *vm, int argCount, Value *args)
+{
+    ObjNative *native = (ObjNative *)AS_OBJ(args[-1]);
+    LoxValue hostArgs[UINT8_COUNT];
+    for (int i = 0; i < argCount; i++)
+        hostArgs[i] = fromValue(vm, args[i]);
+
+    LoxValue result = lox_nil();
+    bool ok = native->hostFunction(vm, native->userData, argCount, hostArgs, &result);
+    // 宿主调用了 lox_error，或者里面再调用的 Lox 函数出错了：栈已经被清空
+    if (vm->stackTop != args + argCount)
+    {
+        vm->nativeFailed = true;
+        return NIL_VAL;
+    }
+    if (!ok)
+        return nativeError(vm, "Native function failed.");
+    return toValue(vm, result);
+}
+
+LoxVM *lox_new(void)
+{
+    return lox_new_shared(NULL);
+}
+
+LoxVM *lox_new_shared(LoxProgram *program)
+{
+    // VM 里有整个值栈和调用栈，放在堆上
+    VM *vm = (VM *)malloc(sizeof(VM));
+    if (vm == NULL)
+        return NULL;
+    initSharedVM(vm, (SharedCode *)program);
+    return vm;
+}
+
+void lox_free(LoxVM *vm)
+{
+    freeVM(vm);
+    free(vm);
+}
+
+LoxScript *lox_compile(LoxVM *vm, const char *source)
+{
+    ObjFunction *function = compile(vm, source);
+    if (function == NULL)
+        return NULL;
+    push(vm, OBJ_VAL(function));
+    ObjClosure *closure = newClosure(vm, function);
+    push(vm, OBJ_VAL(closure));
+    writeValueArray(vm, &vm->handles, OBJ_VAL(closure));
+    pop(vm);
+    pop(vm);
+    return (LoxScript *)closure;
+}
+
+LoxResult lox_run(LoxVM *vm, LoxScript *script)
+{
+    LoxValue callee;
+    callee.type = LOX_OBJECT;
+    callee.as.object = script;
+    return lox_call(vm, callee, 0, NULL, NULL);
+}
+
+void lox_release(LoxVM *vm, LoxScript *script)
+{
+    ValueArray *handles = &vm->handles;
+    for (int i = 0; i < handles->count; i++)
+    {
+        if (AS_OBJ(handles->values[i]) == (Obj *)script)
+        {
+            // 句柄之间没有顺序，用最后一个填上空位
+            handles->values[i] = handles->values[--handles->count];
+            return;
+        }
+    }
+}
+
+void lox_checkpoint(LoxVM *vm)
+{
+    checkpointVM(vm);
+}
+
+void lox_reset(LoxVM *vm)
+{
+    resetVM(vm);
+}
+
+LoxProgram *lox_program_new(const char *source)
+{
+    return (LoxProgram *)compileShared(source, false);
+}
+
+void lox_program_free(LoxProgram *program)
+{
+    freeShared((SharedCode *)program);
+}
+
+LoxResult lox_run_program(LoxVM *vm, LoxProgram *program)
+{
+    SharedCode *shared = (SharedCode *)program;
+    // 名字按指针比较，共享代码只能在用它创建的VM里运行
+    if (vm->shared != shared)
+    {
+        fprintf(stderr, "Program is not shared with this VM.\n");
+        return LOX_RUNTIME_ERROR;
+    }
+    push(vm, OBJ_VAL(shared->script));
+    ObjClosure *closure = newClosure(vm, shared->script);
+    pop(vm);
+    LoxValue callee;
+    callee.type = LOX_OBJECT;
+    callee.as.object = closure;
+    return lox_call(vm, callee, 0, NULL, NULL);
+}
+
+bool lox_get_global(LoxVM *vm, const char *name, LoxValue *value)
+{
+    ObjString *string = internString(vm, name, (int)strlen(name));
+    Value global;
+    if (!tableGet(&vm->globals, string, &global))
+        return false;
+    *value = fromValue(vm, global);
+    return true;
+}
+
+void lox_set_global(LoxVM *vm, const char *name, LoxValue value)
+{
+    push(vm, toValue(vm, value));
+    defineGlobal(vm, name, vm->stackTop[-1]);
+    pop(vm);
+}
+
+LoxResult lox_call(LoxVM *vm, LoxValue callee, int argCount, const LoxValue *args,
+                   LoxValue *result)
+{
+    if (argCount < 0 || argCount >= UINT8_COUNT ||
+        vm->stackTop + argCount + 1 > vm->stack + STACK_MAX)
+    {
+        fprintf(stderr, "Stack overflow.\n");
+        return LOX_RUNTIME_ERROR;
+    }
+    Value *base = vm->stackTop;
+    push(vm, toValue(vm, callee));
+    for (int i = 0; i < argCount; i++)
+        push(vm, toValue(vm, args[i]));
+
+    InterpretResult status = callFromHost(vm, argCount);
+    if (status != INTERPRET_OK)
+        return (LoxResult)status;
+    if (result != NULL)
+        *result = fromValue(vm, vm->stackTop[-1]);
+    vm->stackTop = base;
+    return LOX_OK;
+}
+
+void lox_define_native(LoxVM *vm, const char *name, int arity, LoxNativeFn function,
+                       void *userData)
+{
+    ObjNative *native = newNative(vm, hostNative, arity);
+    native->hostFunction = function;
+    native->userData = userData;
+    push(vm, OBJ_VAL(native));
+    defineGlobal(vm, name, OBJ_VAL(native));
+    pop(vm);
+}
+
+void lox_error(LoxVM *vm, const char *message)
+{
+    nativeError(vm, message);
+}
+
+void lox_set_print(LoxVM *vm, LoxPrintFn function, void *userData)
+{
+    vm->printFn = function;
+    vm->printData = userData;
+}
@@ -0,0 +1,133 @@
+#ifndef clox_lox_h
+#define clox_lox_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// 嵌入接口：宿主程序只需要包含这个头文件，链接除 main.c 外的所有 .c。
+// VM 和编译好的脚本对宿主都是不透明的；值用 LoxValue 在两边传递，和 VM 内部的值表示无关。
+//
+//   LoxVM *vm = lox_new();
+//   LoxScript *script = lox_compile(vm, "fun add(a, b) { return a + b; }");
+//   lox_run(vm, script);
+//   LoxValue add, args[2] = {lox_number(1), lox_number(2)}, sum;
+//   lox_get_global(vm, "add", &add);
+//   lox_call(vm, add, 2, args, &sum);
+//   lox_free(vm);
+
+typedef struct VM LoxVM;
+typedef struct LoxScript LoxScript;
+typedef struct LoxProgram LoxProgram;
+
+// 和 InterpretResult 一一对应
+typedef enum
+{
+  LOX_OK,
+  LOX_COMPILE_ERROR,
+  LOX_RUNTIME_ERROR
+} LoxResult;
+
+typedef enum
+{
+  LOX_NIL,
+  LOX_BOOL,
+  LOX_NUMBER,
+  LOX_STRING,
+  // 函数、类、实例等其他对象，只能原样传回 VM
+  LOX_OBJECT
+} LoxType;
+
+// VM 返回的字符串和对象指向托管内存：字符串在下一次调用 VM 之前有效，
+// 对象在它还能从全局变量到达时有效。宿主传进去的字符串会被复制
+typedef struct
+{
+  LoxType type;
+  union
+  {
+    bool boolean;
+    double number;
+    struct
+    {
+      const char *chars;
+      int length;
+    } string;
+    void *object;
+  } as;
+} LoxValue;
+
+// 本地函数：成功时把返回值写进 result 并返回 true；
+// 失败时先调用 lox_error 报错再返回 false。userData 是注册时传入的指针
+typedef bool (*LoxNativeFn)(LoxVM *vm, void *userData, int argCount,
+                            const LoxValue *args, LoxValue *result);
+// print 语句的输出，text 不含换行
+typedef void (*LoxPrintFn)(LoxVM *vm, void *userData, const char *text, size_t length);
+
+LoxVM *lox_new(void);
+void lox_free(LoxVM *vm);
+
+// 编译出的脚本一直有效，可以反复运行，直到 lox_release 或 lox_free；编译错误时返回 NULL
+LoxScript *lox_compile(LoxVM *vm, const char *source);
+LoxResult lox_run(LoxVM *vm, LoxScript *script);
+void lox_release(LoxVM *vm, LoxScript *script);
+
+// 把VM现在的状态记成基线，通常在定义完本地函数、运行完公共的初始化脚本之后调用一次
+void lox_checkpoint(LoxVM *vm);
+// 回到基线：全局变量、基线里实例的字段、闭包捕获的变量和挂起的纤程都恢复原样，
+// 基线之后分配的对象一次清除，基线之后编译的脚本随之失效。通道除外：通道可能和别的VM共用，发出的消息不会撤回。
+// 比 lox_free 再 lox_new 快得多，适合池化的VM在两个租户之间复用。不能在本地函数里调用
+void lox_reset(LoxVM *vm);
+
+// 编译成只读的共享代码，可以被任意多个VM（包括不同线程里的）同时运行，每个VM只有自己的全局变量和对象。
+// 编译错误时返回NULL；用它创建的VM都释放之后才能释放它
+LoxProgram *lox_program_new(const char *source);
+void lox_program_free(LoxProgram *program);
+// 创建一个能运行 program 的VM，也可以照常编译运行自己的脚本
+LoxVM *lox_new_shared(LoxProgram *program);
+LoxResult lox_run_program(LoxVM *vm, LoxProgram *program);
+
+// 全局变量不存在时返回 false
+bool lox_get_global(LoxVM *vm, const char *name, LoxValue *value);
+void lox_set_global(LoxVM *vm, const char *name, LoxValue value);
+// 调用函数、类或本地函数；result 可以为 NULL。可以在本地函数里面调用
+LoxResult lox_call(LoxVM *vm, LoxValue callee, int argCount, const LoxValue *args,
+                   LoxValue *result);
+
+// arity 为 -1 时不检查参数个数
+void lox_define_native(LoxVM *vm, const char *name, int arity, LoxNativeFn function,
+                       void *userData);
+// 在本地函数里报告运行时错误，之后本地函数应返回 false
+void lox_error(LoxVM *vm, const char *message);
+
+// function 为 NULL 时恢复输出到 stdout
+void lox_set_print(LoxVM *vm, LoxPrintFn function, void *userData);
+
+static inline LoxValue lox_nil(void)
+{
+  LoxValue value;
+  value.type = LOX_NIL;
+  return value;
+}
+static inline LoxValue lox_bool(bool boolean)
+{
+  LoxValue value;
+  value.type = LOX_BOOL;
+  value.as.boolean = boolean;
+  return value;
+}
+static inline LoxValue lox_number(double number)
+{
+  LoxValue value;
+  value.type = LOX_NUMBER;
+  value.as.number = number;
+  return value;
+}
+static inline LoxValue lox_string(const char *chars, int length)
+{
+  LoxValue value;
+  value.type = LOX_STRING;
+  value.as.string.chars = chars;
+  value.as.string.length = length;
+  return value;
+}
+
+#endif
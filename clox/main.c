@@ -1,12 +1,25 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "chunk.h"
+#include "aot.h"
+#include "compiler.h"
 #include "debug.h"
+#include "loop.h"
+#include "memory.h"
 #include "vm.h"
-static void repl()
+static void repl(VM *vm)
 {
     char line[1024];
     for (;;)
@@ -19,16 +32,17 @@ static void repl()
             break;
         }
 
-        interpret(line);
+        interpret(vm, line);
     }
 }
-static char *readFile(const char *path)
+// 读不出来时报错并返回NULL
+static char *loadFile(const char *path)
 {
     FILE *file = fopen(path, "rb");
     if (file == NULL)
     {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        return NULL;
     }
     fseek(file, 0L, SEEK_END);
     size_t fileSize = ftell(file);
@@ -38,23 +52,31 @@ static char *readFile(const char *path)
     if (buffer == NULL)
     {
         fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+        fclose(file);
+        return NULL;
     }
     size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    fclose(file);
     if (bytesRead < fileSize)
     {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+        free(buffer);
+        return NULL;
     }
     buffer[bytesRead] = '\0';
-
-    fclose(file);
     return buffer;
 }
-static void runFile(const char *path)
+static char *readFile(const char *path)
+{
+    char *buffer = loadFile(path);
+    if (buffer == NULL)
+        exit(74);
+    return buffer;
+}
+static void runFile(VM *vm, const char *path)
 {
     char *source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result = interpret(vm, source);
     free(source);
 
     if (result == INTERPRET_COMPILE_ERROR)
@@ -62,23 +84,659 @@ static void runFile(const char *path)
     if (result == INTERPRET_RUNTIME_ERROR)
         exit(70);
 }
+// 只编译不运行，把整个函数树翻译成C代码写到 outPath
+static void emitFile(VM *vm, const char *path, const char *outPath)
+{
+    char *source = readFile(path);
+    // 生成C代码需要所有函数体的字节码，不能延迟编译
+    vm->lazyCompile = false;
+    ObjFunction *function = compile(vm, source);
+    free(source);
+    if (function == NULL)
+        exit(65);
+
+    FILE *out = fopen(outPath, "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", outPath);
+        exit(74);
+    }
+    emitC(function, out);
+    fclose(out);
+}
+// --map 模式：同一个脚本对每个输入文件各跑一次。脚本只编译一次，冻结成共享代码；
+// 每个工作线程有一个VM，按顺序从公共的游标领一小段输入，自己的段做完了再领；领完之后从别人的段尾部偷走一半。
+// 输入大致按顺序完成，开头连续做完的那些输出马上写出去，缓存在内存里的只是还在处理的几段
+
+// 每次从公共游标领这么多个输入
+#define MAP_CHUNK 8
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    // 还没开始的输入下标 [next, end)
+    int next;
+    int end;
+} WorkRange;
+
+typedef struct
+{
+    // 这个输入的 print 输出，前面的输入都写出去之后按输入顺序写到 stdout
+    char *text;
+    size_t length;
+    size_t capacity;
+    // 0，或者和单独运行一个文件时一样的退出码
+    int status;
+    bool done;
+} MapOutput;
+
+typedef struct
+{
+    SharedCode *shared;
+    bool jit;
+    const char **inputs;
+    int inputCount;
+    MapOutput *outputs;
+    WorkRange *ranges;
+    int workerCount;
+    // 还没人领的输入从这里开始
+    pthread_mutex_t queueLock;
+    int nextChunk;
+    // written 之前的输出都写出去了；退出码取第一个出错的输入的
+    pthread_mutex_t outputLock;
+    int written;
+    int status;
+} MapJob;
+
+typedef struct
+{
+    MapJob *job;
+    int id;
+    pthread_t thread;
+} MapWorker;
+
+static void appendOutput(VM *vm, void *userData, const char *text, size_t length)
+{
+    MapOutput *output = (MapOutput *)userData;
+    if (output->length + length + 1 > output->capacity)
+    {
+        output->capacity = (output->length + length + 1) * 2;
+        output->text = (char *)realloc(output->text, output->capacity);
+        if (output->text == NULL)
+            exit(1);
+    }
+    memcpy(output->text + output->length, text, length);
+    output->length += length;
+    output->text[output->length++] = '\n';
+}
+
+static bool takeInput(MapJob *job, int self, int *index)
+{
+    WorkRange *own = &job->ranges[self];
+    pthread_mutex_lock(&own->lock);
+    if (own->next < own->end)
+    {
+        *index = own->next++;
+        pthread_mutex_unlock(&own->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    pthread_mutex_lock(&job->queueLock);
+    int start = job->nextChunk;
+    int end = start + MAP_CHUNK < job->inputCount ? start + MAP_CHUNK : job->inputCount;
+    job->nextChunk = end;
+    pthread_mutex_unlock(&job->queueLock);
+    if (start < end)
+    {
+        pthread_mutex_lock(&own->lock);
+        own->next = start + 1;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+        *index = start;
+        return true;
+    }
+
+    for (int i = 1; i < job->workerCount; i++)
+    {
+        WorkRange *victim = &job->ranges[(self + i) % job->workerCount];
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->end - victim->next;
+        if (left > 0)
+        {
+            // 偷走后一半：第一个马上处理，其余的成为自己的段，别人也可以再来偷
+            int start = victim->end - (left + 1) / 2;
+            int end = victim->end;
+            victim->end = start;
+            pthread_mutex_unlock(&victim->lock);
+            pthread_mutex_lock(&own->lock);
+            own->next = start + 1;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            *index = start;
+            return true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return false;
+}
+
+// 标记做完，把开头连续做完的输出写出去
+static void finishInput(MapJob *job, int index)
+{
+    pthread_mutex_lock(&job->outputLock);
+    job->outputs[index].done = true;
+    bool wrote = false;
+    while (job->written < job->inputCount && job->outputs[job->written].done)
+    {
+        MapOutput *output = &job->outputs[job->written++];
+        // 什么也没输出的输入 text 还是 NULL
+        if (output->length > 0)
+            fwrite(output->text, 1, output->length, stdout);
+        free(output->text);
+        output->text = NULL;
+        if (job->status == 0)
+            job->status = output->status;
+        wrote = true;
+    }
+    if (wrote)
+        fflush(stdout);
+    pthread_mutex_unlock(&job->outputLock);
+}
+
+static void *mapWorker(void *arg)
+{
+    MapWorker *worker = (MapWorker *)arg;
+    MapJob *job = worker->job;
+    VM *vm = (VM *)malloc(sizeof(VM));
+    if (vm == NULL)
+        exit(1);
+    int index;
+    while (takeInput(job, worker->id, &index))
+    {
+        MapOutput *output = &job->outputs[index];
+        char *input = loadFile(job->inputs[index]);
+        if (input == NULL)
+        {
+            output->status = 74;
+            finishInput(job, index);
+            continue;
+        }
+        // 每个输入都在一个全新的VM里运行，全局变量不会从上一个输入漏过来
+        initSharedVM(vm, job->shared);
+        vm->jitEnabled = job->jit;
+        vm->printFn = appendOutput;
+        vm->printData = output;
+        defineGlobal(vm, "input", OBJ_VAL(copyString(vm, input, (int)strlen(input))));
+        defineGlobal(vm, "inputPath", OBJ_VAL(copyString(vm, job->inputs[index], (int)strlen(job->inputs[index]))));
+        free(input);
+
+        push(vm, OBJ_VAL(job->shared->script));
+        ObjClosure *closure = newClosure(vm, job->shared->script);
+        pop(vm);
+        push(vm, OBJ_VAL(closure));
+        if (callFromHost(vm, 0) != INTERPRET_OK)
+            output->status = 70;
+        freeVM(vm);
+        finishInput(job, index);
+    }
+    free(vm);
+    return NULL;
+}
+
+static int runMap(const char *path, const char **inputs, int inputCount, int workerCount, bool jit)
+{
+    char *source = readFile(path);
+    SharedCode *shared = compileShared(source, jit);
+    free(source);
+    if (shared == NULL)
+        return 65;
+    if (workerCount > inputCount)
+        workerCount = inputCount > 0 ? inputCount : 1;
+
+    MapJob job;
+    job.shared = shared;
+    job.jit = jit;
+    job.inputs = inputs;
+    job.inputCount = inputCount;
+    job.nextChunk = 0;
+    job.written = 0;
+    job.status = 0;
+    pthread_mutex_init(&job.queueLock, NULL);
+    pthread_mutex_init(&job.outputLock, NULL);
+    job.outputs = (MapOutput *)calloc(inputCount > 0 ? inputCount : 1, sizeof(MapOutput));
+    job.ranges = (WorkRange *)malloc(sizeof(WorkRange) * workerCount);
+    job.workerCount = workerCount;
+    MapWorker *workers = (MapWorker *)malloc(sizeof(MapWorker) * workerCount);
+    if (job.outputs == NULL || job.ranges == NULL || workers == NULL)
+        exit(1);
+    for (int i = 0; i < workerCount; i++)
+    {
+        pthread_mutex_init(&job.ranges[i].lock, NULL);
+        // 开始时都是空段，第一次取输入就去公共游标领
+        job.ranges[i].next = 0;
+        job.ranges[i].end = 0;
+        workers[i].job = &job;
+        workers[i].id = i;
+    }
+    for (int i = 0; i < workerCount; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, mapWorker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Could not start worker thread.\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < workerCount; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    // 输出都在 finishInput 里写完了
+    int status = job.status;
+    pthread_mutex_destroy(&job.queueLock);
+    pthread_mutex_destroy(&job.outputLock);
+    for (int i = 0; i < workerCount; i++)
+        pthread_mutex_destroy(&job.ranges[i].lock);
+    free(workers);
+    free(job.ranges);
+    free(job.outputs);
+    freeShared(shared);
+    return status;
+}
+
+// --serve 模式：脚本只编译、运行一次，然后 fork 出工作进程。编译好的代码冻结成共享代码，GC 不会写它，
+// 和运行脚本建起来的堆一起按写时复制在所有工作进程之间共享。每个连接是一个请求：客户端写完负载后关闭写端，
+// 工作进程用负载字符串调用处理函数，把结果按 print 的格式写回去再关闭连接。
+// 工作进程处理完 maxRequests 个请求后退出，主进程从初始化好的状态再 fork 一个顶上
+typedef struct
+{
+    VM *vm;
+    int listener;
+    const char *handler;
+    // 0 表示不限
+    int maxRequests;
+} ServeJob;
+
+// 一个请求最多这么多字节，超过就丢掉连接；还要能放进 copyString 的 int 长度
+#define SERVE_MAX_REQUEST (16 * 1024 * 1024)
+// 客户端这么多秒不发数据就断开，空闲的连接不能一直占着工作进程
+#define SERVE_READ_TIMEOUT 10
+
+static volatile sig_atomic_t serveStopping = 0;
+
+static void stopServing(int signal)
+{
+    serveStopping = 1;
+}
+
+// 只是为了把主进程从 sigsuspend 里叫醒
+static void workerExited(int signal)
+{
+}
+
+// 读到对端关闭写端为止。出错、超时或者超过 SERVE_MAX_REQUEST 时返回NULL
+static char *readRequest(int connection, size_t *length)
+{
+    size_t capacity = 4096;
+    char *payload = (char *)malloc(capacity);
+    if (payload == NULL)
+        return NULL;
+    *length = 0;
+    for (;;)
+    {
+        ssize_t count = read(connection, payload + *length, capacity - *length);
+        if (count == 0)
+            return payload;
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // SO_RCVTIMEO 到期时是 EAGAIN
+            free(payload);
+            return NULL;
+        }
+        *length += count;
+        if (*length == capacity)
+        {
+            if (capacity >= SERVE_MAX_REQUEST)
+            {
+                fprintf(stderr, "Request larger than %d bytes.\n", SERVE_MAX_REQUEST);
+                free(payload);
+                return NULL;
+            }
+            capacity *= 2;
+            char *grown = (char *)realloc(payload, capacity);
+            if (grown == NULL)
+            {
+                free(payload);
+                return NULL;
+            }
+            payload = grown;
+        }
+    }
+}
+
+static void serveRequest(ServeJob *job, int connection)
+{
+    size_t length;
+    char *payload = readRequest(connection, &length);
+    if (payload == NULL)
+    {
+        close(connection);
+        return;
+    }
+    VM *vm = job->vm;
+    // 每次都按名字找，处理函数可以在请求里被重新赋值
+    ObjString *name = internString(vm, job->handler, (int)strlen(job->handler));
+    Value handler;
+    if (!tableGet(&vm->globals, name, &handler))
+    {
+        fprintf(stderr, "Undefined handler '%s'.\n", job->handler);
+        free(payload);
+        close(connection);
+        return;
+    }
+    push(vm, handler);
+    push(vm, OBJ_VAL(copyString(vm, payload, (int)length)));
+    free(payload);
+    // 出错时报错信息写到 stderr，客户端什么也收不到
+    if (callFromHost(vm, 1) != INTERPRET_OK)
+    {
+        close(connection);
+        return;
+    }
+    FILE *out = fdopen(connection, "w");
+    if (out == NULL)
+        close(connection);
+    else
+    {
+        // 字符串原样写出：里面可以有 NUL
+        Value reply = vm->stackTop[-1];
+        if (IS_TEXT(reply))
+        {
+            ObjString *string = IS_STRING(reply) ? AS_STRING(reply) : flattenRope(vm, AS_ROPE(reply));
+            fwrite(string->chars, 1, string->length, out);
+        }
+        else
+        {
+            fprintValue(vm, out, reply);
+        }
+        fclose(out);
+    }
+    pop(vm);
+}
+
+static void serveWorker(ServeJob *job, sigset_t *signals)
+{
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    // 客户端没等回复就断开时，写回复失败就算了
+    signal(SIGPIPE, SIG_IGN);
+    sigprocmask(SIG_UNBLOCK, signals, NULL);
+    for (int served = 0; job->maxRequests == 0 || served < job->maxRequests; served++)
+    {
+        int connection = accept(job->listener, NULL, NULL);
+        if (connection < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            exit(74);
+        }
+        struct timeval timeout = {SERVE_READ_TIMEOUT, 0};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        serveRequest(job, connection);
+    }
+    fflush(stdout);
+    exit(0);
+}
+
+// 主进程一直屏蔽着信号，子进程先恢复默认处理再打开，不会带着主进程的处理函数收到 SIGTERM
+static pid_t forkWorker(ServeJob *job, sigset_t *signals)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+        serveWorker(job, signals);
+    if (pid < 0)
+        perror("fork");
+    return pid;
+}
+
+static int runServe(const char *path, const char *socketPath, const char *handlerName,
+                    int workerCount, int maxRequests, bool jit)
+{
+    char *source = readFile(path);
+    SharedCode *shared = compileShared(source, jit);
+    free(source);
+    if (shared == NULL)
+        return 65;
+    VM *vm = (VM *)malloc(sizeof(VM));
+    if (vm == NULL)
+        exit(1);
+    initSharedVM(vm, shared);
+    vm->jitEnabled = jit;
+    push(vm, OBJ_VAL(shared->script));
+    ObjClosure *closure = newClosure(vm, shared->script);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    if (callFromHost(vm, 0) != INTERPRET_OK)
+        return 70;
+    pop(vm);
+    Value handler;
+    if (!tableGet(&vm->globals, internString(vm, handlerName, (int)strlen(handlerName)), &handler))
+    {
+        fprintf(stderr, "Undefined handler '%s'.\n", handlerName);
+        return 70;
+    }
+    // epoll 实例不能跨 fork 共享：初始化时用过事件循环的话丢掉，工作进程各自再建
+    resetLoop(vm);
+    freeLoop(vm);
+    freezeHeap(vm, true);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", socketPath);
+        return 64;
+    }
+    strcpy(address.sun_path, socketPath);
+    // 上次没清理掉的套接字文件
+    unlink(socketPath);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0)
+    {
+        fprintf(stderr, "Could not listen on \"%s\": %s.\n", socketPath, strerror(errno));
+        return 74;
+    }
+
+    // 主进程只在 sigsuspend 里接收信号，检查 serveStopping 和等待之间不会漏掉信号
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGCHLD);
+    sigset_t waitMask;
+    sigprocmask(SIG_BLOCK, &signals, &waitMask);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = stopServing;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = workerExited;
+    sigaction(SIGCHLD, &action, NULL);
+
+    // 缓冲区里还没写出去的内容不能被每个子进程各写一遍
+    fflush(stdout);
+    fflush(stderr);
+    ServeJob job = {vm, listener, handlerName, maxRequests};
+    pid_t *workers = (pid_t *)malloc(sizeof(pid_t) * workerCount);
+    if (workers == NULL)
+        exit(1);
+    for (int i = 0; i < workerCount; i++)
+        workers[i] = forkWorker(&job, &signals);
+
+    while (!serveStopping)
+    {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "Worker %d killed by signal %d.\n", (int)pid, WTERMSIG(status));
+            for (int i = 0; i < workerCount; i++)
+            {
+                if (workers[i] == pid)
+                    workers[i] = forkWorker(&job, &signals);
+            }
+        }
+        if (!serveStopping)
+            sigsuspend(&waitMask);
+    }
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        if (workers[i] > 0)
+            kill(workers[i], SIGTERM);
+    }
+    for (int i = 0; i < workerCount; i++)
+    {
+        if (workers[i] > 0)
+            waitpid(workers[i], NULL, 0);
+    }
+    close(listener);
+    unlink(socketPath);
+    sigprocmask(SIG_SETMASK, &waitMask, NULL);
+    free(workers);
+    freeVM(vm);
+    free(vm);
+    freeShared(shared);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: clox [--jit] [--lazy] [--emit-c out.c] [path]\n"
+                    "       clox [--jit] [--workers N] --map script inputs...\n"
+                    "       clox [--jit] [--workers N] [--requests N] [--handler name] --serve script --socket path\n");
+    exit(64);
+}
+
 int main(int argc, const char *argv[])
 {
-    initVM();
-    if (argc == 1)
+    // VM 里有整个值栈和调用栈，放在堆上
+    VM *vm = (VM *)malloc(sizeof(VM));
+    if (vm == NULL)
+        exit(1);
+    initVM(vm);
+    // 以 -- 开头的参数是运行时开关，其余的是脚本路径
+    const char *path = NULL;
+    const char *emitPath = NULL;
+    int workerCount = 1;
+    // --workers 只对 --map 和 --serve 有意义，--socket/--handler/--requests 只对 --serve 有意义
+    bool workersGiven = false;
+    bool serveOptions = false;
+    const char **mapInputs = NULL;
+    int mapCount = 0;
+    bool serve = false;
+    const char *socketPath = NULL;
+    const char *handlerName = "handle";
+    int maxRequests = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--jit") == 0)
+        {
+            vm->jitEnabled = true;
+        }
+        else if (strcmp(argv[i], "--lazy") == 0)
+        {
+            vm->lazyCompile = true;
+        }
+        else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc && emitPath == NULL)
+        {
+            emitPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            workerCount = atoi(argv[++i]);
+            workersGiven = true;
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc && path == NULL)
+        {
+            serve = true;
+            path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc && socketPath == NULL)
+        {
+            socketPath = argv[++i];
+            serveOptions = true;
+        }
+        else if (strcmp(argv[i], "--handler") == 0 && i + 1 < argc)
+        {
+            handlerName = argv[++i];
+            serveOptions = true;
+        }
+        else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0)
+        {
+            maxRequests = atoi(argv[++i]);
+            serveOptions = true;
+        }
+        else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc && path == NULL)
+        {
+            // 脚本之后的参数全是输入文件
+            path = argv[i + 1];
+            mapInputs = &argv[i + 2];
+            mapCount = argc - i - 2;
+            break;
+        }
+        else if (strncmp(argv[i], "--", 2) != 0 && path == NULL)
+        {
+            path = argv[i];
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    if (serve)
+    {
+        if (socketPath == NULL || emitPath != NULL || mapInputs != NULL)
+            usage();
+        int status = runServe(path, socketPath, handlerName, workerCount, maxRequests, vm->jitEnabled);
+        freeVM(vm);
+        free(vm);
+        return status;
+    }
+    if (serveOptions || (workersGiven && mapInputs == NULL))
+        usage();
+    if (mapInputs != NULL)
+    {
+        if (emitPath != NULL)
+            usage();
+        int status = runMap(path, mapInputs, mapCount, workerCount, vm->jitEnabled);
+        freeVM(vm);
+        free(vm);
+        return status;
+    }
+    if (emitPath != NULL)
     {
-        repl();
+        if (path == NULL)
+            usage();
+        emitFile(vm, path, emitPath);
     }
-    else if (argc == 2)
+    else if (path == NULL)
     {
-        runFile(argv[1]);
+        repl(vm);
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(vm, path);
     }
 
-    freeVM();
+    freeVM(vm);
+    free(vm);
     return 0;
 }
\ No newline at end of file
@@ -1,31 +1,43 @@
+#define _DEFAULT_SOURCE
 #include <stdlib.h>
 #include "compiler.h"
+#include "intern.h"
+#include "jit.h"
+#include "loop.h"
 #include "memory.h"
 #include "vm.h"
+#ifdef COMPRESSED_REFS
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#endif
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
 #include "debug.h"
 #endif
 #define GC_HEAP_GROW_FACTOR 2
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+static void maybeCollect(VM *vm)
+{
+#ifdef DEBUG_STRESS_GC
+  collectGarbage(vm);
+#endif
+  // 当总数超过限制时，我们运行回收器。
+  if (vm->bytesAllocated > vm->nextGC)
+  {
+    collectGarbage(vm);
+  }
+}
+
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize)
 {
   // 每当我们分配或释放一些内存时，我们就根据差值来调整计数器。
-  vm.bytesAllocated += newSize - oldSize;
+  vm->bytesAllocated += newSize - oldSize;
   // 每当我们调用reallocate()来获取更多内存时，都会强制运行一次回收
   // 这个if检查是因为，在释放或收缩分配的内存时也会调用reallocate()。
   // 我们不希望在这种时候触发GC——特别是因为GC本身也会调用reallocate()来释放内存
   if (newSize > oldSize)
-  {
-#ifdef DEBUG_STRESS_GC
-    collectGarbage();
-#endif
-    // 当总数超过限制时，我们运行回收器。
-    if (vm.bytesAllocated > vm.nextGC)
-    {
-      collectGarbage();
-    }
-  }
+    maybeCollect(vm);
 
   if (newSize == 0)
   {
@@ -42,54 +54,215 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
   return result;
 }
 
-void markObject(Obj *object)
+#ifdef COMPRESSED_REFS
+// 所有对象都放在一块预留的连续地址空间里，对象之间的引用存成相对 heapBase 的32位偏移。
+// 偏移0表示NULL，所以分配从8开始。区域只预留不提交，物理页在第一次写入时才分配。
+char *heapBase = NULL;
+static size_t heapTop = 8;
+static size_t heapLimit = 0;
+
+// 256字节以内按8字节分档，更大的按2的幂分档；释放的块挂到所在档的空闲链表上复用
+#define SMALL_CLASS_LIMIT 256
+#define SMALL_CLASSES (SMALL_CLASS_LIMIT / 8)
+#define SIZE_CLASSES (SMALL_CLASSES + 32)
+
+typedef struct FreeBlock
+{
+  struct FreeBlock *next;
+} FreeBlock;
+
+static FreeBlock *freeLists[SIZE_CLASSES];
+// 这块区域是进程内所有VM共用的（heapBase 只有一个），分配和释放时用自旋锁保护空闲链表和 heapTop
+static atomic_flag heapLock = ATOMIC_FLAG_INIT;
+
+static void lockHeap()
+{
+  while (atomic_flag_test_and_set_explicit(&heapLock, memory_order_acquire))
+    ;
+}
+
+static void unlockHeap()
+{
+  atomic_flag_clear_explicit(&heapLock, memory_order_release);
+}
+
+static int sizeClass(size_t size, size_t *rounded)
+{
+  if (size <= SMALL_CLASS_LIMIT)
+  {
+    *rounded = (size + 7) & ~(size_t)7;
+    return (int)(*rounded / 8) - 1;
+  }
+  int shift = 9;
+  while (((size_t)1 << shift) < size)
+    shift++;
+  *rounded = (size_t)1 << shift;
+  return SMALL_CLASSES + shift - 9;
+}
+
+static void reserveHeap()
+{
+  // 先试4GB（32位偏移能表示的全部范围），地址空间不够时减半重试
+  for (size_t size = (size_t)1 << 32; size >= ((size_t)1 << 28); size >>= 1)
+  {
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region != MAP_FAILED)
+    {
+      heapBase = (char *)region;
+      heapLimit = size;
+      return;
+    }
+  }
+  fprintf(stderr, "Could not reserve object heap.\n");
+  exit(1);
+}
+
+static void *allocateBlock(size_t size)
+{
+  size_t rounded;
+  int index = sizeClass(size, &rounded);
+  lockHeap();
+  if (heapBase == NULL)
+    reserveHeap();
+  FreeBlock *block = freeLists[index];
+  if (block != NULL)
+  {
+    freeLists[index] = block->next;
+    unlockHeap();
+    return block;
+  }
+  if (heapTop + rounded > heapLimit)
+  {
+    fprintf(stderr, "Object heap exhausted.\n");
+    exit(1);
+  }
+  void *result = heapBase + heapTop;
+  heapTop += rounded;
+  unlockHeap();
+  return result;
+}
+
+static void freeBlock(void *pointer, size_t size)
+{
+  size_t rounded;
+  int index = sizeClass(size, &rounded);
+  FreeBlock *block = (FreeBlock *)pointer;
+  lockHeap();
+  block->next = freeLists[index];
+  freeLists[index] = block;
+  unlockHeap();
+}
+
+void *heapAllocate(VM *vm, size_t size)
+{
+  vm->bytesAllocated += size;
+  maybeCollect(vm);
+  return allocateBlock(size);
+}
+
+void heapFree(VM *vm, void *pointer, size_t size)
+{
+  vm->bytesAllocated -= size;
+  freeBlock(pointer, size);
+}
+
+// 压缩引用只能指向这块区域，不属于任何VM的对象也要分配在这里
+void *allocateUnowned(size_t size)
+{
+  return allocateBlock(size);
+}
+
+void freeUnowned(void *pointer, size_t size)
+{
+  freeBlock(pointer, size);
+}
+#else
+void *allocateUnowned(size_t size)
+{
+  void *result = malloc(size);
+  if (result == NULL)
+    exit(1);
+  return result;
+}
+
+void freeUnowned(void *pointer, size_t size)
+{
+  free(pointer);
+}
+#endif
+
+void markObject(VM *vm, Obj *object)
 {
   if (object == NULL)
     return;
   // 如果对象已经被标记，我们就不会再标记它，因此也不会把它添加到灰色栈中。这就保证了已经是灰色的对象不会被重复添加，
   // 而且黑色对象不会无意中变回灰色。换句话说，它使得波前只通过白色对象向前移动
   if (object->isMarked)
+  {
+    // 并发驻留表里的字符串永远是已标记的，只记下这一轮这个VM还用着它
+    if (object->type == OBJ_STRING && ((ObjString *)object)->shared)
+      touchSharedString(vm, (ObjString *)object);
     return;
+  }
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void *)object);
-  printValue(OBJ_VAL(object));
+  // 打印 rope 会展平并分配内存，回收过程中不能这样做
+  if (object->type != OBJ_ROPE)
+    printValue(vm, OBJ_VAL(object));
   printf("\n");
 #endif
   object->isMarked = true;
 
-  if (vm.grayCapacity < vm.grayCount + 1)
+  if (vm->grayCapacity < vm->grayCount + 1)
   {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack = (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    vm->grayStack = (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
 
-    if (vm.grayStack == NULL)
+    if (vm->grayStack == NULL)
     {
       // 我们对这个数组负担全部责任，其中包括分配失败。如果我们不能创建或扩张灰色栈，那我们就无法完成垃圾回收
       exit(1);
     }
   }
-  vm.grayStack[vm.grayCount++] = object;
+  vm->grayStack[vm->grayCount++] = object;
 }
 
-void markValue(Value value)
+void markValue(VM *vm, Value value)
 {
   if (IS_OBJ(value))
-    markObject(AS_OBJ(value));
+    markObject(vm, AS_OBJ(value));
 }
 
-static void markArray(ValueArray *array)
+static void markArray(VM *vm, ValueArray *array)
 {
   for (int i = 0; i < array->count; i++)
   {
-    markValue(array->values[i]);
+    markValue(vm, array->values[i]);
   }
 }
-static void blackenObject(Obj *object)
+// 等着它的纤程要一起留下。正在运行的纤程的栈在 VM 里，由 markRoots 标记，它自己存的状态已经过时了
+static void markFiber(VM *vm, ObjFiber *fiber)
+{
+  markObject(vm, (Obj *)fiber->caller);
+  if (fiber == vm->fiber)
+    return;
+  for (Value *slot = fiber->stack; slot < fiber->stackTop; slot++)
+    markValue(vm, *slot);
+  // 方法调用的帧，槽0是接收者而不是闭包
+  for (int i = 0; i < fiber->frameCount; i++)
+    markObject(vm, (Obj *)fiber->frames[i].closure);
+  for (Value *slot = fiber->stack; slot < fiber->openUpvaluesTop; slot++)
+    markObject(vm, (Obj *)fiber->openUpvalues[slot - fiber->stack]);
+}
+
+static void blackenObject(VM *vm, Obj *object)
 {
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void *)object);
-  printValue(OBJ_VAL(object));
+  if (object->type != OBJ_ROPE)
+    printValue(vm, OBJ_VAL(object));
   printf("\n");
 #endif
   switch (object->type)
@@ -97,51 +270,70 @@ static void blackenObject(Obj *object)
   case OBJ_BOUND_METHOD:
   {
     ObjBoundMethod *bound = (ObjBoundMethod *)object;
-    markValue(bound->receiver);
-    markObject((Obj *)bound->method);
+    markValue(vm, bound->receiver);
+    markObject(vm, (Obj *)FROM_REF(ObjClosure, bound->method));
     break;
   }
   case OBJ_CLASS:
   {
     ObjClass *klass = (ObjClass *)object;
-    markObject((Obj *)klass->name);
-    markTable(&klass->methods);
+    markObject(vm, (Obj *)FROM_REF(ObjString, klass->name));
+    markObject(vm, (Obj *)FROM_REF(ObjClass, klass->superclass));
+    for (int i = 0; i < klass->methodCount; i++)
+      markValue(vm, klass->methods[i]);
+    for (int i = 0; i < INHERITED_CACHE_SIZE; i++)
+      markValue(vm, klass->inheritedMethods[i]);
+    markValue(vm, klass->initializer);
     break;
   }
   case OBJ_CLOSURE:
   {
     ObjClosure *closure = (ObjClosure *)object;
-    markObject((Obj *)closure->function);
+    markObject(vm, (Obj *)FROM_REF(ObjFunction, closure->function));
     for (int i = 0; i < closure->upvalueCount; i++)
     {
-      markObject((Obj *)closure->upvalues[i]);
+      markValue(vm, closure->upvalues[i]);
     }
     break;
   }
   case OBJ_FUNCTION:
   {
     ObjFunction *function = (ObjFunction *)object;
-    markObject((Obj *)function->name);
-    markArray(&function->chunk.constants);
+    markObject(vm, (Obj *)FROM_REF(ObjString, function->name));
+    markArray(vm, &function->chunk.constants);
+    if (function->lazy != NULL)
+      markObject(vm, (Obj *)function->lazy->source);
     break;
   }
+  case OBJ_FIBER:
+    markFiber(vm, (ObjFiber *)object);
+    break;
   case OBJ_INSTANCE:
   {
     ObjInstance *instance = (ObjInstance *)object;
-    markObject((Obj *)instance->klass);
-    markTable(&instance->fields);
+    markObject(vm, (Obj *)FROM_REF(ObjClass, instance->klass));
+    markTable(vm, &instance->fields);
     break;
   }
   case OBJ_UPVALUE:
-    markValue(((ObjUpvalue *)object)->closed);
+    markValue(vm, ((ObjUpvalue *)object)->closed);
+    break;
+  case OBJ_ROPE:
+  {
+    ObjRope *rope = (ObjRope *)object;
+    markObject(vm, FROM_REF(Obj, rope->left));
+    markObject(vm, FROM_REF(Obj, rope->right));
+    markObject(vm, (Obj *)FROM_REF(ObjString, rope->flat));
     break;
+  }
+  case OBJ_CHANNEL:
   case OBJ_NATIVE:
   case OBJ_STRING:
     break;
   }
 }
 
-static void freeObject(Obj *object)
+static void freeObject(VM *vm, Obj *object)
 {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void *)object, object->type);
@@ -149,103 +341,140 @@ static void freeObject(Obj *object)
   switch (object->type)
   {
   case OBJ_BOUND_METHOD:
-    FREE(ObjBoundMethod, object);
+    FREE_OBJECT(vm, ObjBoundMethod, object);
+    break;
+  case OBJ_CHANNEL:
+    FREE_OBJECT(vm, ObjChannel, object);
     break;
   case OBJ_CLASS:
   {
     ObjClass *klass = (ObjClass *)object;
-    freeTable(&klass->methods);
-    FREE(ObjClass, object);
+    FREE_ARRAY(vm, Value, klass->methods, klass->methodCount);
+    if (klass->methodKeys != NULL)
+      FREE_ARRAY(vm, int, klass->methodKeys, klass->methodCount);
+    FREE_OBJECT(vm, ObjClass, object);
     break;
   }
   case OBJ_CLOSURE:
   {
-    // ObjClosure并不拥有ObjUpvalue本身，但它确实拥有包含指向这些上值的指针的数组。
+    // ObjClosure并不拥有ObjUpvalue本身，上值数组和闭包在同一块内存里，一起释放。
     ObjClosure *closure = (ObjClosure *)object;
-    FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
+    FREE_OBJECT_SIZE(vm, object, sizeof(ObjClosure) + sizeof(closure->upvalues[0]) * closure->upvalueCount);
     // 只释放ObjClosure本身，而不释放ObjFunction。这是因为闭包不拥有函数对象的内存管理权
     // 可能会有多个闭包都引用了同一个函数，但没有一个闭包声称对该函数有任何特殊的权限。
     // 我们不能释放某个ObjFunction，直到引用它的所有对象全部消失——甚至包括那些常量表中包含该函数的外围函数。
     // 要跟踪这个信息听起来很棘手，事实也的确如此！这就是我们很快就会写一个垃圾收集器来管理它们的原因
-    FREE(ObjClosure, object);
+    break;
+  }
+  case OBJ_FIBER:
+  {
+    // 结束的纤程已经释放了栈
+    ObjFiber *fiber = (ObjFiber *)object;
+    if (fiber->stack != NULL)
+      FREE_ARRAY(vm, char, fiber->stack, FIBER_STACK_BYTES);
+    FREE_OBJECT(vm, ObjFiber, object);
     break;
   }
   case OBJ_FUNCTION:
   {
     ObjFunction *function = (ObjFunction *)object;
-    freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
+    freeChunk(vm, &function->chunk);
+    jitFree(function->jitCode);
+    freeLazyFunction(vm, function->lazy);
+    FREE_OBJECT(vm, ObjFunction, object);
     break;
   }
   case OBJ_INSTANCE:
   {
     ObjInstance *instance = (ObjInstance *)object;
-    freeTable(&instance->fields);
-    FREE(ObjInstance, object);
+    freeTable(vm, &instance->fields);
+    size_t storage = instance->inlineCapacity > 0 ? tableBytes(instance->inlineCapacity) : 0;
+    FREE_OBJECT_SIZE(vm, object, sizeof(ObjInstance) + storage);
     break;
   }
   case OBJ_NATIVE:
-    FREE(ObjNative, object);
+    FREE_OBJECT(vm, ObjNative, object);
+    break;
+  case OBJ_ROPE:
+    FREE_OBJECT(vm, ObjRope, object);
     break;
   case OBJ_STRING:
   {
     ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
+    FREE_OBJECT_SIZE(vm, object, sizeof(ObjString) + string->length + 1);
     break;
   }
   case OBJ_UPVALUE:
     // 多个闭包可以关闭同一个变量，所以ObjUpvalue并不拥有它引用的变量。因此，唯一需要释放的就是ObjUpvalue本身。
-    FREE(ObjUpvalue, object);
+    FREE_OBJECT(vm, ObjUpvalue, object);
     break;
   }
 }
 // 沿着链表释放所有对象
-void freeObjects()
+void freeObjects(VM *vm)
 {
-  Obj *object = vm.objects;
+  Obj *object = vm->objects;
   while (object != NULL)
   {
-    Obj *next = object->next;
-    freeObject(object);
+    Obj *next = FROM_REF(Obj, object->next);
+    freeObject(vm, object);
+    object = next;
+  }
+  object = vm->frozenObjects;
+  while (object != NULL)
+  {
+    Obj *next = FROM_REF(Obj, object->next);
+    freeObject(vm, object);
     object = next;
   }
   // 当VM关闭时，我们需要释放它。
-  free(vm.grayStack);
+  // 压缩引用的对象区域由所有VM共用，这里不归还，释放的对象已经回到空闲链表上了
+  free(vm->grayStack);
 }
-static void markRoots()
+static void markRoots(VM *vm)
 {
-  for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
   {
-    markValue(*slot);
+    markValue(vm, *slot);
   }
-  for (int i = 0; i < vm.frameCount; i++)
+  for (int i = 0; i < vm->frameCount; i++)
   {
-    markObject((Obj *)vm.frames[i].closure);
+    markObject(vm, (Obj *)vm->frames[i].closure);
   }
 
-  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+  for (Value *slot = vm->stack; slot < vm->openUpvaluesTop; slot++)
   {
-    markObject((Obj *)upvalue);
+    markObject(vm, (Obj *)vm->openUpvalues[slot - vm->stack]);
   }
-  markTable(&vm.globals);
-  markCompilerRoots();
-  markObject((Obj *)vm.initString);
+  // 上面是正在运行的纤程的栈；主纤程不在堆上，没在运行时它的栈也是根
+  markObject(vm, (Obj *)vm->fiber);
+  if (vm->fiber != &vm->mainFiber)
+    markFiber(vm, &vm->mainFiber);
+  markTable(vm, &vm->globals);
+  markCompilerRoots(vm);
+  markObject(vm, (Obj *)vm->initString);
+  markArray(vm, &vm->selectors);
+  markArray(vm, &vm->handles);
+  markTable(vm, &vm->baseGlobals);
+  markLoop(vm);
+  // 冻结的对象永远是已标记的，markObject 不会经过它们；它们可能指向冻结之后才分配的对象，每次都只读地扫一遍
+  for (Obj *object = vm->frozenObjects; object != NULL; object = FROM_REF(Obj, object->next))
+    blackenObject(vm, object);
 }
 
-static void traceReferences()
+static void traceReferences(VM *vm)
 {
-  while (vm.grayCount > 0)
+  while (vm->grayCount > 0)
   {
-    Obj *object = vm.grayStack[--vm.grayCount];
-    blackenObject(object);
+    Obj *object = vm->grayStack[--vm->grayCount];
+    blackenObject(vm, object);
   }
 }
 
-static void sweep()
+static void sweep(VM *vm)
 {
   Obj *previous = NULL;
-  Obj *object = vm.objects;
+  Obj *object = vm->objects;
   // 外层的while循环会遍历堆中每个对象组成的链表，检查它们的标记位。
   // 如果某个对象被标记（黑色），我们就不管它，继续进行。
   // 如果它没有被标记（白色），我们将它从链表中断开，并使用我们已经写好的freeObject()函数释放它
@@ -255,46 +484,68 @@ static void sweep()
     {
       object->isMarked = false;
       previous = object;
-      object = object->next;
+      object = FROM_REF(Obj, object->next);
     }
     else
     {
       Obj *unreached = object;
-      object = object->next;
+      object = FROM_REF(Obj, object->next);
       if (previous != NULL)
       {
-        previous->next = object;
+        previous->next = TO_REF(object);
       }
       else
       {
-        vm.objects = object;
+        vm->objects = object;
       }
 
-      freeObject(unreached);
+      freeObject(vm, unreached);
     }
   }
 }
 
-void collectGarbage()
+// --serve 在 fork 之前调用：标记位写在对象头里，不冻结的话工作进程第一次回收就会把共享的页全部复制一遍
+void freezeHeap(VM *vm, bool share)
+{
+  collectGarbage(vm);
+  Obj *object = vm->objects;
+  while (object != NULL)
+  {
+    Obj *next = FROM_REF(Obj, object->next);
+    // 只给这一个VM用的基线只要永远是已标记的就够了，函数还能照常变热被JIT编译
+    if (share)
+      freezeObject(object);
+    else
+      object->isMarked = true;
+    object->next = TO_REF(vm->frozenObjects);
+    vm->frozenObjects = object;
+    object = next;
+  }
+  vm->objects = NULL;
+}
+
+void collectGarbage(VM *vm)
 {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
   // 记录一我们在回收之前捕获堆的大小
-  size_t before = vm.bytesAllocated;
+  size_t before = vm->bytesAllocated;
 #endif
+  beginInternCollection(vm);
   // 标记根
-  markRoots();
+  markRoots(vm);
   // 标记阶段
-  traceReferences();
+  traceReferences(vm);
   // 标记表中的字符串: 需要特殊处理
-  tableRemoveWhite(&vm.strings);
+  tableRemoveWhite(&vm->strings);
+  endInternCollection(vm);
   // 回收
-  sweep();
+  sweep(vm);
   // 所以在收集完成后，我们知道还有多少活动字节。我们在此基础上调整下一次GC的阈值
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
   // 我们就可以看到垃圾回收器在运行时完成了多少任务
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
 #endif
 }
\ No newline at end of file
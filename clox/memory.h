@@ -3,24 +3,43 @@
 
 #include "common.h"
 #include "object.h"
-#define ALLOCATE(type, count) \
-    (type *)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type *)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount)      \
-    (type *)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount)      \
+    (type *)reallocate(vm, pointer, sizeof(type) * (oldCount), \
                        sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+    reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize);
-void markObject(Obj* object);
-void markValue(Value value);
-void collectGarbage();
-void freeObjects();
+#ifdef COMPRESSED_REFS
+// 对象分配在压缩引用的连续区域里，其他内存（字节码、哈希表数组）仍然用 reallocate
+#define ALLOCATE_OBJECT(vm, size) heapAllocate(vm, size)
+#define FREE_OBJECT(vm, type, pointer) heapFree(vm, pointer, sizeof(type))
+#define FREE_OBJECT_SIZE(vm, pointer, size) heapFree(vm, pointer, size)
+void *heapAllocate(VM *vm, size_t size);
+void heapFree(VM *vm, void *pointer, size_t size);
+#else
+#define ALLOCATE_OBJECT(vm, size) reallocate(vm, NULL, 0, size)
+#define FREE_OBJECT(vm, type, pointer) FREE(vm, type, pointer)
+#define FREE_OBJECT_SIZE(vm, pointer, size) reallocate(vm, pointer, size, 0)
+#endif
+
+void *reallocate(VM *vm, void *pointer, size_t oldSize, size_t newSize);
+// 不属于任何VM的对象（并发驻留表里的字符串）：不计入 bytesAllocated，也不会触发回收
+void *allocateUnowned(size_t size);
+void freeUnowned(void *pointer, size_t size);
+void markObject(VM *vm, Obj* object);
+void markValue(VM *vm, Value value);
+void collectGarbage(VM *vm);
+// 回收一次，然后把活着的对象全部冻结：之后的回收不再写它们，也不释放它们。
+// share 为真时按共享代码的办法冻结（字符串先算好哈希，函数不再累加热度），冻结的页以后都不会被写
+void freezeHeap(VM *vm, bool share);
+void freeObjects(VM *vm);
 #endif
\ No newline at end of file
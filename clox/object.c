@@ -1,200 +1,451 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "channel.h"
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
-#define ALLOCATE_OBJ(type, objectType) \
-    (type *)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type *)allocateObject(vm, sizeof(type), objectType)
 
-static Obj *allocateObject(size_t size, ObjType type)
+static Obj *allocateObject(VM *vm, size_t size, ObjType type)
 {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+    Obj *object = (Obj *)ALLOCATE_OBJECT(vm, size);
     object->type = type;
     object->isMarked = false;
     // 手动维护单链表： 每当我们分配一个Obj时，就将其插入到列表中
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = TO_REF(vm->objects);
+    vm->objects = object;
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void *)object, size, type);
 #endif
     return object;
 }
 
-ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method)
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method)
 {
-    ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+    ObjBoundMethod *bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
-    bound->method = method;
+    bound->method = TO_REF(method);
     return bound;
 }
 
-ObjClass *newClass(ObjString *name)
+ObjClass *newClass(VM *vm, ObjString *name)
 {
-    ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
-    klass->name = name;
-    initTable(&klass->methods);
+    ObjClass *klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
+    klass->name = TO_REF(name);
+    klass->superclass = TO_REF(NULL);
+    klass->methods = NULL;
+    klass->methodKeys = NULL;
+    klass->methodBase = 0;
+    klass->methodCount = 0;
+    klass->methodDefined = 0;
+    for (int i = 0; i < INHERITED_CACHE_SIZE; i++)
+    {
+        klass->inheritedSelectors[i] = -1;
+        klass->inheritedMethods[i] = NIL_VAL;
+    }
+    klass->initializer = NIL_VAL;
+    klass->fieldCount = 0;
     return klass;
 }
-ObjClosure *newClosure(ObjFunction *function)
+ObjClosure *newClosure(VM *vm, ObjFunction *function)
 {
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
+    // 上值指针数组跟在对象后面，一次分配
+    ObjClosure *closure = (ObjClosure *)allocateObject(vm, 
+        sizeof(ObjClosure) + sizeof(Value) * function->upvalueCount, OBJ_CLOSURE);
+    closure->function = TO_REF(function);
+    closure->upvalueCount = function->upvalueCount;
     for (int i = 0; i < function->upvalueCount; i++)
     {
-        upvalues[i] = NULL;
+        closure->upvalues[i] = NIL_VAL;
     }
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
-
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
-ObjFunction *newFunction()
+ObjFunction *newFunction(VM *vm)
 {
-    ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
-    function->name = NULL;
+    function->name = TO_REF(NULL);
+    function->hotness = 0;
+    function->jitCode = NULL;
+    function->lazy = NULL;
+    function->accessor = ACCESSOR_NONE;
+    function->accessorValue = NIL_VAL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjInstance *newInstance(ObjClass *klass)
+ObjInstance *newInstance(VM *vm, ObjClass *klass)
 {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-    instance->klass = klass;
-    initTable(&instance->fields);
+    // 字段表的初始存储跟在实例后面，构造一个实例只分配一次内存，前几个字段也不用扩容
+    int capacity = klass->fieldCount > 0 ? tableCapacityFor(klass->fieldCount) : 0;
+    size_t storage = capacity > 0 ? tableBytes(capacity) : 0;
+    ObjInstance *instance = (ObjInstance *)allocateObject(vm, sizeof(ObjInstance) + storage, OBJ_INSTANCE);
+    instance->klass = TO_REF(klass);
+    instance->inlineCapacity = capacity;
+    if (capacity > 0)
+        initTableInline(&instance->fields, instance + 1, capacity);
+    else
+        initTable(&instance->fields);
     return instance;
 }
 
-ObjNative *newNative(NativeFn function)
+ObjNative *newNative(VM *vm, NativeFn function, int arity)
 {
-    ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
+    native->hostFunction = NULL;
+    native->userData = NULL;
     return native;
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash)
+ObjChannel *newChannel(VM *vm, Channel *channel)
+{
+    ObjChannel *object = ALLOCATE_OBJ(vm, ObjChannel, OBJ_CHANNEL);
+    object->channel = channel;
+    return object;
+}
+
+ObjFiber *newFiber(VM *vm, ObjClosure *closure)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjFiber *fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->state = FIBER_SUSPENDED;
+    fiber->caller = NULL;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->openUpvalues = NULL;
+    fiber->openUpvaluesTop = NULL;
+    fiber->entryFrame = 0;
+    // 分配栈时可能触发GC，纤程要先挂在栈上；这块内存不用清零，栈顶以上的内容都不会被读到
+    push(vm, OBJ_VAL(fiber));
+    char *block = ALLOCATE(vm, char, FIBER_STACK_BYTES);
+    pop(vm);
+    fiber->stack = (Value *)block;
+    fiber->openUpvalues = (ObjUpvalue **)(fiber->stack + STACK_MAX);
+    fiber->frames = (CallFrame *)(fiber->openUpvalues + STACK_MAX);
+    fiber->stack[0] = OBJ_VAL(closure);
+    fiber->stackTop = fiber->stack + 1;
+    fiber->openUpvaluesTop = fiber->stack;
+    return fiber;
+}
+
+ObjRope *newRope(VM *vm, Obj *left, Obj *right)
+{
+    ObjRope *rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    // 已经展平的一段直接引用结果字符串，旧的 rope 节点就可以回收了
+    if (left->type == OBJ_ROPE && ((ObjRope *)left)->flat != TO_REF(NULL))
+        left = (Obj *)FROM_REF(ObjString, ((ObjRope *)left)->flat);
+    if (right->type == OBJ_ROPE && ((ObjRope *)right)->flat != TO_REF(NULL))
+        right = (Obj *)FROM_REF(ObjString, ((ObjRope *)right)->flat);
+    rope->length = textLength(left) + textLength(right);
+    rope->left = TO_REF(left);
+    rope->right = TO_REF(right);
+    rope->flat = TO_REF(NULL);
+    return rope;
+}
+
+// 字符直接跟在对象后面，一次分配。调用方原地填好字符后交给 takeString
+ObjString *newString(VM *vm, int length)
+{
+    ObjString *string = (ObjString *)allocateObject(vm, sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    string->hash = 0;
+    string->hashed = false;
+    string->interned = false;
+    string->shared = false;
+    string->intrinsic = 0;
+    string->selector = -1;
+    string->chars[length] = '\0';
+    return string;
+}
+
+static ObjString *intern(VM *vm, ObjString *string, uint32_t hash)
+{
     string->hash = hash;
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
+    string->hashed = true;
+    string->interned = true;
+    push(vm, OBJ_VAL(string));
+    tableSet(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
     return string;
 }
-// 这是工业级“快而散”的 FNV-1a 32 位哈希；两个常量是规范魔法数，循环里“异或+乘”就能把任意字节序列均匀地搅成 32 位哈希值。
-// 异或——把新字节的“局部变化”砸进当前哈希的低位；
-// 乘法——用一个大素数（或演示里的小乘数）把低位变化扩散到整个 32 位寄存器，完成雪崩。
-// 循环下去，每个字符都经历“先异或再扩散”，最后得到分布均匀的 32 位哈希值。
-
-// 2166136261u
-//      FNV 作者先选定一个大素数做“偏移基数”（offset basis），要求是大于 2³² 的下一个素数附近、二进制里 0/1 分布均衡的数，让初始状态“既大又乱”。
-//      随后用几十万个英文单词、路径名、源码标识符做碰撞测试，最终把“碰撞最少”的那个固定下来——所以它是数学筛选＋实测调优的结果。
-// 16777619
-//      理论：选素数是为了乘法逆元存在，且低位全为 1（0x01000193），保证进位链最长，能把低位变化迅速卷到高位。
-//      实践：同样拿海量真实数据跑桶分布，发现它比邻近素数冲突少、雪崩快，才写进规范。
-// → 先定数学标准（素数、逆元、位分布）→ 再用统计学验证碰撞率
+// 一次处理8个字节的乘法哈希：每个字宽先循环左移再异或、乘一个奇数常量，
+// 最后用 murmur3 的 fmix64 做雪崩，折成32位。
+// 逐字节的 FNV-1a 每个字节都要等一次乘法，大字符串上慢好几倍
 static uint32_t hashString(const char *key, int length)
 {
-    // 无符号32位
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++)
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ (uint64_t)length;
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        // memcpy 处理不对齐的读取，编译器会优化成一条 mov
+        memcpy(&word, key + i, sizeof(word));
+        hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95ull;
+    }
+    if (i < length)
     {
-        // (uint8_t)key[i] 就是把 char 的 1 个字节当成无符号 8 位整数取出来，范围 0~255。
-        // C 的整型提升规则（integer promotion）会自动把 uint8_t 先零扩展成 32 位，再跟 uint32_t 做异或，
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+        uint64_t word = 0;
+        memcpy(&word, key + i, length - i);
+        hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95ull;
     }
-    return hash;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
 }
-// 字符串拼接也走缓存
-// "a"+"b" 先 malloc 出 "ab" → 马上 takeString("ab")；
-// 若 intern 表里已有 "ab"，会释放刚拼出来的那块内存，返回旧指针
-// 下次再拼 "a"+"b" 同样拿到同一指针，比较时直接 ptr == ptr。
-// 因此拼接结果也会被全局驻留，重复拼接不会泄露内存，也不会产生重复对象
-ObjString *takeString(char *chars, int length)
+
+// 不驻留的长字符串第一次和别的字符串比较时才计算哈希
+static uint32_t stringHash(ObjString *string)
 {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    if (!string->hashed)
+    {
+        string->hash = hashString(string->chars, string->length);
+        string->hashed = true;
+    }
+    return string->hash;
+}
+// 共享代码里的字符串先查：同样内容的名字在各个VM里必须是同一个对象。
+// 并发驻留表最后查：别的VM后来加进去的字符串，本VM可能早就有一个自己的了，不能出现两个
+static ObjString *findInterned(VM *vm, const char *chars, int length, uint32_t hash)
+{
+    if (vm->shared == NULL)
+        return tableFindString(&vm->strings, chars, length, hash);
+    ObjString *string = tableFindString(&vm->shared->owner->strings, chars, length, hash);
+    if (string == NULL)
+        string = tableFindString(&vm->strings, chars, length, hash);
+    if (string == NULL)
+        string = findSharedString(vm->shared->strings, chars, length, hash);
+    return string;
+}
+// 接管一个用 newString 分配、已经填好字符的字符串
+// 若 intern 表里已有相同内容，返回旧指针，新对象没有引用，下次GC回收
+// 超过 INTERN_MAX_LENGTH 的结果不哈希也不驻留，相等比较退回到逐字节比较
+ObjString *takeString(VM *vm, ObjString *string)
+{
+    if (string->length > INTERN_MAX_LENGTH)
+        return string;
+    uint32_t hash = hashString(string->chars, string->length);
+    ObjString *interned = findInterned(vm, string->chars, string->length, hash);
     if (interned != NULL)
     {
-        FREE_ARRAY(char, chars, length + 1);
         return interned;
     }
-    return allocateString(chars, length, hash);
+    return intern(vm, string, hash);
 }
 // 把【外部】一段不一定在堆的字符序列拷贝进来，
 // 先查全局 intern 表：命中则直接返回旧指针；
 // 未命中则 malloc 一份新内存 → 做成 ObjString → 插入 intern 表 → 返回新指针。
-// 保证：出来的字符串全局唯一，可直接用指针比较。
-ObjString *copyString(const char *chars, int length)
+// 和 takeString 一样，太长的字符串（比如大段文本字面量）只拷贝不驻留
+ObjString *copyString(VM *vm, const char *chars, int length)
+{
+    if (length > INTERN_MAX_LENGTH)
+    {
+        ObjString *string = newString(vm, length);
+        memcpy(string->chars, chars, length);
+        return string;
+    }
+    return internString(vm, chars, length);
+}
+
+// 不管多长都驻留：标识符要作为表的键，表只按指针比较键
+ObjString *internString(VM *vm, const char *chars, int length)
 {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = findInterned(vm, chars, length, hash);
     if (interned != NULL)
     {
         return interned;
     }
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    // 编译时的名字和字面量放进并发驻留表，运行同一份共享代码的VM编译出的常量是同一批对象
+    if (vm->parser != NULL && vm->shared != NULL)
+        return addSharedString(vm->shared->strings, chars, length, hash);
+    ObjString *string = newString(vm, length);
+    memcpy(string->chars, chars, length);
+    return intern(vm, string, hash);
 }
 
-ObjUpvalue *newUpvalue(Value *slot)
+int methodSelector(VM *vm, ObjString *name)
 {
-    ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+    if (name->selector == -1)
+    {
+        // 编号对应的名字一直保留在 vm.selectors 里，字符串不会被回收后换一个编号重新出现。
+        // 共享字符串创建时就编了号，运行共享代码的VM从同一个计数器编号才不会和它们重复
+        name->selector = vm->shared != NULL ? nextSharedSelector(vm->shared->strings)
+                                            : vm->selectorBase + vm->selectors.count;
+        writeValueArray(vm, &vm->selectors, OBJ_VAL(name));
+    }
+    return name->selector;
+}
+
+// 两个不同的字符串对象是否内容相同。驻留的字符串都不超过 INTERN_MAX_LENGTH，
+// 不驻留的都更长，所以长度相同时两者要么都驻留（内容必然不同），要么都不驻留
+static bool stringsEqual(ObjString *a, ObjString *b)
+{
+    if (a == b)
+        return true;
+    if (a->length != b->length || a->interned || b->interned)
+        return false;
+    if (stringHash(a) != stringHash(b))
+        return false;
+    return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+// 把 rope 复制成一个普通字符串，结果缓存在 rope 里
+// 从右往左填：沿右侧链下降，左子树暂存在显式栈里。
+// 循环拼接得到的是左倾的长链，这样展平只需要常数深度，不会递归爆栈
+ObjString *flattenRope(VM *vm, ObjRope *rope)
+{
+    if (rope->flat != TO_REF(NULL))
+        return FROM_REF(ObjString, rope->flat);
+    // 下面会分配内存，先压栈防止 rope 和新字符串被回收
+    push(vm, OBJ_VAL(rope));
+    ObjString *string = newString(vm, rope->length);
+    push(vm, OBJ_VAL(string));
+
+    int capacity = 8;
+    int count = 0;
+    Obj **pending = ALLOCATE(vm, Obj *, capacity);
+    int end = rope->length;
+    Obj *node = (Obj *)rope;
+    for (;;)
+    {
+        while (node->type == OBJ_ROPE && ((ObjRope *)node)->flat == TO_REF(NULL))
+        {
+            if (count + 1 > capacity)
+            {
+                int oldCapacity = capacity;
+                capacity = GROW_CAPACITY(oldCapacity);
+                pending = GROW_ARRAY(vm, Obj *, pending, oldCapacity, capacity);
+            }
+            pending[count++] = FROM_REF(Obj, ((ObjRope *)node)->left);
+            node = FROM_REF(Obj, ((ObjRope *)node)->right);
+        }
+        ObjString *leaf = node->type == OBJ_STRING ? (ObjString *)node
+                                                   : FROM_REF(ObjString, ((ObjRope *)node)->flat);
+        end -= leaf->length;
+        memcpy(string->chars + end, leaf->chars, leaf->length);
+        if (count == 0)
+            break;
+        node = pending[--count];
+    }
+    FREE_ARRAY(vm, Obj *, pending, capacity);
+
+    ObjString *flat = takeString(vm, string);
+    rope->flat = TO_REF(flat);
+    // 两段子树不再需要，交给GC回收
+    rope->left = TO_REF(NULL);
+    rope->right = TO_REF(NULL);
+    pop(vm);
+    pop(vm);
+    return flat;
+}
+
+// 两个位模式不同的对象的相等比较：只有字符串和 rope 需要比较内容
+bool textsEqual(VM *vm, Value a, Value b)
+{
+    if (!IS_TEXT(a) || !IS_TEXT(b))
+        return false;
+    if (textLength(AS_OBJ(a)) != textLength(AS_OBJ(b)))
+        return false;
+    if (IS_STRING(a) && IS_STRING(b))
+        return stringsEqual(AS_STRING(a), AS_STRING(b));
+    // 调用方可能已经把两个操作数出栈了，展平期间要保证它们都是根
+    push(vm, a);
+    push(vm, b);
+    ObjString *x = IS_ROPE(a) ? flattenRope(vm, AS_ROPE(a)) : AS_STRING(a);
+    ObjString *y = IS_ROPE(b) ? flattenRope(vm, AS_ROPE(b)) : AS_STRING(b);
+    pop(vm);
+    pop(vm);
+    return stringsEqual(x, y);
+}
+
+ObjUpvalue *newUpvalue(VM *vm, Value *slot)
+{
+    ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
-    upvalue->next = NULL;
     return upvalue;
 }
 
-static void printFunction(ObjFunction *function)
+static void printFunction(FILE *out, ObjFunction *function)
 {
     // 用户没有办法获取对顶层函数的引用并试图打印它
-    if (function->name == NULL)
+    if (function->name == TO_REF(NULL))
     {
-        printf("<script>");
+        fprintf(out, "<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    fprintf(out, "<fn %s>", FROM_REF(ObjString, function->name)->chars);
 }
 
-void printObject(Value value)
+void printObject(VM *vm, FILE *out, Value value)
 {
     switch (OBJ_TYPE(value))
     {
     case OBJ_BOUND_METHOD:
-        printFunction(AS_BOUND_METHOD(value)->method->function);
+        printFunction(out, FROM_REF(ObjFunction, FROM_REF(ObjClosure, AS_BOUND_METHOD(value)->method)->function));
+        break;
+    case OBJ_CHANNEL:
+        fprintf(out, "<channel %s>", channelName(AS_CHANNEL(value)->channel));
         break;
     case OBJ_CLASS:
-        printf("%s", AS_CLASS(value)->name->chars);
+        fprintf(out, "%s", FROM_REF(ObjString, AS_CLASS(value)->name)->chars);
         break;
     case OBJ_CLOSURE:
-        printFunction(AS_CLOSURE(value)->function);
+        printFunction(out, FROM_REF(ObjFunction, AS_CLOSURE(value)->function));
+        break;
+    case OBJ_FIBER:
+        fprintf(out, "<fiber>");
         break;
     case OBJ_FUNCTION:
-        printFunction(AS_FUNCTION(value));
+        printFunction(out, AS_FUNCTION(value));
         break;
     case OBJ_INSTANCE:
-        printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+        fprintf(out, "%s instance", FROM_REF(ObjString, FROM_REF(ObjClass, AS_INSTANCE(value)->klass)->name)->chars);
         break;
     case OBJ_NATIVE:
-        printf("<native fn>");
+        fprintf(out, "<native fn>");
+        break;
+    case OBJ_ROPE:
+        fprintf(out, "%s", flattenRope(vm, AS_ROPE(value))->chars);
         break;
     case OBJ_STRING:
-        printf("%s", AS_CSTRING(value));
+        fprintf(out, "%s", AS_CSTRING(value));
         break;
     case OBJ_UPVALUE:
-        printf("upvalue");
+        fprintf(out, "upvalue");
         break;
     }
-}
\ No newline at end of file
+}
+
+void freezeObject(Obj *object)
+{
+    switch (object->type)
+    {
+    case OBJ_STRING:
+        stringHash((ObjString *)object);
+        break;
+    case OBJ_FUNCTION:
+    {
+        // 没有本地代码的共享函数不再累加热度
+        ObjFunction *function = (ObjFunction *)object;
+        if (function->jitCode == NULL)
+            function->hotness = INT32_MIN;
+        break;
+    }
+    default:
+        break;
+    }
+    // 永远是已标记的：markObject 碰到它直接返回，不会写它也不会把它放进灰色栈
+    object->isMarked = true;
+}
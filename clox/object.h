@@ -3,38 +3,79 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "lox.h"
 #include "table.h"
 #include "value.h"
+
+#ifdef COMPRESSED_REFS
+// 压缩引用：所有对象都分配在 memory.c 预留的一整块地址空间里，
+// 对象里指向其他对象的字段只存相对基址的32位偏移，0 表示 NULL
+typedef uint32_t ObjRef;
+extern char *heapBase;
+static inline ObjRef toRef(void *pointer)
+{
+  return pointer == NULL ? 0 : (ObjRef)((char *)pointer - heapBase);
+}
+static inline void *fromRef(ObjRef ref)
+{
+  return ref == 0 ? NULL : heapBase + ref;
+}
+#define OBJ_REF(type) ObjRef
+#define TO_REF(pointer) toRef(pointer)
+#define FROM_REF(type, ref) ((type *)fromRef(ref))
+#else
+// 普通模式下引用就是指针，两个转换宏什么都不做
+#define OBJ_REF(type) type *
+#define TO_REF(pointer) (pointer)
+#define FROM_REF(type, ref) (ref)
+#endif
+
 // 获取OBJ类型
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 // 我们用一个宏来检查某个值是否类对象OBJ_BOUND_METHOD
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+// 检查某个值是否通道
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
 // 我们用一个宏来检查某个值是否类对象OBJ_CLASS。
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 // 我们用一个宏来检查某个值是否闭包。
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+// 检查某个值是否纤程
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
 // 确保你的值实际上是一个函数
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 // 确保你的值实际上是一个OBJ_INSTANCE
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 // 我们用一个宏来检查某个值是否本地函数。
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+// 检查某个值是否还没展平的拼接结果
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 // 通过c语言结构体内存对齐特性实现继承
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+// 字符串或 rope，两者对 Lox 程序来说都是字符串
+#define IS_TEXT(value) (IS_STRING(value) || IS_ROPE(value))
 
 // Value安全地转换为一个ObjBoundMethod指针
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+// Value安全地转换为一个ObjChannel指针
+#define AS_CHANNEL(value) ((ObjChannel *)AS_OBJ(value))
 // Value安全地转换为一个ObjClass指针
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
 // Value安全地转换为一个ObjClosure指针
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+// Value安全地转换为一个ObjFiber指针
+#define AS_FIBER(value) ((ObjFiber *)AS_OBJ(value))
 // Value安全地转换为一个ObjFunction指针
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 // Value安全地转换为一个ObjInstance指针
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+// 闭包里按引用捕获的上值
+#define AS_UPVALUE(value) ((ObjUpvalue *)AS_OBJ(value))
 // Value安全地转换为一个ObjNative指针本地函数的Value中提取C函数指针
 #define AS_NATIVE(value) \
   (((ObjNative *)AS_OBJ(value))->function)
+// Value安全地转换为一个ObjRope指针
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
 // 接受一个Value返回 ObjString* 指针
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 // // 接受一个Value返回 字符数组本身
@@ -42,11 +83,14 @@
 typedef enum
 {
   OBJ_BOUND_METHOD,
+  OBJ_CHANNEL,
   OBJ_CLASS,
   OBJ_CLOSURE,
+  OBJ_FIBER,
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_ROPE,
   OBJ_STRING,
   OBJ_UPVALUE
 } ObjType;
@@ -57,9 +101,30 @@ struct Obj
   // 标记垃圾回收器是否已经标记了这个对象
   bool isMarked;
   // 创建一个链表存储每个Obj。虚拟机可以遍历这个列表，找到在堆上分配的每一个对象
-  struct Obj *next;
+  OBJ_REF(struct Obj) next;
 };
 
+// JIT生成的本地代码，定义在jit.h
+typedef struct JitCode JitCode;
+// VM之间共享的消息队列，定义在channel.c
+typedef struct Channel Channel;
+// 调用栈上的一帧，定义在vm.h
+typedef struct CallFrame CallFrame;
+// 延迟编译的函数体，定义在compiler.h
+typedef struct LazyFunction LazyFunction;
+
+// 方法体是下面几种固定形式之一时，OP_INVOKE 直接在接收者上完成，不建立调用帧
+typedef enum
+{
+  ACCESSOR_NONE,
+  // getX() { return this.x; }
+  ACCESSOR_GETTER,
+  // setX(v) { this.x = v; }
+  ACCESSOR_SETTER,
+  // m() { return 42; }，也包括空方法体
+  ACCESSOR_CONSTANT
+} AccessorKind;
+
 typedef struct
 {
   Obj obj;
@@ -70,80 +135,197 @@ typedef struct
   int upvalueCount;
   Chunk chunk;
   // 存储函数名称
-  ObjString *name;
+  OBJ_REF(ObjString) name;
+  // 热度计数：调用和循环回边都会累加，变热之后交给JIT编译
+  int hotness;
+  // JIT翻译出的本地代码，NULL表示仍由解释器执行
+  JitCode *jitCode;
+  // 非NULL表示函数体还没有编译，第一次调用时再编译
+  LazyFunction *lazy;
+  // AccessorKind；getter/setter 时 accessorValue 是字段名，常量方法时是返回值。它同时也在常量表里
+  uint8_t accessor;
+  Value accessorValue;
 } ObjFunction;
 
 // 添加本地函数
-typedef Value (*NativeFn)(int argCount, Value *args);
+// 一个VM里对通道的引用。通道本身不归VM管，回收这个对象不影响通道
+typedef struct
+{
+  Obj obj;
+  Channel *channel;
+} ObjChannel;
+
+typedef Value (*NativeFn)(VM *vm, int argCount, Value *args);
 typedef struct
 {
   Obj obj;
   NativeFn function;
+  // 参数个数，-1 表示不检查
+  int arity;
+  // 宿主通过 lox_define_native 注册的函数和它的私有数据，内置函数为NULL
+  LoxNativeFn hostFunction;
+  void *userData;
 } ObjNative;
 
 struct ObjString
 {
   Obj obj;
   int length;
-  char *chars;
+  // hashed 为假时 hash 还没算；驻留的字符串创建时就有哈希
   uint32_t hash;
+  bool hashed;
+  // 在 vm.strings 里驻留，可以直接按指针比较、当表的键
+  bool interned;
+  // 内置函数的全局变量名：intrinsics 表下标加一，其他字符串为0
+  uint8_t intrinsic;
+  // 在共享代码的并发驻留表里，不属于任何VM的堆，见 intern.h
+  bool shared;
+  // 用作方法名时的全局选择子编号，类的方法数组按它下标；没用作方法名时为-1
+  int selector;
+  // 柔性数组成员：字符和对象头在同一块内存里，以 '\0' 结尾
+  char chars[];
 };
 
+// 字符串拼接的结果：只记住左右两段，复制和哈希推迟到打印或比较时才做，
+// 循环里 s = s + x 因此是线性的，中间结果也不会进驻留表
+typedef struct
+{
+  Obj obj;
+  int length;
+  // 左右两段，ObjString 或 ObjRope；展平之后置为 NULL
+  OBJ_REF(Obj) left;
+  OBJ_REF(Obj) right;
+  // 展平后的字符串，NULL 表示还没展平
+  OBJ_REF(ObjString) flat;
+} ObjRope;
+
+// 拼接结果短于这个长度时直接复制，只有长字符串才用 rope
+#define ROPE_MIN_LENGTH 64
+// 超过这个长度的字符串不驻留，哈希也推迟到第一次比较内容时
+#define INTERN_MAX_LENGTH 256
+
 typedef struct ObjUpvalue
 {
   Obj obj;
   // 上值捕获Value数组指针
   Value *location;
-  // 当上值从栈上退出移到堆上时，closed字段保存了它的实际值
+  // 当上值从栈上退出移到堆上时，closed字段保存了它的实际值。
+  // 打开时它指向栈所在的纤程（主纤程为nil），闭包还在，纤程的栈就不会被回收
   Value closed;
-  // 使用链表指向下一元素
-  struct ObjUpvalue *next;
 } ObjUpvalue;
 
+typedef enum
+{
+  // 新建的，或者 yield 出去了，可以恢复
+  FIBER_SUSPENDED,
+  // 正在运行，或者恢复了别的纤程、正在等它回来
+  FIBER_RUNNING,
+  // 挂起在事件循环里（等 I/O、定时器，或者 spawn 之后还没运行），只有循环能恢复它
+  FIBER_WAITING,
+  // 函数已经返回，或者运行时出了错
+  FIBER_DONE
+} FiberState;
+
+// 纤程：可以暂停和继续的一段执行，有自己的调用栈、值栈和打开的上值表。
+// 正在运行的纤程的这些状态在 VM 里，下面的字段只在它不运行时有效
+typedef struct ObjFiber
+{
+  Obj obj;
+  FiberState state;
+  // 恢复了它、等它 yield 或结束的纤程。可能是 VM 里的主纤程，所以存指针而不是引用
+  struct ObjFiber *caller;
+  CallFrame *frames;
+  int frameCount;
+  // 新纤程的栈底是它的函数，第一次恢复时调用；结束后整块栈就释放了，这几个指针为NULL
+  Value *stack;
+  Value *stackTop;
+  ObjUpvalue **openUpvalues;
+  Value *openUpvaluesTop;
+  int entryFrame;
+} ObjFiber;
+
 // 闭包对象
 typedef struct
 {
   Obj obj;
-  ObjFunction *function;
-  // 不同的闭包可能会有不同数量的上值，所以我们需要一个动态数组。
-  // 上值本身也是动态分配的，因此我们最终需要一个二级指针——一个指向动态分配的上值指针数组的指针
-  ObjUpvalue **upvalues;
+  OBJ_REF(ObjFunction) function;
   // 存储数组中的元素数量
   int upvalueCount;
+  // 不同的闭包可能会有不同数量的上值，所以我们需要一个变长数组，作为柔性数组成员跟在对象后面，和闭包一次分配。
+  // 按引用捕获的上值存 OBJ_VAL(ObjUpvalue)；捕获后不再赋值的变量按值捕获，直接存变量的值
+  Value upvalues[];
 } ObjClosure;
 
-typedef struct
+#define INHERITED_CACHE_SIZE 8
+
+typedef struct ObjClass
 {
   Obj obj;
-  ObjString *name;
-  Table methods;
+  OBJ_REF(ObjString) name;
+  // 父类，没有时为空。子类不复制父类的方法，查找时沿父类链逐级按选择子取下标
+  OBJ_REF(struct ObjClass) superclass;
+  // 本类定义的方法，有两种存法，空位都是 nil：
+  // methodKeys 为空时是一段窗口，methods[i] 是选择子 methodBase + i 对应的闭包。
+  // 只覆盖本类方法的选择子区间，同一个类体里的方法名大多是连续编号的，数组比较紧凑；
+  // 方法名编号相隔很远时（init 和新起的名字、许多类各自的方法名）窗口会很稀疏，
+  // 这时改成按选择子散列的开放寻址表：methodCount 是容量（2的幂），methodKeys[i] 是槽里的选择子，空槽为-1
+  Value *methods;
+  int *methodKeys;
+  int methodBase;
+  int methodCount;
+  // 已定义的方法个数
+  int methodDefined;
+  // 从父类链上找到的方法的缓存，按选择子低位直接映射，空位的选择子为-1。
+  // 类体执行完之后才可能在类上查找方法，此后方法和父类都不再变化，缓存不需要失效
+  int inheritedSelectors[INHERITED_CACHE_SIZE];
+  Value inheritedMethods[INHERITED_CACHE_SIZE];
+  // 缓存的 init() 闭包，没有时为 nil；构造实例时不必再查方法表
+  Value initializer;
+  // 这个类的实例出现过的最多字段数，新实例按它预留字段表
+  int fieldCount;
 } ObjClass;
 
+// 按学到的字段数预留时最多预留这么多，避免个别当字典用的实例让所有实例都变大
+#define MAX_FIELD_HINT 32
+
 typedef struct
 {
   Obj obj;
-  ObjClass *klass;
+  OBJ_REF(ObjClass) klass;
+  // 和实例一起分配的字段存储的容量，0表示没有；字段表扩容后这块存储就闲置了
+  int inlineCapacity;
   Table fields;
 } ObjInstance;
 typedef struct
 {
   Obj obj;
+  // method：类里定义的那个原始闭包（ObjClosure *），也就是方法本身的字节码和常量表。
+  OBJ_REF(ObjClosure) method;
   // receiver：调用这个方法时，this 应该指向的具体实例。
   Value receiver;
-  // method：类里定义的那个原始闭包（ObjClosure *），也就是方法本身的字节码和常量表。
-  ObjClosure *method;
 } ObjBoundMethod;
 
-ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
-ObjClass *newClass(ObjString *name);
-ObjClosure *newClosure(ObjFunction *function);
-ObjFunction *newFunction();
-ObjInstance *newInstance(ObjClass *klass);
-ObjNative *newNative(NativeFn function);
-ObjString *takeString(char *chars, int length);
-ObjString *copyString(const char *chars, int length);
-ObjUpvalue *newUpvalue(Value *slot);
-void printObject(Value value);
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method);
+ObjClass *newClass(VM *vm, ObjString *name);
+ObjClosure *newClosure(VM *vm, ObjFunction *function);
+ObjFunction *newFunction(VM *vm);
+ObjInstance *newInstance(VM *vm, ObjClass *klass);
+ObjNative *newNative(VM *vm, NativeFn function, int arity);
+ObjChannel *newChannel(VM *vm, Channel *channel);
+ObjFiber *newFiber(VM *vm, ObjClosure *closure);
+ObjRope *newRope(VM *vm, Obj *left, Obj *right);
+ObjString *flattenRope(VM *vm, ObjRope *rope);
+bool textsEqual(VM *vm, Value a, Value b);
+ObjString *newString(VM *vm, int length);
+ObjString *takeString(VM *vm, ObjString *string);
+ObjString *copyString(VM *vm, const char *chars, int length);
+ObjString *internString(VM *vm, const char *chars, int length);
+// 给方法名分配选择子编号，已经有编号时直接返回
+int methodSelector(VM *vm, ObjString *name);
+ObjUpvalue *newUpvalue(VM *vm, Value *slot);
+void printObject(VM *vm, FILE *out, Value value);
+// 把对象变成共享代码的一部分：补齐所有延迟计算的字段，之后任何VM都不会再写它
+void freezeObject(Obj *object);
 // static inline 就不会触发多重定义，还能让编译器自由内联省掉 .o 文件和链接这一步
 // 高频、超短、零状态” 的小函数，用 static inline 扔到头文件里，是 C 世界里最常见、最合理的写法
 static inline bool isObjType(Value value, ObjType type)
@@ -151,4 +333,10 @@ static inline bool isObjType(Value value, ObjType type)
   // isObjType判断是OBJ类型且类型匹配
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
+
+// 字符串或 rope 的长度
+static inline int textLength(Obj *text)
+{
+  return text->type == OBJ_STRING ? ((ObjString *)text)->length : ((ObjRope *)text)->length;
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,396 @@
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "regcode.h"
+
+#ifdef REGISTER_VM
+
+// 改写只依赖一个事实：clox 编译器生成的字节码在每条指令处的栈高度都是静态确定的。
+// 栈高度 d 处的临时值就是寄存器 d，局部变量本来就是寄存器，
+// 所以 “GET_LOCAL a; GET_LOCAL b; ADD” 等价于 “ADD_RR d a b”。
+
+// 指令执行后栈高度的变化
+static int stackEffect(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_CLOSURE:
+    case OP_CLASS:
+        return 1;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:
+    case OP_METHOD:
+        return -1;
+    case OP_CALL:
+        return -chunk->code[offset + 1];
+    case OP_INVOKE:
+        return -chunk->code[offset + 2];
+    case OP_SUPER_INVOKE:
+        return -chunk->code[offset + 2] - 1;
+    case OP_SQRT:
+    case OP_FLOOR:
+    case OP_ABS:
+    case OP_MIN:
+    case OP_MAX:
+    case OP_LEN:
+    case OP_CLOCK:
+        // 弹出参数，压入结果
+        return 1 - chunk->code[offset + 1];
+    default:
+        return 0;
+    }
+}
+
+static int jumpTarget(Chunk *chunk, int offset)
+{
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+// 栈式运算对应的 RR 形式，RK 形式紧跟在后面
+static int registerOpcode(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_ADD:
+        return OP_ADD_RR;
+    case OP_SUBTRACT:
+        return OP_SUBTRACT_RR;
+    case OP_MULTIPLY:
+        return OP_MULTIPLY_RR;
+    case OP_DIVIDE:
+        return OP_DIVIDE_RR;
+    case OP_LESS:
+        return OP_LESS_RR;
+    case OP_GREATER:
+        return OP_GREATER_RR;
+    case OP_EQUAL:
+        return OP_EQUAL_RR;
+    default:
+        return -1;
+    }
+}
+
+static int branchOpcode(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_LESS:
+        return OP_JUMP_IF_NOT_LESS_RR;
+    case OP_GREATER:
+        return OP_JUMP_IF_NOT_GREATER_RR;
+    case OP_EQUAL:
+        return OP_JUMP_IF_NOT_EQUAL_RR;
+    default:
+        return -1;
+    }
+}
+
+typedef struct
+{
+    Chunk *chunk;
+    // 每条指令开始处的栈高度，不是指令开头的位置为 -1
+    int *depth;
+    // 有多少条跳转指令以这里为目标
+    int *targets;
+    // 前一条指令的开始位置
+    int *previous;
+    // 改写后删掉的指令（只会是不可达的 OP_POP）
+    bool *dropped;
+    // 旧偏移 -> 新偏移
+    int *newOffset;
+    // 新代码里等待回填的跳转：操作数位置、旧的目标偏移、是否向后跳
+    int *jumpAt;
+    int *jumpTarget;
+    bool *jumpBack;
+    int jumpCount;
+    Chunk out;
+} Rewriter;
+
+// 计算每条指令处的栈高度和跳转目标；栈高度不一致（不该发生）时返回 false，放弃改写
+static bool analyze(Rewriter *rw, int arity)
+{
+    Chunk *chunk = rw->chunk;
+    int *expected = (int *)malloc(sizeof(int) * (chunk->count + 1));
+    for (int i = 0; i <= chunk->count; i++)
+    {
+        rw->depth[i] = -1;
+        expected[i] = -1;
+    }
+    // 槽0是被调用的闭包或者接收者，后面是形参
+    int depth = arity + 1;
+    int previous = -1;
+    bool ok = true;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        // 无条件跳转之后的指令只能从跳转到达，栈高度以跳转处为准
+        // （比如循环出口的 OP_POP 要弹出条件值，而循环体末尾的 OP_LOOP 处条件值已经弹掉了）
+        bool fallsThrough = previous == -1 || (chunk->code[previous] != OP_JUMP && chunk->code[previous] != OP_LOOP);
+        if (!fallsThrough && expected[offset] != -1)
+            depth = expected[offset];
+        if (expected[offset] != -1 && expected[offset] != depth)
+            ok = false;
+        rw->depth[offset] = depth;
+        rw->previous[offset] = previous;
+        previous = offset;
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP)
+        {
+            int target = jumpTarget(chunk, offset);
+            rw->targets[target]++;
+            if (instruction == OP_LOOP)
+            {
+                if (rw->depth[target] != depth)
+                    ok = false;
+            }
+            else
+            {
+                expected[target] = depth;
+            }
+        }
+        depth += stackEffect(chunk, offset);
+    }
+    free(expected);
+    return ok;
+}
+
+static void emit(VM *vm, Rewriter *rw, uint8_t byte, int line)
+{
+    writeChunk(vm, &rw->out, byte, line);
+}
+
+static void emitJumpOperand(VM *vm, Rewriter *rw, int oldTarget, bool back, int line)
+{
+    rw->jumpAt[rw->jumpCount] = rw->out.count;
+    rw->jumpTarget[rw->jumpCount] = oldTarget;
+    rw->jumpBack[rw->jumpCount] = back;
+    rw->jumpCount++;
+    emit(vm, rw, 0xff, line);
+    emit(vm, rw, 0xff, line);
+}
+
+// offset 处是一条不是跳转目标的 instruction 指令
+static bool at(Rewriter *rw, int offset, uint8_t instruction)
+{
+    return offset < rw->chunk->count && rw->targets[offset] == 0 && rw->chunk->code[offset] == instruction;
+}
+
+static int nextInstruction(Rewriter *rw, int offset)
+{
+    if (offset >= rw->chunk->count)
+        return offset;
+    return offset + instructionLength(rw->chunk, offset);
+}
+
+// 尝试从 offset 开始合并一组指令，返回合并掉的旧字节数；0 表示不能合并
+static int fuse(VM *vm, Rewriter *rw, int offset)
+{
+    Chunk *chunk = rw->chunk;
+    uint8_t *code = chunk->code;
+    int i1 = nextInstruction(rw, offset);
+    int i2 = nextInstruction(rw, i1);
+    int i3 = nextInstruction(rw, i2);
+    int i4 = nextInstruction(rw, i3);
+
+    // GET_LOCAL a; GET_LOCAL b|CONSTANT k; <运算>
+    if (code[offset] == OP_GET_LOCAL && (at(rw, i1, OP_GET_LOCAL) || at(rw, i1, OP_CONSTANT)) &&
+        i2 < chunk->count && rw->targets[i2] == 0 && registerOpcode(code[i2]) != -1)
+    {
+        uint8_t a = code[offset + 1];
+        uint8_t b = code[i1 + 1];
+        bool isConstant = code[i1] == OP_CONSTANT;
+        int line = chunk->lines[i2];
+
+        // ...; SET_LOCAL c; POP：结果直接写进局部变量
+        if (at(rw, i3, OP_SET_LOCAL) && at(rw, i4, OP_POP))
+        {
+            emit(vm, rw, (uint8_t)(registerOpcode(code[i2]) + isConstant), line);
+            emit(vm, rw, code[i3 + 1], line);
+            emit(vm, rw, a, line);
+            emit(vm, rw, b, line);
+            return i4 + 1 - offset;
+        }
+
+        // ...; JUMP_IF_FALSE L; POP，且 L 处是 POP：比较后直接跳到 L 之后，条件值不入栈
+        if (branchOpcode(code[i2]) != -1 && at(rw, i3, OP_JUMP_IF_FALSE) && at(rw, i4, OP_POP))
+        {
+            int target = jumpTarget(chunk, i3);
+            if (target < chunk->count && code[target] == OP_POP)
+            {
+                emit(vm, rw, (uint8_t)(branchOpcode(code[i2]) + isConstant), line);
+                emit(vm, rw, a, line);
+                emit(vm, rw, b, line);
+                emitJumpOperand(vm, rw, target + 1, false, line);
+                // 只有这条跳转会到达的 L 前面是无条件跳转，L 就成了死代码
+                int previous = rw->previous[target];
+                if (rw->targets[target] == 1 && previous != -1 &&
+                    (code[previous] == OP_JUMP || code[previous] == OP_LOOP))
+                {
+                    rw->dropped[target] = true;
+                }
+                return i4 + 1 - offset;
+            }
+        }
+
+        // 结果压栈：目标寄存器就是当前栈顶
+        int depth = rw->depth[offset];
+        if (depth <= UINT8_MAX)
+        {
+            emit(vm, rw, (uint8_t)(registerOpcode(code[i2]) + isConstant), line);
+            emit(vm, rw, (uint8_t)depth, line);
+            emit(vm, rw, a, line);
+            emit(vm, rw, b, line);
+            return i3 - offset;
+        }
+        return 0;
+    }
+
+    // 左操作数是刚算出来的栈顶临时值：GET_LOCAL b|CONSTANT k; <运算>
+    // 栈顶寄存器 d-1 既是左操作数也是结果，栈高度不变
+    if ((code[offset] == OP_GET_LOCAL || code[offset] == OP_CONSTANT) &&
+        i1 < chunk->count && rw->targets[i1] == 0 && registerOpcode(code[i1]) != -1)
+    {
+        int top = rw->depth[offset] - 1;
+        if (top <= UINT8_MAX)
+        {
+            int line = chunk->lines[i1];
+            emit(vm, rw, (uint8_t)(registerOpcode(code[i1]) + (code[offset] == OP_CONSTANT)), line);
+            emit(vm, rw, (uint8_t)top, line);
+            emit(vm, rw, (uint8_t)top, line);
+            emit(vm, rw, code[offset + 1], line);
+            return i2 - offset;
+        }
+        return 0;
+    }
+
+    // GET_LOCAL a|CONSTANT k; SET_LOCAL c; POP
+    if ((code[offset] == OP_GET_LOCAL || code[offset] == OP_CONSTANT) &&
+        at(rw, i1, OP_SET_LOCAL) && at(rw, i2, OP_POP))
+    {
+        int line = chunk->lines[i1];
+        emit(vm, rw, code[offset] == OP_GET_LOCAL ? OP_MOVE : OP_LOADK, line);
+        emit(vm, rw, code[i1 + 1], line);
+        emit(vm, rw, code[offset + 1], line);
+        return i2 + 1 - offset;
+    }
+
+    // SET_LOCAL c; POP：表达式语句里的赋值
+    if (code[offset] == OP_SET_LOCAL && at(rw, i1, OP_POP))
+    {
+        int line = chunk->lines[offset];
+        emit(vm, rw, OP_STORE, line);
+        emit(vm, rw, code[offset + 1], line);
+        return i1 + 1 - offset;
+    }
+    return 0;
+}
+
+void registerizeFunction(VM *vm, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int count = chunk->count;
+    Rewriter rw;
+    rw.chunk = chunk;
+    rw.depth = (int *)malloc(sizeof(int) * (count + 1));
+    rw.targets = (int *)calloc(count + 1, sizeof(int));
+    rw.previous = (int *)malloc(sizeof(int) * (count + 1));
+    rw.dropped = (bool *)calloc(count + 1, sizeof(bool));
+    rw.newOffset = (int *)malloc(sizeof(int) * (count + 1));
+    rw.jumpAt = (int *)malloc(sizeof(int) * (count + 1));
+    rw.jumpTarget = (int *)malloc(sizeof(int) * (count + 1));
+    rw.jumpBack = (bool *)malloc(sizeof(bool) * (count + 1));
+    rw.jumpCount = 0;
+    initChunk(&rw.out);
+
+    if (analyze(&rw, function->arity))
+    {
+        int offset = 0;
+        while (offset < count)
+        {
+            rw.newOffset[offset] = rw.out.count;
+            if (rw.dropped[offset])
+            {
+                offset++;
+                continue;
+            }
+            int fused = fuse(vm, &rw, offset);
+            if (fused > 0)
+            {
+                offset += fused;
+                continue;
+            }
+            // 其余指令原样复制，跳转的偏移量稍后回填
+            uint8_t instruction = chunk->code[offset];
+            int length = instructionLength(chunk, offset);
+            int line = chunk->lines[offset];
+            if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP)
+            {
+                emit(vm, &rw, instruction, line);
+                emitJumpOperand(vm, &rw, jumpTarget(chunk, offset), instruction == OP_LOOP, line);
+            }
+            else
+            {
+                for (int i = 0; i < length; i++)
+                    emit(vm, &rw, chunk->code[offset + i], chunk->lines[offset + i]);
+            }
+            offset += length;
+        }
+        rw.newOffset[count] = rw.out.count;
+
+        for (int i = 0; i < rw.jumpCount; i++)
+        {
+            int operand = rw.jumpAt[i];
+            int target = rw.newOffset[rw.jumpTarget[i]];
+            int jump = rw.jumpBack[i] ? operand + 2 - target : target - (operand + 2);
+            rw.out.code[operand] = (jump >> 8) & 0xff;
+            rw.out.code[operand + 1] = jump & 0xff;
+        }
+
+        // 换上新代码，常量表不变
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+        chunk->code = rw.out.code;
+        chunk->lines = rw.out.lines;
+        chunk->count = rw.out.count;
+        chunk->capacity = rw.out.capacity;
+    }
+
+    free(rw.depth);
+    free(rw.targets);
+    free(rw.previous);
+    free(rw.dropped);
+    free(rw.newOffset);
+    free(rw.jumpAt);
+    free(rw.jumpTarget);
+    free(rw.jumpBack);
+}
+
+#else
+
+void registerizeFunction(VM *vm, ObjFunction *function)
+{
+}
+
+#endif
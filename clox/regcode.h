@@ -0,0 +1,11 @@
+#ifndef clox_regcode_h
+#define clox_regcode_h
+
+#include "object.h"
+
+// 寄存器式字节码（在 common.h 中打开 REGISTER_VM）：
+// 编译器照常生成栈式字节码，endCompiler 再把常见的“取局部变量/常量 -> 运算 -> 存回局部变量”
+// 序列改写成直接读写帧内栈槽的三地址指令，其余指令保持栈式语义。
+void registerizeFunction(VM *vm, ObjFunction *function);
+
+#endif
@@ -60,6 +60,18 @@ typedef struct
     int length;
     int line;
 } Token;
-void initScanner(const char *source);
-Token scanToken();
+typedef struct
+{
+    // start指针标识正在被扫描的词素的起点
+    const char *start;
+    // current指针指向当前正在查看的字符
+    const char *current;
+    int line;
+} Scanner;
+
+// 扫描器的状态由调用方持有（编译器把它放在 Parser 里），同时编译多份源码互不干扰
+void initScanner(Scanner *scanner, const char *source);
+// 从源码中间的某个位置开始扫描（延迟编译函数体时使用）
+void initScannerAt(Scanner *scanner, const char *source, int line);
+Token scanToken(Scanner *scanner);
 #endif
\ No newline at end of file
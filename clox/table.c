@@ -5,76 +5,174 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
-// 管理表负载因子的方式。我们不会在容量全满的时候才进行扩展。相反，当数组达到75%满时[11]，我们会提前扩展数组
-#define TABLE_MAX_LOAD 0.75
-void initTable(Table *table)
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// 管理表负载因子的方式。我们不会在容量全满的时候才进行扩展。相反，当数组达到 7/8 满时，我们会提前扩展数组。
+// 按16个槽一组探测，组内的冲突不需要额外的比较，负载因子可以比逐个探测时更高
+#define TABLE_MAX_LOAD 0.875
+// 一组的槽数，正好是一个 SSE2 寄存器的宽度
+#define GROUP_WIDTH 16
+// 控制字节：最高位为1表示没有键，空槽和墓碑；最高位为0时低7位是键哈希值的低7位
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+// 组数减一，用来对组下标取模。容量是2的幂，小于一组时结果是0：
+// 控制数组仍然按一整组分配，多出来的控制字节永远是空槽
+static inline int groupMask(int capacity)
 {
-    table->count = 0;
-    table->capacity = 0;
-    table->entries = NULL;
+    return (capacity - 1) / GROUP_WIDTH;
 }
-void freeTable(Table *table)
+
+// 条目数组和控制字节在同一块内存里，控制字节紧跟在条目后面
+size_t tableBytes(int capacity)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    initTable(table);
+    return sizeof(Entry) * capacity + (groupMask(capacity) + 1) * GROUP_WIDTH;
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key)
+// 第 i 位表示组内第 i 个槽的控制字节等于 tag
+static inline uint32_t matchTag(const uint8_t *group, uint8_t tag)
 {
-    // 对hash桶进行线性探测
-    // 利用2进制为底数的按位与运算实现模运算
-    uint32_t index = key->hash & (capacity - 1);
-    // 定义墓碑
-    Entry *tombstone = NULL;
-    for (;;)
+#ifdef __SSE2__
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
     {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value))
-            {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                // We found a tombstone.
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
-        }
-        else if (entry->key == key)
+        if (group[i] == tag)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// 组内没有键的槽（空槽或墓碑），也就是最高位为1的控制字节
+static inline uint32_t matchFree(const uint8_t *group)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+    {
+        if (group[i] & 0x80)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// 哈希值的高位选起始组，低7位存进控制字节
+static inline uint8_t hashTag(uint32_t hash)
+{
+    return (uint8_t)(hash & 0x7f);
+}
+
+// 在 table 里找 key 所在的槽，找不到返回 -1。
+// 按组做三角数探测（第 i 次跳过 i 组），组数是2的幂时能遍历所有组；
+// 一组里只要还有空槽，key 就不可能放在后面的组里，可以停止探测
+static int findSlot(Table *table, ObjString *key)
+{
+    int mask = groupMask(table->capacity);
+    int group = (int)(key->hash >> 7) & mask;
+    uint8_t tag = hashTag(key->hash);
+    for (int step = 1;; step++)
+    {
+        const uint8_t *control = table->control + group * GROUP_WIDTH;
+        for (uint32_t match = matchTag(control, tag); match != 0; match &= match - 1)
         {
-            // We found the key.
-            return entry;
+            int index = group * GROUP_WIDTH + __builtin_ctz(match);
+            if (table->entries[index].key == key)
+                return index;
         }
+        if (matchTag(control, CONTROL_EMPTY) != 0)
+            return -1;
+        group = (group + step) & mask;
+    }
+}
 
-        index = (index + 1) & (capacity - 1);
+// 沿着同样的探测序列找第一个没有键的槽，新键放在这里
+static int findFreeSlot(const uint8_t *controlBytes, int capacity, uint32_t hash)
+{
+    int mask = groupMask(capacity);
+    int group = (int)(hash >> 7) & mask;
+    // 容量不足一组时，只有前 capacity 个槽是真实存在的
+    uint32_t slots = capacity < GROUP_WIDTH ? (1u << capacity) - 1 : 0xffff;
+    for (int step = 1;; step++)
+    {
+        uint32_t available = matchFree(controlBytes + group * GROUP_WIDTH) & slots;
+        if (available != 0)
+            return group * GROUP_WIDTH + __builtin_ctz(available);
+        group = (group + step) & mask;
     }
 }
 
+void initTable(Table *table)
+{
+    table->count = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+    table->control = NULL;
+    table->inlineStorage = false;
+}
+
+static void clearSlots(Entry *entries, int capacity)
+{
+    memset(entries + capacity, CONTROL_EMPTY, (groupMask(capacity) + 1) * GROUP_WIDTH);
+    for (int i = 0; i < capacity; i++)
+    {
+        entries[i].key = NULL;
+        entries[i].value = NIL_VAL;
+    }
+}
+
+void initTableInline(Table *table, void *storage, int capacity)
+{
+    table->count = 0;
+    table->capacity = capacity;
+    table->entries = (Entry *)storage;
+    table->control = (uint8_t *)(table->entries + capacity);
+    table->inlineStorage = true;
+    clearSlots(table->entries, capacity);
+}
+
+int tableCapacityFor(int count)
+{
+    int capacity = GROW_CAPACITY(0);
+    while (count > capacity * TABLE_MAX_LOAD)
+        capacity = GROW_CAPACITY(capacity);
+    return capacity;
+}
+
+void freeTable(VM *vm, Table *table)
+{
+    if (table->entries != NULL && !table->inlineStorage)
+        reallocate(vm, table->entries, tableBytes(table->capacity), 0);
+    initTable(table);
+}
+
 bool tableGet(Table *table, ObjString *key, Value *value)
 {
     if (table->count == 0)
         return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int index = findSlot(table, key);
+    if (index < 0)
         return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
-static void adjustCapacity(Table *table, int capacity)
+// 重新分配并把所有键搬过去，墓碑在这一步被清掉
+static void adjustCapacity(VM *vm, Table *table, int capacity)
 {
-    Entry *entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++)
-    {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
-    table->count = 0;
+    Entry *entries = (Entry *)reallocate(vm, NULL, 0, tableBytes(capacity));
+    uint8_t *control = (uint8_t *)(entries + capacity);
+    clearSlots(entries, capacity);
+    int count = 0;
     // 这些新的桶可能会出现新的冲突，我们需要处理这些冲突。
     for (int i = 0; i < table->capacity; i++)
     {
@@ -82,32 +180,91 @@ static void adjustCapacity(Table *table, int capacity)
         if (entry->key == NULL)
             continue;
 
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        int index = findFreeSlot(control, capacity, entry->key->hash);
+        control[index] = hashTag(entry->key->hash);
+        entries[index] = *entry;
+        count++;
     }
-    // 释放旧桶占用内存
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    // 释放旧桶占用内存；内联的旧存储随所属对象一起释放
+    freeTable(vm, table);
+    table->count = count;
     table->entries = entries;
+    table->control = control;
     table->capacity = capacity;
 }
 
 // 定的键/值对添加到给定的哈希表中。如果该键的条目已存在，新值将覆盖旧值。如果添加了新条目，则该函数返回true
-bool tableSet(Table *table, ObjString *key, Value value)
+// 查找键的同时记下探测路径上第一个可用的槽，新键不需要再探测一遍
+bool tableSet(VM *vm, Table *table, ObjString *key, Value value)
 {
+    uint8_t tag = hashTag(key->hash);
+    int index = -1;
+    if (table->capacity > 0)
+    {
+        int mask = groupMask(table->capacity);
+        int group = (int)(key->hash >> 7) & mask;
+        // 容量不足一组时，只有前 capacity 个槽是真实存在的
+        uint32_t slots = table->capacity < GROUP_WIDTH ? (1u << table->capacity) - 1 : 0xffff;
+        for (int step = 1;; step++)
+        {
+            const uint8_t *control = table->control + group * GROUP_WIDTH;
+            for (uint32_t match = matchTag(control, tag); match != 0; match &= match - 1)
+            {
+                Entry *entry = &table->entries[group * GROUP_WIDTH + __builtin_ctz(match)];
+                if (entry->key == key)
+                {
+                    entry->value = value;
+                    return false;
+                }
+            }
+            uint32_t available = matchFree(control) & slots;
+            if (index < 0 && available != 0)
+                index = group * GROUP_WIDTH + __builtin_ctz(available);
+            if (matchTag(control, CONTROL_EMPTY) != 0)
+                break;
+            group = (group + step) & mask;
+        }
+    }
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        // 删除留下的墓碑很多时，原地重建就能腾出空间，不必扩容
+        int live = 0;
+        for (int i = 0; i < table->capacity; i++)
+        {
+            if (table->entries[i].key != NULL)
+                live++;
+        }
+        int capacity = live + 1 > table->capacity * TABLE_MAX_LOAD / 2
+                           ? GROW_CAPACITY(table->capacity)
+                           : table->capacity;
+        adjustCapacity(vm, table, capacity);
+        index = findFreeSlot(table->control, table->capacity, key->hash);
     }
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value))
+    // 复用墓碑不改变占用的槽数
+    if (table->control[index] == CONTROL_EMPTY)
         table->count++;
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    table->control[index] = tag;
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    return true;
+}
+
+// 删除 index 处的键。如果这一组还有空槽，探测本来就会停在这一组，
+// 直接把槽标成空槽即可；否则要留下墓碑，让探测继续走到后面的组
+static void removeSlot(Table *table, int index)
+{
+    const uint8_t *group = table->control + index / GROUP_WIDTH * GROUP_WIDTH;
+    if (matchTag(group, CONTROL_EMPTY) != 0)
+    {
+        table->control[index] = CONTROL_EMPTY;
+        table->count--;
+    }
+    else
+    {
+        table->control[index] = CONTROL_DELETED;
+    }
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
 }
 
 bool tableDelete(Table *table, ObjString *key)
@@ -116,24 +273,22 @@ bool tableDelete(Table *table, ObjString *key)
         return false;
 
     // Find the entry.
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int index = findSlot(table, key);
+    if (index < 0)
         return false;
 
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    removeSlot(table, index);
     return true;
 }
 
-void tableAddAll(Table *from, Table *to)
+void tableAddAll(VM *vm, Table *from, Table *to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
         Entry *entry = &from->entries[i];
         if (entry->key != NULL)
         {
-            tableSet(to, entry->key, entry->value);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -143,27 +298,28 @@ ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t
     if (table->count == 0)
         return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;)
+    int mask = groupMask(table->capacity);
+    int group = (int)(hash >> 7) & mask;
+    uint8_t tag = hashTag(hash);
+    for (int step = 1;; step++)
     {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL)
+        const uint8_t *control = table->control + group * GROUP_WIDTH;
+        for (uint32_t match = matchTag(control, tag); match != 0; match &= match - 1)
         {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value))
-                return NULL;
-        }
-        // 为了避免哈希冲突，命中桶之后
-        // 再进行实际的逐字符的字符串比较。这是虚拟机中我们真正测试字符串是否相等的一个地方
-        else if (entry->key->length == length &&
-                 entry->key->hash == hash &&
-                 memcmp(entry->key->chars, chars, length) == 0)
-        {
-            // We found it.
-            return entry->key;
+            ObjString *key = table->entries[group * GROUP_WIDTH + __builtin_ctz(match)].key;
+            // 为了避免哈希冲突，命中桶之后
+            // 再进行实际的逐字符的字符串比较。这是虚拟机中我们真正测试字符串是否相等的一个地方
+            if (key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0)
+            {
+                // We found it.
+                return key;
+            }
         }
-
-        index = (index + 1) & (table->capacity - 1);
+        // Stop if we find an empty non-tombstone entry.
+        if (matchTag(control, CONTROL_EMPTY) != 0)
+            return NULL;
+        group = (group + step) & mask;
     }
 }
 void tableRemoveWhite(Table *table)
@@ -173,17 +329,17 @@ void tableRemoveWhite(Table *table)
         Entry *entry = &table->entries[i];
         if (entry->key != NULL && !entry->key->obj.isMarked)
         {
-            tableDelete(table, entry->key);
+            removeSlot(table, i);
         }
     }
 }
 
-void markTable(Table *table)
+void markTable(VM *vm, Table *table)
 {
     for (int i = 0; i < table->capacity; i++)
     {
         Entry *entry = &table->entries[i];
-        markObject((Obj *)entry->key);
-        markValue(entry->value);
+        markObject(vm, (Obj *)entry->key);
+        markValue(vm, entry->value);
     }
-}
\ No newline at end of file
+}
@@ -9,23 +9,33 @@ typedef struct
     Value value;
 } Entry;
 
-// 哈希表是一个条目数组
+// 哈希表是一个条目数组，外加一个控制字节数组（Swiss table 布局）：
+// 每个槽一个控制字节，空槽、墓碑或者键哈希值的低7位。
+// 查找时一次比较16个控制字节，只有低7位匹配的槽才去读条目
 typedef struct
 {
-    // 键/值对数量（计数，count）。
+    // 已占用的槽数量（键/值对加上墓碑），用来判断负载
     int count;
     //   数组的分配大小（容量，capacity）
     int capacity;
     Entry *entries;
+    uint8_t *control;
+    // 条目数组是别的对象的一部分（实例的内联字段），扩容时不能释放
+    bool inlineStorage;
 } Table;
 void initTable(Table* table);
-void freeTable(Table* table);
+// 用调用者提供的 tableBytes(capacity) 字节作为初始存储，空表
+void initTableInline(Table *table, void *storage, int capacity);
+// 能放下 count 个键而不扩容的最小容量
+int tableCapacityFor(int count);
+size_t tableBytes(int capacity);
+void freeTable(VM *vm, Table* table);
 // 传入一个表和一个键。如果它找到一个带有该键的条目，则返回true，否则返回false
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM *vm, Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM *vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars,int length, uint32_t hash);
 void tableRemoveWhite(Table* table);
-void markTable(Table* table);
+void markTable(VM *vm, Table* table);
 #endif
\ No newline at end of file
@@ -0,0 +1,161 @@
+// lox.h 嵌入接口：编译运行脚本、读写全局变量、从宿主调用 Lox 函数和类、
+// 带 userData 的本地函数（包括在本地函数里回调 Lox）、本地函数报错，以及 print 输出的重定向。
+// test/run.sh 把它和除 main.c 外的所有源码链接在一起运行
+#include <stdio.h>
+#include <string.h>
+
+#include "lox.h"
+
+static void show(const char *label, LoxValue value)
+{
+    switch (value.type)
+    {
+    case LOX_NIL:
+        printf("%s: nil\n", label);
+        break;
+    case LOX_BOOL:
+        printf("%s: %s\n", label, value.as.boolean ? "true" : "false");
+        break;
+    case LOX_NUMBER:
+        printf("%s: %g\n", label, value.as.number);
+        break;
+    case LOX_STRING:
+        printf("%s: \"%.*s\" (%d)\n", label, value.as.string.length, value.as.string.chars,
+               value.as.string.length);
+        break;
+    case LOX_OBJECT:
+        printf("%s: object\n", label);
+        break;
+    }
+}
+
+// 每调用一次给宿主的计数器加一，返回参数之和
+static bool tally(LoxVM *vm, void *userData, int argCount, const LoxValue *args, LoxValue *result)
+{
+    int *calls = (int *)userData;
+    double sum = 0;
+    for (int i = 0; i < argCount; i++)
+    {
+        if (args[i].type != LOX_NUMBER)
+        {
+            lox_error(vm, "tally() takes numbers.");
+            return false;
+        }
+        sum += args[i].as.number;
+    }
+    (*calls)++;
+    *result = lox_number(sum);
+    return true;
+}
+
+// apply(f, x)：在本地函数里回调 Lox
+static bool apply(LoxVM *vm, void *userData, int argCount, const LoxValue *args, LoxValue *result)
+{
+    return lox_call(vm, args[0], 1, &args[1], result) == LOX_OK;
+}
+
+typedef struct
+{
+    char text[256];
+    size_t length;
+    int lines;
+} Captured;
+
+static void capture(LoxVM *vm, void *userData, const char *text, size_t length)
+{
+    Captured *captured = (Captured *)userData;
+    if (captured->length + length + 1 < sizeof(captured->text))
+    {
+        memcpy(captured->text + captured->length, text, length);
+        captured->length += length;
+        captured->text[captured->length++] = '/';
+    }
+    captured->lines++;
+}
+
+int main(void)
+{
+    LoxVM *vm = lox_new();
+    int calls = 0;
+    lox_define_native(vm, "tally", -1, tally, &calls);
+    lox_define_native(vm, "apply", 2, apply, NULL);
+
+    LoxScript *script = lox_compile(vm,
+                                    "var runs = 0;\n"
+                                    "runs = runs + 1;\n"
+                                    "fun add(a, b) { return a + b; }\n"
+                                    "fun twice(x) { return x * 2; }\n"
+                                    "class Pair { init(a, b) { this.a = a; this.b = b; } sum() { return this.a + this.b; } }\n"
+                                    "var sum = tally(1, 2, 3) + tally();\n"
+                                    "print \"ran \" + \"script\";\n");
+    if (script == NULL)
+        return 1;
+    // 同一份脚本可以反复运行
+    printf("run: %d\n", lox_run(vm, script));
+    printf("run: %d\n", lox_run(vm, script));
+    lox_release(vm, script);
+    printf("tally calls: %d\n", calls);
+
+    LoxValue value;
+    printf("missing: %d\n", lox_get_global(vm, "missing", &value));
+    lox_get_global(vm, "runs", &value);
+    show("runs", value);
+    lox_get_global(vm, "sum", &value);
+    show("sum", value);
+
+    LoxValue add, result;
+    lox_get_global(vm, "add", &add);
+    show("add", add);
+    LoxValue numbers[2] = {lox_number(1.5), lox_number(2)};
+    printf("call: %d\n", lox_call(vm, add, 2, numbers, &result));
+    show("add(1.5, 2)", result);
+    // 宿主传进去的字符串会被复制，可以带 NUL
+    LoxValue strings[2] = {lox_string("ab", 2), lox_string("c\0d", 3)};
+    lox_call(vm, add, 2, strings, &result);
+    show("add(\"ab\", \"c\\0d\")", result);
+
+    // 调用类得到实例，实例再传回 VM
+    LoxValue pair;
+    lox_get_global(vm, "Pair", &value);
+    lox_call(vm, value, 2, numbers, &pair);
+    show("Pair(1.5, 2)", pair);
+    lox_set_global(vm, "pair", pair);
+    lox_set_global(vm, "greeting", lox_string("hello", 5));
+    script = lox_compile(vm, "var total = pair.sum(); var shout = greeting + \"!\";");
+    printf("run: %d\n", lox_run(vm, script));
+    lox_release(vm, script);
+    lox_get_global(vm, "total", &value);
+    show("total", value);
+    lox_get_global(vm, "shout", &value);
+    show("shout", value);
+
+    // 本地函数里回调 Lox，以及从宿主直接调用本地函数
+    LoxValue twice;
+    lox_get_global(vm, "twice", &twice);
+    lox_get_global(vm, "apply", &value);
+    LoxValue applyArgs[2] = {twice, lox_number(21)};
+    lox_call(vm, value, 2, applyArgs, &result);
+    show("apply(twice, 21)", result);
+    lox_get_global(vm, "tally", &value);
+    lox_call(vm, value, 2, numbers, NULL);
+    printf("tally calls: %d\n", calls);
+
+    // 本地函数报错：调用返回运行时错误，报错信息在 stderr
+    LoxValue wrong = lox_bool(true);
+    printf("error: %d\n", lox_call(vm, value, 1, &wrong, &result));
+    printf("tally calls: %d\n", calls);
+    printf("compile error: %d\n", lox_compile(vm, "var = ;") == NULL);
+
+    // print 交给回调，恢复之后又写回 stdout
+    Captured captured = {{0}, 0, 0};
+    lox_set_print(vm, capture, &captured);
+    script = lox_compile(vm, "print 1 + 2; print \"x\" + \"y\"; print nil;");
+    lox_run(vm, script);
+    lox_set_print(vm, NULL, NULL);
+    printf("captured %d: %.*s\n", captured.lines, (int)captured.length, captured.text);
+    lox_run(vm, script);
+    lox_release(vm, script);
+
+    lox_free(vm);
+    return 0;
+}
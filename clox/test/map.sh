@@ -0,0 +1,43 @@
+# --workers N --map：输出按输入的顺序排好，和哪个工作线程先做完无关；
+# 退出码取第一个出错的输入的，其余输入照常输出。--workers 离开 --map/--serve 是用法错误。
+# 用法：bash map.sh clox [运行参数...]，由 test/run.sh 调用
+clox=$1
+shift
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# 第 i 个输入有 i 个字符，越靠前的输入要做的事越多，做完的顺序和输入顺序正好相反
+inputs=()
+for i in $(seq 1 24); do
+    printf '%*s' "$i" '' > "$work/in$i.txt"
+    inputs+=("$work/in$i.txt")
+done
+cat > "$work/square.lox" <<'EOF'
+var n = len(input);
+var spin = 0;
+for (var i = 0; i < (25 - n) * 2000; i = i + 1) spin = spin + 1;
+print n * n;
+EOF
+"$clox" "$@" --workers 4 --map "$work/square.lox" "${inputs[@]}"
+echo "status $?"
+
+# 第 3 个输入运行时出错，第 5 个输入不存在：退出码是先出错的那个的
+cat > "$work/fail.lox" <<'EOF'
+if (len(input) == 3) print nil + 1;
+print len(input);
+EOF
+"$clox" "$@" --workers 3 --map "$work/fail.lox" "${inputs[@]:0:4}" "$work/missing.txt" "${inputs[@]:5:2}" 2> "$work/stderr"
+echo "status $?"
+# 两个出错的输入可能在不同线程里同时报错，排序之后再比较
+sed "s|$work/||" "$work/stderr" | LC_ALL=C sort
+"$clox" "$@" --workers 2 --map "$work/fail.lox" "${inputs[@]:4:1}" "$work/missing.txt" 2> "$work/stderr"
+echo "status $?"
+sed "s|$work/||" "$work/stderr"
+
+# 脚本编译不过
+echo 'print ;' > "$work/broken.lox"
+"$clox" "$@" --map "$work/broken.lox" "${inputs[@]:0:2}" 2> /dev/null
+echo "status $?"
+
+"$clox" "$@" --workers 3 "$work/square.lox" 2> /dev/null
+echo "status $?"
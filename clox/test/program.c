@@ -0,0 +1,89 @@
+// 共享程序：lox_program_new 编译一次，lox_new_shared 建出来的几个VM（同一线程里的和不同线程里的）
+// 都能运行它，全局变量和对象各是各的；这些VM也能照常编译运行自己的脚本。
+// test/run.sh 把它和除 main.c 外的所有源码链接在一起运行
+#include <pthread.h>
+#include <stdio.h>
+
+#include "lox.h"
+
+#define THREADS 4
+#define ROUNDS 200
+
+static const char *source =
+    "var count = 0;\n"
+    "class Counter { init(step) { this.step = step; } bump() { count = count + this.step; return count; } }\n"
+    "fun label(name) { return name + \":\" + \"vm\"; }\n";
+
+static LoxProgram *program;
+
+static double number(LoxVM *vm, const char *name)
+{
+    LoxValue value;
+    if (!lox_get_global(vm, name, &value) || value.type != LOX_NUMBER)
+        return -1;
+    return value.as.number;
+}
+
+// 每个线程一个VM，步长各不相同；别的线程的计数漏过来结果就不对
+static void *worker(void *arg)
+{
+    long step = (long)arg + 1;
+    LoxVM *vm = lox_new_shared(program);
+    long bad = 0;
+    if (lox_run_program(vm, program) != LOX_OK)
+        bad++;
+    LoxScript *script = lox_compile(vm, "var c = Counter(step); var last; for (var i = 0; i < 10; i = i + 1) last = c.bump();");
+    lox_set_global(vm, "step", lox_number((double)step));
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        if (lox_run(vm, script) != LOX_OK)
+            bad++;
+    }
+    if (number(vm, "count") != (double)(step * 10 * ROUNDS))
+        bad++;
+    lox_release(vm, script);
+    lox_free(vm);
+    return (void *)bad;
+}
+
+int main(void)
+{
+    printf("compile error: %d\n", lox_program_new("fun (") == NULL);
+    program = lox_program_new(source);
+    if (program == NULL)
+        return 1;
+
+    // 同一线程里的两个VM互不影响
+    LoxVM *first = lox_new_shared(program);
+    LoxVM *second = lox_new_shared(program);
+    printf("run: %d %d\n", lox_run_program(first, program), lox_run_program(second, program));
+    LoxScript *script = lox_compile(first, "Counter(5).bump(); print label(\"first\");");
+    printf("run: %d\n", lox_run(first, script));
+    lox_release(first, script);
+    printf("counts: %g %g\n", number(first, "count"), number(second, "count"));
+    // 再运行一次程序，全局变量回到脚本里的初值
+    lox_run_program(first, program);
+    printf("counts: %g %g\n", number(first, "count"), number(second, "count"));
+
+    // 共享程序里的函数照样可以从宿主调用
+    LoxValue label, name = lox_string("second", 6), result;
+    lox_get_global(second, "label", &label);
+    lox_call(second, label, 1, &name, &result);
+    printf("%.*s\n", result.as.string.length, result.as.string.chars);
+    lox_free(first);
+    lox_free(second);
+
+    pthread_t threads[THREADS];
+    for (long i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    long bad = 0;
+    for (int i = 0; i < THREADS; i++)
+    {
+        void *failures;
+        pthread_join(threads[i], &failures);
+        bad += (long)failures;
+    }
+    printf("threads: %d, failures: %ld\n", THREADS, bad);
+    lox_program_free(program);
+    return 0;
+}
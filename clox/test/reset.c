@@ -0,0 +1,112 @@
+// lox_reset 的隔离：租户改过的基线对象（实例字段、闭包捕获的变量、挂起的纤程）在 reset 之后都要回到基线的样子，
+// 下一个租户看不到上一个租户写进去的东西；租户新起的方法名也不会一直占着。
+// test/run.sh 把它和除 main.c 外的所有源码链接在一起运行
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lox.h"
+#include "vm.h"
+
+static const char *prelude =
+    "class Cfg {}\n"
+    "var cfg = Cfg();\n"
+    "cfg.mode = \"base\";\n"
+    "fun makeCounter() { var n = 0; fun inc() { n = n + 1; return n; } return inc; }\n"
+    "var tick = makeCounter();\n"
+    "fun numbers() { yield(1); yield(2); return 3; }\n"
+    "fun letters() { yield(\"a\"); yield(\"b\"); return \"c\"; }\n"
+    "var fresh = Fiber(numbers);\n"
+    "var started = Fiber(letters);\n"
+    "resume(started);\n";
+
+// 租户A：改掉字段、加一个新字段、让计数器和两个纤程往前走，其中一个走到结束
+static const char *tenantA =
+    "cfg.mode = \"tenant A\";\n"
+    "cfg.secret = \"A's token\";\n"
+    "print cfg.mode;\n"
+    "print tick() + tick();\n"
+    "print resume(started);\n"
+    "print resume(started);\n"
+    "print isDone(started);\n"
+    "print resume(fresh);\n";
+
+static const char *tenantB =
+    "print cfg.mode;\n"
+    "print tick();\n"
+    "print resume(started);\n"
+    "print isDone(started);\n"
+    "print resume(fresh);\n";
+
+static const char *peek = "print cfg.secret;\n";
+
+// 冻结对象链表上最后一个对象（Later 和它的方法）没有可变状态
+static const char *trailing =
+    "var b;\n"
+    "class Base { init() { this.x = 1; } }\n"
+    "b = Base();\n"
+    "class Later { z() {} }\n";
+
+static LoxResult runSource(LoxVM *vm, const char *source)
+{
+    LoxScript *script = lox_compile(vm, source);
+    if (script == NULL)
+        return LOX_COMPILE_ERROR;
+    LoxResult result = lox_run(vm, script);
+    lox_release(vm, script);
+    return result;
+}
+
+// 每个租户定义一个新名字的方法，reset 之后方法名的编号要交还
+static int tenantSelectors(LoxVM *vm)
+{
+    char source[128];
+    for (int i = 0; i < 1000; i++)
+    {
+        snprintf(source, sizeof(source), "class T { method%d() { return %d; } } T().method%d();\n", i, i, i);
+        if (runSource(vm, source) != LOX_OK)
+            return -1;
+        lox_reset(vm);
+    }
+    return vm->selectors.count;
+}
+
+int main(void)
+{
+    // 基线里没有需要保存的对象
+    LoxVM *vm = lox_new();
+    lox_checkpoint(vm);
+    int selectors = vm->selectors.count;
+    printf("empty baseline: %d\n", runSource(vm, "print 1;"));
+    lox_reset(vm);
+    printf("selectors after tenants: %d\n", tenantSelectors(vm) - selectors);
+    lox_free(vm);
+
+    vm = lox_new();
+    if (runSource(vm, trailing) != LOX_OK)
+        return 1;
+    lox_checkpoint(vm);
+    printf("trailing: %d\n", runSource(vm, "b.x = 2; print b.x;"));
+    lox_reset(vm);
+    printf("trailing: %d\n", runSource(vm, "print b.x; print Later().z();"));
+    lox_free(vm);
+
+    vm = lox_new();
+    if (runSource(vm, prelude) != LOX_OK)
+        return 1;
+    lox_checkpoint(vm);
+    for (int round = 0; round < 2; round++)
+    {
+        printf("tenant A: %d\n", runSource(vm, tenantA));
+        lox_reset(vm);
+    }
+    printf("tenant B: %d\n", runSource(vm, tenantB));
+    // 租户A加的字段已经不在了，读它是运行时错误
+    printf("peek: %d\n", runSource(vm, peek));
+    lox_reset(vm);
+    printf("tenant B: %d\n", runSource(vm, tenantB));
+    // 基线里的纤程结束后不 reset 直接释放：它的栈这时只归基线所有
+    lox_reset(vm);
+    printf("tenant A: %d\n", runSource(vm, tenantA));
+    lox_free(vm);
+    return 0;
+}
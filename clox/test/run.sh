@@ -0,0 +1,114 @@
+#!/bin/bash
+# make test：每种配置各编译一份 clox，把 test/ 下的每个脚本都跑一遍，
+# 标准输出加上最后一行 "exit 退出码" 要和 .out 一样，标准错误要和 .err 一样（没有 .err 表示应该为空）。
+# test/ 下的 .c 是通过嵌入接口测试的宿主程序，和这份配置除 main.o 外的目标文件链接后运行，结果按同样的办法比较。
+# test/ 下其余的 .sh 测试命令行模式（--map、--serve）：参数是这份配置的 clox 和运行参数，脚本自己去调用它。
+# 用法：test/run.sh [配置...]，不给时跑全部配置
+cd "$(dirname "$0")/.." || exit 1
+
+ALL="interp jit jit-all lazy union register compressed asan asan-compressed aot"
+CONFIGS=${*:-$ALL}
+CC=${CC:-gcc}
+CFLAGS="-Wall -Wextra -std=c11 -O2 -Wno-unused-parameter"
+LDFLAGS="-lm -pthread"
+
+# 每种配置：要改的 common.h 开关（sed 表达式）、额外的编译选项、运行参数。
+# 调试输出总是关掉；压力GC默认开着，JIT 和 AOT 关掉它只是为了跑得快些
+QUIET='s@^#define DEBUG_PRINT_CODE@// &@; s@^#define DEBUG_TRACE_EXECUTION@// &@'
+NO_STRESS='s@^#define DEBUG_STRESS_GC@// &@'
+configure()
+{
+    SWITCHES=$QUIET
+    EXTRA=""
+    ARGS=""
+    # 压缩引用的对象区域是 mmap 出来的，LeakSanitizer 看不到里面的指针，会把它们引用的内存都当成泄漏
+    LEAKS=1
+    case $1 in
+    interp) ;;
+    jit) SWITCHES="$SWITCHES; $NO_STRESS"; ARGS="--jit" ;;
+    # 阈值为0：每个函数第一次调用就编译，整套脚本都走本地代码
+    jit-all) SWITCHES="$SWITCHES; $NO_STRESS"; EXTRA="-DJIT_HOT_THRESHOLD=0"; ARGS="--jit" ;;
+    lazy) ARGS="--lazy" ;;
+    union) SWITCHES="$SWITCHES; s@^#define NAN_BOXING@// &@" ;;
+    register) SWITCHES="$SWITCHES; s@^// #define REGISTER_VM@#define REGISTER_VM@" ;;
+    compressed) SWITCHES="$SWITCHES; s@^// #define COMPRESSED_REFS@#define COMPRESSED_REFS@" ;;
+    asan) EXTRA="-fsanitize=address,undefined -g" ;;
+    asan-compressed)
+        SWITCHES="$SWITCHES; s@^// #define COMPRESSED_REFS@#define COMPRESSED_REFS@"
+        EXTRA="-fsanitize=address,undefined -g"
+        LEAKS=0 ;;
+    aot) SWITCHES="$SWITCHES; $NO_STRESS" ;;
+    *) echo "unknown configuration '$1' (known: $ALL)" >&2; exit 64 ;;
+    esac
+}
+
+# 编译一份配置到 $DIR：源码复制过去再改开关，目标文件留着给 AOT 链接
+build()
+{
+    rm -rf "$DIR"
+    mkdir -p "$DIR/src"
+    cp ./*.c ./*.h "$DIR/src/"
+    sed -i "$SWITCHES" "$DIR/src/common.h"
+    for source in "$DIR"/src/*.c; do
+        $CC $CFLAGS $EXTRA -c "$source" -o "${source%.c}.o" || return 1
+    done
+    $CC $EXTRA "$DIR"/src/*.o -o "$DIR/clox" $LDFLAGS
+}
+
+# 跑一个脚本，结果写到 $DIR/$name.out 和 .err
+runCase()
+{
+    local script=$1 name=$2
+    if [ "${script%.c}" != "$script" ]; then
+        $CC $CFLAGS $EXTRA -I"$DIR/src" "$script" \
+            $(ls "$DIR"/src/*.o | grep -v '/main\.o$') -o "$DIR/$name.bin" $LDFLAGS || return
+        (cd test && ASAN_OPTIONS=detect_leaks=$LEAKS timeout 120 "../$DIR/$name.bin" > "../$DIR/$name.out" 2> "../$DIR/$name.err"
+         echo "exit $?" >> "../$DIR/$name.out")
+    elif [ "${script%.sh}" != "$script" ]; then
+        (cd test && ASAN_OPTIONS=detect_leaks=$LEAKS timeout 120 bash "$(basename "$script")" "../$DIR/clox" $ARGS > "../$DIR/$name.out" 2> "../$DIR/$name.err"
+         echo "exit $?" >> "../$DIR/$name.out")
+    elif [ "$CONFIG" = aot ]; then
+        # 编译错误时 --emit-c 和直接运行报一样的错、返回一样的退出码
+        if ! "$DIR/clox" --emit-c "$DIR/$name.c" "$script" > "$DIR/$name.out" 2> "$DIR/$name.err"; then
+            echo "exit 65" >> "$DIR/$name.out"
+            return
+        fi
+        $CC $CFLAGS -Wno-unused-label -I"$DIR/src" "$DIR/$name.c" \
+            $(ls "$DIR"/src/*.o | grep -v '/main\.o$') -o "$DIR/$name.bin" $LDFLAGS || return
+        (cd test && timeout 120 "../$DIR/$name.bin" > "../$DIR/$name.out" 2> "../$DIR/$name.err"
+         echo "exit $?" >> "../$DIR/$name.out")
+    else
+        (cd test && ASAN_OPTIONS=detect_leaks=$LEAKS timeout 120 "../$DIR/clox" $ARGS "$(basename "$script")" > "../$DIR/$name.out" 2> "../$DIR/$name.err"
+         echo "exit $?" >> "../$DIR/$name.out")
+    fi
+}
+
+status=0
+for CONFIG in $CONFIGS; do
+    configure "$CONFIG"
+    DIR=build/test/$CONFIG
+    if ! build; then
+        echo "FAIL $CONFIG: build"
+        status=1
+        continue
+    fi
+    failed=0
+    total=0
+    for script in test/*.lox test/*.c test/*.sh; do
+        [ "$script" = test/run.sh ] && continue
+        name=$(basename "${script%.*}")
+        total=$((total + 1))
+        runCase "$script" "$name"
+        expectedErr=test/$name.err
+        [ -f "$expectedErr" ] || expectedErr=/dev/null
+        if ! cmp -s "test/$name.out" "$DIR/$name.out" || ! cmp -s "$expectedErr" "$DIR/$name.err"; then
+            echo "FAIL $CONFIG: $name"
+            diff "test/$name.out" "$DIR/$name.out" | head -5
+            diff "$expectedErr" "$DIR/$name.err" | head -5
+            failed=$((failed + 1))
+        fi
+    done
+    echo "$CONFIG: $((total - failed))/$total passed"
+    [ $failed = 0 ] || status=1
+done
+exit $status
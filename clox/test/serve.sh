@@ -0,0 +1,61 @@
+# --serve：工作进程处理完 --requests 个请求后退出，主进程从初始化好的状态重新 fork 一个，
+# 所以请求里改的全局变量在换了工作进程之后回到初值。回复按 print 的格式写回，字符串原样写回（可以有 NUL）；
+# 处理函数出错时客户端收到空回复，工作进程接着服务。SIGTERM 让主进程收回工作进程、删掉套接字文件后退出。
+# 用法：bash serve.sh clox [运行参数...]，由 test/run.sh 调用
+clox=$1
+shift
+work=$(mktemp -d)
+socket=$work/serve.sock
+server=
+trap '[ -n "$server" ] && kill "$server" 2> /dev/null; rm -rf "$work"' EXIT
+
+# 发一个请求：负载从标准输入读，回复里的 NUL 显示成 \0
+request()
+{
+    perl -MIO::Socket::UNIX -e '
+        my $socket = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "connect: $!\n";
+        local $/;
+        my $payload = <STDIN>;
+        print $socket $payload;
+        $socket->shutdown(1);
+        my $reply = <$socket>;
+        $reply = "" unless defined $reply;
+        $reply =~ s/\0/\\0/g;
+        print "[$reply]\n";' "$socket"
+}
+
+cat > "$work/handler.lox" <<'EOF'
+var served = 0;
+fun handle(request)
+{
+    served = served + 1;
+    if (request == "fail") return nil + 1;
+    if (request == "count") return served;
+    return request + " #" + "x" + request;
+}
+EOF
+"$clox" "$@" --workers 1 --requests 3 --serve "$work/handler.lox" --socket "$socket" 2> "$work/stderr" &
+server=$!
+for i in $(seq 1 100); do
+    [ -S "$socket" ] && break
+    sleep 0.05
+done
+
+# 每个工作进程服务三个请求，served 在第四个请求时重新从 0 开始
+for i in 1 2 3 4 5 6 7; do
+    printf 'count' | request
+done
+printf 'a\0b' | request
+printf 'fail' | request
+printf 'count' | request
+printf '' | request
+
+kill -TERM "$server"
+wait "$server"
+echo "server $?"
+server=
+[ -e "$socket" ] && echo "socket left behind"
+cat "$work/stderr"
+
+"$clox" "$@" --workers 1 --socket "$socket" "$work/handler.lox" 2> /dev/null
+echo "status $?"
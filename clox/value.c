@@ -10,13 +10,13 @@ void initValueArray(ValueArray *array)
   array->capacity = 0;
   array->count = 0;
 }
-void writeValueArray(ValueArray *array, Value value)
+void writeValueArray(VM *vm, ValueArray *array, Value value)
 {
   if (array->capacity < array->count + 1)
   {
     int oldCapacity = array->capacity;
     array->capacity = GROW_CAPACITY(oldCapacity);
-    array->values = GROW_ARRAY(Value, array->values,
+    array->values = GROW_ARRAY(vm, Value, array->values,
                                oldCapacity, array->capacity);
   }
 
@@ -24,58 +24,70 @@ void writeValueArray(ValueArray *array, Value value)
   array->count++;
 }
 
-void freeValueArray(ValueArray *array)
+void freeValueArray(VM *vm, ValueArray *array)
 {
-  FREE_ARRAY(Value, array->values, array->capacity);
+  FREE_ARRAY(vm, Value, array->values, array->capacity);
   initValueArray(array);
 }
-void printValue(Value value)
+// 按 print 语句的格式把值写到 out
+void fprintValue(VM *vm, FILE *out, Value value)
 {
 #ifdef NAN_BOXING
   if (IS_BOOL(value))
   {
-    printf(AS_BOOL(value) ? "true" : "false");
+    fprintf(out, AS_BOOL(value) ? "true" : "false");
   }
   else if (IS_NIL(value))
   {
-    printf("nil");
+    fprintf(out, "nil");
   }
   else if (IS_NUMBER(value))
   {
-    printf("%g", AS_NUMBER(value));
+    fprintf(out, "%g", AS_NUMBER(value));
   }
   else if (IS_OBJ(value))
   {
-    printObject(value);
+    printObject(vm, out, value);
   }
 #else
 
   switch (value.type)
   {
   case VAL_BOOL:
-    printf(AS_BOOL(value) ? "true" : "false");
+    fprintf(out, AS_BOOL(value) ? "true" : "false");
     break;
   case VAL_NIL:
-    printf("nil");
+    fprintf(out, "nil");
     break;
   case VAL_NUMBER:
-    printf("%g", AS_NUMBER(value));
+  case VAL_INT:
+    fprintf(out, "%g", AS_NUMBER(value));
     break;
   case VAL_OBJ:
-    printObject(value);
+    printObject(vm, out, value);
     break;
   }
 #endif
 }
-bool valuesEqual(Value a, Value b)
+void printValue(VM *vm, Value value)
+{
+  fprintValue(vm, stdout, value);
+}
+bool valuesEqual(VM *vm, Value a, Value b)
 {
 #ifdef NAN_BOXING
   if (IS_NUMBER(a) && IS_NUMBER(b))
   {
     return AS_NUMBER(a) == AS_NUMBER(b);
   }
-  return a == b;
+  if (a == b)
+    return true;
+  // 不驻留的长字符串和 rope 可能内容相同但是不同的对象
+  return IS_OBJ(a) && IS_OBJ(b) && textsEqual(vm, a, b);
 #else
+  // 整数和双精度数之间按数值比较，1 和 1.0 相等
+  if (IS_NUMBER(a) && IS_NUMBER(b))
+    return AS_NUMBER(a) == AS_NUMBER(b);
   if (a.type != b.type)
     return false;
   switch (a.type)
@@ -84,10 +96,8 @@ bool valuesEqual(Value a, Value b)
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
     return true;
-  case VAL_NUMBER:
-    return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJ:
-    return AS_OBJ(a) == AS_OBJ(b);
+    return AS_OBJ(a) == AS_OBJ(b) || textsEqual(vm, a, b);
   default:
     return false; // Unreachable.
   }
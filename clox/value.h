@@ -1,5 +1,6 @@
 #ifndef clox_value_h
 #define clox_value_h
+#include <stdio.h>
 #include <string.h>
 #include "common.h"
 // 头文件要“自给自足”且“最小公开”；h文件引入可能导致“污染范围”（因为h文件可能被外部引用）
@@ -11,6 +12,8 @@
 // 添加前向声明
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+// 运行时的所有状态都在 VM 里，分配内存、创建对象的函数都要显式传入它
+typedef struct VM VM;
 
 #ifdef NAN_BOXING
 
@@ -36,14 +39,20 @@ typedef struct ObjString ObjString;
 #define TAG_NIL 1   // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE 3  // 11.
+// 32位整数：在 QNAN 的基础上再置第48位，低32位存放补码。
+// 不带符号位所以不会被当成对象，第48位又和 nil/true/false 区分开
+#define INT_TAG ((uint64_t)(QNAN | 0x0001000000000000))
+#define INT_MASK ((uint64_t)(SIGN_BIT | INT_TAG))
 
 typedef uint64_t Value;
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value) (((value) & INT_MASK) == INT_TAG)
+#define IS_NUMBER(value) isNumber(value)
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
 #define AS_NUMBER(value) valueToNum(value)
 #define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
@@ -51,11 +60,19 @@ typedef uint64_t Value;
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define INT_VAL(i) ((Value)(INT_TAG | (uint32_t)(int32_t)(i)))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
+// 对 Lox 来说整数和双精度数都是 number，只是两种不同的存放方式
+static inline bool isNumber(Value value)
+{
+    return ((value & QNAN) != QNAN) || IS_INT(value);
+}
 static inline double valueToNum(Value value)
 {
+    if (IS_INT(value))
+        return (double)AS_INT(value);
     double num;
     memcpy(&num, &value, sizeof(Value));
     return num;
@@ -73,6 +90,7 @@ typedef enum
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    VAL_INT,
     VAL_OBJ
 } ValueType;
 
@@ -83,36 +101,61 @@ typedef struct
     {
         bool boolean;
         double number;
+        int32_t integer;
         Obj *obj;
     } as;
 } Value;
 // 定义了几个宏来检查 Value 的类型
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
+#define IS_NUMBER(value) isNumber(value)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 // Value 解包并恢复出 C 值
 #define AS_OBJ(value) ((value).as.obj)
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
+#define AS_NUMBER(value) valueToNum(value)
 
 // 将原生 C 值提升为 Value
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
+// 对 Lox 来说整数和双精度数都是 number，只是两种不同的存放方式
+static inline bool isNumber(Value value)
+{
+    return value.type == VAL_NUMBER || value.type == VAL_INT;
+}
+static inline double valueToNum(Value value)
+{
+    return value.type == VAL_INT ? (double)value.as.integer : value.as.number;
+}
+
 #endif
+
+// 整数加减的结果还放得进32位就保持整数，否则提升成双精度。
+// 两个int32的和差在double里是精确的，所以提升前后算出来的数完全一样
+static inline Value int64ToValue(int64_t number)
+{
+    if (number >= INT32_MIN && number <= INT32_MAX)
+        return INT_VAL((int32_t)number);
+    return NUMBER_VAL((double)number);
+}
+
 typedef struct
 {
     int capacity;
     int count;
     Value *values;
 } ValueArray;
-bool valuesEqual(Value a, Value b);
+bool valuesEqual(VM *vm, Value a, Value b);
 void initValueArray(ValueArray *array);
-void writeValueArray(ValueArray *array, Value value);
-void freeValueArray(ValueArray *array);
-void printValue(Value value);
+void writeValueArray(VM *vm, ValueArray *array, Value value);
+void freeValueArray(VM *vm, ValueArray *array);
+void printValue(VM *vm, Value value);
+void fprintValue(VM *vm, FILE *out, Value value);
 #endif
\ No newline at end of file
@@ -1,25 +1,87 @@
+#define _DEFAULT_SOURCE
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "common.h"
 #include <string.h>
 #include <time.h>
+#include "channel.h"
 #include "compiler.h"
+#include "intern.h"
 #include "debug.h"
+#include "jit.h"
+#include "loop.h"
 #include "object.h"
 #include "memory.h"
 #include "vm.h"
 
-VM vm;
-static Value clockNative(int argCount, Value *args)
+static void defineFiberNatives(VM *vm);
+
+static Value clockNative(VM *vm, int argCount, Value *args)
 {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
-static void resetStack()
+// 把正在运行的纤程的状态存回它自己，换上 to 的。切换纤程就是这几次赋值
+static void switchFiber(VM *vm, ObjFiber *to)
+{
+    ObjFiber *from = vm->fiber;
+    from->frameCount = vm->frameCount;
+    from->stackTop = vm->stackTop;
+    from->openUpvaluesTop = vm->openUpvaluesTop;
+    from->entryFrame = vm->entryFrame;
+    vm->fiber = to;
+    vm->frames = to->frames;
+    vm->frameCount = to->frameCount;
+    vm->stack = to->stack;
+    vm->stackTop = to->stackTop;
+    vm->openUpvalues = to->openUpvalues;
+    vm->openUpvaluesTop = to->openUpvaluesTop;
+    vm->entryFrame = to->entryFrame;
+}
+static void resetStack(VM *vm)
 {
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
+    // 出错时整条纤程链都停下来，回到主纤程：出错的纤程和等着它的纤程都不能再恢复了。
+    // spawn 出来的纤程没有恢复者，从它直接回到主纤程
+    while (vm->fiber != &vm->mainFiber)
+    {
+        ObjFiber *fiber = vm->fiber;
+        switchFiber(vm, fiber->caller != NULL ? fiber->caller : &vm->mainFiber);
+        fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        fiber->frameCount = 0;
+        fiber->stackTop = fiber->stack;
+        fiber->openUpvaluesTop = fiber->stack;
+    }
+    // 事件循环里挂起的纤程也不会再恢复了；主纤程可能正挂起在循环里
+    resetLoop(vm);
+    vm->fiber->state = FIBER_RUNNING;
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    // 出错时还没关闭的上值直接丢弃，对应的闭包也不会再运行了
+    for (Value *slot = vm->stack; slot < vm->openUpvaluesTop; slot++)
+        vm->openUpvalues[slot - vm->stack] = NULL;
+    vm->openUpvaluesTop = vm->stack;
 }
-static void runtimeError(const char *format, ...)
+static void printTrace(CallFrame *frames, int frameCount)
+{
+    for (int i = frameCount - 1; i >= 0; i--)
+    {
+        CallFrame *frame = &frames[i];
+        ObjFunction *function = FROM_REF(ObjFunction, frame->closure->function);
+        size_t instruction = frame->ip - function->chunk.code - 1;
+        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        if (function->name == TO_REF(NULL))
+        {
+            fprintf(stderr, "script\n");
+        }
+        else
+        {
+            fprintf(stderr, "%s()\n", FROM_REF(ObjString, function->name)->chars);
+        }
+    }
+}
+static void runtimeError(VM *vm, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -27,100 +89,480 @@ static void runtimeError(const char *format, ...)
     va_end(args);
     fputs("\n", stderr);
 
-    // 打印报错调用栈
-    for (int i = vm.frameCount - 1; i >= 0; i--)
+    // 打印报错调用栈：出错的纤程，再沿着恢复它的纤程一路往外
+    printTrace(vm->frames, vm->frameCount);
+    for (ObjFiber *fiber = vm->fiber->caller; fiber != NULL; fiber = fiber->caller)
+        printTrace(fiber->frames, fiber->frameCount);
+    resetStack(vm);
+}
+
+// 本地函数报错后置位 vm->nativeFailed，callValue 看到后中止调用；报错时栈已经被清空了
+Value nativeError(VM *vm, const char *message)
+{
+    runtimeError(vm, "%s", message);
+    vm->nativeFailed = true;
+    return NIL_VAL;
+}
+static Value sqrtNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]))
+        return nativeError(vm, "Argument must be a number.");
+    return NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+}
+static Value floorNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]))
+        return nativeError(vm, "Argument must be a number.");
+    return NUMBER_VAL(floor(AS_NUMBER(args[0])));
+}
+static Value absNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]))
+        return nativeError(vm, "Argument must be a number.");
+    return NUMBER_VAL(fabs(AS_NUMBER(args[0])));
+}
+static Value minNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1]))
+        return nativeError(vm, "Arguments must be numbers.");
+    // 返回原来的值，整数参数的结果还是整数
+    return AS_NUMBER(args[1]) < AS_NUMBER(args[0]) ? args[1] : args[0];
+}
+static Value maxNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1]))
+        return nativeError(vm, "Arguments must be numbers.");
+    return AS_NUMBER(args[1]) > AS_NUMBER(args[0]) ? args[1] : args[0];
+}
+static Value lenNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_TEXT(args[0]))
+        return nativeError(vm, "Argument must be a string.");
+    return INT_VAL(textLength(AS_OBJ(args[0])));
+}
+
+// 和 intrinsics 表一一对应
+static const NativeFn intrinsicNatives[INTRINSIC_COUNT] = {
+    sqrtNative,
+    floorNative,
+    absNative,
+    minNative,
+    maxNative,
+    lenNative,
+    clockNative,
+};
+
+static void defineNative(VM *vm, const char *name, NativeFn function, int arity)
+{
+    push(vm, OBJ_VAL(internString(vm, name, (int)strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function, arity)));
+    tableSet(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+    pop(vm);
+    pop(vm);
+}
+
+// 内置函数对应的全局变量被重新赋值后，对应的指令改走普通调用
+static void markRebound(VM *vm, ObjString *name)
+{
+    if (name->intrinsic != 0)
+        vm->reboundIntrinsics |= 1u << (name->intrinsic - 1);
+}
+void defineGlobal(VM *vm, const char *name, Value value)
+{
+    push(vm, value);
+    ObjString *string = internString(vm, name, (int)strlen(name));
+    push(vm, OBJ_VAL(string));
+    tableSet(vm, &vm->globals, string, value);
+    markRebound(vm, string);
+    pop(vm);
+    pop(vm);
+}
+void initVM(VM *vm)
+{
+    initSharedVM(vm, NULL);
+}
+void initSharedVM(VM *vm, SharedCode *shared)
+{
+    // 第一次驻留字符串之前就要能查到共享的驻留表
+    vm->shared = shared;
+    vm->internMember = shared == NULL ? NULL : joinInternTable(shared->strings);
+    vm->loop = NULL;
+    vm->selectorBase = shared == NULL ? 0 : shared->owner->selectorBase + shared->owner->selectors.count;
+    // 主纤程用 VM 自带的数组。它不在堆上，永远是已标记的，markObject 碰到它直接返回
+    ObjFiber *main = &vm->mainFiber;
+    main->obj.type = OBJ_FIBER;
+    main->obj.isMarked = true;
+    main->obj.next = TO_REF(NULL);
+    main->state = FIBER_RUNNING;
+    main->caller = NULL;
+    main->frames = vm->mainFrames;
+    main->frameCount = 0;
+    main->stack = vm->mainStack;
+    main->stackTop = vm->mainStack;
+    main->openUpvalues = vm->mainUpvalues;
+    // 上值表只有 openUpvaluesTop 以下的表项有意义，VM 刚 malloc 出来也不用清零
+    main->openUpvaluesTop = vm->mainStack;
+    main->entryFrame = 0;
+    vm->fiber = main;
+    vm->frames = main->frames;
+    vm->stack = main->stack;
+    vm->openUpvalues = main->openUpvalues;
+    vm->openUpvaluesTop = main->openUpvaluesTop;
+    resetStack(vm);
+    vm->objects = NULL;
+    vm->frozenObjects = NULL;
+    vm->grayCount = 0;
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->jitEnabled = false;
+    vm->lazyCompile = false;
+    vm->nativeFailed = false;
+    vm->parser = NULL;
+    vm->entryFrame = 0;
+    vm->printFn = NULL;
+    vm->printData = NULL;
+    initValueArray(&vm->handles);
+    initTable(&vm->baseGlobals);
+    vm->baseline = NULL;
+    vm->baselineCount = 0;
+    initTable(&vm->globals);
+    initTable(&vm->strings);
+    initValueArray(&vm->selectors);
+    vm->initString = NULL;
+    vm->initString = internString(vm, "init", 4);
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+    vm->instructionCount = 0;
+#endif
+    // 添加本地函数；名字字符串记下自己是第几个内置函数，编译器据此生成专用指令
+    vm->reboundIntrinsics = 0;
+    for (int i = 0; i < INTRINSIC_COUNT; i++)
     {
-        CallFrame *frame = &vm.frames[i];
-        ObjFunction *function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
-        if (function->name == NULL)
+        defineNative(vm, intrinsics[i].name, intrinsicNatives[i], intrinsics[i].arity);
+        // 共享代码里的同名字符串已经标记过了，不能再写
+        ObjString *name = internString(vm, intrinsics[i].name, (int)strlen(intrinsics[i].name));
+        if (name->intrinsic == 0)
+            name->intrinsic = (uint8_t)(i + 1);
+    }
+    defineChannelNatives(vm);
+    defineFiberNatives(vm);
+    defineLoopNatives(vm);
+    tableAddAll(vm, &vm->globals, &vm->baseGlobals);
+    vm->baseRebound = vm->reboundIntrinsics;
+    vm->baseSelectors = vm->selectors.count;
+}
+
+static void freeBaseline(VM *vm);
+
+void freeVM(VM *vm)
+{
+    freeTable(vm, &vm->globals);
+    freeTable(vm, &vm->baseGlobals);
+    freeBaseline(vm);
+    freeTable(vm, &vm->strings);
+    freeValueArray(vm, &vm->selectors);
+    freeValueArray(vm, &vm->handles);
+    vm->initString = NULL;
+    freeLoop(vm);
+    freeObjects(vm);
+    if (vm->internMember != NULL)
+        leaveInternTable(vm->shared->strings, vm->internMember);
+}
+
+// 挂起的纤程存下来的字节数：栈里用到的值、打开的上值表和调用帧
+static size_t savedFiberBytes(BaselineObject *saved)
+{
+    return sizeof(Value) * saved->as.fiber.stackCount + sizeof(ObjUpvalue *) * saved->as.fiber.upvalueCount +
+           sizeof(CallFrame) * saved->as.fiber.frameCount;
+}
+
+// 纤程的栈、上值表和调用帧在同一块内存里，见 newFiber
+static void attachFiberBlock(ObjFiber *fiber, char *block)
+{
+    fiber->stack = (Value *)block;
+    fiber->openUpvalues = (ObjUpvalue **)(fiber->stack + STACK_MAX);
+    fiber->frames = (CallFrame *)(fiber->openUpvalues + STACK_MAX);
+}
+
+static void freeBaseline(VM *vm)
+{
+    for (int i = 0; i < vm->baselineCount; i++)
+    {
+        BaselineObject *saved = &vm->baseline[i];
+        if (saved->object->type == OBJ_INSTANCE)
         {
-            fprintf(stderr, "script\n");
+            freeTable(vm, &saved->as.fields);
+        }
+        else if (saved->object->type == OBJ_FIBER)
+        {
+            FREE_ARRAY(vm, char, saved->as.fiber.saved, savedFiberBytes(saved));
+            // 基线之后结束了的纤程已经不再引用它的栈
+            if (((ObjFiber *)saved->object)->stack == NULL)
+                FREE_ARRAY(vm, char, saved->as.fiber.block, FIBER_STACK_BYTES);
+        }
+    }
+    FREE_ARRAY(vm, BaselineObject, vm->baseline, vm->baselineCount);
+    vm->baseline = NULL;
+    vm->baselineCount = 0;
+}
+
+// 冻结对象里会在基线之后被改写的：实例、上值和还没结束的纤程
+static bool hasMutableState(Obj *object)
+{
+    return object->type == OBJ_INSTANCE || object->type == OBJ_UPVALUE ||
+           (object->type == OBJ_FIBER && ((ObjFiber *)object)->stack != NULL);
+}
+
+// 记下冻结对象里可变的部分。刚冻结完，它们引用的对象也都是冻结的，副本不需要作为GC根
+static void saveBaseline(VM *vm)
+{
+    freeBaseline(vm);
+    int count = 0;
+    for (Obj *object = vm->frozenObjects; object != NULL; object = FROM_REF(Obj, object->next))
+    {
+        if (hasMutableState(object))
+            count++;
+    }
+    if (count == 0)
+        return;
+    BaselineObject *baseline = ALLOCATE(vm, BaselineObject, count);
+    int saved = 0;
+    for (Obj *object = vm->frozenObjects; object != NULL; object = FROM_REF(Obj, object->next))
+    {
+        if (!hasMutableState(object))
+            continue;
+        BaselineObject *entry = &baseline[saved++];
+        entry->object = object;
+        if (object->type == OBJ_INSTANCE)
+        {
+            initTable(&entry->as.fields);
+            tableAddAll(vm, &((ObjInstance *)object)->fields, &entry->as.fields);
+        }
+        else if (object->type == OBJ_UPVALUE)
+        {
+            entry->as.upvalue.location = ((ObjUpvalue *)object)->location;
+            entry->as.upvalue.closed = ((ObjUpvalue *)object)->closed;
         }
         else
         {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            ObjFiber *fiber = (ObjFiber *)object;
+            entry->as.fiber.state = fiber->state;
+            entry->as.fiber.frameCount = fiber->frameCount;
+            entry->as.fiber.entryFrame = fiber->entryFrame;
+            entry->as.fiber.stackCount = (int)(fiber->stackTop - fiber->stack);
+            entry->as.fiber.upvalueCount = (int)(fiber->openUpvaluesTop - fiber->stack);
+            entry->as.fiber.block = (char *)fiber->stack;
+            char *copy = ALLOCATE(vm, char, savedFiberBytes(entry));
+            size_t values = sizeof(Value) * entry->as.fiber.stackCount;
+            size_t upvalues = sizeof(ObjUpvalue *) * entry->as.fiber.upvalueCount;
+            memcpy(copy, fiber->stack, values);
+            memcpy(copy + values, fiber->openUpvalues, upvalues);
+            memcpy(copy + values + upvalues, fiber->frames, sizeof(CallFrame) * fiber->frameCount);
+            entry->as.fiber.saved = copy;
         }
     }
-    resetStack();
+    vm->baseline = baseline;
+    vm->baselineCount = count;
 }
 
-static void defineNative(const char *name, NativeFn function)
+// 把基线对象写回 checkpointVM 时的状态。字段表清空再填回去：键可能被删过，也可能多出了新键
+static void restoreBaseline(VM *vm)
 {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+    for (int i = 0; i < vm->baselineCount; i++)
+    {
+        BaselineObject *saved = &vm->baseline[i];
+        switch (saved->object->type)
+        {
+        case OBJ_INSTANCE:
+        {
+            Table *fields = &((ObjInstance *)saved->object)->fields;
+            for (int j = 0; j < fields->capacity; j++)
+            {
+                if (fields->entries[j].key != NULL)
+                    tableDelete(fields, fields->entries[j].key);
+            }
+            tableAddAll(vm, &saved->as.fields, fields);
+            break;
+        }
+        case OBJ_UPVALUE:
+        {
+            ObjUpvalue *upvalue = (ObjUpvalue *)saved->object;
+            upvalue->location = saved->as.upvalue.location;
+            upvalue->closed = saved->as.upvalue.closed;
+            break;
+        }
+        case OBJ_FIBER:
+        {
+            ObjFiber *fiber = (ObjFiber *)saved->object;
+            attachFiberBlock(fiber, saved->as.fiber.block);
+            size_t values = sizeof(Value) * saved->as.fiber.stackCount;
+            size_t upvalues = sizeof(ObjUpvalue *) * saved->as.fiber.upvalueCount;
+            memcpy(fiber->stack, saved->as.fiber.saved, values);
+            memcpy(fiber->openUpvalues, saved->as.fiber.saved + values, upvalues);
+            memcpy(fiber->frames, saved->as.fiber.saved + values + upvalues,
+                   sizeof(CallFrame) * saved->as.fiber.frameCount);
+            fiber->stackTop = fiber->stack + saved->as.fiber.stackCount;
+            fiber->openUpvaluesTop = fiber->stack + saved->as.fiber.upvalueCount;
+            fiber->frameCount = saved->as.fiber.frameCount;
+            fiber->entryFrame = saved->as.fiber.entryFrame;
+            fiber->state = saved->as.fiber.state;
+            fiber->caller = NULL;
+            break;
+        }
+        default:
+            break;
+        }
+    }
 }
-void initVM()
+
+void checkpointVM(VM *vm)
+{
+    // 全局变量引用的对象都冻结了，基线表不再拉住任何会被回收的东西
+    freezeHeap(vm, false);
+    freeTable(vm, &vm->baseGlobals);
+    initTable(&vm->baseGlobals);
+    tableAddAll(vm, &vm->globals, &vm->baseGlobals);
+    vm->baseRebound = vm->reboundIntrinsics;
+    vm->baseSelectors = vm->selectors.count;
+    saveBaseline(vm);
+}
+
+void resetVM(VM *vm)
 {
-    resetStack();
-    vm.objects = NULL;
-    vm.grayCount = 0;
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
-    initTable(&vm.globals);
-    initTable(&vm.strings);
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
-    // 添加本地函数
-    defineNative("clock", clockNative);
+    resetStack(vm);
+    freeLoop(vm);
+    vm->nativeFailed = false;
+    vm->entryFrame = 0;
+    // 回收之外只有冻结的对象是已标记的：没标记的句柄是基线之后编译的脚本
+    ValueArray *handles = &vm->handles;
+    for (int i = handles->count - 1; i >= 0; i--)
+    {
+        if (!AS_OBJ(handles->values[i])->isMarked)
+            handles->values[i] = handles->values[--handles->count];
+    }
+    freeTable(vm, &vm->globals);
+    initTable(&vm->globals);
+    tableAddAll(vm, &vm->baseGlobals, &vm->globals);
+    vm->reboundIntrinsics = vm->baseRebound;
+    // 基线之后编号的方法名：用到它们的类都在基线之后，马上就被回收了，名字交还编号，也不再被 selectors 拉住
+    for (int i = vm->baseSelectors; i < vm->selectors.count; i++)
+        AS_STRING(vm->selectors.values[i])->selector = -1;
+    vm->selectors.count = vm->baseSelectors;
+    restoreBaseline(vm);
+    // 冻结的对象只读地扫一遍，不会被清除；释放的只有基线之后分配、现在又够不着的对象
+    collectGarbage(vm);
 }
 
-void freeVM()
+SharedCode *compileShared(const char *source, bool jit)
 {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    vm.initString = NULL;
-    freeObjects();
+    VM *owner = (VM *)malloc(sizeof(VM));
+    if (owner == NULL)
+        return NULL;
+    initVM(owner);
+    ObjFunction *script = compile(owner, source);
+    if (script == NULL)
+    {
+        freeVM(owner);
+        free(owner);
+        return NULL;
+    }
+    push(owner, OBJ_VAL(script));
+    // 任何驻留的名字都可能在别的VM里被用作方法名，冻结之后就不能再给它编号了
+    for (int i = 0; i < owner->strings.capacity; i++)
+    {
+        ObjString *name = owner->strings.entries[i].key;
+        if (name != NULL && name->selector == -1)
+        {
+            push(owner, OBJ_VAL(name));
+            methodSelector(owner, name);
+            pop(owner);
+        }
+    }
+    for (Obj *object = owner->objects; object != NULL; object = FROM_REF(Obj, object->next))
+    {
+        if (jit && object->type == OBJ_FUNCTION && ((ObjFunction *)object)->jitCode == NULL)
+            jitCompile((ObjFunction *)object);
+        freezeObject(object);
+    }
+    pop(owner);
+
+    SharedCode *shared = (SharedCode *)malloc(sizeof(SharedCode));
+    if (shared == NULL)
+    {
+        freeVM(owner);
+        free(owner);
+        return NULL;
+    }
+    shared->owner = owner;
+    shared->script = script;
+    shared->strings = newInternTable(owner->selectorBase + owner->selectors.count);
+    return shared;
 }
-void push(Value value)
+
+void freeShared(SharedCode *shared)
 {
-    *vm.stackTop = value;
+    freeInternTable(shared->strings);
+    freeVM(shared->owner);
+    free(shared->owner);
+    free(shared);
+}
+void push(VM *vm, Value value)
+{
+    *vm->stackTop = value;
     //  指向下一个空位置
-    vm.stackTop++;
+    vm->stackTop++;
 }
-Value pop()
+Value pop(VM *vm)
 {
-    vm.stackTop--;
-    return *vm.stackTop;
+    vm->stackTop--;
+    return *vm->stackTop;
 }
-static Value peek(int distance)
+static Value peek(VM *vm, int distance)
 {
     // 在 C 里，指针就是数组的通用接口，[] 只是 *(ptr + offset) 的“甜语法”，负数、正数都能用，只要别越界。
     // int a[] = {1, 2, 3};
     // int *q = a;
     // *(q + 1) 等价于 q[1]
-    return vm.stackTop[-1 - distance];
+    return vm->stackTop[-1 - distance];
 }
 
 // 切换函数执行CallFrames上下文
-static bool call(ObjClosure *closure, int argCount)
+static bool call(VM *vm, ObjClosure *closure, int argCount)
 {
     // 函数参数个数拦截校验
-    if (argCount != closure->function->arity)
+    if (argCount != FROM_REF(ObjFunction, closure->function)->arity)
     {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        runtimeError(vm, "Expected %d arguments but got %d.", FROM_REF(ObjFunction, closure->function)->arity, argCount);
         return false;
     }
     // CallFrame数组具有固定的大小，我们需要确保一个深的调用链不会溢
-    if (vm.frameCount == FRAMES_MAX)
+    if (vm->frameCount == FRAMES_MAX)
+    {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    ObjFunction *function = FROM_REF(ObjFunction, closure->function);
+    // 延迟编译模式下第一次调用时才编译函数体
+    if (function->lazy != NULL && !compileLazy(vm, function))
     {
-        runtimeError("Stack overflow.");
+        runtimeError(vm, "Could not compile function body.");
         return false;
     }
-    CallFrame *frame = &vm.frames[vm.frameCount++];
+    // 每次调用都给函数加热度，足够热时交给JIT编译
+    if (vm->jitEnabled && function->jitCode == NULL && function->hotness >= 0 &&
+        ++function->hotness > JIT_HOT_THRESHOLD)
+    {
+        jitCompile(function);
+    }
+    CallFrame *frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->ip = FROM_REF(ObjFunction, closure->function)->chunk.code;
+    frame->slots = vm->stackTop - argCount - 1;
     return true;
 }
 
-static bool callValue(Value callee, int argCount)
+static bool callValue(VM *vm, Value callee, int argCount)
 {
     if (IS_OBJ(callee))
     {
@@ -130,67 +572,224 @@ static bool callValue(Value callee, int argCount)
         {
             ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
             // 当某个方法被调用时，栈顶包含所有的参数，然后在这些参数下面是被调用方法的闭包。这就是新的CallFrame中槽0所在的位置
-            vm.stackTop[-argCount - 1] = bound->receiver;
-            return call(bound->method, argCount);
+            vm->stackTop[-argCount - 1] = bound->receiver;
+            return call(vm, FROM_REF(ObjClosure, bound->method), argCount);
         }
         case OBJ_CLASS:
         {
             ObjClass *klass = AS_CLASS(callee);
-            vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+            vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
 
-            Value initializer;
-            // 在类中寻找init()方法。如果找到了，就对其发起调用
+            // 类缓存了自己的init()方法。如果有，就对其发起调用
             // init()方法的新CallFrame共享了这个栈窗口
-            if (tableGet(&klass->methods, vm.initString, &initializer))
+            if (!IS_NIL(klass->initializer))
             {
-                return call(AS_CLOSURE(initializer), argCount);
+                return call(vm, AS_CLOSURE(klass->initializer), argCount);
             }
             else if (argCount != 0)
             {
                 // 如果没有init()方法，那么在创建实例时向类传递参数就没有意义了。我们将其当作一个错误
-                runtimeError("Expected 0 arguments but got %d.", argCount);
+                runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
                 return false;
             }
             return true;
         }
         case OBJ_CLOSURE:
-            return call(AS_CLOSURE(callee), argCount);
+            return call(vm, AS_CLOSURE(callee), argCount);
         case OBJ_NATIVE:
         {
             // 如果被调用的对象是一个本地函数，我们就会立即调用C函数。
             // 没有必要使用CallFrames或其它任何东西。
             // 我们只需要交给C语言，得到结果，然后把结果塞回栈中。这使得本地函数的运行速度能够尽可能快
-            NativeFn native = AS_NATIVE(callee);
-            Value result = native(argCount, vm.stackTop - argCount);
-            vm.stackTop -= argCount + 1;
-            push(result);
+            ObjNative *native = (ObjNative *)AS_OBJ(callee);
+            if (native->arity >= 0 && argCount != native->arity)
+            {
+                runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+                return false;
+            }
+            Value *args = vm->stackTop - argCount;
+            Value result = native->function(vm, argCount, args);
+            // 正常返回时参数还在栈顶。出错时栈已经被清空；切换了纤程时结果已经交给了要运行的纤程
+            if (vm->stackTop != args + argCount)
+            {
+                if (!vm->nativeFailed)
+                    return true;
+                vm->nativeFailed = false;
+                return false;
+            }
+            vm->stackTop = args - 1;
+            push(vm, result);
             return true;
         }
         default:
             break; // Non-callable object type.
         }
     }
-    runtimeError("Can only call functions and classes.");
+    runtimeError(vm, "Can only call functions and classes.");
+    return false;
+}
+
+// 内置函数指令：全局变量还是原来的本地函数且参数个数对得上时直接算，
+// 否则把全局变量的当前值插到参数下面，按普通调用处理
+static bool runIntrinsic(VM *vm, int index, int argCount)
+{
+    if (argCount == intrinsics[index].arity && !(vm->reboundIntrinsics & (1u << index)))
+    {
+        Value *args = vm->stackTop - argCount;
+        Value result = intrinsicNatives[index](vm, argCount, args);
+        if (vm->nativeFailed)
+        {
+            vm->nativeFailed = false;
+            return false;
+        }
+        vm->stackTop = args;
+        push(vm, result);
+        return true;
+    }
+    const Intrinsic *intrinsic = &intrinsics[index];
+    ObjString *name = internString(vm, intrinsic->name, (int)strlen(intrinsic->name));
+    Value callee;
+    if (!tableGet(&vm->globals, name, &callee))
+    {
+        runtimeError(vm, "Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    Value *args = vm->stackTop - argCount;
+    memmove(args + 1, args, sizeof(Value) * argCount);
+    *args = callee;
+    vm->stackTop++;
+    return callValue(vm, callee, argCount);
+}
+
+// 新增字段时顺便让类记住实例的字段数，之后构造的实例一开始就预留好
+static void setField(VM *vm, ObjInstance *instance, ObjString *name, Value value)
+{
+    if (tableSet(vm, &instance->fields, name, value))
+    {
+        ObjClass *klass = FROM_REF(ObjClass, instance->klass);
+        if (instance->fields.count > klass->fieldCount && instance->fields.count <= MAX_FIELD_HINT)
+            klass->fieldCount = instance->fields.count;
+    }
+}
+
+// 被 tagAccessor 标记过的方法直接在接收者上完成，结果替换掉接收者和参数，不建立调用帧。
+// 可能出错的情况（参数个数不对、字段不存在、调用栈已满）返回false，交给 call() 按原样执行和报错
+static bool runAccessor(VM *vm, ObjFunction *function, int argCount)
+{
+    Value receiver = vm->stackTop[-argCount - 1];
+    if (argCount != function->arity || vm->frameCount == FRAMES_MAX || !IS_INSTANCE(receiver))
+        return false;
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    Value result = NIL_VAL;
+    switch (function->accessor)
+    {
+    case ACCESSOR_GETTER:
+        if (!tableGet(&instance->fields, AS_STRING(function->accessorValue), &result))
+            return false;
+        break;
+    case ACCESSOR_SETTER:
+        setField(vm, instance, AS_STRING(function->accessorValue), peek(vm, 0));
+        break;
+    case ACCESSOR_CONSTANT:
+        result = function->accessorValue;
+        break;
+    default:
+        return false;
+    }
+    vm->stackTop -= argCount + 1;
+    push(vm, result);
+    return true;
+}
+
+// 方法窗口的跨度超过已定义方法数的两倍再加这么多时，改用散列表
+#define METHOD_WINDOW_SLACK 8
+
+// 稀疏的方法表里选择子的起始槽。选择子是连续编号的小整数，乘一个奇数再取高位，
+// 步长规整的一组编号（比如每个类各起一批名字）也能散开
+static inline int methodSlot(int selector, int capacity)
+{
+    return (int)(((uint32_t)selector * 0x9e3779b1u) >> 16) & (capacity - 1);
+}
+
+// 稀疏的方法表：线性探测到选择子或者空槽为止
+static bool findHashedMethod(ObjClass *klass, int selector, Value *method)
+{
+    int mask = klass->methodCount - 1;
+    for (int index = methodSlot(selector, klass->methodCount);; index = (index + 1) & mask)
+    {
+        if (klass->methodKeys[index] == selector)
+        {
+            *method = klass->methods[index];
+            return true;
+        }
+        if (klass->methodKeys[index] == -1)
+            return false;
+    }
+}
+
+// 按选择子查类自己的方法数组，窗口时只是一次区间判断和数组下标
+static inline bool findOwnMethod(ObjClass *klass, int selector, Value *method)
+{
+    if (klass->methodKeys != NULL)
+        return findHashedMethod(klass, selector, method);
+    unsigned index = (unsigned)(selector - klass->methodBase);
+    if (index < (unsigned)klass->methodCount && !IS_NIL(klass->methods[index]))
+    {
+        *method = klass->methods[index];
+        return true;
+    }
+    return false;
+}
+
+// 先查本类，再查继承缓存，都没有时沿父类链逐级查找并记进缓存
+static bool findMethod(ObjClass *klass, ObjString *name, Value *method)
+{
+    int selector = name->selector;
+    // 从没用作方法名的名字不可能有方法
+    if (selector == -1)
+        return false;
+    if (findOwnMethod(klass, selector, method))
+        return true;
+    int slot = selector & (INHERITED_CACHE_SIZE - 1);
+    if (klass->inheritedSelectors[slot] == selector)
+    {
+        *method = klass->inheritedMethods[slot];
+        return true;
+    }
+    for (ObjClass *super = FROM_REF(ObjClass, klass->superclass); super != NULL;
+         super = FROM_REF(ObjClass, super->superclass))
+    {
+        if (findOwnMethod(super, selector, method))
+        {
+            klass->inheritedSelectors[slot] = selector;
+            klass->inheritedMethods[slot] = *method;
+            return true;
+        }
+    }
     return false;
 }
 
-static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount)
+static bool invokeFromClass(VM *vm, ObjClass *klass, ObjString *name, int argCount)
 {
     Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    if (!findMethod(klass, name, &method))
     {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    ObjClosure *closure = AS_CLOSURE(method);
+    ObjFunction *function = FROM_REF(ObjFunction, closure->function);
+    if (function->accessor != ACCESSOR_NONE && runAccessor(vm, function, argCount))
+        return true;
+    return call(vm, closure, argCount);
 }
 
-static bool invoke(ObjString *name, int argCount)
+static bool invoke(VM *vm, ObjString *name, int argCount)
 {
-    Value receiver = peek(argCount);
+    Value receiver = peek(vm, argCount);
     if (!IS_INSTANCE(receiver))
     {
-        runtimeError("Only instances have methods.");
+        runtimeError(vm, "Only instances have methods.");
         return false;
     }
     ObjInstance *instance = AS_INSTANCE(receiver);
@@ -200,83 +799,78 @@ static bool invoke(ObjString *name, int argCount)
     Value value;
     if (tableGet(&instance->fields, name, &value))
     {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+        vm->stackTop[-argCount - 1] = value;
+        return callValue(vm, value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    return invokeFromClass(vm, FROM_REF(ObjClass, instance->klass), name, argCount);
 }
 
-static bool bindMethod(ObjClass *klass, ObjString *name)
+static bool bindMethod(VM *vm, ObjClass *klass, ObjString *name)
 {
     Value method;
     // 我们在类的方法表中查找具有指定名称的方法。如果我们没有找到，我们就报告一个运行时错误并退出。否则，
-    if (!tableGet(&klass->methods, name, &method))
+    if (!findMethod(klass, name, &method))
     {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
     // 我们获取该方法，并将其包装为一个新的ObjBoundMethod。我们从栈顶获得接收器。
-    ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-    pop();
+    ObjBoundMethod *bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+    pop(vm);
     // 最后，我们弹出实例，并将这个已绑定方法替换到栈顶
-    push(OBJ_VAL(bound));
+    push(vm, OBJ_VAL(bound));
     return true;
 }
 
-static ObjUpvalue *captureUpvalue(Value *local)
+static ObjUpvalue *captureUpvalue(VM *vm, Value *local)
 {
-    ObjUpvalue *prevUpvalue = NULL;
-    ObjUpvalue *upvalue = vm.openUpvalues;
-    // 我们从列表的头部开始，
-    // 我们有三个原因可以退出循环：
-    // 1.我们停止时的局部变量槽是我们要找的槽。我在找到了一个现有的上值捕获了这个变量，因此我们重用这个上值
-    // 2.我们找不到需要搜索的上值了。当upvalue为NULL时，这意味着列表中每个开放上值都指向位于我们要找的槽之上的局部变量，或者（更可能是）上值列表是空的。无论怎样，我们都没有找到对应该槽的上值
-    // 3.我们找到了一个上值，其局部变量槽低于我们正查找的槽位。因为列表是有序的，这意味着我们已经超过了正在关闭的槽，因此肯定没有对应该槽的已有上值。
-    while (upvalue != NULL && upvalue->location > local)
-    {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
-    }
+    // 每个栈槽最多只有一个打开的上值，按槽号直接找到它。
+    // VM现在可以确保每个指定的局部变量槽都只有一个ObjUpvalue。如果两个闭包捕获了相同的变量，它们会得到相同的上值
+    if (local < vm->openUpvaluesTop && vm->openUpvalues[local - vm->stack] != NULL)
+        return vm->openUpvalues[local - vm->stack];
 
-    if (upvalue != NULL && upvalue->location == local)
-    {
-        return upvalue;
-    }
+    ObjUpvalue *upvalue = newUpvalue(vm, local);
+    if (vm->fiber != &vm->mainFiber)
+        upvalue->closed = OBJ_VAL(vm->fiber);
+    // openUpvaluesTop 以上的表项是没用过的内存，抬高之前先清空
+    for (Value *slot = vm->openUpvaluesTop; slot < local; slot++)
+        vm->openUpvalues[slot - vm->stack] = NULL;
+    vm->openUpvalues[local - vm->stack] = upvalue;
+    if (local >= vm->openUpvaluesTop)
+        vm->openUpvaluesTop = local + 1;
+    return upvalue;
+}
 
-    ObjUpvalue *createdUpvalue = newUpvalue(local);
-    // 只需要添加代码将上值插入到列表中。我们退出列表遍历的原因，要么是到达了列表末尾，要么是停在了第一个栈槽低于待查找槽位的上值
-    createdUpvalue->next = upvalue;
-    if (prevUpvalue == NULL)
-    {
-        vm.openUpvalues = createdUpvalue;
-    }
-    else
-    {
-        prevUpvalue->next = createdUpvalue;
-    }
-    // VM现在可以确保每个指定的局部变量槽都只有一个ObjUpvalue。如果两个闭包捕获了相同的变量，它们会得到相同的上值
-    return createdUpvalue;
+// OP_CLOSURE 的一对操作数对应的上值：复制外层闭包的上值、直接复制局部变量的值，或者捕获局部变量的栈槽
+static Value captureOperand(VM *vm, CallFrame *frame, uint8_t flags, uint8_t index)
+{
+    if (!(flags & UPVALUE_LOCAL))
+        return frame->closure->upvalues[index];
+    if (flags & UPVALUE_BY_VALUE)
+        return frame->slots[index];
+    return OBJ_VAL(captureUpvalue(vm, frame->slots + index));
 }
 
 // closeUpvalues 只干一件事儿：把“还指向栈、且地址 ≥ last 这一级”的所有 open upvalue 节点，一次性搬离栈、永久落户到堆。
-static void closeUpvalues(Value *last)
+static void closeUpvalues(VM *vm, Value *last)
 {
     // 1、last 是即将消失的那一段栈的“起始地址
-    // 2、链表按 location 降序排列，头插法 → 越靠头的节点，location 值越大。
-    // 3、从链表头开始，只要节点还指向 ≥ last 的栈地址，就说明它马上会变成悬空指针，必须处理。
-    // 4、因为降序，一旦遇到 < last 的节点，后面全安全，可立即结束循环。
-    // 5、取出当前头节点（location 最大）。
-    // 6、把栈上的值拷贝到堆里的 closed 字段——“搬家”第一步。
-    // 7、把 location 指针改指向自己的 closed 字段——从此脱离栈，后续读写都走堆。
-    // 8、把头节点摘掉，继续处理下一个可能也 ≥ last 的节点。
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last)
-    {
-        ObjUpvalue *upvalue = vm.openUpvalues;
+    // 2、openUpvaluesTop 以上没有打开的上值，大多数函数返回时一次比较就结束了。
+    // 3、否则逐个检查 [last, openUpvaluesTop) 的栈槽，它们都在即将消失的那几帧里。
+    // 4、把栈上的值拷贝到堆里的 closed 字段——“搬家”第一步。
+    // 5、把 location 指针改指向自己的 closed 字段——从此脱离栈，后续读写都走堆。
+    for (Value *slot = last; slot < vm->openUpvaluesTop; slot++)
+    {
+        ObjUpvalue *upvalue = vm->openUpvalues[slot - vm->stack];
+        if (upvalue == NULL)
+            continue;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        vm->openUpvalues[slot - vm->stack] = NULL;
     }
+    if (last < vm->openUpvaluesTop)
+        vm->openUpvaluesTop = last;
 }
 // 场景1：遇到 } 结束任意局部作用域（if / while / for / block）。
 // 只关当前栈顶那一个 slot（stackTop - 1），保证刚死亡的局部变量立即从 open 链表移除，不干扰后续代码。
@@ -297,43 +891,391 @@ static void closeUpvalues(Value *last)
 // 函数返回时整帧销毁，如果不把 a 也搬堆，闭包 g 就悬空。
 // 因此 OP_RETURN 必须兜底批量关——从 frame->slots 到 stackTop 之间所有仍 open 的 upvalue 一次全搬走，保证帧 pop 后没有遗留指针指向废栈
 
-static void defineMethod(ObjString *name)
+// 纤程。resume/yield/transfer 都是普通的本地函数：把结果压到接下来要运行的纤程的栈上、换掉 VM 里的栈指针就返回。
+// 解释器和本地代码看到栈顶帧变了，就从新纤程的栈顶帧接着执行，C 栈不会因为切换纤程而变深
+
+// 第一次恢复时调用栈底的函数（有参数时 value 就是参数），之后 value 是纤程里那次 yield() 的返回值
+bool enterFiber(VM *vm, ObjFiber *fiber, Value value)
+{
+    switchFiber(vm, fiber);
+    fiber->state = FIBER_RUNNING;
+    if (vm->frameCount > 0)
+    {
+        push(vm, value);
+        return true;
+    }
+    ObjClosure *closure = AS_CLOSURE(vm->stack[0]);
+    int arity = FROM_REF(ObjFunction, closure->function)->arity;
+    if (arity == 1)
+        push(vm, value);
+    return call(vm, closure, arity);
+}
+
+static bool checkResumable(VM *vm, ObjFiber *fiber)
+{
+    if (fiber->state == FIBER_RUNNING)
+    {
+        nativeError(vm, "Cannot resume a running fiber.");
+        return false;
+    }
+    if (fiber->state == FIBER_DONE)
+    {
+        nativeError(vm, "Cannot resume a finished fiber.");
+        return false;
+    }
+    if (fiber->state == FIBER_WAITING)
+    {
+        nativeError(vm, "Cannot resume a fiber waiting on the event loop.");
+        return false;
+    }
+    return true;
+}
+
+// 纤程的函数返回了：返回值交给恢复它的纤程。spawn 出来的纤程没有恢复者，返回值丢掉，换事件循环里下一个能运行的纤程。
+// 栈再也用不到了，先释放（基线里的纤程除外），纤程对象留给GC
+static bool finishFiber(VM *vm)
+{
+    Value result = pop(vm);
+    ObjFiber *fiber = vm->fiber;
+    ObjFiber *caller = fiber->caller;
+    fiber->state = FIBER_DONE;
+    fiber->caller = NULL;
+    bool ok = true;
+    if (caller != NULL)
+    {
+        switchFiber(vm, caller);
+        push(vm, result);
+    }
+    else
+    {
+        Value value;
+        if (!nextReadyFiber(vm, &caller, &value))
+        {
+            runtimeError(vm, "Deadlock: every fiber is waiting.");
+            return false;
+        }
+        ok = enterFiber(vm, caller, value);
+    }
+    // 回收之外只有冻结的对象是已标记的：基线里的纤程的栈归基线所有，resetVM 还要写回去
+    if (!fiber->obj.isMarked)
+        FREE_ARRAY(vm, char, fiber->stack, FIBER_STACK_BYTES);
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->openUpvalues = NULL;
+    fiber->openUpvaluesTop = NULL;
+    return ok;
+}
+
+// Fiber(fn)：新建一个纤程，fn 最多有一个参数，第一次 resume 时才开始运行
+static Value fiberNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_CLOSURE(args[0]) || FROM_REF(ObjFunction, AS_CLOSURE(args[0])->function)->arity > 1)
+        return nativeError(vm, "Fiber needs a function that takes at most one argument.");
+    return OBJ_VAL(newFiber(vm, AS_CLOSURE(args[0])));
+}
+
+// resume(fiber) / resume(fiber, value)：运行 fiber 直到它 yield 或者结束，结果是 yield 的值或者函数的返回值
+static Value resumeNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0]))
+        return nativeError(vm, "Expected a fiber and an optional value.");
+    ObjFiber *fiber = AS_FIBER(args[0]);
+    if (!checkResumable(vm, fiber))
+        return NIL_VAL;
+    // 宿主直接调用时 callFromHost 已经把入口帧抬到了当前帧数，此时没有 Lox 代码可以接着运行
+    if (vm->entryFrame == vm->frameCount)
+        return nativeError(vm, "Fibers can only be switched from Lox code.");
+    Value value = argCount == 2 ? args[1] : NIL_VAL;
+    // 弹出被调用者和参数，fiber 交回控制时结果压在这里
+    vm->stackTop = args - 1;
+    fiber->caller = vm->fiber;
+    if (!enterFiber(vm, fiber, value))
+        vm->nativeFailed = true;
+    return NIL_VAL;
+}
+
+// yield() / yield(value)：暂停当前纤程，value 交给恢复它的纤程，作为 resume 的结果
+static Value yieldNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount > 1)
+        return nativeError(vm, "Expected at most one value.");
+    ObjFiber *fiber = vm->fiber;
+    if (fiber == &vm->mainFiber)
+        return nativeError(vm, "Cannot yield from the main fiber.");
+    // 宿主嵌套调用的 run() 还在 C 栈上，离开这个纤程就回不到它了
+    if (vm->entryFrame != 0)
+        return nativeError(vm, "Cannot switch fibers across a native call.");
+    // 没有恢复者（spawn 出来的）时只是让事件循环先运行别的纤程
+    if (fiber->caller == NULL)
+        return yieldToLoop(vm, args);
+    Value value = argCount == 1 ? args[0] : NIL_VAL;
+    ObjFiber *caller = fiber->caller;
+    vm->stackTop = args - 1;
+    fiber->state = FIBER_SUSPENDED;
+    fiber->caller = NULL;
+    switchFiber(vm, caller);
+    push(vm, value);
+    return NIL_VAL;
+}
+
+// transfer(fiber) / transfer(fiber, value)：暂停当前纤程，让 fiber 顶替它的位置：
+// fiber 之后 yield 或者结束时，回到的是恢复当前纤程的那个纤程
+static Value transferNative(VM *vm, int argCount, Value *args)
+{
+    if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0]))
+        return nativeError(vm, "Expected a fiber and an optional value.");
+    ObjFiber *fiber = AS_FIBER(args[0]);
+    ObjFiber *current = vm->fiber;
+    if (current == &vm->mainFiber)
+        return nativeError(vm, "Cannot transfer from the main fiber.");
+    if (vm->entryFrame != 0)
+        return nativeError(vm, "Cannot switch fibers across a native call.");
+    if (!checkResumable(vm, fiber))
+        return NIL_VAL;
+    Value value = argCount == 2 ? args[1] : NIL_VAL;
+    vm->stackTop = args - 1;
+    fiber->caller = current->caller;
+    current->caller = NULL;
+    current->state = FIBER_SUSPENDED;
+    if (!enterFiber(vm, fiber, value))
+        vm->nativeFailed = true;
+    return NIL_VAL;
+}
+
+// isDone(fiber)：函数已经返回（或者出了错），不能再恢复
+static Value isDoneNative(VM *vm, int argCount, Value *args)
+{
+    if (!IS_FIBER(args[0]))
+        return nativeError(vm, "Argument must be a fiber.");
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+static void defineFiberNatives(VM *vm)
+{
+    defineGlobal(vm, "Fiber", OBJ_VAL(newNative(vm, fiberNative, 1)));
+    defineGlobal(vm, "resume", OBJ_VAL(newNative(vm, resumeNative, -1)));
+    defineGlobal(vm, "yield", OBJ_VAL(newNative(vm, yieldNative, -1)));
+    defineGlobal(vm, "transfer", OBJ_VAL(newNative(vm, transferNative, -1)));
+    defineGlobal(vm, "isDone", OBJ_VAL(newNative(vm, isDoneNative, 1)));
+}
+
+// 把类的方法（窗口或者散列表）重新放进一张容量为 capacity 的散列表
+static void rehashMethods(VM *vm, ObjClass *klass, int capacity)
+{
+    int *keys = GROW_ARRAY(vm, int, NULL, 0, capacity);
+    Value *methods = GROW_ARRAY(vm, Value, NULL, 0, capacity);
+    for (int i = 0; i < capacity; i++)
+    {
+        keys[i] = -1;
+        methods[i] = NIL_VAL;
+    }
+    for (int i = 0; i < klass->methodCount; i++)
+    {
+        if (IS_NIL(klass->methods[i]))
+            continue;
+        int selector = klass->methodKeys != NULL ? klass->methodKeys[i] : klass->methodBase + i;
+        int index = methodSlot(selector, capacity);
+        while (keys[index] != -1)
+            index = (index + 1) & (capacity - 1);
+        keys[index] = selector;
+        methods[index] = klass->methods[i];
+    }
+    FREE_ARRAY(vm, Value, klass->methods, klass->methodCount);
+    if (klass->methodKeys != NULL)
+        FREE_ARRAY(vm, int, klass->methodKeys, klass->methodCount);
+    klass->methods = methods;
+    klass->methodKeys = keys;
+    klass->methodCount = capacity;
+}
+
+// 散列表里选择子所在的槽，没有时是探测到的空槽
+static int methodHashSlot(ObjClass *klass, int selector)
+{
+    int index = methodSlot(selector, klass->methodCount);
+    while (klass->methodKeys[index] != selector && klass->methodKeys[index] != -1)
+        index = (index + 1) & (klass->methodCount - 1);
+    return index;
+}
+
+static void defineMethod(VM *vm, ObjString *name)
 {
     // 在给class添加方法时 methods本身已经在栈顶，class在方法下面一个位置
-    Value method = peek(0);
-    ObjClass *klass = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
+    Value method = peek(vm, 0);
+    ObjClass *klass = AS_CLASS(peek(vm, 1));
+    int selector = methodSelector(vm, name);
+    Value existing;
+    if (!findOwnMethod(klass, selector, &existing))
+        klass->methodDefined++;
+    if (klass->methodKeys == NULL)
+    {
+        int base = klass->methodCount == 0 ? selector : klass->methodBase;
+        int end = klass->methodCount == 0 ? selector + 1 : klass->methodBase + klass->methodCount;
+        if (selector < base)
+            base = selector;
+        if (selector >= end)
+            end = selector + 1;
+        if (end - base > 2 * klass->methodDefined + METHOD_WINDOW_SLACK)
+        {
+            // 窗口里空位太多，换成散列表，负载不超过 3/4
+            int capacity = 8;
+            while (klass->methodDefined * 4 > capacity * 3)
+                capacity *= 2;
+            rehashMethods(vm, klass, capacity);
+        }
+        else if (end - base != klass->methodCount)
+        {
+            // 把方法数组扩到刚好包含新的选择子，新增的空位填 nil
+            Value *methods = GROW_ARRAY(vm, Value, NULL, 0, end - base);
+            for (int i = 0; i < end - base; i++)
+                methods[i] = NIL_VAL;
+            if (klass->methodCount > 0)
+                memcpy(methods + (klass->methodBase - base), klass->methods, sizeof(Value) * klass->methodCount);
+            FREE_ARRAY(vm, Value, klass->methods, klass->methodCount);
+            klass->methods = methods;
+            klass->methodBase = base;
+            klass->methodCount = end - base;
+        }
+    }
+    else if (klass->methodDefined * 4 > klass->methodCount * 3)
+    {
+        rehashMethods(vm, klass, klass->methodCount * 2);
+    }
+    if (klass->methodKeys != NULL)
+    {
+        int index = methodHashSlot(klass, selector);
+        klass->methodKeys[index] = selector;
+        klass->methods[index] = method;
+    }
+    else
+    {
+        klass->methods[selector - klass->methodBase] = method;
+    }
+    if (name == vm->initString)
+        klass->initializer = method;
     // 弹出方法，class类保留在栈上
-    pop();
+    pop(vm);
 }
 static bool isFalsey(Value value)
 {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
-static void concatenate()
+// 整数取反仍是整数；0 取反得到 -0、INT32_MIN 取反会溢出，这两种交给双精度
+static Value negateNumber(Value value)
+{
+    if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT32_MIN)
+        return INT_VAL(-AS_INT(value));
+    return NUMBER_VAL(-AS_NUMBER(value));
+}
+#ifdef REGISTER_VM
+// 寄存器指令的运算：两个操作数都是数字时直接算（加减比较先试整数），
+// 其余情况（字符串拼接、类型错误）压栈后交给 jitBinary，和栈式指令走同一条路径
+static inline bool registerBinary(VM *vm, int op, Value a, Value b, Value *result)
+{
+    if (op == OP_EQUAL)
+    {
+        *result = BOOL_VAL(valuesEqual(vm, a, b));
+        return true;
+    }
+    if (IS_INT(a) && IS_INT(b) && op != OP_MULTIPLY && op != OP_DIVIDE)
+    {
+        int64_t x = AS_INT(a);
+        int64_t y = AS_INT(b);
+        switch (op)
+        {
+        case OP_ADD:
+            *result = int64ToValue(x + y);
+            return true;
+        case OP_SUBTRACT:
+            *result = int64ToValue(x - y);
+            return true;
+        case OP_LESS:
+            *result = BOOL_VAL(x < y);
+            return true;
+        case OP_GREATER:
+            *result = BOOL_VAL(x > y);
+            return true;
+        }
+    }
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (op)
+        {
+        case OP_ADD:
+            *result = NUMBER_VAL(x + y);
+            return true;
+        case OP_SUBTRACT:
+            *result = NUMBER_VAL(x - y);
+            return true;
+        case OP_MULTIPLY:
+            *result = NUMBER_VAL(x * y);
+            return true;
+        case OP_DIVIDE:
+            *result = NUMBER_VAL(x / y);
+            return true;
+        case OP_LESS:
+            *result = BOOL_VAL(x < y);
+            return true;
+        case OP_GREATER:
+            *result = BOOL_VAL(x > y);
+            return true;
+        }
+    }
+    push(vm, a);
+    push(vm, b);
+    if (jitBinary(vm, op) != JIT_CONTINUE)
+        return false;
+    *result = pop(vm);
+    return true;
+}
+
+// 结果写进帧内栈槽；目标正好是栈顶的下一个槽时相当于一次压栈
+#define WRITE_REGISTER(index, value)         \
+    do                                       \
+    {                                        \
+        Value *reg = &frame->slots[(index)]; \
+        *reg = (value);                      \
+        if (reg >= vm->stackTop)              \
+            vm->stackTop = reg + 1;           \
+    } while (false)
+#endif
+static void concatenate(VM *vm)
 {
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
+    // 长结果只建一个 rope 节点，复制推迟到真正需要字符的时候
+    if (textLength(AS_OBJ(peek(vm, 0))) + textLength(AS_OBJ(peek(vm, 1))) >= ROPE_MIN_LENGTH)
+    {
+        ObjRope *rope = newRope(vm, AS_OBJ(peek(vm, 1)), AS_OBJ(peek(vm, 0)));
+        pop(vm);
+        pop(vm);
+        push(vm, OBJ_VAL(rope));
+        return;
+    }
+    // 短结果的两段一定都是普通字符串：rope 至少有 ROPE_MIN_LENGTH 长
+    ObjString *b = AS_STRING(peek(vm, 0));
+    ObjString *a = AS_STRING(peek(vm, 1));
     // 赋值原始两个字符串之后， a 和 b 目前仍然活在堆里，这段代码并没有释放它们，等待GC回收
+    // 短结果先拼在栈上的缓冲区里，驻留表里已经有的话一次分配都不需要
     int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
+    char chars[ROPE_MIN_LENGTH];
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
 
-    ObjString *result = takeString(chars, length);
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+    ObjString *result = copyString(vm, chars, length);
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
 }
 // | 写在                  | 作用域             | 链接属性                |
 // | ---------------      | ----------         | ------------------- |
 // | 函数定义前加 `static` | 当前 `.c` 文件     | **内部链接**（本文件私有）     |
 // | 全局变量前加 `static` | 当前 `.c` 文件     | **内部链接**（本文件私有）     |
 // | 局部变量加 `static`   | 所在代码块         | **静态存储期**（函数返回也不销毁） |
-static InterpretResult run()
+static InterpretResult run(VM *vm)
 {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
 
 #define READ_BYTE() (*frame->ip++)
 
@@ -342,33 +1284,67 @@ static InterpretResult run()
      (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 
 #define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+    (FROM_REF(ObjFunction, frame->closure->function)->chunk.constants.values[READ_BYTE()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define BINARY_OP(valueType, op)                        \
     do                                                  \
     {                                                   \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
         {                                               \
-            runtimeError("Operands must be numbers.");  \
+            runtimeError(vm, "Operands must be numbers.");  \
             return INTERPRET_RUNTIME_ERROR;             \
         }                                               \
-        double b = AS_NUMBER(pop());                    \
-        double a = AS_NUMBER(pop());                    \
-        push(valueType(a op b));                        \
+        double b = AS_NUMBER(pop(vm));                    \
+        double a = AS_NUMBER(pop(vm));                    \
+        push(vm, valueType(a op b));                        \
+    } while (false)
+// 两个操作数都是32位整数时在 int64 里计算，加减溢出由 int64ToValue 提升为双精度
+#define INT_BINARY_OP(intType, valueType, op)           \
+    do                                                  \
+    {                                                   \
+        if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1)))         \
+        {                                               \
+            int64_t b = AS_INT(pop(vm));                  \
+            int64_t a = AS_INT(pop(vm));                  \
+            push(vm, intType(a op b));                      \
+        }                                               \
+        else                                            \
+        {                                               \
+            BINARY_OP(valueType, op);                   \
+        }                                               \
+    } while (false)
+// 栈顶帧已经有本地代码时，交给JIT执行，直到它退回解释器
+#define JIT_DISPATCH()                                          \
+    do                                                          \
+    {                                                           \
+        if (FROM_REF(ObjFunction, frame->closure->function)->jitCode != NULL)          \
+        {                                                       \
+            JitStatus status = jitRun(vm);                        \
+            if (status == JIT_HALT)                             \
+                return INTERPRET_OK;                            \
+            if (status == JIT_ERROR)                            \
+                return INTERPRET_RUNTIME_ERROR;                 \
+            frame = &vm->frames[vm->frameCount - 1];              \
+        }                                                       \
     } while (false)
+    // 入口帧可能已经有本地代码（AOT程序的顶层函数，或者阈值为0时的JIT）
+    JIT_DISPATCH();
     for (;;)
     {
 #ifdef DEBUG_TRACE_EXECUTION
         printf("  vm'stack is ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+        for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
         {
             printf("[ ");
-            printValue(*slot);
+            printValue(vm, *slot);
             printf(" ]");
         }
         printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+        disassembleInstruction(vm, &FROM_REF(ObjFunction, frame->closure->function)->chunk, (int)(frame->ip - FROM_REF(ObjFunction, frame->closure->function)->chunk.code));
+#endif
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+        vm->instructionCount++;
 #endif
         uint8_t instruction;
         switch (instruction = READ_BYTE())
@@ -376,59 +1352,61 @@ static InterpretResult run()
         case OP_CONSTANT:
         {
             Value constant = READ_CONSTANT();
-            push(constant);
+            push(vm, constant);
             break;
         }
         case OP_NIL:
-            push(NIL_VAL);
+            push(vm, NIL_VAL);
             break;
         case OP_TRUE:
-            push(BOOL_VAL(true));
+            push(vm, BOOL_VAL(true));
             break;
         case OP_FALSE:
-            push(BOOL_VAL(false));
+            push(vm, BOOL_VAL(false));
             break;
         case OP_POP:
-            pop();
+            pop(vm);
             break;
         case OP_GET_LOCAL:
         {
             uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
+            push(vm, frame->slots[slot]);
             break;
         }
         case OP_SET_LOCAL:
         {
             uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
+            frame->slots[slot] = peek(vm, 0);
             break;
         }
         case OP_GET_GLOBAL:
         {
             ObjString *name = READ_STRING();
             Value value;
-            if (!tableGet(&vm.globals, name, &value))
+            if (!tableGet(&vm->globals, name, &value))
             {
-                runtimeError("Undefined variable '%s'.", name->chars);
+                runtimeError(vm, "Undefined variable '%s'.", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(value);
+            push(vm, value);
             break;
         }
         case OP_DEFINE_GLOBAL:
         {
             ObjString *name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0));
-            pop();
+            markRebound(vm, name);
+            tableSet(vm, &vm->globals, name, peek(vm, 0));
+            pop(vm);
             break;
         }
         case OP_SET_GLOBAL:
         {
             ObjString *name = READ_STRING();
-            if (tableSet(&vm.globals, name, peek(0)))
+            markRebound(vm, name);
+            if (tableSet(vm, &vm->globals, name, peek(vm, 0)))
             {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'.", name->chars);
+                tableDelete(&vm->globals, name);
+                runtimeError(vm, "Undefined variable '%s'.", name->chars);
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
@@ -436,36 +1414,39 @@ static InterpretResult run()
         case OP_GET_UPVALUE:
         {
             uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
+            push(vm, *AS_UPVALUE(frame->closure->upvalues[slot])->location);
             break;
         }
+        case OP_GET_CAPTURED:
+            push(vm, frame->closure->upvalues[READ_BYTE()]);
+            break;
         case OP_SET_UPVALUE:
         {
             uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
+            *AS_UPVALUE(frame->closure->upvalues[slot])->location = peek(vm, 0);
             break;
         }
         case OP_GET_PROPERTY:
         {
             // 在访问某个值上的任何字段之前，检查该值是否是一个实例
-            if (!IS_INSTANCE(peek(0)))
+            if (!IS_INSTANCE(peek(vm, 0)))
             {
-                runtimeError("Only instances have properties.");
+                runtimeError(vm, "Only instances have properties.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            ObjInstance *instance = AS_INSTANCE(peek(0));
+            ObjInstance *instance = AS_INSTANCE(peek(vm, 0));
             ObjString *name = READ_STRING();
 
             Value value;
             if (tableGet(&instance->fields, name, &value))
             {
-                pop(); // Instance.
-                push(value);
+                pop(vm); // Instance.
+                push(vm, value);
                 break;
             }
             // 字段优先于方法，因此我们首先查找字段。如果实例确实不包含具有给定属性名称的字段，那么这个名称可能指向的是一个方法
-            if (!bindMethod(instance->klass, name))
+            if (!bindMethod(vm, FROM_REF(ObjClass, instance->klass), name))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
@@ -474,25 +1455,24 @@ static InterpretResult run()
         case OP_SET_PROPERTY:
         {
 
-            if (!IS_INSTANCE(peek(1)))
+            if (!IS_INSTANCE(peek(vm, 1)))
             {
-                runtimeError("Only instances have fields.");
+                runtimeError(vm, "Only instances have fields.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            ObjInstance *instance = AS_INSTANCE(peek(1));
-            tableSet(&instance->fields, READ_STRING(), peek(0));
-            Value value = pop();
-            pop();
-            push(value);
+            setField(vm, AS_INSTANCE(peek(vm, 1)), READ_STRING(), peek(vm, 0));
+            Value value = pop(vm);
+            pop(vm);
+            push(vm, value);
             break;
         }
         case OP_GET_SUPER:
         {
             ObjString *name = READ_STRING();
-            ObjClass *superclass = AS_CLASS(pop());
+            ObjClass *superclass = AS_CLASS(pop(vm));
 
-            if (!bindMethod(superclass, name))
+            if (!bindMethod(vm, superclass, name))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
@@ -500,39 +1480,45 @@ static InterpretResult run()
         }
         case OP_EQUAL:
         {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
+            Value b = pop(vm);
+            Value a = pop(vm);
+            push(vm, BOOL_VAL(valuesEqual(vm, a, b)));
             break;
         }
         case OP_GREATER:
-            BINARY_OP(BOOL_VAL, >);
+            INT_BINARY_OP(BOOL_VAL, BOOL_VAL, >);
             break;
         case OP_LESS:
-            BINARY_OP(BOOL_VAL, <);
+            INT_BINARY_OP(BOOL_VAL, BOOL_VAL, <);
             break;
         case OP_ADD:
         {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1)))
+            {
+                int64_t b = AS_INT(pop(vm));
+                int64_t a = AS_INT(pop(vm));
+                push(vm, int64ToValue(a + b));
+            }
+            else if (IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1)))
             {
-                concatenate();
+                concatenate(vm);
             }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
             {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                double b = AS_NUMBER(pop(vm));
+                double a = AS_NUMBER(pop(vm));
+                push(vm, NUMBER_VAL(a + b));
             }
             else
             {
-                runtimeError(
+                runtimeError(vm, 
                     "Operands must be two numbers or two strings.");
                 return INTERPRET_RUNTIME_ERROR;
             }
             break;
         }
         case OP_SUBTRACT:
-            BINARY_OP(NUMBER_VAL, -);
+            INT_BINARY_OP(int64ToValue, NUMBER_VAL, -);
             break;
         case OP_MULTIPLY:
             BINARY_OP(NUMBER_VAL, *);
@@ -541,20 +1527,20 @@ static InterpretResult run()
             BINARY_OP(NUMBER_VAL, /);
             break;
         case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
+            push(vm, BOOL_VAL(isFalsey(pop(vm))));
             break;
         case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
+            if (!IS_NUMBER(peek(vm, 0)))
             {
-                runtimeError("Operand must be a number.");
+                runtimeError(vm, "Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            push(vm, negateNumber(pop(vm)));
             break;
         case OP_PRINT:
         {
-            printValue(pop());
-            printf("\n");
+            printLine(vm, peek(vm, 0));
+            pop(vm);
             break;
         }
         case OP_JUMP:
@@ -567,7 +1553,7 @@ static InterpretResult run()
         {
             // 还原字节码存储的偏移量
             uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0)))
+            if (isFalsey(peek(vm, 0)))
                 frame->ip += offset;
             break;
         }
@@ -575,110 +1561,200 @@ static InterpretResult run()
         {
             uint16_t offset = READ_SHORT();
             frame->ip -= offset;
+            // 循环回边也算热度，长时间运行的循环可以直接从循环头进入本地代码
+            if (vm->jitEnabled)
+            {
+                ObjFunction *function = FROM_REF(ObjFunction, frame->closure->function);
+                if (function->jitCode == NULL && function->hotness >= 0 &&
+                    ++function->hotness > JIT_HOT_THRESHOLD)
+                {
+                    jitCompile(function);
+                }
+                JIT_DISPATCH();
+            }
             break;
         }
         case OP_CALL:
         {
             int argCount = READ_BYTE();
-            if (!callValue(peek(argCount), argCount))
+            if (!callValue(vm, peek(vm, argCount), argCount))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
+            frame = &vm->frames[vm->frameCount - 1];
+            JIT_DISPATCH();
             break;
         }
         case OP_INVOKE:
         {
             ObjString *method = READ_STRING();
             int argCount = READ_BYTE();
-            if (!invoke(method, argCount))
+            if (!invoke(vm, method, argCount))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
+            frame = &vm->frames[vm->frameCount - 1];
+            JIT_DISPATCH();
             break;
         }
         case OP_SUPER_INVOKE:
         {
             ObjString *method = READ_STRING();
             int argCount = READ_BYTE();
-            ObjClass *superclass = AS_CLASS(pop());
-            if (!invokeFromClass(superclass, method, argCount))
+            ObjClass *superclass = AS_CLASS(pop(vm));
+            if (!invokeFromClass(vm, superclass, method, argCount))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
-            frame = &vm.frames[vm.frameCount - 1];
+            frame = &vm->frames[vm->frameCount - 1];
+            JIT_DISPATCH();
             break;
         }
         case OP_CLOSURE:
         {
             ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-            ObjClosure *closure = newClosure(function);
-            push(OBJ_VAL(closure));
+            ObjClosure *closure = newClosure(vm, function);
+            push(vm, OBJ_VAL(closure));
             // 这段代码是闭包诞生的神奇时刻。我们遍历了闭包所期望的每个上值。对于每个上值，我们读取一对操作数字节
             for (int i = 0; i < closure->upvalueCount; i++)
             {
-                uint8_t isLocal = READ_BYTE();
+                uint8_t flags = READ_BYTE();
                 uint8_t index = READ_BYTE();
-                if (isLocal)
-                {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                }
-                else
-                {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
-                }
+                closure->upvalues[i] = captureOperand(vm, frame, flags, index);
             }
             break;
         }
         // 到达该指令时，我们要提取的变量就在栈顶。我们调用一个辅助函数，传入栈槽的地址。该函数负责关闭上值，并将局部变量从栈中移动到堆上
         case OP_CLOSE_UPVALUE:
-            closeUpvalues(vm.stackTop - 1);
-            pop();
+            closeUpvalues(vm, vm->stackTop - 1);
+            pop(vm);
             break;
         case OP_RETURN:
         {
             // 当函数返回一个值时，该值会在栈顶
-            Value result = pop();
+            Value result = pop(vm);
             // 当函数返回时，我们调用相同的辅助函数，并传入函数拥有的第一个栈槽
-            closeUpvalues(frame->slots);
-            vm.frameCount--;
-            // 如果是最后一个CallFrame，这意味着我们已经完成了顶层代码的执行
-            if (vm.frameCount == 0)
+            closeUpvalues(vm, frame->slots);
+            vm->frameCount--;
+            // 我们把返回值压回堆栈，切换回调用者的上下文
+            vm->stackTop = frame->slots;
+            push(vm, result);
+            // 如果回到了入口帧，这意味着我们已经完成了顶层代码（或宿主发起的调用）的执行，返回值留在栈顶。
+            // 纤程的函数返回时则回到恢复它的纤程接着执行
+            if (vm->frameCount == vm->entryFrame)
             {
-                pop();
-                return INTERPRET_OK;
+                if (vm->entryFrame != 0 || vm->fiber == &vm->mainFiber)
+                    return INTERPRET_OK;
+                if (!finishFiber(vm))
+                    return INTERPRET_RUNTIME_ERROR;
             }
-            // 否则我们把返回值压回堆栈，切换回调用者的上下文
-            vm.stackTop = frame->slots;
-            push(result);
-            frame = &vm.frames[vm.frameCount - 1];
+            frame = &vm->frames[vm->frameCount - 1];
+            JIT_DISPATCH();
             break;
         }
         case OP_CLASS:
-            push(OBJ_VAL(newClass(READ_STRING())));
+            push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
             break;
         case OP_INHERIT:
         {
-            Value superclass = peek(1);
+            Value superclass = peek(vm, 1);
             // 阻止用户继承一个根本不是类的对象
             if (!IS_CLASS(superclass))
             {
-                runtimeError("Superclass must be a class.");
+                runtimeError(vm, "Superclass must be a class.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            ObjClass *subclass = AS_CLASS(peek(0));
-            // OP_INHERIT指令： 超类的方法复制到子类的方法表中
-            // OP_METHOD指令: 子类重写的任何方法都会覆盖表中那些继承的条
-            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-            pop(); // Subclass.
+            ObjClass *subclass = AS_CLASS(peek(vm, 0));
+            // OP_INHERIT指令：子类只记住父类，查不到的方法到父类里找，不复制父类的方法
+            // OP_METHOD指令: 子类重写的方法放在子类自己的方法数组里，查找时先找到
+            subclass->superclass = TO_REF(AS_CLASS(superclass));
+            subclass->initializer = AS_CLASS(superclass)->initializer;
+            pop(vm); // Subclass.
             break;
         }
         case OP_METHOD:
-            defineMethod(READ_STRING());
+            defineMethod(vm, READ_STRING());
+            break;
+        case OP_SQRT:
+        case OP_FLOOR:
+        case OP_ABS:
+        case OP_MIN:
+        case OP_MAX:
+        case OP_LEN:
+        case OP_CLOCK:
+        {
+            int argCount = READ_BYTE();
+            if (!runIntrinsic(vm, instruction - OP_SQRT, argCount))
+                return INTERPRET_RUNTIME_ERROR;
+            // 退回普通调用时可能压入了新的帧
+            frame = &vm->frames[vm->frameCount - 1];
+            JIT_DISPATCH();
+            break;
+        }
+#ifdef REGISTER_VM
+// RR/RK 两种形式相邻排列，instruction 等于 RR 形式时第二个操作数是寄存器，否则是常量
+#define READ_OPERAND(rr) (instruction == (rr) ? frame->slots[READ_BYTE()] : READ_CONSTANT())
+#define REGISTER_CASE(rr, stackOp)                          \
+    case rr:                                                \
+    case rr + 1:                                            \
+    {                                                       \
+        uint8_t dst = READ_BYTE();                          \
+        Value a = frame->slots[READ_BYTE()];                \
+        Value b = READ_OPERAND(rr);                         \
+        Value result;                                       \
+        if (!registerBinary(vm, stackOp, a, b, &result))        \
+            return INTERPRET_RUNTIME_ERROR;                 \
+        WRITE_REGISTER(dst, result);                        \
+        break;                                              \
+    }
+#define BRANCH_CASE(rr, stackOp)                            \
+    case rr:                                                \
+    case rr + 1:                                            \
+    {                                                       \
+        Value a = frame->slots[READ_BYTE()];                \
+        Value b = READ_OPERAND(rr);                         \
+        uint16_t offset = READ_SHORT();                     \
+        Value result;                                       \
+        if (!registerBinary(vm, stackOp, a, b, &result))        \
+            return INTERPRET_RUNTIME_ERROR;                 \
+        if (isFalsey(result))                               \
+            frame->ip += offset;                            \
+        break;                                              \
+    }
+            REGISTER_CASE(OP_ADD_RR, OP_ADD)
+            REGISTER_CASE(OP_SUBTRACT_RR, OP_SUBTRACT)
+            REGISTER_CASE(OP_MULTIPLY_RR, OP_MULTIPLY)
+            REGISTER_CASE(OP_DIVIDE_RR, OP_DIVIDE)
+            REGISTER_CASE(OP_LESS_RR, OP_LESS)
+            REGISTER_CASE(OP_GREATER_RR, OP_GREATER)
+            REGISTER_CASE(OP_EQUAL_RR, OP_EQUAL)
+            BRANCH_CASE(OP_JUMP_IF_NOT_LESS_RR, OP_LESS)
+            BRANCH_CASE(OP_JUMP_IF_NOT_GREATER_RR, OP_GREATER)
+            BRANCH_CASE(OP_JUMP_IF_NOT_EQUAL_RR, OP_EQUAL)
+        case OP_MOVE:
+        {
+            uint8_t dst = READ_BYTE();
+            WRITE_REGISTER(dst, frame->slots[READ_BYTE()]);
             break;
         }
+        case OP_LOADK:
+        {
+            uint8_t dst = READ_BYTE();
+            WRITE_REGISTER(dst, READ_CONSTANT());
+            break;
+        }
+        case OP_STORE:
+        {
+            uint8_t dst = READ_BYTE();
+            frame->slots[dst] = pop(vm);
+            break;
+        }
+#undef READ_OPERAND
+#undef REGISTER_CASE
+#undef BRANCH_CASE
+#endif
+        }
     }
     // 在函数退出之前 #undef READ_BYTE，外部就无法使用这个宏了
 #undef READ_BYTE
@@ -686,18 +1762,332 @@ static InterpretResult run()
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef INT_BINARY_OP
+#undef JIT_DISPATCH
 }
-InterpretResult interpret(const char *source)
+
+// 下面是JIT本地代码的慢路径。本地代码调用它们之前已经同步了 vm.stackTop 和 frame->ip，
+// 所以这里可以像解释器一样直接操作栈，报错时的行号和调用栈也保持一致
+JitStatus jitGetGlobal(VM *vm, ObjString *name)
 {
-    ObjFunction *function = compile(source);
-    if (function == NULL)
-        return INTERPRET_COMPILE_ERROR;
+    Value value;
+    if (!tableGet(&vm->globals, name, &value))
+    {
+        runtimeError(vm, "Undefined variable '%s'.", name->chars);
+        return JIT_ERROR;
+    }
+    push(vm, value);
+    return JIT_CONTINUE;
+}
+
+JitStatus jitDefineGlobal(VM *vm, ObjString *name)
+{
+    markRebound(vm, name);
+    tableSet(vm, &vm->globals, name, peek(vm, 0));
+    pop(vm);
+    return JIT_CONTINUE;
+}
+
+JitStatus jitSetGlobal(VM *vm, ObjString *name)
+{
+    markRebound(vm, name);
+    if (tableSet(vm, &vm->globals, name, peek(vm, 0)))
+    {
+        tableDelete(&vm->globals, name);
+        runtimeError(vm, "Undefined variable '%s'.", name->chars);
+        return JIT_ERROR;
+    }
+    return JIT_CONTINUE;
+}
+
+JitStatus jitGetProperty(VM *vm, ObjString *name)
+{
+    if (!IS_INSTANCE(peek(vm, 0)))
+    {
+        runtimeError(vm, "Only instances have properties.");
+        return JIT_ERROR;
+    }
+    ObjInstance *instance = AS_INSTANCE(peek(vm, 0));
+    Value value;
+    if (tableGet(&instance->fields, name, &value))
+    {
+        pop(vm); // Instance.
+        push(vm, value);
+        return JIT_CONTINUE;
+    }
+    return bindMethod(vm, FROM_REF(ObjClass, instance->klass), name) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+JitStatus jitSetProperty(VM *vm, ObjString *name)
+{
+    if (!IS_INSTANCE(peek(vm, 1)))
+    {
+        runtimeError(vm, "Only instances have fields.");
+        return JIT_ERROR;
+    }
+    setField(vm, AS_INSTANCE(peek(vm, 1)), name, peek(vm, 0));
+    Value value = pop(vm);
+    pop(vm);
+    push(vm, value);
+    return JIT_CONTINUE;
+}
+
+JitStatus jitGetSuper(VM *vm, ObjString *name)
+{
+    ObjClass *superclass = AS_CLASS(pop(vm));
+    return bindMethod(vm, superclass, name) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+// 本地代码只内联了两个操作数都是数字的情况，其余组合（字符串拼接、类型错误）走这里
+JitStatus jitBinary(VM *vm, int op)
+{
+    if (op == OP_ADD && IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1)))
+    {
+        concatenate(vm);
+        return JIT_CONTINUE;
+    }
+    if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1)))
+    {
+        runtimeError(vm, op == OP_ADD ? "Operands must be two numbers or two strings."
+                                  : "Operands must be numbers.");
+        return JIT_ERROR;
+    }
+    if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1)) && op != OP_MULTIPLY && op != OP_DIVIDE)
+    {
+        int64_t b = AS_INT(pop(vm));
+        int64_t a = AS_INT(pop(vm));
+        switch (op)
+        {
+        case OP_ADD:
+            push(vm, int64ToValue(a + b));
+            break;
+        case OP_SUBTRACT:
+            push(vm, int64ToValue(a - b));
+            break;
+        case OP_GREATER:
+            push(vm, BOOL_VAL(a > b));
+            break;
+        case OP_LESS:
+            push(vm, BOOL_VAL(a < b));
+            break;
+        }
+        return JIT_CONTINUE;
+    }
+    double b = AS_NUMBER(pop(vm));
+    double a = AS_NUMBER(pop(vm));
+    switch (op)
+    {
+    case OP_ADD:
+        push(vm, NUMBER_VAL(a + b));
+        break;
+    case OP_SUBTRACT:
+        push(vm, NUMBER_VAL(a - b));
+        break;
+    case OP_MULTIPLY:
+        push(vm, NUMBER_VAL(a * b));
+        break;
+    case OP_DIVIDE:
+        push(vm, NUMBER_VAL(a / b));
+        break;
+    case OP_GREATER:
+        push(vm, BOOL_VAL(a > b));
+        break;
+    case OP_LESS:
+        push(vm, BOOL_VAL(a < b));
+        break;
+    }
+    return JIT_CONTINUE;
+}
+
+JitStatus jitNegate(VM *vm)
+{
+    if (!IS_NUMBER(peek(vm, 0)))
+    {
+        runtimeError(vm, "Operand must be a number.");
+        return JIT_ERROR;
+    }
+    push(vm, negateNumber(pop(vm)));
+    return JIT_CONTINUE;
+}
+
+// 本地代码按位比较；位模式不同的两个对象仍可能是内容相同的长字符串或 rope
+JitStatus jitEqual(VM *vm)
+{
+    bool equal = valuesEqual(vm, peek(vm, 1), peek(vm, 0));
+    pop(vm);
+    pop(vm);
+    push(vm, BOOL_VAL(equal));
+    return JIT_CONTINUE;
+}
+
+JitStatus jitPrint(VM *vm)
+{
+    printLine(vm, peek(vm, 0));
+    pop(vm);
+    return JIT_CONTINUE;
+}
 
-    push(OBJ_VAL(function));
-    ObjClosure *closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call(closure, 0);
+JitStatus jitIntrinsic(VM *vm, int index, int argCount)
+{
+    CallFrame *top = vm->frames + vm->frameCount;
+    if (!runIntrinsic(vm, index, argCount))
+        return JIT_ERROR;
+    return vm->frames + vm->frameCount == top ? JIT_CONTINUE : JIT_FRAME;
+}
+
+// 被调用者如果是闭包，会压入新的CallFrame，此时返回JIT_FRAME让调度循环切换到新帧。
+// 按栈顶帧的地址比较：切换纤程后帧数可能碰巧相同，但已经是另一个调用栈了
+JitStatus jitCall(VM *vm, int argCount)
+{
+    CallFrame *top = vm->frames + vm->frameCount;
+    if (!callValue(vm, peek(vm, argCount), argCount))
+        return JIT_ERROR;
+    return vm->frames + vm->frameCount == top ? JIT_CONTINUE : JIT_FRAME;
+}
+
+JitStatus jitInvoke(VM *vm, ObjString *name, int argCount)
+{
+    CallFrame *top = vm->frames + vm->frameCount;
+    if (!invoke(vm, name, argCount))
+        return JIT_ERROR;
+    return vm->frames + vm->frameCount == top ? JIT_CONTINUE : JIT_FRAME;
+}
+
+JitStatus jitSuperInvoke(VM *vm, ObjString *name, int argCount)
+{
+    ObjClass *superclass = AS_CLASS(pop(vm));
+    CallFrame *top = vm->frames + vm->frameCount;
+    if (!invokeFromClass(vm, superclass, name, argCount))
+        return JIT_ERROR;
+    return vm->frames + vm->frameCount == top ? JIT_CONTINUE : JIT_FRAME;
+}
+
+// operands 指向 OP_CLOSURE 后面的操作数：常量索引，然后是每个上值的 (flags, index)
+JitStatus jitClosure(VM *vm, uint8_t *operands)
+{
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    ObjFunction *function = AS_FUNCTION(FROM_REF(ObjFunction, frame->closure->function)->chunk.constants.values[*operands++]);
+    ObjClosure *closure = newClosure(vm, function);
+    push(vm, OBJ_VAL(closure));
+    for (int i = 0; i < closure->upvalueCount; i++)
+    {
+        uint8_t flags = *operands++;
+        uint8_t index = *operands++;
+        closure->upvalues[i] = captureOperand(vm, frame, flags, index);
+    }
+    return JIT_CONTINUE;
+}
+
+JitStatus jitCloseUpvalue(VM *vm)
+{
+    closeUpvalues(vm, vm->stackTop - 1);
+    pop(vm);
+    return JIT_CONTINUE;
+}
+
+JitStatus jitReturn(VM *vm)
+{
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    Value result = pop(vm);
+    closeUpvalues(vm, frame->slots);
+    vm->frameCount--;
+    vm->stackTop = frame->slots;
+    push(vm, result);
+    if (vm->frameCount != vm->entryFrame)
+        return JIT_FRAME;
+    if (vm->entryFrame != 0 || vm->fiber == &vm->mainFiber)
+        return JIT_HALT;
+    return finishFiber(vm) ? JIT_FRAME : JIT_ERROR;
+}
+JitStatus jitClass(VM *vm, ObjString *name)
+{
+    push(vm, OBJ_VAL(newClass(vm, name)));
+    return JIT_CONTINUE;
+}
+
+JitStatus jitInherit(VM *vm)
+{
+    Value superclass = peek(vm, 1);
+    if (!IS_CLASS(superclass))
+    {
+        runtimeError(vm, "Superclass must be a class.");
+        return JIT_ERROR;
+    }
+    ObjClass *subclass = AS_CLASS(peek(vm, 0));
+    subclass->superclass = TO_REF(AS_CLASS(superclass));
+    subclass->initializer = AS_CLASS(superclass)->initializer;
+    pop(vm); // Subclass.
+    return JIT_CONTINUE;
+}
+
+JitStatus jitMethod(VM *vm, ObjString *name)
+{
+    defineMethod(vm, name);
+    return JIT_CONTINUE;
+}
+
+// 运行一个已经编译好的顶层函数：源码编译出来的，或者AOT程序在启动时重建的
+InterpretResult interpretFunction(VM *vm, ObjFunction *function)
+{
+    push(vm, OBJ_VAL(function));
+    ObjClosure *closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    call(vm, closure, 0);
     printf("vm is runing !\n");
-    return run();
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+    vm->instructionCount = 0;
+    InterpretResult result = run(vm);
+    fprintf(stderr, "instructions: %llu\n", (unsigned long long)vm->instructionCount);
+#else
+    InterpretResult result = run(vm);
+#endif
+    // 顶层代码的返回值没有用
+    if (result == INTERPRET_OK)
+        pop(vm);
+    return result;
+}
+
+InterpretResult callFromHost(VM *vm, int argCount)
+{
+    // 调用之前就抬高入口帧：被调用的如果是 resume 之类的本地函数，据此知道是宿主直接调用的
+    int frameCount = vm->frameCount;
+    int entryFrame = vm->entryFrame;
+    vm->entryFrame = frameCount;
+    InterpretResult result = INTERPRET_OK;
+    if (!callValue(vm, vm->stackTop[-argCount - 1], argCount))
+        result = INTERPRET_RUNTIME_ERROR;
+    // 本地函数和没有 init() 的类已经把结果放在栈顶了
+    else if (vm->frameCount != frameCount)
+        result = run(vm);
+    vm->entryFrame = entryFrame;
+    return result;
+}
+
+// print 语句：默认直接写 stdout；宿主设置了回调时先格式化到内存里再交给回调
+void printLine(VM *vm, Value value)
+{
+    if (vm->printFn == NULL)
+    {
+        printValue(vm, value);
+        printf("\n");
+        return;
+    }
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    if (out == NULL)
+        return;
+    fprintValue(vm, out, value);
+    fclose(out);
+    vm->printFn(vm, vm->printData, text, length);
+    free(text);
+}
+
+InterpretResult interpret(VM *vm, const char *source)
+{
+    ObjFunction *function = compile(vm, source);
+    if (function == NULL)
+        return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(vm, function);
 }
\ No newline at end of file
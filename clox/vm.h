@@ -1,6 +1,7 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include "jit.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -9,7 +10,7 @@
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
 // 一个CallFrame代表一个正在进行的函数调用
-typedef struct
+typedef struct CallFrame
 {
   // 一个指向被调用闭包的指针
   ObjClosure *closure;
@@ -20,14 +21,61 @@ typedef struct
 } CallFrame;
 // 新增部分结束
 
+// 纤程的调用栈、值栈和上值表分配在一起，大小和主程序的一样
+#define FIBER_STACK_BYTES \
+  (sizeof(Value) * STACK_MAX + sizeof(ObjUpvalue *) * STACK_MAX + sizeof(CallFrame) * FRAMES_MAX)
+
+// checkpointVM 时基线里一个可变对象的状态，resetVM 写回去。
+// 冻结的对象只有实例的字段、上值和挂起的纤程会在基线之后被改写；类的继承缓存只取决于方法表，方法表定义完就不再变
 typedef struct
 {
-  // frames字段是一个CallFrame数组，表示函数调用栈
-  CallFrame frames[FRAMES_MAX];
+  Obj *object;
+  union
+  {
+    // 实例：字段表的副本
+    Table fields;
+    // 上值：打开的上值指向基线里某个纤程的栈，关闭后指向 closed
+    struct
+    {
+      Value *location;
+      Value closed;
+    } upvalue;
+    // 挂起的纤程：状态和栈里用到的部分。栈这块内存归基线所有，纤程结束时也不释放，写回时地址不变
+    struct
+    {
+      FiberState state;
+      int frameCount;
+      int entryFrame;
+      int stackCount;
+      int upvalueCount;
+      char *block;
+      // 依次是 stackCount 个值、upvalueCount 个上值指针和 frameCount 个调用帧
+      char *saved;
+    } fiber;
+  } as;
+} BaselineObject;
+
+// 编译后冻结的一棵函数树和它用到的字符串，不属于任何一个VM的堆：
+// GC 不标记也不回收它们，任意多个VM（包括不同线程里的）可以同时引用
+typedef struct SharedCode
+{
+  // 编译它的VM，冻结之后不再运行，只负责持有这些对象和驻留表
+  VM *owner;
+  ObjFunction *script;
+  // 运行它的VM编译时驻留的字符串，见 intern.h
+  struct InternTable *strings;
+} SharedCode;
+
+// 一个解释器实例的全部状态。不同的VM之间不共享任何对象，可以在不同线程里同时运行
+struct VM
+{
+  // 下面几项是正在运行的纤程的状态，切换纤程时只换这几个指针和计数。
+  // frames字段指向CallFrame数组，表示函数调用栈
+  CallFrame *frames;
   // frameCount字段存储了CallFrame栈的当前高度——正在进行的函数调用的数量
   int frameCount;
   // vm的stack存放运行时的值
-  Value stack[STACK_MAX];
+  Value *stack;
   // stackTop指向下一个值要被压入的位置
   Value *stackTop;
   // 全局变量存储
@@ -36,14 +84,33 @@ typedef struct
   Table strings;
   // class 初始化init方法字符串常量
   ObjString *initString;
-  // openUpvalues 存储指向打开的上值链表的头
-  ObjUpvalue *openUpvalues;
+  // 第i个选择子对应的方法名
+  ValueArray selectors;
+  // selectors 里的第一个名字的编号，前面的编号属于共享代码
+  int selectorBase;
+  // 这个VM运行的共享代码，驻留字符串时先查它的驻留表；没有时为NULL
+  SharedCode *shared;
+  // 在 shared->strings 里的登记，不运行共享代码时为NULL
+  struct InternMember *internMember;
+  // openUpvalues 按栈槽记录指向该槽的打开的上值，没有时为NULL；捕获时直接按槽号查找
+  ObjUpvalue **openUpvalues;
+  // 所有打开的上值都在这个栈槽之下，关闭上值时只需要扫描到这里；再往上的表项没有意义
+  Value *openUpvaluesTop;
+  // 正在运行的纤程，主程序运行时指向 mainFiber
+  ObjFiber *fiber;
+  // 主程序本身也是一个纤程，不在堆上，栈就是下面这几个数组
+  ObjFiber mainFiber;
+  CallFrame mainFrames[FRAMES_MAX];
+  Value mainStack[STACK_MAX];
+  ObjUpvalue *mainUpvalues[STACK_MAX];
   // bytesAllocated 是虚拟机已分配的托管内存实时字节总数
   size_t bytesAllocated;
   // nextGC 是触发下一次回收的阈值
   size_t nextGC;
   // 存储一个指向表头的指针，链表中的每个对象都有一个指向下一个对象的指针
   Obj *objects;
+  // freezeHeap 冻结的对象，不参与清除
+  Obj *frozenObjects;
 
   // grayCount 字段存储grayStack数组中的当前元素数量
   int grayCount;
@@ -51,18 +118,90 @@ typedef struct
   int grayCapacity;
   // grayStack 跟踪所有的灰色对象
   Obj **grayStack;
-} VM;
+  // 运行时开关：为true时热点函数会被JIT编译成本地代码
+  bool jitEnabled;
+  // 为true时函数体推迟到第一次调用才编译
+  bool lazyCompile;
+  // 第i位为1表示 intrinsics[i] 对应的全局变量被重新赋值过，它的专用指令要走普通调用
+  uint32_t reboundIntrinsics;
+  // 本地函数报错后置位，callValue 看到后中止调用
+  bool nativeFailed;
+  // 正在编译时指向编译器的状态，GC 通过它标记编译中的函数
+  struct Parser *parser;
+  // run() 在帧数回到这里时返回；宿主从本地函数里再调用 Lox 函数时会抬高它。每个纤程各有一个
+  int entryFrame;
+  // print 语句的输出回调，为NULL时写到 stdout
+  LoxPrintFn printFn;
+  void *printData;
+  // 宿主持有的已编译脚本，作为GC根
+  ValueArray handles;
+  // checkpointVM 时的全局变量和 reboundIntrinsics，resetVM 恢复到这里；没调用过 checkpointVM 时是初始化完的状态
+  Table baseGlobals;
+  uint32_t baseRebound;
+  // 那时 selectors 的长度
+  int baseSelectors;
+  // checkpointVM 时基线对象的可变状态
+  BaselineObject *baseline;
+  int baselineCount;
+  // 事件循环，第一次用到时才创建
+  struct EventLoop *loop;
+#ifdef DEBUG_COUNT_INSTRUCTIONS
+  uint64_t instructionCount;
+#endif
+};
 typedef enum
 {
   INTERPRET_OK,
   INTERPRET_COMPILE_ERROR,
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
-// 导出vm变量，供其他模块使用
-extern VM vm;
-void initVM();
-void freeVM();
-InterpretResult interpret(const char *source);
-void push(Value value);
-Value pop();
+void initVM(VM *vm);
+// 初始化一个运行 shared 的VM，shared 要比它活得久
+void initSharedVM(VM *vm, SharedCode *shared);
+void freeVM(VM *vm);
+// 把现在的堆冻结成基线，记下全局变量，以及基线里实例的字段、上值和挂起的纤程。
+// 之后 resetVM 一次清除丢掉基线之后分配的所有对象，全局变量和基线对象回到这时的样子；
+// 本地函数、initString 和基线里的对象都不用重建
+void checkpointVM(VM *vm);
+// 丢掉正在运行和挂起的纤程、事件循环，以及基线之后编译的宿主脚本，
+// 然后把全局变量和基线对象写回 checkpointVM 时的状态并回收
+void resetVM(VM *vm);
+// 编译并冻结；jit 为真时顺便把所有函数翻译成本地代码。编译错误时返回NULL
+SharedCode *compileShared(const char *source, bool jit);
+void freeShared(SharedCode *shared);
+InterpretResult interpret(VM *vm, const char *source);
+InterpretResult interpretFunction(VM *vm, ObjFunction *function);
+void push(VM *vm, Value value);
+Value pop(VM *vm);
+// 调用栈顶下方 argCount+1 处的值并一直运行到这次调用返回，返回值留在栈顶；出错时栈已被清空
+InterpretResult callFromHost(VM *vm, int argCount);
+// 本地函数报告运行时错误，返回值直接作为本地函数的结果
+Value nativeError(VM *vm, const char *message);
+// 切换到 fiber，value 是交给它的值；第一次进入时调用它的函数。调用出错时返回 false
+bool enterFiber(VM *vm, ObjFiber *fiber, Value value);
+void printLine(VM *vm, Value value);
+// 宿主定义全局变量，和 var 声明一样会让同名内置函数的专用指令失效
+void defineGlobal(VM *vm, const char *name, Value value);
+
+// JIT本地代码和AOT生成的C代码回调的慢路径，操作的都是栈顶的CallFrame
+JitStatus jitGetGlobal(VM *vm, ObjString *name);
+JitStatus jitDefineGlobal(VM *vm, ObjString *name);
+JitStatus jitSetGlobal(VM *vm, ObjString *name);
+JitStatus jitGetProperty(VM *vm, ObjString *name);
+JitStatus jitSetProperty(VM *vm, ObjString *name);
+JitStatus jitGetSuper(VM *vm, ObjString *name);
+JitStatus jitBinary(VM *vm, int op);
+JitStatus jitEqual(VM *vm);
+JitStatus jitNegate(VM *vm);
+JitStatus jitPrint(VM *vm);
+JitStatus jitCall(VM *vm, int argCount);
+JitStatus jitIntrinsic(VM *vm, int index, int argCount);
+JitStatus jitInvoke(VM *vm, ObjString *name, int argCount);
+JitStatus jitSuperInvoke(VM *vm, ObjString *name, int argCount);
+JitStatus jitClosure(VM *vm, uint8_t *operands);
+JitStatus jitCloseUpvalue(VM *vm);
+JitStatus jitReturn(VM *vm);
+JitStatus jitClass(VM *vm, ObjString *name);
+JitStatus jitInherit(VM *vm);
+JitStatus jitMethod(VM *vm, ObjString *name);
 #endif
\ No newline at end of file